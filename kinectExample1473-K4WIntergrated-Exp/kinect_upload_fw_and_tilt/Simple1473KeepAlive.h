@@ -10,7 +10,11 @@
 #define __kinectExample__Simple1473KeepAlive__
 
 #include <iostream>
+#include "kinect_usb_io.h"
 
 void keepAlive1473();
 
+// sends the keep alive on an already opened device
+int keepAlive1473(kusb_io* io);
+
 #endif /* defined(__kinectExample__Simple1473KeepAlive__) */
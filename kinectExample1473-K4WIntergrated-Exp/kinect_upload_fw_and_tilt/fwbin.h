@@ -1,5 +1,17 @@
 #pragma once
 #include <iostream>
+#include "kinect_fw_source.h"
 
 int getFWSize1473();
-unsigned char * getFWData1473();
\ No newline at end of file
+
+// SHA-256 of the image (KINECT_SHA256_SIZE bytes), worked out when it was
+// packed
+const unsigned char * getFWDigest1473();
+
+// The image is stored packed (fwbin_packed.cpp, generated by
+// misc/kinect_pack_fw) and unpacked here on first use.
+unsigned char * getFWData1473();
+
+// Unpacks the image page by page as an upload asks for it, without ever
+// holding the flat copy. Close with kinect_fw_source_close().
+kinect_fw_source * getFWSource1473();
@@ -1,3 +1,9 @@
+#include "k4w_tilt_led.h"
+#include "kinect_protocol.h"
+#include "kinect_trace.h"
+#include "kinect_motor.h"
+#include "kinect_usb_runtime.h"
+
 #include <libusb-1.0/libusb.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,39 +11,49 @@
 #include <stdint.h>
 #include <unistd.h> // For usleep()
 
-uint32_t tag_seq = 1;
-uint32_t tag_next_ack = 1;
-
-typedef enum {
-	LED_OFF = 1,
-	LED_BLINK_GREEN = 2,
-	LED_SOLID_GREEN = 3,
-	LED_SOLID_RED = 4,
-} led_state;
-
-typedef struct {
-	uint32_t magic;
-	uint32_t tag;
-	uint32_t arg1;
-	uint32_t cmd;
-	uint32_t arg2;
-} motor_command;
-
-typedef struct {
-	uint32_t magic;
-	uint32_t tag;
-	uint32_t status;
-} motor_reply;
+// Shared by every caller, so two threads talking to different devices (or
+// the same one) never reuse a tag. Each call waits for the reply to its own.
+static uint32_t tag_seq = 1;
+
+static uint32_t next_tag() {
+	return __sync_fetch_and_add(&tag_seq, 1);
+}
 
 #define le32(X) (X)
+
+#define DO_MOTOR_SAMPLE_HZ 100
 #define LOG(...) fprintf(stderr, __VA_ARGS__)
 
-int get_reply(libusb_device_handle* dev){
-	unsigned char buffer[512];
-	memset(buffer, 0, 512);
+// Buffers come from kusb_alloc(): the io's pool has them ready once warm,
+// and a backend that can hands them to the device without copying.
+#define REPLY_BUF  512
+#define STATUS_BUF 256
+
+// Sends the first length bytes of cmd.
+static int send_command(kusb_io* io, const motor_command* cmd, int length, uint64_t deadline,
+	const char* caller) {
+	unsigned char* buffer = kusb_alloc(io, (int)sizeof(motor_command));
+	if (buffer == NULL) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	memcpy(buffer, cmd, length);
+	int transferred = 0;
+	int res = kusb_bulk_until(io, KINECT_EP_OUT, buffer, length, &transferred, deadline, NULL);
+	kusb_free(io, buffer, (int)sizeof(motor_command));
+	if (res != 0) {
+		LOG("%s(): libusb_bulk_transfer failed: %d (transferred = %d)\n", caller, res, transferred);
+	}
+	return res;
+}
+
+static int get_reply(kusb_io* io, uint32_t tag, uint64_t deadline){
+	unsigned char* buffer = kusb_alloc(io, REPLY_BUF);
+	if (buffer == NULL) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
 	int transferred = 0;
 	int res = 0;
-	res = libusb_bulk_transfer(dev, 0x81, buffer, 512, &transferred, 0);
+	res = kusb_bulk_until(io, KINECT_EP_IN, buffer, REPLY_BUF, &transferred, deadline, NULL);
 	if (res != 0) {
 		LOG("get_reply(): libusb_bulk_transfer failed: %d (transferred = %d)\n", res, transferred);
 	} else if (transferred != 12) {
@@ -45,187 +61,347 @@ int get_reply(libusb_device_handle* dev){
 	} else {
 		motor_reply reply;
 		memcpy(&reply, buffer, sizeof(reply));
-		if (reply.magic != 0x0a6fe000) {
+		if (reply.magic != KINECT_REPLY_MAGIC) {
 			LOG("Bad magic: %08X (expected 0A6FE000\n", reply.magic);
 			res = -1;
 		}
-		if (reply.tag != tag_next_ack) {
-			LOG("Reply tag out of order: expected %d, got %d\n", tag_next_ack, reply.tag);
+		if (reply.tag != tag) {
+			LOG("Reply for another command: expected tag %d, got %d\n", tag, reply.tag);
 			res = -1;
 		}
 		if (reply.status != 0) {
 			LOG("reply status != 0: failure?\n");
 			res = -1;
 		}
-		tag_next_ack++;
-		LOG("get_reply(): got %d bytes:", transferred);
-		int i;
-		for (i = 0; i < transferred; i++) {
-			LOG(" %02X", buffer[i]);
-		}
-		LOG("\n");
 	}
+	kusb_free(io, buffer, REPLY_BUF);
 	return res;
 }
 
-int set_led(libusb_device_handle* dev, led_state state) {
-	int transferred = 0;
-	int res = 0;
+int set_led(kusb_io* io, led_state state) {
+	uint64_t deadline = kusb_deadline_after(KINECT_COMMAND_TIMEOUT);
 	motor_command cmd;
-	cmd.magic = le32(0x06022009);
-	cmd.tag = le32(tag_seq++);
+	cmd.magic = le32(KINECT_CMD_MAGIC);
+	cmd.tag = le32(next_tag());
 	cmd.arg1 = le32(0);
-	cmd.cmd = le32(0x10);
+	cmd.cmd = le32(KINECT_MOTOR_CMD_LED);
 	cmd.arg2 = (uint32_t)(le32((int32_t)state));
-	unsigned char buffer[20];
-	memcpy(buffer, &cmd, 20);
-	// Send command to set LED to solid green
-	LOG("About to send bulk transfer:");
-	int i;
-	for(i = 0; i < 20 ; i++) {
-		LOG(" %02X", buffer[i]);
-	}
-	LOG("\n");
-	res = libusb_bulk_transfer(dev, 0x01, buffer, 20, &transferred, 0);
+	int res = send_command(io, &cmd, 20, deadline, "set_led");
 	if (res != 0) {
-		LOG("set_led(): libusb_bulk_transfer failed: %d (transferred = %d)\n", res, transferred);
 		return res;
 	}
-	return get_reply(dev);
+	return get_reply(io, cmd.tag, deadline);
 }
 
-int set_tilt(libusb_device_handle* dev, int tilt_degrees) {
+int set_tilt(kusb_io* io, int tilt_degrees) {
 	if (tilt_degrees > 31 || tilt_degrees < -31) {
 		LOG("set_tilt(): degrees %d out of safe range [-31, 31]\n", tilt_degrees);
 		return -1;
 	}
+	uint64_t deadline = kusb_deadline_after(KINECT_COMMAND_TIMEOUT);
 	motor_command cmd;
-	cmd.magic = le32(0x06022009);
-	cmd.tag = le32(tag_seq++);
+	cmd.magic = le32(KINECT_CMD_MAGIC);
+	cmd.tag = le32(next_tag());
 	cmd.arg1 = le32(0);
-	cmd.cmd = le32(0x803b);
+	cmd.cmd = le32(KINECT_MOTOR_CMD_TILT);
 	cmd.arg2 = (uint32_t)(le32((int32_t)tilt_degrees));
-	int transferred = 0;
-	int res = 0;
-	unsigned char buffer[20];
-	memcpy(buffer, &cmd, 20);
-
-	LOG("About to send bulk transfer:");
-	int i;
-	for(i = 0; i < 20 ; i++) {
-		LOG(" %02X", buffer[i]);
-	}
-	LOG("\n");
-	res = libusb_bulk_transfer(dev, 0x01, buffer, 20, &transferred, 0);
+	int res = send_command(io, &cmd, 20, deadline, "set_tilt");
 	if (res != 0) {
-		LOG("set_tilt(): libusb_bulk_transfer failed: %d (transferred = %d)\n", res, transferred);
 		return res;
 	}
-	return get_reply(dev);
+	return get_reply(io, cmd.tag, deadline);
 }
 
-int poll_status(libusb_device_handle* dev) {
+int get_status(kusb_io* io, kinect_status* status) {
+	uint64_t deadline = kusb_deadline_after(KINECT_COMMAND_TIMEOUT);
 	int transferred = 0;
 	int res = 0;
 	motor_command cmd;
-	cmd.magic = le32(0x06022009);
-	cmd.tag = le32(tag_seq++);
+	cmd.magic = le32(KINECT_CMD_MAGIC);
+	cmd.tag = le32(next_tag());
 	cmd.arg1 = le32(0x68); // 104.  Incidentally, the number of bytes that we expect in the reply.
-	cmd.cmd = le32(0x8032);
-	unsigned char buffer[256];
-	memcpy(buffer, &cmd, 16);
-	// Send command to set LED to solid green
-	LOG("About to send bulk transfer:");
-	int i;
-	for(i = 0; i < 16 ; i++) {
-		LOG(" %02X", buffer[i]);
-	}
-	LOG("\n");
-	res = libusb_bulk_transfer(dev, 0x01, buffer, 16, &transferred, 0);
+	cmd.cmd = le32(KINECT_MOTOR_CMD_STATUS);
+	res = send_command(io, &cmd, 16, deadline, "get_status");
 	if (res != 0) {
-		LOG("set_led(): libusb_bulk_transfer failed: %d (transferred = %d)\n", res, transferred);
 		return res;
 	}
 
-	res = libusb_bulk_transfer(dev, 0x81, buffer, 256, &transferred, 0); // 104 bytes
+	unsigned char* buffer = kusb_alloc(io, STATUS_BUF);
+	if (buffer == NULL) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	res = kusb_bulk_until(io, KINECT_EP_IN, buffer, STATUS_BUF, &transferred, deadline, NULL); // 104 bytes
+	if (res != 0) {
+		LOG("get_status(): libusb_bulk_transfer failed: %d (transferred = %d)\n", res, transferred);
+	} else if (status != NULL) {
+		kinect_status_decode(buffer, transferred, status);
+	}
+	kusb_free(io, buffer, STATUS_BUF);
 	if (res != 0) {
-		LOG("set_led(): libusb_bulk_transfer failed: %d (transferred = %d)\n", res, transferred);
 		return res;
-	} else {
-		LOG("poll_status():");
-		int i;
-		for(i = 0 ; i < transferred ; i += 4) {
-			int32_t j;
-			memcpy(&j, buffer + i, 4);
-			LOG("\t%d", j);
+	}
+	return get_reply(io, cmd.tag, deadline);
+}
+
+int get_accel(kusb_io* io, int32_t accel[3]) {
+	kinect_status status;
+	int res = get_status(io, &status);
+	if (res == 0) {
+		memcpy(accel, status.accel, sizeof(status.accel));
+	}
+	return res;
+}
+
+int poll_status(kusb_io* io) {
+	return get_status(io, NULL);
+}
+
+void kinect_motor_batch_init(kinect_motor_batch* batch) {
+	memset(batch, 0, sizeof(*batch));
+}
+
+int kinect_motor_batch_add(kinect_motor_batch* batch, uint32_t cmd, int32_t arg) {
+	if (batch->count >= KINECT_MOTOR_BATCH_MAX) {
+		return LIBUSB_ERROR_OVERFLOW;
+	}
+	batch->cmd[batch->count] = cmd;
+	batch->arg[batch->count] = arg;
+	return batch->count++;
+}
+
+// a 12 byte reply per command, and the status block before a status reply
+#define BATCH_READS (2 * KINECT_MOTOR_BATCH_MAX)
+#define BATCH_REPLY_BUF 512
+
+static void batch_cb(kusb_xfer* xfer) {
+	(*(int*)xfer->user_data)--;
+}
+
+// With the reads done: a status block goes to the oldest status command still
+// without one, a reply to the command with its tag.
+static void batch_match(kinect_motor_batch* batch, const unsigned char* data, int length,
+	int* acked, int* have_block) {
+	motor_reply reply;
+	if (length == (int)sizeof(reply)) {
+		memcpy(&reply, data, sizeof(reply));
+	}
+	if (length == (int)sizeof(reply) && le32(reply.magic) == KINECT_REPLY_MAGIC) {
+		for (int i = 0; i < batch->count; i++) {
+			if (batch->result[i].tag == le32(reply.tag) && !acked[i]) {
+				acked[i] = 1;
+				if (le32(reply.status) != 0) {
+					LOG("batch: command %04X reply status %u\n", batch->cmd[i], le32(reply.status));
+					batch->result[i].status = LIBUSB_ERROR_IO;
+				}
+				return;
+			}
+		}
+		LOG("batch: reply for unknown tag %u ignored\n", le32(reply.tag));
+		return;
+	}
+	for (int i = 0; i < batch->count; i++) {
+		if (batch->cmd[i] == KINECT_MOTOR_CMD_STATUS && !have_block[i]) {
+			kinect_status status;
+			kinect_status_decode(data, length, &status);
+			memcpy(batch->result[i].accel, status.accel, sizeof(status.accel));
+			batch->result[i].tilt_angle = status.tilt_angle;
+			batch->result[i].tilt_state = status.tilt_state;
+			have_block[i] = 1;
+			return;
 		}
-		LOG("\n");
-		struct {
-			int32_t x;
-			int32_t y;
-			int32_t z;
-		} accel;
-		memcpy(&accel, buffer + 16, sizeof(accel));
-		LOG("X: %d\tY: %d\tZ:%d\n", accel.x, accel.y, accel.z);
 	}
-	// Reply: skip four uint32_t, then you have three int32_t that give you acceleration in that direction, it seems.
-	// Units still to be worked out.
-	return get_reply(dev);
+	LOG("batch: unexpected %d byte reply ignored\n", length);
 }
 
-int do_motor() {
-	int res;
-	led_state state_to_set = LED_SOLID_RED;
-	int tilt = -30;
+int kinect_motor_batch_run(kusb_io* io, kinect_motor_batch* batch) {
+	uint64_t deadline = kusb_deadline_after(KINECT_COMMAND_TIMEOUT);
+	motor_command wire[KINECT_MOTOR_BATCH_MAX];
+	kusb_xfer out[KINECT_MOTOR_BATCH_MAX];
+	kusb_xfer in[BATCH_READS];
+	unsigned char replies[BATCH_READS][BATCH_REPLY_BUF];
+	int acked[KINECT_MOTOR_BATCH_MAX];
+	int have_block[KINECT_MOTOR_BATCH_MAX];
+	int pending = 0;
+	int reads = 0;
+	int res = 0;
 
-	libusb_context* ctx = NULL;
-	libusb_init(&ctx);
+	for (int i = 0; i < batch->count; i++) {
+		memset(&batch->result[i], 0, sizeof(batch->result[i]));
+		batch->result[i].cmd = batch->cmd[i];
+		batch->result[i].tag = next_tag();
+		batch->result[i].status = LIBUSB_ERROR_TIMEOUT; // until the reply says otherwise
+		acked[i] = 0;
+		have_block[i] = batch->cmd[i] != KINECT_MOTOR_CMD_STATUS;
+		reads += have_block[i] ? 1 : 2;
+	}
 
-	libusb_device_handle* dev = NULL;
-	dev = libusb_open_device_with_vid_pid(ctx, 0x045e, 0x02ad);
-	if (dev == NULL) {
-		LOG("Failed to open audio device\n");
-		libusb_exit(ctx);
-		exit(1);
+	// the reads go first, so each reply has somewhere to land as soon as the
+	// device sends it
+	int submitted = 0;
+	for (; submitted < reads && res == 0; submitted++) {
+		kusb_fill_bulk(&in[submitted], KINECT_EP_IN, replies[submitted], BATCH_REPLY_BUF, batch_cb, &pending,
+			KINECT_COMMAND_TIMEOUT);
+		res = kusb_submit(io, &in[submitted]);
+		if (res == 0) {
+			pending++;
+		}
+	}
+	if (res != 0) {
+		submitted--;
+	}
+	int sent = 0;
+	for (; sent < batch->count && res == 0; sent++) {
+		wire[sent].magic = le32(KINECT_CMD_MAGIC);
+		wire[sent].tag = le32(batch->result[sent].tag);
+		wire[sent].cmd = le32(batch->cmd[sent]);
+		int length = sizeof(motor_command);
+		if (batch->cmd[sent] == KINECT_MOTOR_CMD_STATUS) {
+			wire[sent].arg1 = le32(KINECT_STATUS_REPLY_SIZE);
+			wire[sent].arg2 = 0;
+			length = 16;
+		} else {
+			wire[sent].arg1 = le32(0);
+			wire[sent].arg2 = (uint32_t)le32(batch->arg[sent]);
+		}
+		kusb_fill_bulk(&out[sent], KINECT_EP_OUT, (unsigned char*)&wire[sent], length, batch_cb, &pending,
+			KINECT_COMMAND_TIMEOUT);
+		res = kusb_submit(io, &out[sent]);
+		if (res == 0) {
+			pending++;
+		}
+	}
+	if (res != 0) {
+		LOG("batch: submitting failed: %d\n", res);
+		sent--;
+	}
+
+	// one wait for the lot; past the deadline, or after a failed submit,
+	// whatever is left is cancelled and waited out
+	int cancelled = res != 0;
+	while (pending > 0) {
+		uint64_t now = kusb_now_us();
+		if (!cancelled && now >= deadline) {
+			cancelled = 1;
+		}
+		if (cancelled) {
+			for (int i = 0; i < submitted; i++) {
+				if (in[i].backend != NULL) kusb_cancel(io, &in[i]);
+			}
+			for (int i = 0; i < sent; i++) {
+				if (out[i].backend != NULL) kusb_cancel(io, &out[i]);
+			}
+		}
+		int wait_ms = cancelled ? KUSB_CANCEL_POLL_MS : (int)((deadline - now + 999) / 1000);
+		kusb_handle_events(io, wait_ms);
+	}
+
+	for (int i = 0; i < submitted; i++) {
+		if (in[i].status == 0) {
+			batch_match(batch, replies[i], in[i].actual_length, acked, have_block);
+		}
+	}
+	int first = res;
+	for (int i = 0; i < batch->count; i++) {
+		kinect_motor_result* r = &batch->result[i];
+		if (i >= sent) {
+			r->status = res != 0 ? res : LIBUSB_ERROR_INTERRUPTED;
+		} else if (out[i].status != 0) {
+			r->status = out[i].status;
+		} else if (acked[i] && have_block[i] && r->status == LIBUSB_ERROR_TIMEOUT) {
+			r->status = 0;
+		} else if (acked[i] && !have_block[i]) {
+			r->status = LIBUSB_ERROR_IO;
+		}
+		if (first == 0 && r->status != 0) {
+			first = r->status;
+		}
+	}
+	return first;
+}
+
+int set_led_and_get_accel(kusb_io* io, led_state state, int32_t accel[3]) {
+	kinect_motor_batch batch;
+	kinect_motor_batch_init(&batch);
+	kinect_motor_batch_add(&batch, KINECT_MOTOR_CMD_LED, state);
+	int poll = kinect_motor_batch_add(&batch, KINECT_MOTOR_CMD_STATUS, 0);
+	int res = kinect_motor_batch_run(io, &batch);
+	if (res == 0) {
+		memcpy(accel, batch.result[poll].accel, sizeof(batch.result[poll].accel));
 	}
+	return res;
+}
+
+int do_motor_io(kusb_io* io) {
+	int res;
+	led_state state_to_set = LED_SOLID_RED;
+	int tilt = -30;
 
-	res = libusb_claim_interface(dev, 0);
+	kinect_motor_batch batch;
+	kinect_motor_batch_init(&batch);
+	kinect_motor_batch_add(&batch, KINECT_MOTOR_CMD_LED, state_to_set);
+	kinect_motor_batch_add(&batch, KINECT_MOTOR_CMD_TILT, tilt);
+	res = kinect_motor_batch_run(io, &batch);
 	if (res != 0) {
-		LOG("Failed to claim interface 1: %d\n", res);
-		goto cleanup;
+		LOG("set_led / set_tilt failed\n");
+		return res;
 	}
 
-	res = set_led(dev, state_to_set);
+	// a second of accelerometer readings from the background sampler rather
+	// than ten polls 100 ms apart
+	kinect_motor* motor = kinect_motor_open_io(io);
+	if (motor == NULL) {
+		LOG("kinect_motor_open_io failed\n");
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	kinect_motor_start_sampling(motor, DO_MOTOR_SAMPLE_HZ);
+	// taken as they come, given up on if they take twice as long
+	kinect_accel_sample samples[DO_MOTOR_SAMPLE_HZ];
+	int n = 0;
+	uint64_t deadline = kusb_deadline_after(2000);
+	while (n < DO_MOTOR_SAMPLE_HZ && kusb_now_us() < deadline) {
+		usleep(1000000 / DO_MOTOR_SAMPLE_HZ);
+		n += kinect_motor_read_samples(motor, samples + n, DO_MOTOR_SAMPLE_HZ - n);
+	}
+	kinect_motor_stop_sampling(motor);
+	res = kinect_motor_sync(motor, 1000);
+	kinect_motor_close(motor);
+	if (res == 0 && n < DO_MOTOR_SAMPLE_HZ) {
+		res = LIBUSB_ERROR_TIMEOUT;
+	}
 	if (res != 0) {
-		LOG("set_led failed\n");
-		goto cleanup;
+		LOG("accel sampling failed: %d samples\n", n);
+		return res;
+	}
+	if (n > 0) {
+		const kinect_accel_sample* s = &samples[n - 1];
+		LOG("%d accel samples, last: X %d Y %d Z %d\n", n, s->accel[0], s->accel[1], s->accel[2]);
 	}
 
-	res = set_tilt(dev, tilt);
+	res = set_tilt(io, -tilt);
 	if (res != 0) {
 		LOG("set_tilt failed\n");
-		goto cleanup;
+		return res;
 	}
+	return 0;
+}
 
-	int i;
-	for (i = 0; i < 10; i++) {
-		res = poll_status(dev);
-		if (res != 0) {
-			LOG("poll_status failed\n");
-			goto cleanup;
-		}
-		usleep(100000);
+int do_motor() {
+	libusb_device_handle* dev = kinect_usb_open(KINECT_VID, KINECT_PID_AUDIO);
+	if (dev == NULL) {
+		LOG("Failed to open audio device\n");
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	int res = LIBUSB_ERROR_NO_MEM;
+	kusb_io* io = kusb_io_open_libusb(kinect_usb_context(), dev);
+	if (io != NULL) {
+		res = do_motor_io(io);
+		kusb_io_close(io);
 	}
-	
-    res = set_tilt(dev, -tilt);
 	if (res != 0) {
-		LOG("set_tilt failed\n");
-		goto cleanup;
+		kinect_trace_dump(stderr);
 	}
-    
-cleanup:
-	libusb_close(dev);
-	libusb_exit(ctx);
 
-	return 0;
+	kinect_usb_close(dev);
+	return res;
 }
@@ -0,0 +1,65 @@
+//
+//  k4w_tilt_led.h
+//  kinectExample
+//
+//  Motor, LED and accelerometer commands for the 1473 / K4W audio device.
+//  All calls are blocking and go through a kusb_io, so they work the same on
+//  a real device and on the simulator. A command and its reply share one
+//  KINECT_COMMAND_TIMEOUT deadline, after which the call fails with
+//  LIBUSB_ERROR_TIMEOUT instead of waiting on a wedged device for good.
+//
+
+#ifndef __kinectExample__k4w_tilt_led__
+#define __kinectExample__k4w_tilt_led__
+
+#include "kinect_usb_io.h"
+#include "kinect_status.h"
+#include "kinect_motor_pipe.h"
+
+#define KINECT_COMMAND_TIMEOUT 1000 // ms
+
+typedef enum {
+	LED_OFF = 1,
+	LED_BLINK_GREEN = 2,
+	LED_SOLID_GREEN = 3,
+	LED_SOLID_RED = 4,
+} led_state;
+
+int set_led(kusb_io* io, led_state state);
+int set_tilt(kusb_io* io, int tilt_degrees);
+int poll_status(kusb_io* io);
+// poll_status(), keeping the decoded reply
+int get_status(kusb_io* io, kinect_status* status);
+// poll_status(), keeping the raw accelerometer values (words 4-6 of the reply)
+int get_accel(kusb_io* io, int32_t accel[3]);
+
+// Several commands in one bus round trip: every command and every reply
+// read is submitted at once, then the replies are matched back by tag. Fill
+// in with kinect_motor_batch_add(), run, and each command's outcome is in
+// result[] at the index add() returned.
+#define KINECT_MOTOR_BATCH_MAX 8
+
+typedef struct {
+	int count;
+	uint32_t cmd[KINECT_MOTOR_BATCH_MAX];  // KINECT_MOTOR_CMD_*
+	int32_t arg[KINECT_MOTOR_BATCH_MAX];   // LED state, tilt degrees
+	kinect_motor_result result[KINECT_MOTOR_BATCH_MAX];
+} kinect_motor_batch;
+
+void kinect_motor_batch_init(kinect_motor_batch* batch);
+// Index of the command, or LIBUSB_ERROR_OVERFLOW when the batch is full.
+int kinect_motor_batch_add(kinect_motor_batch* batch, uint32_t cmd, int32_t arg);
+// Runs the batch under one KINECT_COMMAND_TIMEOUT deadline. Returns 0, or the
+// first command's failure.
+int kinect_motor_batch_run(kusb_io* io, kinect_motor_batch* batch);
+
+// The per frame pair as one batch.
+int set_led_and_get_accel(kusb_io* io, led_state state, int32_t accel[3]);
+
+// LED red and tilt down in one batch, a second of accel samples, tilt up - on
+// the first audio device found. 0 or a libusb_error code; the transfer
+// trace is dumped to stderr when it fails.
+int do_motor();
+int do_motor_io(kusb_io* io);
+
+#endif /* defined(__kinectExample__k4w_tilt_led__) */
@@ -0,0 +1,51 @@
+//
+//  kinect_accel_ring.cpp
+//  kinectExample
+//
+
+#include "kinect_accel_ring.h"
+
+#include <string.h>
+
+#define RING_MASK (KINECT_ACCEL_RING_SIZE - 1)
+
+void kinect_accel_ring_init(kinect_accel_ring* ring) {
+	memset(ring, 0, sizeof(*ring));
+}
+
+int kinect_accel_ring_push(kinect_accel_ring* ring, const kinect_accel_sample* sample) {
+	uint32_t head = ring->head;
+	uint32_t tail = ring->tail;
+	if (head - tail >= KINECT_ACCEL_RING_SIZE) {
+		ring->dropped++;
+		return 0;
+	}
+	// the consumer's read of the slot must be done before we reuse it
+	__sync_synchronize();
+	ring->samples[head & RING_MASK] = *sample;
+	// and the sample must be visible before head says it is there
+	__sync_synchronize();
+	ring->head = head + 1;
+	return 1;
+}
+
+int kinect_accel_ring_pop(kinect_accel_ring* ring, kinect_accel_sample* out, int max) {
+	uint32_t tail = ring->tail;
+	uint32_t head = ring->head;
+	__sync_synchronize();
+	int n = (int)(head - tail);
+	if (n > max) {
+		n = max > 0 ? max : 0;
+	}
+	for (int i = 0; i < n; i++) {
+		out[i] = ring->samples[(tail + i) & RING_MASK];
+	}
+	// done copying before the producer may overwrite the slots
+	__sync_synchronize();
+	ring->tail = tail + n;
+	return n;
+}
+
+int kinect_accel_ring_count(const kinect_accel_ring* ring) {
+	return (int)(ring->head - ring->tail);
+}
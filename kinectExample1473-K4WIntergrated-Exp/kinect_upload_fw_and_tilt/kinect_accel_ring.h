@@ -0,0 +1,44 @@
+//
+//  kinect_accel_ring.h
+//  kinectExample
+//
+//  Single producer / single consumer ring of accelerometer samples. The motor
+//  worker pushes, the render thread drains once a frame; neither side takes a
+//  lock or waits for the other. When the reader falls a whole ring behind new
+//  samples are dropped and counted rather than overwriting ones it may be
+//  copying.
+//
+
+#ifndef __kinectExample__kinect_accel_ring__
+#define __kinectExample__kinect_accel_ring__
+
+#include <stdint.h>
+
+#define KINECT_ACCEL_RING_SIZE 1024 // power of two
+
+typedef struct {
+	uint64_t time_us;       // kusb_now_us() when the status reply arrived
+	uint32_t latency_us;    // round trip of the poll, the uncertainty of time_us
+	int32_t accel[3];       // raw values, words 4-6 of the status reply
+} kinect_accel_sample;
+
+typedef struct {
+	kinect_accel_sample samples[KINECT_ACCEL_RING_SIZE];
+	volatile uint32_t head;    // written by the producer only
+	volatile uint32_t tail;    // written by the consumer only
+	volatile uint32_t dropped; // written by the producer only
+} kinect_accel_ring;
+
+void kinect_accel_ring_init(kinect_accel_ring* ring);
+
+// Producer side. Returns 0 if the ring was full and the sample was dropped.
+int kinect_accel_ring_push(kinect_accel_ring* ring, const kinect_accel_sample* sample);
+
+// Consumer side. Copies up to max of the oldest samples into out, returns how
+// many.
+int kinect_accel_ring_pop(kinect_accel_ring* ring, kinect_accel_sample* out, int max);
+
+// Samples waiting, as seen from either side.
+int kinect_accel_ring_count(const kinect_accel_ring* ring);
+
+#endif /* defined(__kinectExample__kinect_accel_ring__) */
@@ -0,0 +1,160 @@
+//
+//  kinect_capture.cpp
+//  kinectExample
+//
+
+#include "kinect_capture.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <vector>
+
+#define CAPTURE_MAGIC   0x5041434b // "KCAP"
+#define CAPTURE_VERSION 1
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t data_bytes;
+} capture_header;
+
+struct kinect_capture {
+	uint64_t start_us;
+	std::vector<kinect_capture_record> records;
+	std::vector<unsigned char> data;
+};
+
+static kinect_capture* volatile active;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+kinect_capture* kinect_capture_start() {
+	kinect_capture* capture = new kinect_capture();
+	capture->start_us = kusb_now_us();
+	pthread_mutex_lock(&capture_lock);
+	if (active != NULL) {
+		pthread_mutex_unlock(&capture_lock);
+		delete capture;
+		return NULL;
+	}
+	active = capture;
+	pthread_mutex_unlock(&capture_lock);
+	return capture;
+}
+
+void kinect_capture_stop(kinect_capture* capture) {
+	pthread_mutex_lock(&capture_lock);
+	if (active == capture) {
+		active = NULL;
+	}
+	pthread_mutex_unlock(&capture_lock);
+}
+
+void kinect_capture_free(kinect_capture* capture) {
+	if (capture != NULL) {
+		kinect_capture_stop(capture);
+		delete capture;
+	}
+}
+
+void kinect_capture_transfer(const kusb_xfer* xfer) {
+	if (active == NULL) {
+		return;
+	}
+	uint64_t now = kusb_now_us();
+	pthread_mutex_lock(&capture_lock);
+	kinect_capture* capture = active;
+	if (capture != NULL) {
+		kinect_capture_record r;
+		r.submit_us = xfer->submit_us > capture->start_us ? xfer->submit_us - capture->start_us : 0;
+		r.complete_us = now - capture->start_us;
+		r.endpoint = xfer->endpoint;
+		r.length = xfer->length;
+		r.actual = xfer->actual_length;
+		r.status = xfer->status;
+		int bytes = (xfer->endpoint & 0x80) ? xfer->actual_length : xfer->length;
+		if (bytes < 0 || xfer->buffer == NULL) bytes = 0;
+		r.offset = (uint32_t)capture->data.size();
+		r.captured = (uint32_t)bytes;
+		capture->data.insert(capture->data.end(), xfer->buffer, xfer->buffer + bytes);
+		capture->records.push_back(r);
+	}
+	pthread_mutex_unlock(&capture_lock);
+}
+
+int kinect_capture_count(const kinect_capture* capture) {
+	return (int)capture->records.size();
+}
+
+const kinect_capture_record* kinect_capture_get(const kinect_capture* capture, int index) {
+	if (index < 0 || index >= (int)capture->records.size()) {
+		return NULL;
+	}
+	return &capture->records[index];
+}
+
+const unsigned char* kinect_capture_data(const kinect_capture* capture, const kinect_capture_record* record) {
+	if (record->captured == 0) {
+		return NULL;
+	}
+	return &capture->data[record->offset];
+}
+
+int kinect_capture_save(const kinect_capture* capture, const char* path) {
+	FILE* f = fopen(path, "wb");
+	if (f == NULL) {
+		return -1;
+	}
+	capture_header header;
+	header.magic = CAPTURE_MAGIC;
+	header.version = CAPTURE_VERSION;
+	header.count = (uint32_t)capture->records.size();
+	header.data_bytes = (uint32_t)capture->data.size();
+	int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	if (ok && header.count > 0) {
+		ok = fwrite(&capture->records[0], sizeof(kinect_capture_record), header.count, f) == header.count;
+	}
+	if (ok && header.data_bytes > 0) {
+		ok = fwrite(&capture->data[0], 1, header.data_bytes, f) == header.data_bytes;
+	}
+	if (fclose(f) != 0 || !ok) {
+		return -1;
+	}
+	return 0;
+}
+
+kinect_capture* kinect_capture_load(const char* path) {
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) {
+		return NULL;
+	}
+	capture_header header;
+	if (fread(&header, sizeof(header), 1, f) != 1
+		|| header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION) {
+		fclose(f);
+		errno = EINVAL;
+		return NULL;
+	}
+	kinect_capture* capture = new kinect_capture();
+	capture->start_us = 0;
+	capture->records.resize(header.count);
+	capture->data.resize(header.data_bytes);
+	int ok = header.count == 0
+		|| fread(&capture->records[0], sizeof(kinect_capture_record), header.count, f) == header.count;
+	if (ok && header.data_bytes > 0) {
+		ok = fread(&capture->data[0], 1, header.data_bytes, f) == header.data_bytes;
+	}
+	for (uint32_t i = 0; ok && i < header.count; i++) {
+		const kinect_capture_record& r = capture->records[i];
+		ok = (uint64_t)r.offset + r.captured <= header.data_bytes;
+	}
+	fclose(f);
+	if (!ok) {
+		delete capture;
+		errno = EINVAL;
+		return NULL;
+	}
+	return capture;
+}
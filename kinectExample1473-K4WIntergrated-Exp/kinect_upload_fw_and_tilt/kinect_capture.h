@@ -0,0 +1,58 @@
+//
+//  kinect_capture.h
+//  kinectExample
+//
+//  Complete record of a device session for replaying it later through
+//  kinect_usb_replay. Unlike kinect_trace, which keeps the last 1024
+//  transfers truncated to 104 bytes for reading, a capture keeps every bulk
+//  transfer whole with its submit and completion time, from whichever
+//  backend and thread it went through, until it is stopped.
+//
+//      kinect_capture* capture = kinect_capture_start();
+//      upload_firmware(true);
+//      kinect_capture_stop(capture);
+//      kinect_capture_save(capture, "upload.kcap");
+//
+//  Control transfers (the 1414 motor) aren't captured.
+//
+
+#ifndef __kinectExample__kinect_capture__
+#define __kinectExample__kinect_capture__
+
+#include "kinect_usb_io.h"
+
+typedef struct kinect_capture kinect_capture;
+
+typedef struct {
+	uint64_t submit_us;   // since the capture started
+	uint64_t complete_us;
+	uint8_t endpoint;
+	int32_t length;       // bytes asked for
+	int32_t actual;       // bytes transferred
+	int32_t status;       // libusb_error, 0 on success
+	uint32_t offset;      // of the bytes sent or received in the capture's data
+	uint32_t captured;    // length for OUT transfers, actual for IN
+} kinect_capture_record;
+
+// Starts a capture and makes it the one transfers are recorded in. NULL if
+// one is running already.
+kinect_capture* kinect_capture_start();
+// Stops recording; the capture stays readable until kinect_capture_free().
+void kinect_capture_stop(kinect_capture* capture);
+void kinect_capture_free(kinect_capture* capture);
+
+// Records in the order the transfers completed.
+int kinect_capture_count(const kinect_capture* capture);
+const kinect_capture_record* kinect_capture_get(const kinect_capture* capture, int index);
+const unsigned char* kinect_capture_data(const kinect_capture* capture, const kinect_capture_record* record);
+
+// Returns 0 or -1 (errno set).
+int kinect_capture_save(const kinect_capture* capture, const char* path);
+// NULL if path can't be read or isn't a capture.
+kinect_capture* kinect_capture_load(const char* path);
+
+// From kusb_complete(), for every transfer; does nothing unless a capture is
+// running.
+void kinect_capture_transfer(const kusb_xfer* xfer);
+
+#endif /* defined(__kinectExample__kinect_capture__) */
@@ -0,0 +1,116 @@
+//
+//  kinect_device.cpp
+//  kinectExample
+//
+
+#include "kinect_device.h"
+#include "kinect_usb_runtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+
+#define NUI_OUT (LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT)
+#define NUI_IN  (LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN)
+
+//------------------------------------------------------------------------------
+// 1414 motor device
+
+// indexed by KINECT_LED_*
+static const int nui_led_values[] = {
+	KINECT_NUI_LED_OFF,         // 0, not a KINECT_LED_* state
+	KINECT_NUI_LED_OFF,         // KINECT_LED_OFF
+	KINECT_NUI_LED_BLINK_GREEN, // KINECT_LED_BLINK_GREEN
+	KINECT_NUI_LED_GREEN,       // KINECT_LED_SOLID_GREEN
+	KINECT_NUI_LED_RED,         // KINECT_LED_SOLID_RED
+};
+
+int kinect_nui_motor_protocol::led_value(int state) {
+	if (state < 0 || state >= (int)(sizeof(nui_led_values) / sizeof(nui_led_values[0]))) {
+		return KINECT_NUI_LED_OFF;
+	}
+	return nui_led_values[state];
+}
+
+int kinect_nui_motor_protocol::set_led(kusb_io* io, int state) {
+	int res = kusb_control(io, NUI_OUT, KINECT_NUI_SET_LED, (uint16_t)led_value(state), 0, NULL, 0,
+		KINECT_COMMAND_TIMEOUT);
+	if (res < 0) {
+		LOG("kinect_device: 1414 set_led failed: %d\n", res);
+		return res;
+	}
+	return 0;
+}
+
+int kinect_nui_motor_protocol::set_tilt(kusb_io* io, int degrees) {
+	int res = kusb_control(io, NUI_OUT, KINECT_NUI_SET_TILT, (uint16_t)(int16_t)(degrees * 2), 0, NULL, 0,
+		KINECT_COMMAND_TIMEOUT);
+	if (res < 0) {
+		LOG("kinect_device: 1414 set_tilt failed: %d\n", res);
+		return res;
+	}
+	return 0;
+}
+
+int kinect_nui_motor_protocol::get_status(kusb_io* io, kinect_status* status) {
+	unsigned char buf[KINECT_NUI_STATE_SIZE];
+	int res = kusb_control(io, NUI_IN, KINECT_NUI_GET_STATE, 0, 0, buf, sizeof(buf), KINECT_COMMAND_TIMEOUT);
+	if (res < 0) {
+		LOG("kinect_device: 1414 get_status failed: %d\n", res);
+		return res;
+	}
+	if (res != KINECT_NUI_STATE_SIZE) {
+		LOG("kinect_device: 1414 state is %d bytes (expected %d)\n", res, KINECT_NUI_STATE_SIZE);
+		return LIBUSB_ERROR_IO;
+	}
+	if (status != NULL) {
+		memset(status, 0, sizeof(*status));
+		for (int i = 0; i < 3; i++) {
+			status->accel[i] = (int16_t)((buf[2 + i * 2] << 8) | buf[3 + i * 2]);
+		}
+		status->tilt_angle = (int8_t)buf[8] / 2;
+		status->tilt_state = buf[9];
+		status->length = res;
+	}
+	return 0;
+}
+
+//------------------------------------------------------------------------------
+// opening
+
+struct kinect_usb_device {
+	libusb_device_handle* dev; // borrowed from kinect_usb_runtime
+	kusb_io* io;
+};
+
+kinect_usb_device* kinect_usb_device_open(uint16_t pid) {
+	libusb_device_handle* dev = kinect_usb_open(KINECT_VID, pid);
+	if (dev == NULL) {
+		LOG("kinect_device: no %04x:%04x attached\n", KINECT_VID, pid);
+		return NULL;
+	}
+	kinect_usb_device* device = (kinect_usb_device*)calloc(1, sizeof(kinect_usb_device));
+	kusb_io* io = device != NULL ? kusb_io_open_libusb(kinect_usb_context(), dev) : NULL;
+	if (io == NULL) {
+		free(device);
+		kinect_usb_close(dev);
+		return NULL;
+	}
+	device->dev = dev;
+	device->io = io;
+	return device;
+}
+
+kusb_io* kinect_usb_device_io(kinect_usb_device* device) {
+	return device->io;
+}
+
+void kinect_usb_device_close(kinect_usb_device* device) {
+	if (device == NULL) {
+		return;
+	}
+	kusb_io_close(device->io);
+	kinect_usb_close(device->dev);
+	free(device);
+}
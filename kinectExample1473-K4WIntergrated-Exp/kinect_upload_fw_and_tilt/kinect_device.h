@@ -0,0 +1,170 @@
+//
+//  kinect_device.h
+//  kinectExample
+//
+//  One controller for the tilt motor, LED and accelerometer of every model.
+//  What differs between them (which device to open, bulk commands or control
+//  requests, how the status reply is laid out, whether firmware has to be
+//  uploaded first) is in kinect_device_traits<model>, so a controller is
+//  bound to its protocol at compile time and the command and polling paths
+//  don't ask what they are talking to:
+//
+//      kinect_controller<KINECT_MODEL_1473> motor;
+//      if (motor.open() == 0) {
+//          motor.set_tilt(10);
+//          motor.get_status(&status);
+//      }
+//
+//  LED states are KINECT_LED_* for every model. ofxKinect already drives the
+//  1414's motor device, so open that one only when ofxKinect doesn't.
+//
+//  A controller is blocking and bound to one model, for tools and tests that
+//  know what they are talking to, e.g. the device benchmark. testApp doesn't
+//  know the model until something is plugged in: the 1414's motor stays with
+//  ofxKinect and the 1473 / K4W go through kinect_motor, which samples and
+//  sends commands on its own thread. testApp only asks which of the two has
+//  the device; the command and polling paths under each don't branch.
+//
+
+#ifndef __kinectExample__kinect_device__
+#define __kinectExample__kinect_device__
+
+#include "kinect_usb_io.h"
+#include "kinect_protocol.h"
+#include "kinect_status.h"
+#include "k4w_tilt_led.h"
+
+#include <string.h>
+
+typedef enum {
+	KINECT_MODEL_1414,  // original Xbox Kinect
+	KINECT_MODEL_1473,  // later Xbox Kinect
+	KINECT_MODEL_K4W    // Kinect for Windows
+} kinect_model;
+
+// 1414: vendor requests to the motor device on the control endpoint.
+struct kinect_nui_motor_protocol {
+	static int set_led(kusb_io* io, int state);
+	static int set_tilt(kusb_io* io, int degrees);
+	// Fills in accel, tilt_angle and tilt_state.
+	static int get_status(kusb_io* io, kinect_status* status);
+	// KINECT_NUI_LED_* for a KINECT_LED_* state
+	static int led_value(int state);
+};
+
+// 1473 and K4W: tagged bulk commands to the audio device once it runs the
+// uploaded firmware, see k4w_tilt_led.h.
+struct kinect_audio_motor_protocol {
+	static int set_led(kusb_io* io, int state) {
+		return ::set_led(io, (led_state)state);
+	}
+	static int set_tilt(kusb_io* io, int degrees) {
+		return ::set_tilt(io, degrees);
+	}
+	static int get_status(kusb_io* io, kinect_status* status) {
+		return ::get_status(io, status);
+	}
+	static int led_value(int state) {
+		return state;
+	}
+};
+
+template <kinect_model M> struct kinect_device_traits;
+
+template <> struct kinect_device_traits<KINECT_MODEL_1414> {
+	typedef kinect_nui_motor_protocol protocol;
+	enum {
+		pid = KINECT_PID_NUI_MOTOR,
+		needs_firmware = 0,
+		tilt_min = -31,
+		tilt_max = 31
+	};
+	static const char* name() { return "1414"; }
+};
+
+template <> struct kinect_device_traits<KINECT_MODEL_1473> {
+	typedef kinect_audio_motor_protocol protocol;
+	enum {
+		pid = KINECT_PID_AUDIO,
+		needs_firmware = 1,
+		tilt_min = -31,
+		tilt_max = 31
+	};
+	static const char* name() { return "1473"; }
+};
+
+template <> struct kinect_device_traits<KINECT_MODEL_K4W> {
+	typedef kinect_audio_motor_protocol protocol;
+	enum {
+		pid = KINECT_PID_K4W_AUDIO,
+		needs_firmware = 1,
+		tilt_min = -27,
+		tilt_max = 27
+	};
+	static const char* name() { return "K4W"; }
+};
+
+// The first attached device with product id pid, interface 0 claimed, and
+// a kusb_io on it.
+typedef struct kinect_usb_device kinect_usb_device;
+kinect_usb_device* kinect_usb_device_open(uint16_t pid);
+kusb_io* kinect_usb_device_io(kinect_usb_device* device);
+void kinect_usb_device_close(kinect_usb_device* device);
+
+template <kinect_model M>
+class kinect_controller {
+public:
+	typedef kinect_device_traits<M> traits;
+	typedef typename traits::protocol protocol;
+
+	kinect_controller() : device(NULL), io(NULL) {}
+	// Drives io (a simulated device, or one opened elsewhere) without owning it.
+	explicit kinect_controller(kusb_io* io) : device(NULL), io(io) {}
+	~kinect_controller() { close(); }
+
+	// The 1473 and K4W only show up once their firmware has been uploaded,
+	// see upload_firmware_if_needed().
+	int open() {
+		close();
+		device = kinect_usb_device_open(traits::pid);
+		io = device != NULL ? kinect_usb_device_io(device) : NULL;
+		return io != NULL ? 0 : LIBUSB_ERROR_NOT_FOUND;
+	}
+	void close() {
+		kinect_usb_device_close(device);
+		device = NULL;
+		io = NULL;
+	}
+	bool is_open() const { return io != NULL; }
+	kusb_io* get_io() const { return io; }
+
+	int set_led(int state) {
+		return protocol::set_led(io, state);
+	}
+	// Clamped to what the model's motor takes.
+	int set_tilt(int degrees) {
+		if (degrees < traits::tilt_min) degrees = traits::tilt_min;
+		if (degrees > traits::tilt_max) degrees = traits::tilt_max;
+		return protocol::set_tilt(io, degrees);
+	}
+	int get_status(kinect_status* status) {
+		return protocol::get_status(io, status);
+	}
+	int get_accel(int32_t accel[3]) {
+		kinect_status status;
+		int res = protocol::get_status(io, &status);
+		if (res == 0) {
+			memcpy(accel, status.accel, sizeof(status.accel));
+		}
+		return res;
+	}
+
+private:
+	kinect_usb_device* device; // NULL when io belongs to the caller
+	kusb_io* io;
+
+	kinect_controller(const kinect_controller&);
+	kinect_controller& operator=(const kinect_controller&);
+};
+
+#endif /* defined(__kinectExample__kinect_device__) */
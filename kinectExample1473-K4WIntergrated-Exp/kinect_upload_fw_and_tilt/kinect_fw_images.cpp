@@ -0,0 +1,33 @@
+//
+//  kinect_fw_images.cpp
+//  kinectExample
+//
+//  Add a line here (sha256sum of the file) before uploading a new image.
+//
+
+#include "kinect_fw_images.h"
+
+#include <string.h>
+
+static const kinect_fw_image images[] = {
+	{ "audios.bin", "1473 audio firmware", 474624,
+		"3c7eaea16a4eb0c4b8afe3a82c01fb33c78fb6376e3dbd4fe34da6a0a7dfb3d8" },
+	// the image compiled in as fw1473Bin: the array in the first fwbin.cpp,
+	// byte for byte bin/data/audiosAlt.bin. What it differs from audios.bin
+	// in, and for which hardware, isn't known.
+	{ "audiosAlt.bin", "1473 audio firmware, compiled in (fw1473Bin)", 474624,
+		"19078afa4f7dc534de05faa496ece59251f7cb32ada263cfe651bf23fdbf529d" },
+	{ "firmware.bin", "1414 audio firmware", 132096,
+		"efd1dd2fd2610f69d07af7aeff56b26551ac6ec4251159c50027769545b6f7a5" },
+};
+
+const kinect_fw_image* kinect_fw_find_image(const unsigned char digest[KINECT_SHA256_SIZE], int size) {
+	char hex[2 * KINECT_SHA256_SIZE + 1];
+	kinect_sha256_hex(digest, hex);
+	for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); i++) {
+		if (images[i].size == size && strcmp(images[i].sha256, hex) == 0) {
+			return &images[i];
+		}
+	}
+	return NULL;
+}
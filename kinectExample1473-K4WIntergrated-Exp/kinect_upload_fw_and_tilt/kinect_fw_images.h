@@ -0,0 +1,25 @@
+//
+//  kinect_fw_images.h
+//  kinectExample
+//
+//  Firmware images we know the audio/motor bootloader can run. The upload
+//  hashes what it sends and refuses to execute anything not listed here, so
+//  a truncated or modified file is caught before the device jumps into it.
+//
+
+#ifndef __kinectExample__kinect_fw_images__
+#define __kinectExample__kinect_fw_images__
+
+#include "kinect_sha256.h"
+
+typedef struct {
+	const char* name;
+	const char* description;
+	int size;
+	const char* sha256; // lowercase hex
+} kinect_fw_image;
+
+// The image with this size and digest, or NULL.
+const kinect_fw_image* kinect_fw_find_image(const unsigned char digest[KINECT_SHA256_SIZE], int size);
+
+#endif /* defined(__kinectExample__kinect_fw_images__) */
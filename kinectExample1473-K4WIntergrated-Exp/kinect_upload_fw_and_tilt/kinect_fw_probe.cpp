@@ -0,0 +1,259 @@
+//
+//  kinect_fw_probe.cpp
+//  kinectExample
+//
+
+#include "kinect_fw_probe.h"
+#include "kinect_protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+
+#define LOG(...) printf(__VA_ARGS__)
+#define fn_le32(x) (x)
+
+#define CACHE_NAME "kinect_fw_state"
+#define CACHE_MAX_ENTRIES 32
+
+const char* kinect_fw_state_name(kinect_fw_state state) {
+	switch (state) {
+	case KINECT_FW_STATE_BOOTLOADER: return "bootloader";
+	case KINECT_FW_STATE_APPLICATION: return "application";
+	default: return "unknown";
+	}
+}
+
+int kinect_fw_probe_device(libusb_device_handle* dev, kinect_fw_probe_result* result) {
+	memset(result, 0, sizeof(*result));
+
+	libusb_device* device = libusb_get_device(dev);
+	struct libusb_device_descriptor desc;
+	int res = libusb_get_device_descriptor(device, &desc);
+	if (res != 0) {
+		return res;
+	}
+	if (desc.iSerialNumber != 0) {
+		if (libusb_get_string_descriptor_ascii(dev, desc.iSerialNumber,
+			(unsigned char*)result->serial, sizeof(result->serial)) < 0) {
+			result->serial[0] = '\0';
+		}
+	}
+
+	struct libusb_config_descriptor* config = NULL;
+	res = libusb_get_active_config_descriptor(device, &config);
+	if (res != 0) {
+		return res;
+	}
+	result->interfaces = config->bNumInterfaces;
+	libusb_free_config_descriptor(config);
+
+	result->state = result->interfaces >= 2 ? KINECT_FW_STATE_APPLICATION : KINECT_FW_STATE_BOOTLOADER;
+	if (result->serial[0] != '\0') {
+		result->cached = kinect_fw_cache_lookup(result->serial, result->loaded_sha256) == 0;
+	}
+	return 0;
+}
+
+int kinect_fw_needs_upload(const kinect_fw_probe_result* probe,
+	const unsigned char digest[KINECT_SHA256_SIZE], const char* who) {
+	if (probe->state != KINECT_FW_STATE_APPLICATION) {
+		return 1;
+	}
+	if (!probe->cached) {
+		LOG("%s: %s is running firmware we didn't upload, leaving it\n", who, probe->serial);
+	} else if (memcmp(probe->loaded_sha256, digest, KINECT_SHA256_SIZE) != 0) {
+		char hex[2 * KINECT_SHA256_SIZE + 1];
+		kinect_sha256_hex(probe->loaded_sha256, hex);
+		LOG("%s: %s is running another image (sha256 %s), power cycle it to load this one\n",
+			who, probe->serial, hex);
+	} else {
+		LOG("%s: %s already running this image\n", who, probe->serial);
+	}
+	return 0;
+}
+
+kinect_fw_state kinect_fw_probe_io(kusb_io* io, unsigned int timeout) {
+	bootloader_command cmd;
+	cmd.magic = fn_le32(KINECT_CMD_MAGIC);
+	cmd.seq = fn_le32(1);
+	cmd.bytes = fn_le32(KINECT_FW_INFO_REPLY_SIZE);
+	cmd.cmd = fn_le32(KINECT_BL_CMD_INFO);
+	cmd.write_addr = fn_le32(0x15);
+	cmd.unk = fn_le32(0);
+
+	int transferred = 0;
+	int res = kusb_bulk(io, KINECT_EP_OUT, (unsigned char*)&cmd, sizeof(cmd), &transferred, timeout);
+	if (res != 0 || transferred != sizeof(cmd)) {
+		return KINECT_FW_STATE_UNKNOWN;
+	}
+
+	union {
+		status_code code;
+		unsigned char dump[512];
+	} reply;
+	res = kusb_bulk(io, KINECT_EP_IN, reply.dump, sizeof(reply.dump), &transferred, timeout);
+	if (res != 0) {
+		return KINECT_FW_STATE_UNKNOWN;
+	}
+	if (transferred == KINECT_FW_INFO_REPLY_SIZE) {
+		// the status for the info request, so the next command starts clean
+		kusb_bulk(io, KINECT_EP_IN, reply.dump, sizeof(reply.dump), &transferred, timeout);
+		return KINECT_FW_STATE_BOOTLOADER;
+	}
+	if (transferred >= (int)sizeof(status_code) && fn_le32(reply.code.magic) == KINECT_REPLY_MAGIC) {
+		return KINECT_FW_STATE_APPLICATION;
+	}
+	return KINECT_FW_STATE_UNKNOWN;
+}
+
+int kinect_fw_digest(kinect_fw_source* src, unsigned char digest[KINECT_SHA256_SIZE]) {
+	kinect_sha256 sha;
+	kinect_sha256_init(&sha);
+	int pages = kinect_fw_source_pages(src);
+	for (int i = 0; i < pages; i++) {
+		const unsigned char* page = kinect_fw_source_page(src, i);
+		if (page == NULL) {
+			return LIBUSB_ERROR_IO;
+		}
+		kinect_sha256_update(&sha, page, kinect_fw_source_page_length(src, i));
+	}
+	kinect_sha256_final(&sha, digest);
+	return 0;
+}
+
+//------------------------------------------------------------------------------
+// cache: one "<serial> <sha256 hex>" line per device
+
+typedef struct {
+	char serial[64];
+	unsigned char sha256[KINECT_SHA256_SIZE];
+} cache_entry;
+
+static void cache_path(char* path, size_t size, const char* suffix) {
+	const char* dir = getenv("TMPDIR");
+	if (dir == NULL || dir[0] == '\0') {
+		dir = "/tmp";
+	}
+	size_t len = strlen(dir);
+	snprintf(path, size, "%s%s%s%s", dir, dir[len - 1] == '/' ? "" : "/", CACHE_NAME, suffix);
+}
+
+static int parse_hex(const char* hex, unsigned char* out, int size) {
+	for (int i = 0; i < size; i++) {
+		unsigned int byte;
+		if (sscanf(hex + i * 2, "%2x", &byte) != 1) {
+			return -1;
+		}
+		out[i] = (unsigned char)byte;
+	}
+	return hex[size * 2] == '\0' ? 0 : -1;
+}
+
+static int cache_read(cache_entry* entries, int max) {
+	char path[1024];
+	cache_path(path, sizeof(path), "");
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+	int count = 0;
+	char line[192];
+	char hex[2 * KINECT_SHA256_SIZE + 2];
+	while (count < max && fgets(line, sizeof(line), f) != NULL) {
+		// lines from before the cache held digests don't parse and are dropped
+		if (sscanf(line, "%63s %65s", entries[count].serial, hex) == 2
+			&& parse_hex(hex, entries[count].sha256, KINECT_SHA256_SIZE) == 0) {
+			count++;
+		}
+	}
+	fclose(f);
+	return count;
+}
+
+int kinect_fw_cache_lookup(const char* serial, unsigned char digest[KINECT_SHA256_SIZE]) {
+	cache_entry entries[CACHE_MAX_ENTRIES];
+	int count = cache_read(entries, CACHE_MAX_ENTRIES);
+	for (int i = 0; i < count; i++) {
+		if (strcmp(entries[i].serial, serial) == 0) {
+			memcpy(digest, entries[i].sha256, KINECT_SHA256_SIZE);
+			return 0;
+		}
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+// Under the lock, so no other store reads the file between our read and
+// our rename and then renames its own copy, without our entry, over it.
+static int cache_update(const char* serial, const unsigned char digest[KINECT_SHA256_SIZE]) {
+	cache_entry entries[CACHE_MAX_ENTRIES];
+	int count = cache_read(entries, CACHE_MAX_ENTRIES);
+
+	int i = 0;
+	while (i < count && strcmp(entries[i].serial, serial) != 0) {
+		i++;
+	}
+	if (i == CACHE_MAX_ENTRIES) {
+		// forget the oldest
+		memmove(&entries[0], &entries[1], (CACHE_MAX_ENTRIES - 1) * sizeof(cache_entry));
+		i = CACHE_MAX_ENTRIES - 1;
+	} else if (i == count) {
+		count++;
+	}
+	snprintf(entries[i].serial, sizeof(entries[i].serial), "%s", serial);
+	memcpy(entries[i].sha256, digest, KINECT_SHA256_SIZE);
+
+	// write a uniquely named sibling and rename it over, so a reader never
+	// sees half a file
+	char path[1024];
+	char tmp[1040];
+	cache_path(path, sizeof(path), "");
+	cache_path(tmp, sizeof(tmp), ".XXXXXX");
+	int fd = mkstemp(tmp);
+	if (fd < 0) {
+		return LIBUSB_ERROR_IO;
+	}
+	FILE* f = fdopen(fd, "w");
+	if (f == NULL) {
+		close(fd);
+		remove(tmp);
+		return LIBUSB_ERROR_IO;
+	}
+	for (int j = 0; j < count; j++) {
+		char hex[2 * KINECT_SHA256_SIZE + 1];
+		kinect_sha256_hex(entries[j].sha256, hex);
+		fprintf(f, "%s %s\n", entries[j].serial, hex);
+	}
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		remove(tmp);
+		return LIBUSB_ERROR_IO;
+	}
+	return 0;
+}
+
+int kinect_fw_cache_store(const char* serial, const unsigned char digest[KINECT_SHA256_SIZE]) {
+	if (serial == NULL || serial[0] == '\0' || strchr(serial, ' ') != NULL) {
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	// flock() locks are per open file, so this serialises threads of one
+	// process as well as other processes
+	char lock_path[1040];
+	cache_path(lock_path, sizeof(lock_path), ".lock");
+	int lock = open(lock_path, O_RDWR | O_CREAT, 0600);
+	if (lock < 0) {
+		return LIBUSB_ERROR_IO;
+	}
+	while (flock(lock, LOCK_EX) != 0) {
+		if (errno != EINTR) {
+			close(lock);
+			return LIBUSB_ERROR_IO;
+		}
+	}
+	int res = cache_update(serial, digest);
+	close(lock); // lets go of the lock
+	return res;
+}
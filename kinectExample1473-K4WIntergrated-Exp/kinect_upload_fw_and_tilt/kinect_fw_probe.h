@@ -0,0 +1,66 @@
+//
+//  kinect_fw_probe.h
+//  kinectExample
+//
+//  Works out whether the audio/motor device still needs its firmware. The
+//  bootloader exposes a single interface and the running firmware two (the
+//  same test libfreenect uses), so the descriptors answer that without
+//  talking to the device. Which image is running can't be read back, so the
+//  SHA-256 of every image we upload, the digest kinect_fw_images knows
+//  images by, is remembered per device serial in a small cache file; the
+//  serial survives the re-enumeration after execute.
+//
+
+#ifndef __kinectExample__kinect_fw_probe__
+#define __kinectExample__kinect_fw_probe__
+
+#include <libusb.h>
+
+#include "kinect_usb_io.h"
+#include "kinect_fw_source.h"
+#include "kinect_sha256.h"
+
+typedef enum {
+	KINECT_FW_STATE_UNKNOWN,
+	KINECT_FW_STATE_BOOTLOADER,
+	KINECT_FW_STATE_APPLICATION
+} kinect_fw_state;
+
+typedef struct {
+	kinect_fw_state state;
+	int interfaces;       // in the active configuration, 0 if unreadable
+	char serial[64];      // empty if the device has none
+	int cached;           // loaded_sha256 came from the cache
+	unsigned char loaded_sha256[KINECT_SHA256_SIZE]; // image we last uploaded to this serial
+} kinect_fw_probe_result;
+
+// Descriptors only, nothing is sent to the device. Returns 0 or a
+// libusb_error code.
+int kinect_fw_probe_device(libusb_device_handle* dev, kinect_fw_probe_result* result);
+
+// 0 if the device already runs its firmware and must be left alone, which
+// is logged with who in front, 1 if it is to be flashed with the image of
+// that digest. A device running an image we didn't upload, or another one
+// than this, keeps it until it is power cycled.
+int kinect_fw_needs_upload(const kinect_fw_probe_result* probe,
+	const unsigned char digest[KINECT_SHA256_SIZE], const char* who);
+
+// Asks the bootloader for its 96 byte info block and drains the status that
+// follows, for when descriptors aren't available (e.g. the simulator).
+// Anything else that answers with a reply magic is taken to be the firmware.
+kinect_fw_state kinect_fw_probe_io(kusb_io* io, unsigned int timeout);
+
+// SHA-256 over the whole image, as misc/kinect_pack_fw and the upload's
+// stats have it. Returns 0 or LIBUSB_ERROR_IO if a page can't be read.
+int kinect_fw_digest(kinect_fw_source* src, unsigned char digest[KINECT_SHA256_SIZE]);
+
+// $TMPDIR/kinect_fw_state, so it goes away with a reboot. The firmware does
+// too on a power cycle, which probing then sees as the bootloader again.
+// Stores from several threads or processes are serialised on a lock file
+// next to it.
+int kinect_fw_cache_lookup(const char* serial, unsigned char digest[KINECT_SHA256_SIZE]);
+int kinect_fw_cache_store(const char* serial, const unsigned char digest[KINECT_SHA256_SIZE]);
+
+const char* kinect_fw_state_name(kinect_fw_state state);
+
+#endif /* defined(__kinectExample__kinect_fw_probe__) */
@@ -0,0 +1,318 @@
+//
+//  kinect_fw_source.cpp
+//  kinectExample
+//
+
+#include "kinect_fw_source.h"
+#include "kinect_lzss.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+
+#define DEFAULT_WINDOW_PAGES 4
+
+int kinect_fw_source_pages(const kinect_fw_source* src) {
+	return (src->size + KINECT_FW_PAGE_SIZE - 1) / KINECT_FW_PAGE_SIZE;
+}
+
+int kinect_fw_source_page_length(const kinect_fw_source* src, int index) {
+	int left = src->size - index * KINECT_FW_PAGE_SIZE;
+	if (left <= 0) {
+		return 0;
+	}
+	return left < KINECT_FW_PAGE_SIZE ? left : KINECT_FW_PAGE_SIZE;
+}
+
+const unsigned char* kinect_fw_source_page(kinect_fw_source* src, int index) {
+	if (index < 0 || index >= kinect_fw_source_pages(src)) {
+		return NULL;
+	}
+	return src->ops->page(src, index);
+}
+
+void kinect_fw_source_close(kinect_fw_source* src) {
+	if (src != NULL) {
+		src->ops->destroy(src);
+	}
+}
+
+static kinect_fw_source* new_source(const kinect_fw_source_ops* ops, int size, void* priv) {
+	kinect_fw_source* src = (kinect_fw_source*)calloc(1, sizeof(kinect_fw_source));
+	if (src != NULL) {
+		src->ops = ops;
+		src->size = size;
+		src->priv = priv;
+	}
+	return src;
+}
+
+//------------------------------------------------------------------------------
+// memory
+
+static const unsigned char* memory_page(kinect_fw_source* src, int index) {
+	return (const unsigned char*)src->priv + index * KINECT_FW_PAGE_SIZE;
+}
+
+static void memory_destroy(kinect_fw_source* src) {
+	free(src);
+}
+
+static const kinect_fw_source_ops memory_ops = {
+	"memory",
+	memory_page,
+	memory_destroy,
+};
+
+kinect_fw_source* kinect_fw_source_open_memory(const unsigned char* data, int size) {
+	return new_source(&memory_ops, data != NULL && size > 0 ? size : 0, (void*)data);
+}
+
+//------------------------------------------------------------------------------
+// mmap
+
+typedef struct {
+	void* base;
+	size_t length;
+} mapped_file;
+
+static const unsigned char* mapped_page(kinect_fw_source* src, int index) {
+	return (const unsigned char*)((mapped_file*)src->priv)->base + index * KINECT_FW_PAGE_SIZE;
+}
+
+static void mapped_destroy(kinect_fw_source* src) {
+	mapped_file* m = (mapped_file*)src->priv;
+	munmap(m->base, m->length);
+	free(m);
+	free(src);
+}
+
+static const kinect_fw_source_ops mapped_ops = {
+	"mmap",
+	mapped_page,
+	mapped_destroy,
+};
+
+kinect_fw_source* kinect_fw_source_open_file(const char* filename) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		LOG("Failed to open %s: %s\n", filename, strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		LOG("Failed to stat %s: %s\n", filename, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	void* base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		LOG("Can't map %s (%s), streaming it instead\n", filename, strerror(errno));
+		return kinect_fw_source_open_stream(filename, DEFAULT_WINDOW_PAGES);
+	}
+	madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+	mapped_file* m = (mapped_file*)calloc(1, sizeof(mapped_file));
+	kinect_fw_source* src = m != NULL ? new_source(&mapped_ops, (int)st.st_size, m) : NULL;
+	if (src == NULL) {
+		munmap(base, (size_t)st.st_size);
+		free(m);
+		return NULL;
+	}
+	m->base = base;
+	m->length = (size_t)st.st_size;
+	return src;
+}
+
+//------------------------------------------------------------------------------
+// streamed through a ring of page buffers
+
+typedef struct {
+	int fd;
+	int window;
+	unsigned char* buffers; // window * KINECT_FW_PAGE_SIZE
+	int* loaded;            // page held by each buffer, -1 for none
+} streamed_file;
+
+static const unsigned char* streamed_page(kinect_fw_source* src, int index) {
+	streamed_file* s = (streamed_file*)src->priv;
+	int slot = index % s->window;
+	unsigned char* buf = s->buffers + slot * KINECT_FW_PAGE_SIZE;
+	if (s->loaded[slot] == index) {
+		return buf;
+	}
+
+	int length = kinect_fw_source_page_length(src, index);
+	off_t offset = (off_t)index * KINECT_FW_PAGE_SIZE;
+	int done = 0;
+	while (done < length) {
+		ssize_t n = pread(s->fd, buf + done, length - done, offset + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			LOG("kinect_fw_source: read of page %d failed: %s\n", index, n < 0 ? strerror(errno) : "short file");
+			s->loaded[slot] = -1;
+			return NULL;
+		}
+		done += (int)n;
+	}
+	s->loaded[slot] = index;
+	return buf;
+}
+
+static void streamed_destroy(kinect_fw_source* src) {
+	streamed_file* s = (streamed_file*)src->priv;
+	close(s->fd);
+	free(s->buffers);
+	free(s->loaded);
+	free(s);
+	free(src);
+}
+
+static const kinect_fw_source_ops streamed_ops = {
+	"stream",
+	streamed_page,
+	streamed_destroy,
+};
+
+kinect_fw_source* kinect_fw_source_open_stream(const char* filename, int window_pages) {
+	if (window_pages < 2) {
+		window_pages = 2;
+	}
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		LOG("Failed to open %s: %s\n", filename, strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		LOG("Failed to stat %s: %s\n", filename, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	streamed_file* s = (streamed_file*)calloc(1, sizeof(streamed_file));
+	if (s != NULL) {
+		s->buffers = (unsigned char*)malloc((size_t)window_pages * KINECT_FW_PAGE_SIZE);
+		s->loaded = (int*)malloc(window_pages * sizeof(int));
+	}
+	kinect_fw_source* src = NULL;
+	if (s != NULL && s->buffers != NULL && s->loaded != NULL) {
+		src = new_source(&streamed_ops, (int)st.st_size, s);
+	}
+	if (src == NULL) {
+		if (s != NULL) {
+			free(s->buffers);
+			free(s->loaded);
+		}
+		free(s);
+		close(fd);
+		return NULL;
+	}
+
+	s->fd = fd;
+	s->window = window_pages;
+	for (int i = 0; i < window_pages; i++) {
+		s->loaded[i] = -1;
+	}
+	src->window_pages = window_pages;
+	return src;
+}
+
+//------------------------------------------------------------------------------
+// packed, decoded through a ring of page buffers
+
+typedef struct {
+	kinect_lzss z;
+	int next;               // page the decoder produces next
+	int window;
+	unsigned char* buffers; // window * KINECT_FW_PAGE_SIZE
+	int* loaded;
+} packed_image;
+
+static const unsigned char* packed_page(kinect_fw_source* src, int index) {
+	packed_image* p = (packed_image*)src->priv;
+	int slot = index % p->window;
+	if (p->loaded[slot] == index) {
+		return p->buffers + slot * KINECT_FW_PAGE_SIZE;
+	}
+
+	if (index < p->next) {
+		kinect_lzss_init(&p->z, p->z.in, p->z.in_size);
+		p->next = 0;
+	}
+	while (p->next <= index) {
+		int s = p->next % p->window;
+		int length = kinect_fw_source_page_length(src, p->next);
+		p->loaded[s] = -1;
+		if (kinect_lzss_read(&p->z, p->buffers + s * KINECT_FW_PAGE_SIZE, length) != length) {
+			LOG("kinect_fw_source: packed image is corrupt at page %d\n", p->next);
+			// start over next time rather than carry on from a broken state
+			p->next = INT_MAX;
+			return NULL;
+		}
+		p->loaded[s] = p->next++;
+	}
+	return p->buffers + slot * KINECT_FW_PAGE_SIZE;
+}
+
+static void packed_destroy(kinect_fw_source* src) {
+	packed_image* p = (packed_image*)src->priv;
+	free(p->buffers);
+	free(p->loaded);
+	free(p);
+	free(src);
+}
+
+static const kinect_fw_source_ops packed_ops = {
+	"packed",
+	packed_page,
+	packed_destroy,
+};
+
+kinect_fw_source* kinect_fw_source_open_packed(const unsigned char* packed, int packed_size,
+	int size, int window_pages) {
+	if (packed == NULL || packed_size <= 0 || size <= 0) {
+		return NULL;
+	}
+	if (window_pages < 2) {
+		window_pages = 2;
+	}
+
+	packed_image* p = (packed_image*)calloc(1, sizeof(packed_image));
+	if (p != NULL) {
+		p->buffers = (unsigned char*)malloc((size_t)window_pages * KINECT_FW_PAGE_SIZE);
+		p->loaded = (int*)malloc(window_pages * sizeof(int));
+	}
+	kinect_fw_source* src = NULL;
+	if (p != NULL && p->buffers != NULL && p->loaded != NULL) {
+		src = new_source(&packed_ops, size, p);
+	}
+	if (src == NULL) {
+		if (p != NULL) {
+			free(p->buffers);
+			free(p->loaded);
+		}
+		free(p);
+		return NULL;
+	}
+
+	kinect_lzss_init(&p->z, packed, packed_size);
+	p->window = window_pages;
+	for (int i = 0; i < window_pages; i++) {
+		p->loaded[i] = -1;
+	}
+	src->window_pages = window_pages;
+	return src;
+}
@@ -0,0 +1,58 @@
+//
+//  kinect_fw_source.h
+//  kinectExample
+//
+//  Where the firmware bytes come from. The upload engine asks for one 0x4000
+//  page at a time and hands the returned pointer straight to the USB
+//  transfers, so a source never copies for memory and mmap'd images. When a
+//  file can't be mapped it is streamed through a small ring of page buffers
+//  instead of being read whole. Packed images (misc/kinect_pack_fw) are
+//  decoded into the same kind of ring one page ahead of the upload.
+//
+
+#ifndef __kinectExample__kinect_fw_source__
+#define __kinectExample__kinect_fw_source__
+
+#include "kinect_protocol.h"
+
+typedef struct kinect_fw_source kinect_fw_source;
+
+typedef struct {
+	const char* name;
+	const unsigned char* (*page)(kinect_fw_source* src, int index);
+	void (*destroy)(kinect_fw_source* src);
+} kinect_fw_source_ops;
+
+struct kinect_fw_source {
+	const kinect_fw_source_ops* ops;
+	int size;
+	// pages that stay valid at once, 0 when every page stays valid for the
+	// lifetime of the source
+	int window_pages;
+	void* priv;
+};
+
+// Wraps an image already in memory, e.g. getFWData1473(). Not copied.
+kinect_fw_source* kinect_fw_source_open_memory(const unsigned char* data, int size);
+
+// Maps filename read only, falling back to kinect_fw_source_open_stream().
+kinect_fw_source* kinect_fw_source_open_file(const char* filename);
+
+// Reads filename through window_pages page buffers as the upload advances.
+kinect_fw_source* kinect_fw_source_open_stream(const char* filename, int window_pages);
+
+// Decodes a kinect_pack_fw image of size bytes as pages are asked for. An
+// earlier page than the last one decoded restarts the decoder.
+kinect_fw_source* kinect_fw_source_open_packed(const unsigned char* packed, int packed_size,
+	int size, int window_pages);
+
+void kinect_fw_source_close(kinect_fw_source* src);
+
+int kinect_fw_source_pages(const kinect_fw_source* src);
+int kinect_fw_source_page_length(const kinect_fw_source* src, int index);
+
+// Start of page index, valid until window_pages later pages have been asked
+// for. NULL if the page can't be read.
+const unsigned char* kinect_fw_source_page(kinect_fw_source* src, int index);
+
+#endif /* defined(__kinectExample__kinect_fw_source__) */
@@ -0,0 +1,255 @@
+//
+//  kinect_fw_wait.cpp
+//  kinectExample
+//
+
+#include "kinect_fw_wait.h"
+#include "kinect_protocol.h"
+#include "kinect_usb_io.h"
+#include "kinect_usb_runtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <libusb.h>
+
+#define LOG(...) printf(__VA_ARGS__)
+
+#define MAX_ARRIVED   8
+#define EVENT_SLICE_US 20000 // how often a device that wouldn't open yet is retried
+#define SCAN_EVERY_US 10000
+#define RESCAN_US     500000 // full scan even with hotplug, in case an arrival was missed
+
+struct kinect_fw_wait {
+	libusb_context* ctx;
+	int hotplug;
+	libusb_hotplug_callback_handle handle;
+	char serial[64];
+	// devices the hotplug callback saw arrive, checked outside the callback
+	// since it mustn't open them itself. The callback runs on the
+	// kinect_usb_runtime event thread, hence the lock.
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	libusb_device* arrived[MAX_ARRIVED];
+	int arrived_count;
+	int signalled;          // something arrived since the last sleep
+};
+
+static int LIBUSB_CALL arrived_cb(libusb_context* ctx, libusb_device* device,
+	libusb_hotplug_event event, void* user_data) {
+	(void)ctx;
+	(void)event;
+	kinect_fw_wait* wait = (kinect_fw_wait*)user_data;
+	pthread_mutex_lock(&wait->lock);
+	if (wait->arrived_count < MAX_ARRIVED) {
+		wait->arrived[wait->arrived_count++] = libusb_ref_device(device);
+	}
+	wait->signalled = 1;
+	pthread_cond_signal(&wait->cond);
+	pthread_mutex_unlock(&wait->lock);
+	return 0;
+}
+
+// 1 if device is the running firmware (the bootloader has one interface) with
+// the right serial and can be claimed, 0 if not, LIBUSB_ERROR_BUSY if it
+// might be once it has settled.
+static int device_ready(kinect_fw_wait* wait, libusb_device* device) {
+	struct libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(device, &desc) != 0
+		|| desc.idVendor != KINECT_VID || desc.idProduct != KINECT_PID_AUDIO) {
+		return 0;
+	}
+	struct libusb_config_descriptor* config = NULL;
+	if (libusb_get_active_config_descriptor(device, &config) != 0) {
+		return LIBUSB_ERROR_BUSY;
+	}
+	int interfaces = config->bNumInterfaces;
+	libusb_free_config_descriptor(config);
+	if (interfaces < 2) {
+		return 0;
+	}
+
+	libusb_device_handle* dev = NULL;
+	if (libusb_open(device, &dev) != 0) {
+		return LIBUSB_ERROR_BUSY;
+	}
+	int res = 1;
+	if (wait->serial[0] != '\0') {
+		char serial[64];
+		if (desc.iSerialNumber == 0
+			|| libusb_get_string_descriptor_ascii(dev, desc.iSerialNumber, (unsigned char*)serial, sizeof(serial)) < 0) {
+			res = LIBUSB_ERROR_BUSY;
+		} else if (strcmp(serial, wait->serial) != 0) {
+			res = 0;
+		}
+	}
+	if (res == 1) {
+		if (libusb_claim_interface(dev, 0) == 0) {
+			libusb_release_interface(dev, 0);
+		} else {
+			res = LIBUSB_ERROR_BUSY;
+		}
+	}
+	libusb_close(dev);
+	return res;
+}
+
+static int check_arrived(kinect_fw_wait* wait) {
+	// taken out of the list so the devices aren't opened with the lock held
+	libusb_device* arrived[MAX_ARRIVED];
+	pthread_mutex_lock(&wait->lock);
+	int count = wait->arrived_count;
+	memcpy(arrived, wait->arrived, count * sizeof(libusb_device*));
+	wait->arrived_count = 0;
+	pthread_mutex_unlock(&wait->lock);
+
+	int kept = 0;
+	int ready = 0;
+	for (int i = 0; i < count; i++) {
+		int res = ready ? 0 : device_ready(wait, arrived[i]);
+		if (res == 1) {
+			ready = 1;
+		}
+		if (res == LIBUSB_ERROR_BUSY) {
+			arrived[kept++] = arrived[i];
+		} else {
+			libusb_unref_device(arrived[i]);
+		}
+	}
+
+	// put back what may be ready later, ahead of anything that arrived since
+	pthread_mutex_lock(&wait->lock);
+	int room = MAX_ARRIVED - kept;
+	int later = wait->arrived_count < room ? wait->arrived_count : room;
+	for (int i = later; i < wait->arrived_count; i++) {
+		libusb_unref_device(wait->arrived[i]);
+	}
+	memmove(wait->arrived + kept, wait->arrived, later * sizeof(libusb_device*));
+	memcpy(wait->arrived, arrived, kept * sizeof(libusb_device*));
+	wait->arrived_count = kept + later;
+	pthread_mutex_unlock(&wait->lock);
+	return ready;
+}
+
+// Sleeps for slice_us or until the hotplug callback saw a device arrive.
+static void sleep_for_arrival(kinect_fw_wait* wait, uint64_t slice_us) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	uint64_t until = (uint64_t)now.tv_sec * 1000000 + now.tv_usec + slice_us;
+	struct timespec ts;
+	ts.tv_sec = (time_t)(until / 1000000);
+	ts.tv_nsec = (long)(until % 1000000) * 1000;
+	pthread_mutex_lock(&wait->lock);
+	while (!wait->signalled) {
+		if (pthread_cond_timedwait(&wait->cond, &wait->lock, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+	wait->signalled = 0;
+	pthread_mutex_unlock(&wait->lock);
+}
+
+static int scan_bus(kinect_fw_wait* wait) {
+	libusb_device** list = NULL;
+	ssize_t count = libusb_get_device_list(wait->ctx, &list);
+	int ready = 0;
+	for (ssize_t i = 0; i < count && !ready; i++) {
+		ready = device_ready(wait, list[i]) == 1;
+	}
+	if (list != NULL) {
+		libusb_free_device_list(list, 1);
+	}
+	return ready;
+}
+
+kinect_fw_wait* kinect_fw_wait_open(const char* serial) {
+	kinect_fw_wait* wait = (kinect_fw_wait*)calloc(1, sizeof(kinect_fw_wait));
+	if (wait == NULL) {
+		return NULL;
+	}
+	wait->ctx = kinect_usb_context();
+	if (wait->ctx == NULL) {
+		free(wait);
+		return NULL;
+	}
+	pthread_mutex_init(&wait->lock, NULL);
+	pthread_cond_init(&wait->cond, NULL);
+	if (serial != NULL) {
+		snprintf(wait->serial, sizeof(wait->serial), "%s", serial);
+	}
+
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		// no LIBUSB_HOTPLUG_ENUMERATE, the bootloader that is still attached
+		// is of no interest
+		int res = libusb_hotplug_register_callback(wait->ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+			(libusb_hotplug_flag)0, KINECT_VID, KINECT_PID_AUDIO, LIBUSB_HOTPLUG_MATCH_ANY,
+			arrived_cb, wait, &wait->handle);
+		wait->hotplug = res == LIBUSB_SUCCESS;
+		if (!wait->hotplug) {
+			LOG("kinect_fw_wait: no hotplug callback (%d), scanning the bus instead\n", res);
+		}
+	}
+	return wait;
+}
+
+int kinect_fw_wait_ready(kinect_fw_wait* wait, unsigned int timeout_ms) {
+	uint64_t start = kusb_now_us();
+	uint64_t last_scan = start;
+	for (;;) {
+		uint64_t slice = SCAN_EVERY_US;
+		if (wait->hotplug) {
+			if (check_arrived(wait)) {
+				break;
+			}
+			if (kusb_now_us() - last_scan >= RESCAN_US) {
+				last_scan = kusb_now_us();
+				if (scan_bus(wait)) {
+					break;
+				}
+			}
+			slice = EVENT_SLICE_US;
+		} else if (scan_bus(wait)) {
+			break;
+		}
+
+		uint64_t elapsed = kusb_now_us() - start;
+		if (timeout_ms != 0) {
+			uint64_t limit = (uint64_t)timeout_ms * 1000;
+			if (elapsed >= limit) {
+				LOG("kinect_fw_wait: device didn't come back within %u ms\n", timeout_ms);
+				return LIBUSB_ERROR_TIMEOUT;
+			}
+			if (limit - elapsed < slice) {
+				slice = limit - elapsed;
+			}
+		}
+
+		if (wait->hotplug) {
+			// the runtime's event thread delivers the callbacks meanwhile
+			sleep_for_arrival(wait, slice);
+		} else {
+			usleep((useconds_t)slice);
+		}
+	}
+	LOG("kinect_fw_wait: device back after %.1f ms\n", (kusb_now_us() - start) / 1000.0);
+	return 0;
+}
+
+void kinect_fw_wait_close(kinect_fw_wait* wait) {
+	if (wait == NULL) {
+		return;
+	}
+	if (wait->hotplug) {
+		libusb_hotplug_deregister_callback(wait->ctx, wait->handle);
+	}
+	for (int i = 0; i < wait->arrived_count; i++) {
+		libusb_unref_device(wait->arrived[i]);
+	}
+	pthread_cond_destroy(&wait->cond);
+	pthread_mutex_destroy(&wait->lock);
+	free(wait);
+}
@@ -0,0 +1,28 @@
+//
+//  kinect_fw_wait.h
+//  kinectExample
+//
+//  Waits for the audio/motor device to come back after the execute command.
+//  Open the wait before executing so the hotplug callback is armed when the
+//  device drops off the bus, then kinect_fw_wait_ready() returns as soon as
+//  the re-enumerated device can be opened and its interface claimed, rather
+//  than after a fixed sleep. Without hotplug support (libusb on Windows) the
+//  bus is scanned every few milliseconds instead.
+//
+
+#ifndef __kinectExample__kinect_fw_wait__
+#define __kinectExample__kinect_fw_wait__
+
+typedef struct kinect_fw_wait kinect_fw_wait;
+
+// serial is what kinect_fw_probe_device() reported, NULL or "" takes the
+// first device running its firmware.
+kinect_fw_wait* kinect_fw_wait_open(const char* serial);
+
+// Returns 0 once the device is back, LIBUSB_ERROR_TIMEOUT after timeout_ms
+// (0 waits forever), or another libusb_error.
+int kinect_fw_wait_ready(kinect_fw_wait* wait, unsigned int timeout_ms);
+
+void kinect_fw_wait_close(kinect_fw_wait* wait);
+
+#endif /* defined(__kinectExample__kinect_fw_wait__) */
@@ -0,0 +1,177 @@
+//
+//  kinect_keepalive.cpp
+//  kinectExample
+//
+
+#include "kinect_keepalive.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+// slots of the wheel; an entry further out than one turn waits out its
+// rounds where it is
+#define WHEEL_SLOTS 64
+
+typedef struct keepalive_entry {
+	kinect_motor* motor;
+	uint64_t interval_us;
+	unsigned int rounds;
+	struct keepalive_entry* next;
+} keepalive_entry;
+
+struct kinect_keepalive {
+	uint64_t tick_us;
+	keepalive_entry* wheel[WHEEL_SLOTS];
+	unsigned int current;     // slot the thread handles next
+	uint64_t next_tick_us;
+	kinect_keepalive_stats stats;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;      // stop
+	int stop;
+};
+
+// With the lock held: files entry delay_us from the coming tick.
+static void schedule(kinect_keepalive* k, keepalive_entry* e, uint64_t delay_us) {
+	uint64_t ticks = (delay_us + k->tick_us - 1) / k->tick_us;
+	if (ticks > 0) {
+		ticks--; // the coming tick is one of them
+	}
+	e->rounds = (unsigned int)(ticks / WHEEL_SLOTS);
+	unsigned int slot = (k->current + (unsigned int)(ticks % WHEEL_SLOTS)) % WHEEL_SLOTS;
+	e->next = k->wheel[slot];
+	k->wheel[slot] = e;
+}
+
+// With the lock held: everything filed in the current slot.
+static void run_slot(kinect_keepalive* k, uint64_t now) {
+	keepalive_entry* e = k->wheel[k->current];
+	k->wheel[k->current] = NULL;
+	k->current = (k->current + 1) % WHEEL_SLOTS;
+	while (e != NULL) {
+		keepalive_entry* next = e->next;
+		if (e->rounds > 0) {
+			e->rounds--;
+			schedule(k, e, (uint64_t)WHEEL_SLOTS * k->tick_us);
+		} else {
+			uint64_t last = kinect_motor_last_traffic_us(e->motor);
+			if (last != 0 && now - last < e->interval_us) {
+				// already talked to, come back an interval after that
+				k->stats.skipped++;
+				schedule(k, e, last + e->interval_us - now);
+			} else {
+				kinect_motor_keep_alive(e->motor);
+				k->stats.sent++;
+				schedule(k, e, e->interval_us);
+			}
+		}
+		e = next;
+	}
+}
+
+static void* keepalive_thread(void* arg) {
+	kinect_keepalive* k = (kinect_keepalive*)arg;
+	pthread_mutex_lock(&k->lock);
+	while (!k->stop) {
+		uint64_t now = kusb_now_us();
+		if (now < k->next_tick_us) {
+			// pthread_cond_timedwait wants wall clock time
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			uint64_t until_us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec + (k->next_tick_us - now);
+			struct timespec until;
+			until.tv_sec = (time_t)(until_us / 1000000);
+			until.tv_nsec = (long)(until_us % 1000000) * 1000;
+			pthread_cond_timedwait(&k->wake, &k->lock, &until);
+			continue;
+		}
+		run_slot(k, now);
+		k->next_tick_us += k->tick_us;
+		if (k->next_tick_us < now) {
+			// fell behind (suspended?), don't race through the missed ticks
+			k->next_tick_us = now + k->tick_us;
+		}
+	}
+	pthread_mutex_unlock(&k->lock);
+	return NULL;
+}
+
+kinect_keepalive* kinect_keepalive_start(unsigned int tick_ms) {
+	kinect_keepalive* k = (kinect_keepalive*)calloc(1, sizeof(kinect_keepalive));
+	if (k == NULL) {
+		return NULL;
+	}
+	k->tick_us = (uint64_t)(tick_ms > 0 ? tick_ms : 1) * 1000;
+	k->next_tick_us = kusb_now_us() + k->tick_us;
+	pthread_mutex_init(&k->lock, NULL);
+	pthread_cond_init(&k->wake, NULL);
+	if (pthread_create(&k->thread, NULL, keepalive_thread, k) != 0) {
+		pthread_cond_destroy(&k->wake);
+		pthread_mutex_destroy(&k->lock);
+		free(k);
+		return NULL;
+	}
+	return k;
+}
+
+void kinect_keepalive_stop(kinect_keepalive* k) {
+	if (k == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&k->lock);
+	k->stop = 1;
+	pthread_cond_signal(&k->wake);
+	pthread_mutex_unlock(&k->lock);
+	pthread_join(k->thread, NULL);
+
+	for (int i = 0; i < WHEEL_SLOTS; i++) {
+		while (k->wheel[i] != NULL) {
+			keepalive_entry* e = k->wheel[i];
+			k->wheel[i] = e->next;
+			free(e);
+		}
+	}
+	pthread_cond_destroy(&k->wake);
+	pthread_mutex_destroy(&k->lock);
+	free(k);
+}
+
+int kinect_keepalive_add(kinect_keepalive* k, kinect_motor* motor, unsigned int interval_ms) {
+	keepalive_entry* e = (keepalive_entry*)calloc(1, sizeof(keepalive_entry));
+	if (e == NULL) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	e->motor = motor;
+	e->interval_us = (uint64_t)(interval_ms > 0 ? interval_ms : 1) * 1000;
+	pthread_mutex_lock(&k->lock);
+	schedule(k, e, e->interval_us);
+	k->stats.devices++;
+	pthread_mutex_unlock(&k->lock);
+	return 0;
+}
+
+void kinect_keepalive_remove(kinect_keepalive* k, kinect_motor* motor) {
+	pthread_mutex_lock(&k->lock);
+	for (int i = 0; i < WHEEL_SLOTS; i++) {
+		keepalive_entry** link = &k->wheel[i];
+		while (*link != NULL) {
+			keepalive_entry* e = *link;
+			if (e->motor == motor) {
+				*link = e->next;
+				free(e);
+				k->stats.devices--;
+			} else {
+				link = &e->next;
+			}
+		}
+	}
+	pthread_mutex_unlock(&k->lock);
+}
+
+void kinect_keepalive_get_stats(kinect_keepalive* k, kinect_keepalive_stats* stats) {
+	pthread_mutex_lock(&k->lock);
+	*stats = k->stats;
+	pthread_mutex_unlock(&k->lock);
+}
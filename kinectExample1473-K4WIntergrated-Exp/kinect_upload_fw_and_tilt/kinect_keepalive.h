@@ -0,0 +1,37 @@
+//
+//  kinect_keepalive.h
+//  kinectExample
+//
+//  Keeps 1473s from dropping off the bus on OS X by making sure each sees
+//  some traffic every interval. One thread serves every device: sessions sit
+//  in a timer wheel, and when one comes due it only gets a keep alive if
+//  nothing else (a tilt, an LED change, an accel sample) went to the device
+//  within the interval. A device that is being sampled never gets one.
+//
+
+#ifndef __kinectExample__kinect_keepalive__
+#define __kinectExample__kinect_keepalive__
+
+#include "kinect_motor.h"
+
+typedef struct kinect_keepalive kinect_keepalive;
+
+typedef struct {
+	int devices;
+	int sent;       // keep alives queued
+	int skipped;    // came due but the device had seen traffic anyway
+} kinect_keepalive_stats;
+
+// Starts the thread; due times are rounded up to tick_ms.
+kinect_keepalive* kinect_keepalive_start(unsigned int tick_ms);
+
+// Stops the thread. Sessions still added are left open.
+void kinect_keepalive_stop(kinect_keepalive* keepalive);
+
+// motor must stay open until it is removed again.
+int kinect_keepalive_add(kinect_keepalive* keepalive, kinect_motor* motor, unsigned int interval_ms);
+void kinect_keepalive_remove(kinect_keepalive* keepalive, kinect_motor* motor);
+
+void kinect_keepalive_get_stats(kinect_keepalive* keepalive, kinect_keepalive_stats* stats);
+
+#endif /* defined(__kinectExample__kinect_keepalive__) */
@@ -0,0 +1,67 @@
+//
+//  kinect_lzss.cpp
+//  kinectExample
+//
+
+#include "kinect_lzss.h"
+
+#include <string.h>
+
+#define WINDOW_MASK (KINECT_LZSS_WINDOW - 1)
+
+void kinect_lzss_init(kinect_lzss* z, const unsigned char* in, int in_size) {
+	memset(z, 0, sizeof(kinect_lzss) - sizeof(z->window));
+	z->in = in;
+	z->in_size = in_size;
+}
+
+int kinect_lzss_read(kinect_lzss* z, unsigned char* out, int size) {
+	int done = 0;
+	while (done < size) {
+		if (z->copy_left > 0) {
+			unsigned int from = z->out_pos - z->copy_dist;
+			while (z->copy_left > 0 && done < size) {
+				unsigned char c = z->window[from++ & WINDOW_MASK];
+				z->window[z->out_pos++ & WINDOW_MASK] = c;
+				out[done++] = c;
+				z->copy_left--;
+			}
+			continue;
+		}
+
+		if (z->flag_bits == 0) {
+			if (z->in_pos >= z->in_size) {
+				break;
+			}
+			z->flags = z->in[z->in_pos++];
+			z->flag_bits = 8;
+		}
+
+		if (z->flags & 1) {
+			if (z->in_pos >= z->in_size) {
+				return -1;
+			}
+			unsigned char c = z->in[z->in_pos++];
+			z->window[z->out_pos++ & WINDOW_MASK] = c;
+			out[done++] = c;
+		} else {
+			if (z->in_pos + 2 > z->in_size) {
+				// the packer pads the last flag byte with zero bits
+				if (z->in_pos == z->in_size) {
+					break;
+				}
+				return -1;
+			}
+			int lo = z->in[z->in_pos++];
+			int hi = z->in[z->in_pos++];
+			z->copy_dist = (lo | ((hi & 0xf0) << 4)) + 1;
+			z->copy_left = (hi & 0x0f) + KINECT_LZSS_MIN_MATCH;
+			if ((unsigned int)z->copy_dist > z->out_pos) {
+				return -1;
+			}
+		}
+		z->flags >>= 1;
+		z->flag_bits--;
+	}
+	return done;
+}
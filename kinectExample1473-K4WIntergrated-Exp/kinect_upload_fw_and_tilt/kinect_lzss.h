@@ -0,0 +1,34 @@
+//
+//  kinect_lzss.h
+//  kinectExample
+//
+//  Streaming decoder for the images packed by misc/kinect_pack_fw. Output is
+//  produced in whatever sized pieces the caller asks for, so an upload can
+//  decode one page while the previous one is still on the wire.
+//
+
+#ifndef __kinectExample__kinect_lzss__
+#define __kinectExample__kinect_lzss__
+
+#define KINECT_LZSS_WINDOW    4096
+#define KINECT_LZSS_MIN_MATCH 3
+
+typedef struct {
+	const unsigned char* in;
+	int in_size;
+	int in_pos;
+	unsigned int flags;   // remaining flag bits, shifted down as items are read
+	int flag_bits;
+	int copy_left;        // bytes of the current match still to be copied
+	int copy_dist;
+	unsigned int out_pos; // total bytes produced
+	unsigned char window[KINECT_LZSS_WINDOW];
+} kinect_lzss;
+
+void kinect_lzss_init(kinect_lzss* z, const unsigned char* in, int in_size);
+
+// Decodes up to size bytes into out. Returns the number of bytes written,
+// fewer than size only once the input is used up, or -1 for a corrupt stream.
+int kinect_lzss_read(kinect_lzss* z, unsigned char* out, int size);
+
+#endif /* defined(__kinectExample__kinect_lzss__) */
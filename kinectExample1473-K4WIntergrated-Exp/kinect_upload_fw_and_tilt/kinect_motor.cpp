@@ -0,0 +1,575 @@
+//
+//  kinect_motor.cpp
+//  kinectExample
+//
+
+#include "kinect_motor.h"
+#include "kinect_motor_pipe.h"
+#include "kinect_accel_ring.h"
+#include "kinect_usb_runtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <deque>
+
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+
+#define MOTOR_IN_FLIGHT 4
+#define MOTOR_TIMEOUT   1000
+// what kinect_motor_close() gives queued commands before cancelling them
+#define CLOSE_TIMEOUT   2000
+
+// after a failed sample, so an unplugged device doesn't get polled flat out
+#define SAMPLE_RETRY_US  100000
+// at most ten tilt commands a second, however often the UI asks
+#define TILT_INTERVAL_US 100000
+// how often a waiting tilt asks whether the motor stopped, unless sampling
+#define TILT_POLL_US     20000
+#define NOT_DUE          (~(uint64_t)0)
+
+typedef struct {
+	uint32_t cmd;
+	int32_t arg;
+	kinect_motor_cb done;
+} motor_cmd;
+
+struct kinect_motor {
+	libusb_device_handle* dev; // borrowed, NULL when the caller owns the device
+	kusb_io* io;
+	kinect_motor_pipe* pipe;  // worker thread only
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work;      // something was queued, or stop
+	pthread_cond_t idle;      // a command finished
+	std::deque<motor_cmd> queue;
+	int in_flight;            // handed to the pipe, not completed
+	int stop;
+	int cancel;               // the worker is to cancel what is in the pipe
+
+	int error;                // first failure since the last sync
+	int led;                  // last state set, what a keep alive repeats
+	uint64_t last_traffic_us; // the device last answered anything
+	int have_accel;
+	int32_t accel[3];
+
+	int sampling;
+	unsigned int sample_period_us;
+	// worker thread only
+	int sample_busy;          // a sampling poll is in the pipe
+	uint64_t next_sample_us;
+	int sample_failed;        // the last one did, logged once
+	kinect_accel_ring samples;
+
+	// Latest wins: a tilt waits here until the motor has stopped and the
+	// previous one was sent TILT_INTERVAL_US ago, a newer one replaces it.
+	int tilt_pending;
+	int32_t tilt_target;
+	int tilt_busy;            // a tilt command is in the pipe
+	int moving;               // per the last status reply, or sent a tilt since
+	uint64_t next_tilt_us;
+	int tilts_requested;
+	int tilts_sent;
+};
+
+// With the lock held: anything the caller asked for not done yet.
+static int busy(kinect_motor* m) {
+	return !m->queue.empty() || m->in_flight > 0 || m->tilt_pending || m->tilt_busy;
+}
+
+// With the lock held, for every status reply.
+static void status_seen(kinect_motor* m, const kinect_motor_result* result) {
+	m->last_traffic_us = kusb_now_us();
+	m->accel[0] = result->accel[0];
+	m->accel[1] = result->accel[1];
+	m->accel[2] = result->accel[2];
+	m->have_accel = 1;
+	m->moving = result->tilt_state == KINECT_TILT_MOVING;
+}
+
+// With the lock held, for every command but a tilt.
+static void finish(kinect_motor* m, const kinect_motor_result* result, int traffic) {
+	m->in_flight--;
+	if (result->status != 0) {
+		if (result->status != LIBUSB_ERROR_INTERRUPTED) {
+			LOG("kinect_motor: command %04X failed: %d\n", result->cmd, result->status);
+		}
+		if (m->error == 0) {
+			m->error = result->status;
+		}
+	} else if (result->cmd == KINECT_MOTOR_CMD_STATUS) {
+		status_seen(m, result);
+	} else if (traffic) {
+		m->last_traffic_us = kusb_now_us();
+	}
+	pthread_cond_broadcast(&m->idle);
+}
+
+// runs on the worker thread, from kinect_motor_pipe_handle_events()
+static void command_done(const kinect_motor_result* result, void* user_data) {
+	kinect_motor* m = (kinect_motor*)user_data;
+	pthread_mutex_lock(&m->lock);
+	finish(m, result, 1);
+	pthread_mutex_unlock(&m->lock);
+}
+
+// Same, but a keep alive doesn't count as traffic, or it would put off the
+// next one by its own round trip.
+static void keep_alive_done(const kinect_motor_result* result, void* user_data) {
+	kinect_motor* m = (kinect_motor*)user_data;
+	pthread_mutex_lock(&m->lock);
+	finish(m, result, 0);
+	pthread_mutex_unlock(&m->lock);
+}
+
+// runs on the worker thread, for the one tilt command let through
+static void tilt_done(const kinect_motor_result* result, void* user_data) {
+	kinect_motor* m = (kinect_motor*)user_data;
+	pthread_mutex_lock(&m->lock);
+	m->tilt_busy = 0;
+	if (result->status != 0) {
+		if (result->status != LIBUSB_ERROR_INTERRUPTED) {
+			LOG("kinect_motor: tilt failed: %d\n", result->status);
+		}
+		if (m->error == 0) {
+			m->error = result->status;
+		}
+	} else {
+		// until a status reply says it has stopped
+		m->moving = 1;
+		m->last_traffic_us = kusb_now_us();
+	}
+	pthread_cond_broadcast(&m->idle);
+	pthread_mutex_unlock(&m->lock);
+}
+
+// runs on the worker thread, for the polls kinect_motor_start_sampling() keeps
+// going and those watching the motor for a waiting tilt. They aren't counted
+// in in_flight, a sync doesn't wait for them.
+static void sample_done(const kinect_motor_result* result, void* user_data) {
+	kinect_motor* m = (kinect_motor*)user_data;
+	uint64_t now = kusb_now_us();
+	m->sample_busy = 0;
+	if (result->status != 0) {
+		if (result->status == LIBUSB_ERROR_INTERRUPTED) {
+			return;
+		}
+		if (!m->sample_failed) {
+			LOG("kinect_motor: accel sample failed: %d\n", result->status);
+		}
+		m->sample_failed = 1;
+		m->next_sample_us = now + SAMPLE_RETRY_US;
+		pthread_mutex_lock(&m->lock);
+		if (m->error == 0) {
+			m->error = result->status;
+		}
+		// can't tell any more, don't hold a waiting tilt back for it
+		m->moving = 0;
+		pthread_mutex_unlock(&m->lock);
+		return;
+	}
+	m->sample_failed = 0;
+
+	pthread_mutex_lock(&m->lock);
+	if (m->sampling) {
+		kinect_accel_sample sample;
+		sample.time_us = now;
+		sample.latency_us = (uint32_t)result->latency_us;
+		sample.accel[0] = result->accel[0];
+		sample.accel[1] = result->accel[1];
+		sample.accel[2] = result->accel[2];
+		kinect_accel_ring_push(&m->samples, &sample);
+	}
+	status_seen(m, result);
+	pthread_mutex_unlock(&m->lock);
+}
+
+static uint64_t wait_until(uint64_t due_us) {
+	uint64_t now = kusb_now_us();
+	return due_us > now ? due_us - now : 0;
+}
+
+// With the lock held: how long until the next status poll is due, 0 for now,
+// NOT_DUE when none is (one is on the wire, or nobody wants them).
+static uint64_t status_wait_us(kinect_motor* m) {
+	if (m->sample_busy || (!m->sampling && !(m->tilt_pending && m->moving))) {
+		return NOT_DUE;
+	}
+	return wait_until(m->next_sample_us);
+}
+
+// The same for the waiting tilt. On the way out it goes right away.
+static uint64_t tilt_wait_us(kinect_motor* m) {
+	if (!m->tilt_pending || m->tilt_busy) {
+		return NOT_DUE;
+	}
+	if (m->stop) {
+		return 0;
+	}
+	return m->moving ? NOT_DUE : wait_until(m->next_tilt_us);
+}
+
+static uint64_t next_wait_us(kinect_motor* m) {
+	uint64_t status = status_wait_us(m);
+	uint64_t tilt = tilt_wait_us(m);
+	return status < tilt ? status : tilt;
+}
+
+static void submit_sample(kinect_motor* m, unsigned int period_us) {
+	uint64_t now = kusb_now_us();
+	// on a fixed grid so the rate doesn't drift by the round trip, but
+	// without a burst to catch up after a stall
+	m->next_sample_us += period_us;
+	if (m->next_sample_us < now) {
+		m->next_sample_us = now;
+	}
+	m->sample_busy = 1;
+	int res = kinect_motor_pipe_submit(m->pipe, KINECT_MOTOR_CMD_STATUS, 0, sample_done, m);
+	if (res != 0) {
+		kinect_motor_result result;
+		memset(&result, 0, sizeof(result));
+		result.cmd = KINECT_MOTOR_CMD_STATUS;
+		result.status = res;
+		sample_done(&result, m);
+	}
+}
+
+// pthread_cond_timedwait wants wall clock time
+static void deadline_after(struct timespec* until, uint64_t us) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	uint64_t until_us = (uint64_t)now.tv_sec * 1000000 + now.tv_usec + us;
+	until->tv_sec = (time_t)(until_us / 1000000);
+	until->tv_nsec = (long)(until_us % 1000000) * 1000;
+}
+
+// Everything queued goes straight to the pipe, which keeps up to
+// MOTOR_IN_FLIGHT commands on the wire, so a status poll doesn't sit behind
+// a tilt move waiting for its reply. The next status poll and the waiting
+// tilt join them when they are due.
+static void* motor_thread(void* arg) {
+	kinect_motor* m = (kinect_motor*)arg;
+	pthread_mutex_lock(&m->lock);
+	for (;;) {
+		uint64_t wait_us = NOT_DUE;
+		while (m->queue.empty() && m->in_flight == 0 && !m->sample_busy && !m->tilt_busy && !m->stop
+			&& !m->cancel && (wait_us = next_wait_us(m)) != 0) {
+			if (wait_us == NOT_DUE) {
+				pthread_cond_wait(&m->work, &m->lock);
+			} else {
+				struct timespec until;
+				deadline_after(&until, wait_us);
+				pthread_cond_timedwait(&m->work, &m->lock, &until);
+			}
+		}
+		if (m->cancel) {
+			m->cancel = 0;
+			pthread_mutex_unlock(&m->lock);
+			kinect_motor_pipe_cancel(m->pipe);
+			pthread_mutex_lock(&m->lock);
+			continue;
+		}
+		if (m->stop && !busy(m)) {
+			break;
+		}
+		std::deque<motor_cmd> batch;
+		batch.swap(m->queue);
+		m->in_flight += (int)batch.size();
+
+		unsigned int period_us = m->sampling ? m->sample_period_us : TILT_POLL_US;
+		int poll = status_wait_us(m) == 0;
+		int tilt = tilt_wait_us(m) == 0;
+		int32_t tilt_target = m->tilt_target;
+		if (tilt) {
+			m->tilt_pending = 0;
+			m->tilt_busy = 1;
+			m->tilts_sent++;
+			m->next_tilt_us = kusb_now_us() + TILT_INTERVAL_US;
+		}
+		wait_us = poll ? period_us : next_wait_us(m);
+		pthread_mutex_unlock(&m->lock);
+
+		for (size_t i = 0; i < batch.size(); i++) {
+			int res = kinect_motor_pipe_submit(m->pipe, batch[i].cmd, batch[i].arg, batch[i].done, m);
+			if (res != 0) {
+				kinect_motor_result result;
+				memset(&result, 0, sizeof(result));
+				result.cmd = batch[i].cmd;
+				result.status = res;
+				batch[i].done(&result, m);
+			}
+		}
+		if (tilt) {
+			int res = kinect_motor_pipe_submit(m->pipe, KINECT_MOTOR_CMD_TILT, tilt_target, tilt_done, m);
+			if (res != 0) {
+				kinect_motor_result result;
+				memset(&result, 0, sizeof(result));
+				result.cmd = KINECT_MOTOR_CMD_TILT;
+				result.status = res;
+				tilt_done(&result, m);
+			}
+		}
+		if (poll) {
+			submit_sample(m, period_us);
+		}
+		if (kinect_motor_pipe_pending(m->pipe) > 0) {
+			// short, so commands queued meanwhile join the ones in flight and
+			// the next sample doesn't wait for a slow reply
+			int timeout_ms = wait_us < 10000 ? (int)(wait_us / 1000) + 1 : 10;
+			kinect_motor_pipe_handle_events(m->pipe, timeout_ms);
+		}
+
+		pthread_mutex_lock(&m->lock);
+	}
+	pthread_mutex_unlock(&m->lock);
+	return NULL;
+}
+
+static kinect_motor* start(libusb_device_handle* dev, kusb_io* io) {
+	kinect_motor* m = new kinect_motor();
+	m->dev = dev;
+	m->io = io;
+	m->pipe = kinect_motor_pipe_open(io, MOTOR_IN_FLIGHT, MOTOR_TIMEOUT);
+	if (m->pipe == NULL) {
+		delete m;
+		return NULL;
+	}
+	m->in_flight = 0;
+	m->stop = 0;
+	m->cancel = 0;
+	m->error = 0;
+	m->led = KINECT_LED_SOLID_RED;
+	m->last_traffic_us = 0;
+	m->have_accel = 0;
+	m->sampling = 0;
+	m->sample_period_us = 0;
+	m->sample_busy = 0;
+	m->next_sample_us = 0;
+	m->sample_failed = 0;
+	kinect_accel_ring_init(&m->samples);
+	m->tilt_pending = 0;
+	m->tilt_target = 0;
+	m->tilt_busy = 0;
+	m->moving = 0;
+	m->next_tilt_us = 0;
+	m->tilts_requested = 0;
+	m->tilts_sent = 0;
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->work, NULL);
+	pthread_cond_init(&m->idle, NULL);
+	if (pthread_create(&m->thread, NULL, motor_thread, m) != 0) {
+		kinect_motor_pipe_close(m->pipe);
+		pthread_cond_destroy(&m->idle);
+		pthread_cond_destroy(&m->work);
+		pthread_mutex_destroy(&m->lock);
+		delete m;
+		return NULL;
+	}
+	return m;
+}
+
+kinect_motor* kinect_motor_open_io(kusb_io* io) {
+	return io != NULL ? start(NULL, io) : NULL;
+}
+
+// Takes dev over, closing it if the session can't be started.
+static kinect_motor* open_handle(libusb_device_handle* dev) {
+	kusb_io* io = kusb_io_open_libusb(kinect_usb_context(), dev);
+	kinect_motor* m = io != NULL ? start(dev, io) : NULL;
+	if (m == NULL) {
+		kusb_io_close(io);
+		kinect_usb_close(dev);
+	}
+	return m;
+}
+
+kinect_motor* kinect_motor_open() {
+	// a 1473, or else a Kinect for Windows, which speaks the same protocol
+	libusb_device_handle* dev = kinect_usb_open(KINECT_VID, KINECT_PID_AUDIO);
+	if (dev == NULL) {
+		dev = kinect_usb_open(KINECT_VID, KINECT_PID_K4W_AUDIO);
+	}
+	if (dev == NULL) {
+		LOG("kinect_motor: Failed to open audio device\n");
+		return NULL;
+	}
+	return open_handle(dev);
+}
+
+kinect_motor* kinect_motor_open_device(libusb_device* device) {
+	libusb_device_handle* dev = kinect_usb_open_device(device);
+	if (dev == NULL) {
+		LOG("kinect_motor: Failed to open audio device %03d:%03d\n",
+			libusb_get_bus_number(device), libusb_get_device_address(device));
+		return NULL;
+	}
+	return open_handle(dev);
+}
+
+void kinect_motor_close(kinect_motor* m) {
+	if (m == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&m->lock);
+	m->stop = 1;
+	pthread_cond_signal(&m->work);
+	// a wedged device doesn't get to hold up the app's exit
+	struct timespec until;
+	deadline_after(&until, (uint64_t)CLOSE_TIMEOUT * 1000);
+	int timed_out = 0;
+	while (busy(m) && !timed_out) {
+		timed_out = pthread_cond_timedwait(&m->idle, &m->lock, &until) == ETIMEDOUT;
+	}
+	if (timed_out) {
+		LOG("kinect_motor: device not answering, dropping what is left\n");
+		m->queue.clear();
+		m->tilt_pending = 0;
+		m->cancel = 1;
+		pthread_cond_signal(&m->work);
+	}
+	pthread_mutex_unlock(&m->lock);
+	pthread_join(m->thread, NULL);
+	kinect_motor_pipe_close(m->pipe);
+
+	if (m->dev != NULL) {
+		kusb_io_close(m->io);
+		kinect_usb_close(m->dev);
+	}
+	pthread_cond_destroy(&m->idle);
+	pthread_cond_destroy(&m->work);
+	pthread_mutex_destroy(&m->lock);
+	delete m;
+}
+
+static int enqueue(kinect_motor* m, uint32_t op, int arg, kinect_motor_cb done) {
+	motor_cmd cmd;
+	cmd.cmd = op;
+	cmd.arg = arg;
+	cmd.done = done;
+	pthread_mutex_lock(&m->lock);
+	m->queue.push_back(cmd);
+	pthread_cond_signal(&m->work);
+	pthread_mutex_unlock(&m->lock);
+	return 0;
+}
+
+int kinect_motor_set_led(kinect_motor* m, int state) {
+	pthread_mutex_lock(&m->lock);
+	m->led = state;
+	pthread_mutex_unlock(&m->lock);
+	return enqueue(m, KINECT_MOTOR_CMD_LED, state, command_done);
+}
+
+int kinect_motor_set_tilt(kinect_motor* m, int degrees) {
+	pthread_mutex_lock(&m->lock);
+	m->tilt_target = degrees;
+	m->tilt_pending = 1;
+	m->tilts_requested++;
+	pthread_cond_signal(&m->work);
+	pthread_mutex_unlock(&m->lock);
+	return 0;
+}
+
+int kinect_motor_keep_alive(kinect_motor* m) {
+	// the cheapest command there is, 20 bytes out and 12 back, and with the
+	// LED state it already has it changes nothing. Solid red until set, what
+	// keepAlive1473() sends.
+	pthread_mutex_lock(&m->lock);
+	int led = m->led;
+	pthread_mutex_unlock(&m->lock);
+	return enqueue(m, KINECT_MOTOR_CMD_LED, led, keep_alive_done);
+}
+
+uint64_t kinect_motor_last_traffic_us(kinect_motor* m) {
+	pthread_mutex_lock(&m->lock);
+	uint64_t last = m->last_traffic_us;
+	pthread_mutex_unlock(&m->lock);
+	return last;
+}
+
+int kinect_motor_poll_status(kinect_motor* m) {
+	return enqueue(m, KINECT_MOTOR_CMD_STATUS, 0, command_done);
+}
+
+int kinect_motor_get_accel(kinect_motor* m, int32_t accel[3]) {
+	pthread_mutex_lock(&m->lock);
+	int res = m->have_accel ? 0 : LIBUSB_ERROR_NOT_FOUND;
+	if (res == 0) {
+		accel[0] = m->accel[0];
+		accel[1] = m->accel[1];
+		accel[2] = m->accel[2];
+	}
+	pthread_mutex_unlock(&m->lock);
+	return res;
+}
+
+int kinect_motor_is_moving(kinect_motor* m) {
+	pthread_mutex_lock(&m->lock);
+	int moving = m->moving;
+	pthread_mutex_unlock(&m->lock);
+	return moving;
+}
+
+void kinect_motor_get_tilt_stats(kinect_motor* m, int* requested, int* sent) {
+	pthread_mutex_lock(&m->lock);
+	*requested = m->tilts_requested;
+	*sent = m->tilts_sent;
+	pthread_mutex_unlock(&m->lock);
+}
+
+int kinect_motor_start_sampling(kinect_motor* m, unsigned int hz) {
+	pthread_mutex_lock(&m->lock);
+	m->sample_period_us = hz > 0 ? 1000000 / hz : 0;
+	m->sampling = 1;
+	pthread_cond_signal(&m->work);
+	pthread_mutex_unlock(&m->lock);
+	return 0;
+}
+
+void kinect_motor_stop_sampling(kinect_motor* m) {
+	pthread_mutex_lock(&m->lock);
+	m->sampling = 0;
+	pthread_mutex_unlock(&m->lock);
+}
+
+int kinect_motor_read_samples(kinect_motor* m, kinect_accel_sample* out, int max) {
+	return kinect_accel_ring_pop(&m->samples, out, max);
+}
+
+uint32_t kinect_motor_samples_dropped(kinect_motor* m) {
+	return m->samples.dropped;
+}
+
+void kinect_motor_cancel(kinect_motor* m) {
+	pthread_mutex_lock(&m->lock);
+	m->queue.clear();
+	m->tilt_pending = 0;
+	m->cancel = 1;
+	pthread_cond_signal(&m->work);
+	pthread_mutex_unlock(&m->lock);
+}
+
+int kinect_motor_sync(kinect_motor* m, unsigned int timeout_ms) {
+	struct timespec until;
+	deadline_after(&until, (uint64_t)timeout_ms * 1000);
+
+	pthread_mutex_lock(&m->lock);
+	int timed_out = 0;
+	while (busy(m) && !timed_out) {
+		if (timeout_ms == 0) {
+			pthread_cond_wait(&m->idle, &m->lock);
+		} else {
+			timed_out = pthread_cond_timedwait(&m->idle, &m->lock, &until) == ETIMEDOUT;
+		}
+	}
+	int res = timed_out ? LIBUSB_ERROR_TIMEOUT : m->error;
+	if (!timed_out) {
+		m->error = 0;
+	}
+	pthread_mutex_unlock(&m->lock);
+	return res;
+}
@@ -0,0 +1,89 @@
+//
+//  kinect_motor.h
+//  kinectExample
+//
+//  Long lived motor / LED / accelerometer session. The device is opened and
+//  its interface claimed once, then a worker thread hands whatever is queued
+//  to a kinect_motor_pipe, several commands in flight at once. A tilt or LED
+//  change from the UI costs one USB round trip instead of a
+//  libusb_init / open / claim / exit cycle like do_motor() and
+//  keepAlive1473() pay on every call. A device that stops answering costs
+//  each command a second on the worker thread, never the caller.
+//
+
+#ifndef __kinectExample__kinect_motor__
+#define __kinectExample__kinect_motor__
+
+#include "kinect_usb_io.h"
+#include "kinect_protocol.h"
+#include "kinect_accel_ring.h"
+
+typedef struct kinect_motor kinect_motor;
+
+// The first 045e:02ad (1473) or 045e:02be (K4W) device, which has to be
+// running its firmware already. NULL if there is none or it can't be claimed.
+kinect_motor* kinect_motor_open();
+
+// The audio device of one particular Kinect, e.g. a kinect_sensor's
+// devices[KINECT_SENSOR_AUDIO]. NULL if it is open already or can't be claimed.
+kinect_motor* kinect_motor_open_device(libusb_device* device);
+
+// Drives an already opened device, e.g. the simulator. io stays owned by the
+// caller and must not be used by anything else until kinect_motor_close().
+kinect_motor* kinect_motor_open_io(kusb_io* io);
+
+// Sends what is still queued, then stops the worker and releases the device.
+// A device that doesn't answer gets two seconds, then the rest is cancelled.
+void kinect_motor_close(kinect_motor* motor);
+
+// These queue the command and return 0 right away. Failures show up in
+// kinect_motor_sync(). state is one of KINECT_LED_*; this header stays clear
+// of led_state so it can sit next to libfreenect's LED names.
+int kinect_motor_set_led(kinect_motor* motor, int state);
+
+// Not queued: only the latest angle is kept, and sent once the motor has
+// stopped moving for the previous one and at most ten times a second. Key
+// repeat can call this every frame.
+int kinect_motor_set_tilt(kinect_motor* motor, int degrees);
+// Repeats the last LED state, solid red before one was set.
+int kinect_motor_keep_alive(kinect_motor* motor);
+int kinect_motor_poll_status(kinect_motor* motor);
+
+// kusb_now_us() when the device last answered a command or poll, 0 before
+// it has. Keep alives don't count.
+uint64_t kinect_motor_last_traffic_us(kinect_motor* motor);
+
+// Raw accelerometer values from the last status poll. Returns 0, or
+// LIBUSB_ERROR_NOT_FOUND before the first poll has completed.
+int kinect_motor_get_accel(kinect_motor* motor, int32_t accel[3]);
+
+// Whether the motor was moving at the last status reply, or has been sent a
+// tilt since. Kept up to date while sampling or while a tilt is waiting.
+int kinect_motor_is_moving(kinect_motor* motor);
+
+// kinect_motor_set_tilt() calls and the tilt commands actually sent for them.
+void kinect_motor_get_tilt_stats(kinect_motor* motor, int* requested, int* sent);
+
+// Keeps a status poll going on the worker thread next to whatever else is
+// queued, hz a second or as fast as the device answers for 0. Every reply is
+// timestamped and kept for kinect_motor_read_samples(), and updates
+// kinect_motor_get_accel(). Failed polls show up in kinect_motor_sync().
+int kinect_motor_start_sampling(kinect_motor* motor, unsigned int hz);
+void kinect_motor_stop_sampling(kinect_motor* motor);
+
+// Moves up to max samples not read yet, oldest first, into out and returns
+// how many. Never blocks; call it from one thread only, e.g. once a frame.
+int kinect_motor_read_samples(kinect_motor* motor, kinect_accel_sample* out, int max);
+
+// Samples lost because the reader fell KINECT_ACCEL_RING_SIZE behind.
+uint32_t kinect_motor_samples_dropped(kinect_motor* motor);
+
+// Drops everything queued and cancels what is on the wire; those commands
+// count as failed with LIBUSB_ERROR_INTERRUPTED. Sampling goes on.
+void kinect_motor_cancel(kinect_motor* motor);
+
+// Waits until everything queued so far has been sent, including a waiting tilt. Returns the first error
+// since the previous sync, or LIBUSB_ERROR_TIMEOUT (0 waits forever).
+int kinect_motor_sync(kinect_motor* motor, unsigned int timeout_ms);
+
+#endif /* defined(__kinectExample__kinect_motor__) */
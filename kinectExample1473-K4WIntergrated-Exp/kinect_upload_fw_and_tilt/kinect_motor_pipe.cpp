@@ -0,0 +1,361 @@
+//
+//  kinect_motor_pipe.cpp
+//  kinectExample
+//
+
+#include "kinect_motor_pipe.h"
+#include "kinect_status.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+#define fn_le32(x) (x)
+
+#define REPLY_BUF 512
+
+typedef struct {
+	uint32_t cmd;
+	int32_t arg;
+	kinect_motor_cb callback;
+	void* user_data;
+} motor_request;
+
+struct kinect_motor_pipe;
+
+typedef struct {
+	kinect_motor_pipe* pipe;
+	motor_request req;
+	kinect_motor_result result;
+	kusb_xfer xfer;
+	motor_command* wire;  // in the pipe's wires
+	uint64_t submit_us;
+	uint64_t deadline_us; // for the reply, KUSB_NO_DEADLINE without a timeout
+	int used;
+	int out_busy;       // OUT transfer not completed yet
+	int acked;
+	int status_block;   // status commands: the data block came in
+} motor_slot;
+
+struct kinect_motor_pipe {
+	kusb_io* io;
+	int in_flight;
+	unsigned int timeout;
+	uint32_t next_tag;
+
+	motor_slot slots[KINECT_MOTOR_MAX_IN_FLIGHT];
+	int used;
+	std::deque<motor_request> waiting;
+
+	// from kusb_alloc(), so a backend that can skips copying them
+	motor_command* wires;
+	kusb_xfer reply_xfer;
+	unsigned char* reply;   // REPLY_BUF
+	int reply_busy;
+	int closing;
+};
+
+static void complete(motor_slot* slot, int status) {
+	kinect_motor_pipe* pipe = slot->pipe;
+	slot->result.status = status;
+	slot->result.latency_us = kusb_now_us() - slot->submit_us;
+	slot->used = 0;
+	pipe->used--;
+	if (slot->req.callback != NULL) {
+		slot->req.callback(&slot->result, slot->req.user_data);
+	}
+}
+
+static void finish_if_done(motor_slot* slot) {
+	if (slot->used && !slot->out_busy && slot->acked) {
+		complete(slot, slot->result.status);
+	}
+}
+
+static void pump(kinect_motor_pipe* pipe);
+
+static void out_cb(kusb_xfer* xfer) {
+	motor_slot* slot = (motor_slot*)xfer->user_data;
+	slot->out_busy = 0;
+	if (xfer->status != 0 || xfer->actual_length != xfer->length) {
+		if (xfer->status != LIBUSB_ERROR_INTERRUPTED) {
+			LOG("kinect_motor_pipe: command %04X tag %u: res: %d\ttransferred: %d (expected %d)\n",
+				slot->req.cmd, slot->result.tag, xfer->status, xfer->actual_length, xfer->length);
+		}
+		complete(slot, xfer->status != 0 ? xfer->status : LIBUSB_ERROR_IO);
+	} else {
+		finish_if_done(slot);
+	}
+	pump(slot->pipe);
+}
+
+static motor_slot* find_tag(kinect_motor_pipe* pipe, uint32_t tag) {
+	for (int i = 0; i < pipe->in_flight; i++) {
+		if (pipe->slots[i].used && pipe->slots[i].result.tag == tag) {
+			return &pipe->slots[i];
+		}
+	}
+	return NULL;
+}
+
+// oldest status request still waiting for its data block
+static motor_slot* find_status(kinect_motor_pipe* pipe) {
+	motor_slot* oldest = NULL;
+	for (int i = 0; i < pipe->in_flight; i++) {
+		motor_slot* slot = &pipe->slots[i];
+		if (slot->used && slot->req.cmd == KINECT_MOTOR_CMD_STATUS && !slot->status_block
+			&& (oldest == NULL || (int32_t)(slot->result.tag - oldest->result.tag) < 0)) {
+			oldest = slot;
+		}
+	}
+	return oldest;
+}
+
+static void fail_all(kinect_motor_pipe* pipe, int status) {
+	for (int i = 0; i < pipe->in_flight; i++) {
+		motor_slot* slot = &pipe->slots[i];
+		// the OUT callback reports a command still being sent
+		if (slot->used && !slot->out_busy) {
+			complete(slot, status);
+		}
+	}
+}
+
+// Commands sent whose reply is overdue. A wedged device costs each of them
+// the pipe's timeout, not every command behind them too.
+static void expire(kinect_motor_pipe* pipe) {
+	uint64_t now = kusb_now_us();
+	for (int i = 0; i < pipe->in_flight; i++) {
+		motor_slot* slot = &pipe->slots[i];
+		if (slot->used && !slot->out_busy && slot->deadline_us != KUSB_NO_DEADLINE && now >= slot->deadline_us) {
+			LOG("kinect_motor_pipe: command %04X tag %u: no reply within %u ms\n",
+				slot->req.cmd, slot->result.tag, pipe->timeout);
+			complete(slot, LIBUSB_ERROR_TIMEOUT);
+		}
+	}
+}
+
+static void fail_waiting(kinect_motor_pipe* pipe, int status) {
+	while (!pipe->waiting.empty()) {
+		motor_request req = pipe->waiting.front();
+		pipe->waiting.pop_front();
+		if (req.callback != NULL) {
+			kinect_motor_result result;
+			memset(&result, 0, sizeof(result));
+			result.cmd = req.cmd;
+			result.status = status;
+			req.callback(&result, req.user_data);
+		}
+	}
+}
+
+static void reply_cb(kusb_xfer* xfer) {
+	kinect_motor_pipe* pipe = (kinect_motor_pipe*)xfer->user_data;
+	pipe->reply_busy = 0;
+
+	if (xfer->status == LIBUSB_ERROR_TIMEOUT) {
+		// nothing came in for a while; only the commands past their own
+		// deadline give up, the read is posted again for the rest
+		expire(pipe);
+	} else if (xfer->status != 0) {
+		if (xfer->status != LIBUSB_ERROR_INTERRUPTED) {
+			LOG("kinect_motor_pipe: reading reply failed: %d\n", xfer->status);
+		}
+		fail_all(pipe, xfer->status);
+	} else if (xfer->actual_length == sizeof(motor_reply)
+		&& fn_le32(((motor_reply*)pipe->reply)->magic) == KINECT_REPLY_MAGIC) {
+		motor_reply reply;
+		memcpy(&reply, pipe->reply, sizeof(reply));
+		motor_slot* slot = find_tag(pipe, fn_le32(reply.tag));
+		if (slot == NULL) {
+			LOG("kinect_motor_pipe: reply for unknown tag %u ignored\n", fn_le32(reply.tag));
+		} else {
+			slot->acked = 1;
+			if (fn_le32(reply.status) != 0) {
+				LOG("kinect_motor_pipe: command %04X tag %u: reply status %u\n",
+					slot->req.cmd, slot->result.tag, fn_le32(reply.status));
+				slot->result.status = LIBUSB_ERROR_IO;
+			}
+			finish_if_done(slot);
+		}
+	} else {
+		motor_slot* slot = find_status(pipe);
+		if (slot == NULL) {
+			LOG("kinect_motor_pipe: unexpected %d byte reply ignored\n", xfer->actual_length);
+		} else {
+			slot->status_block = 1;
+			kinect_status status;
+			kinect_status_decode(pipe->reply, xfer->actual_length, &status);
+			memcpy(slot->result.accel, status.accel, sizeof(slot->result.accel));
+			slot->result.tilt_angle = status.tilt_angle;
+			slot->result.tilt_state = status.tilt_state;
+		}
+	}
+	pump(pipe);
+}
+
+static void pump(kinect_motor_pipe* pipe) {
+	while (!pipe->closing && !pipe->waiting.empty() && pipe->used < pipe->in_flight) {
+		motor_slot* slot = NULL;
+		for (int i = 0; i < pipe->in_flight; i++) {
+			if (!pipe->slots[i].used) {
+				slot = &pipe->slots[i];
+				break;
+			}
+		}
+		slot->req = pipe->waiting.front();
+		pipe->waiting.pop_front();
+
+		memset(&slot->result, 0, sizeof(slot->result));
+		slot->result.cmd = slot->req.cmd;
+		slot->result.tag = pipe->next_tag++;
+		slot->wire->magic = fn_le32(KINECT_CMD_MAGIC);
+		slot->wire->tag = fn_le32(slot->result.tag);
+		slot->wire->cmd = fn_le32(slot->req.cmd);
+		int length = sizeof(motor_command);
+		if (slot->req.cmd == KINECT_MOTOR_CMD_STATUS) {
+			// the bytes we want back; the request itself stops after cmd
+			slot->wire->arg1 = fn_le32(KINECT_STATUS_REPLY_SIZE);
+			slot->wire->arg2 = 0;
+			length = 16;
+		} else {
+			slot->wire->arg1 = 0;
+			slot->wire->arg2 = fn_le32((uint32_t)slot->req.arg);
+		}
+		slot->pipe = pipe;
+		slot->used = 1;
+		slot->out_busy = 1;
+		slot->acked = 0;
+		slot->status_block = 0;
+		slot->submit_us = kusb_now_us();
+		slot->deadline_us = kusb_deadline_after(pipe->timeout);
+		pipe->used++;
+
+		kusb_fill_bulk(&slot->xfer, KINECT_EP_OUT, (unsigned char*)slot->wire, length, out_cb, slot, pipe->timeout);
+		int res = kusb_submit(pipe->io, &slot->xfer);
+		if (res != 0) {
+			slot->out_busy = 0;
+			complete(slot, res);
+		}
+	}
+
+	if (!pipe->closing && !pipe->reply_busy && pipe->used > 0) {
+		kusb_fill_bulk(&pipe->reply_xfer, KINECT_EP_IN, pipe->reply, REPLY_BUF, reply_cb, pipe, pipe->timeout);
+		if (kusb_submit(pipe->io, &pipe->reply_xfer) == 0) {
+			pipe->reply_busy = 1;
+		}
+	}
+}
+
+kinect_motor_pipe* kinect_motor_pipe_open(kusb_io* io, int in_flight, unsigned int timeout) {
+	if (io == NULL) {
+		return NULL;
+	}
+	kinect_motor_pipe* pipe = new kinect_motor_pipe();
+	pipe->io = io;
+	if (in_flight < 1) in_flight = 1;
+	if (in_flight > KINECT_MOTOR_MAX_IN_FLIGHT) in_flight = KINECT_MOTOR_MAX_IN_FLIGHT;
+	pipe->in_flight = in_flight;
+	pipe->timeout = timeout;
+	pipe->next_tag = 1;
+	pipe->wires = (motor_command*)kusb_alloc(io, in_flight * (int)sizeof(motor_command));
+	pipe->reply = kusb_alloc(io, REPLY_BUF);
+	if (pipe->wires == NULL || pipe->reply == NULL) {
+		kusb_free(io, (unsigned char*)pipe->wires, in_flight * (int)sizeof(motor_command));
+		kusb_free(io, pipe->reply, REPLY_BUF);
+		delete pipe;
+		return NULL;
+	}
+	for (int i = 0; i < in_flight; i++) {
+		pipe->slots[i].wire = &pipe->wires[i];
+	}
+	return pipe;
+}
+
+int kinect_motor_pipe_submit(kinect_motor_pipe* pipe, uint32_t cmd, int32_t arg,
+	kinect_motor_cb callback, void* user_data) {
+	if (pipe->closing) {
+		return LIBUSB_ERROR_INTERRUPTED;
+	}
+	if (cmd == KINECT_MOTOR_CMD_TILT && (arg > 31 || arg < -31)) {
+		LOG("kinect_motor_pipe: degrees %d out of safe range [-31, 31]\n", arg);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	motor_request req;
+	req.cmd = cmd;
+	req.arg = arg;
+	req.callback = callback;
+	req.user_data = user_data;
+	pipe->waiting.push_back(req);
+	pump(pipe);
+	return 0;
+}
+
+int kinect_motor_pipe_handle_events(kinect_motor_pipe* pipe, int timeout_ms) {
+	int res = kusb_handle_events(pipe->io, timeout_ms);
+	kinect_motor_pipe_poll(pipe);
+	return res;
+}
+
+void kinect_motor_pipe_poll(kinect_motor_pipe* pipe) {
+	expire(pipe);
+	pump(pipe);
+}
+
+void kinect_motor_pipe_cancel(kinect_motor_pipe* pipe) {
+	fail_waiting(pipe, LIBUSB_ERROR_INTERRUPTED);
+	for (int i = 0; i < pipe->in_flight; i++) {
+		if (pipe->slots[i].used && pipe->slots[i].out_busy) {
+			kusb_cancel(pipe->io, &pipe->slots[i].xfer);
+		}
+	}
+	// their replies, should they still come, are logged and dropped
+	fail_all(pipe, LIBUSB_ERROR_INTERRUPTED);
+}
+
+int kinect_motor_pipe_pending(const kinect_motor_pipe* pipe) {
+	return pipe->used + (int)pipe->waiting.size();
+}
+
+void kinect_motor_pipe_close(kinect_motor_pipe* pipe) {
+	if (pipe == NULL) {
+		return;
+	}
+	pipe->closing = 1;
+	for (int i = 0; i < pipe->in_flight; i++) {
+		if (pipe->slots[i].used && pipe->slots[i].out_busy) {
+			kusb_cancel(pipe->io, &pipe->slots[i].xfer);
+		}
+	}
+	if (pipe->reply_busy) {
+		kusb_cancel(pipe->io, &pipe->reply_xfer);
+	}
+	// the backend writes to the command and reply buffers and calls back into
+	// the pipe until it has given every transfer back, so there is no giving
+	// up after a while; only an io that stopped handling events won't
+	int res = 0;
+	while (pipe->reply_busy || pipe->used > 0) {
+		res = kusb_handle_events(pipe->io, 100);
+		if (!pipe->reply_busy) {
+			fail_all(pipe, LIBUSB_ERROR_INTERRUPTED);
+		}
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED && res != LIBUSB_ERROR_TIMEOUT) {
+			break;
+		}
+	}
+	fail_waiting(pipe, LIBUSB_ERROR_INTERRUPTED);
+	int submitted = pipe->reply_busy;
+	for (int i = 0; i < pipe->in_flight; i++) {
+		submitted += pipe->slots[i].out_busy;
+	}
+	if (submitted > 0) {
+		// better lost than freed under the backend
+		LOG("kinect_motor_pipe: %d transfers not given back (%d), leaking the pipe\n", submitted, res);
+		return;
+	}
+	kusb_free(pipe->io, (unsigned char*)pipe->wires, pipe->in_flight * (int)sizeof(motor_command));
+	kusb_free(pipe->io, pipe->reply, REPLY_BUF);
+	delete pipe;
+}
@@ -0,0 +1,73 @@
+//
+//  kinect_motor_pipe.h
+//  kinectExample
+//
+//  Asynchronous motor command pipeline on one kusb_io. Several commands can
+//  be on the wire at once; each gets a tag of its own and the 12 byte replies
+//  are matched back by that tag, so an accel poll doesn't have to wait for a
+//  tilt move to be acknowledged. The 104 byte status block carries no tag and
+//  goes to the oldest status request still waiting for one.
+//
+//  A pipe is driven from one thread: submit, handle_events, poll and close
+//  must not be called concurrently. Callbacks run on that thread, from
+//  kinect_motor_pipe_handle_events() or kinect_motor_pipe_poll(), whichever
+//  thread reaped the transfers underneath (see kusb_io_open_libusb()).
+//
+
+#ifndef __kinectExample__kinect_motor_pipe__
+#define __kinectExample__kinect_motor_pipe__
+
+#include "kinect_usb_io.h"
+#include "kinect_protocol.h"
+
+#define KINECT_MOTOR_MAX_IN_FLIGHT 16
+
+typedef struct kinect_motor_pipe kinect_motor_pipe;
+
+typedef struct {
+	uint32_t cmd;        // KINECT_MOTOR_CMD_*
+	uint32_t tag;
+	// 0, a libusb_error code, or LIBUSB_ERROR_IO when the device answered
+	// with a nonzero status
+	int status;
+	int32_t accel[3];    // raw values, KINECT_MOTOR_CMD_STATUS only
+	int32_t tilt_angle;  // the same, degrees
+	uint32_t tilt_state; // the same, KINECT_TILT_*
+	uint64_t latency_us; // from submit to the reply
+} kinect_motor_result;
+
+typedef void (*kinect_motor_cb)(const kinect_motor_result* result, void* user_data);
+
+// in_flight commands at most on the wire at once, the rest wait in order.
+// timeout (ms) is how long a reply may take once its command was sent; after
+// that the command fails with LIBUSB_ERROR_TIMEOUT. The command and reply
+// buffers come from kusb_alloc(). NULL if they can't be had.
+kinect_motor_pipe* kinect_motor_pipe_open(kusb_io* io, int in_flight, unsigned int timeout);
+
+// Cancels what is outstanding and waits for the io to give every transfer
+// back; callbacks see LIBUSB_ERROR_INTERRUPTED. Should the io fail before
+// that, the pipe is left allocated rather than freed under it.
+void kinect_motor_pipe_close(kinect_motor_pipe* pipe);
+
+// Queues a command, arg is what goes in arg2 (LED state, tilt degrees).
+// callback may be NULL. Returns 0 or a libusb_error code.
+int kinect_motor_pipe_submit(kinect_motor_pipe* pipe, uint32_t cmd, int32_t arg,
+	kinect_motor_cb callback, void* user_data);
+
+// Runs completions, waiting at most timeout_ms for one.
+int kinect_motor_pipe_handle_events(kinect_motor_pipe* pipe, int timeout_ms);
+
+// What handle_events does after running completions: times out overdue
+// commands and sends what is waiting. For a caller that runs the io's
+// events itself, like kinect_reactor.
+void kinect_motor_pipe_poll(kinect_motor_pipe* pipe);
+
+// Fails everything outstanding with LIBUSB_ERROR_INTERRUPTED: what is waiting
+// and what is waiting on a reply right away, commands still being sent once
+// their OUT transfer is cancelled. The pipe stays usable.
+void kinect_motor_pipe_cancel(kinect_motor_pipe* pipe);
+
+// Commands submitted and not completed yet.
+int kinect_motor_pipe_pending(const kinect_motor_pipe* pipe);
+
+#endif /* defined(__kinectExample__kinect_motor_pipe__) */
@@ -0,0 +1,65 @@
+//
+//  kinect_orientation.cpp
+//  kinectExample
+//
+
+#include "kinect_orientation.h"
+#include "kinect_status.h"
+
+#include <math.h>
+#include <string.h>
+
+#define RAD_TO_DEG (180.0f / 3.14159265f)
+
+void kinect_orientation_init(kinect_orientation* o, unsigned int time_constant_ms) {
+	memset(o, 0, sizeof(*o));
+	o->time_constant_s = time_constant_ms / 1000.0f;
+}
+
+static float clamp_unit(float v) {
+	return v > 1.0f ? 1.0f : (v < -1.0f ? -1.0f : v);
+}
+
+void kinect_orientation_update(kinect_orientation* o, const kinect_accel_sample* sample) {
+	float alpha = 1.0f;
+	if (o->samples > 0 && o->time_constant_s > 0.0f && sample->time_us > o->last_us) {
+		float dt = (sample->time_us - o->last_us) / 1000000.0f;
+		alpha = dt / (o->time_constant_s + dt);
+	}
+	for (int i = 0; i < 3; i++) {
+		o->raw[i] += alpha * ((float)sample->accel[i] - o->raw[i]);
+	}
+	o->last_us = sample->time_us;
+	o->samples++;
+
+	float length = sqrtf(o->raw[0] * o->raw[0] + o->raw[1] * o->raw[1] + o->raw[2] * o->raw[2]);
+	if (length > 0.0f) {
+		for (int i = 0; i < 3; i++) {
+			o->gravity[i] = o->raw[i] / length;
+		}
+		o->pitch = asinf(clamp_unit(o->gravity[2])) * RAD_TO_DEG;
+		o->roll = asinf(clamp_unit(o->gravity[0])) * RAD_TO_DEG;
+	}
+}
+
+void kinect_orientation_get_raw_accel(const kinect_orientation* o, float accel[3]) {
+	memcpy(accel, o->raw, sizeof(o->raw));
+}
+
+void kinect_orientation_get_mks_accel(const kinect_orientation* o, float accel[3]) {
+	for (int i = 0; i < 3; i++) {
+		accel[i] = o->raw[i] / KINECT_COUNTS_PER_G * KINECT_GRAVITY;
+	}
+}
+
+float kinect_orientation_get_pitch(const kinect_orientation* o) {
+	return o->pitch;
+}
+
+float kinect_orientation_get_roll(const kinect_orientation* o) {
+	return o->roll;
+}
+
+void kinect_orientation_get_gravity(const kinect_orientation* o, float gravity[3]) {
+	memcpy(gravity, o->gravity, sizeof(o->gravity));
+}
@@ -0,0 +1,45 @@
+//
+//  kinect_orientation.h
+//  kinectExample
+//
+//  Sensor orientation from the accelerometer samples of a kinect_motor
+//  session. Each sample goes through a first order low pass whose weight
+//  follows the time since the previous one, so irregular sampling doesn't
+//  skew it; the update is a handful of flops and the gravity direction, pitch
+//  and roll are kept ready for whoever reads them.
+//
+
+#ifndef __kinectExample__kinect_orientation__
+#define __kinectExample__kinect_orientation__
+
+#include "kinect_accel_ring.h"
+
+typedef struct {
+	float time_constant_s;  // of the low pass
+	uint64_t last_us;       // time_us of the last sample, 0 before the first
+	int samples;
+	float raw[3];           // filtered, accelerometer counts
+	float gravity[3];       // unit vector along raw
+	float pitch;            // degrees
+	float roll;             // degrees
+} kinect_orientation;
+
+// time_constant_ms 0 follows every sample unfiltered.
+void kinect_orientation_init(kinect_orientation* o, unsigned int time_constant_ms);
+
+void kinect_orientation_update(kinect_orientation* o, const kinect_accel_sample* sample);
+
+// The same readings ofxKinect gives for the 1414: getRawAccel(),
+// getMksAccel() (m/s^2), getAccelPitch() and getAccelRoll() (degrees). All
+// zero before the first sample.
+void kinect_orientation_get_raw_accel(const kinect_orientation* o, float accel[3]);
+void kinect_orientation_get_mks_accel(const kinect_orientation* o, float accel[3]);
+float kinect_orientation_get_pitch(const kinect_orientation* o);
+float kinect_orientation_get_roll(const kinect_orientation* o);
+
+// Unit vector along the filtered reading, in sensor coordinates. At rest the
+// accelerometer feels the floor pushing back, so this is the floor normal,
+// pointing up.
+void kinect_orientation_get_gravity(const kinect_orientation* o, float gravity[3]);
+
+#endif /* defined(__kinectExample__kinect_orientation__) */
@@ -0,0 +1,98 @@
+//
+//  kinect_protocol.h
+//  kinectExample
+//
+//  Wire structures shared by the audio/motor device code (045e:02ad).
+//  Everything on the wire is little endian.
+//
+
+#ifndef __kinectExample__kinect_protocol__
+#define __kinectExample__kinect_protocol__
+
+#include <stdint.h>
+
+#define KINECT_VID                0x045e
+#define KINECT_PID_AUDIO          0x02ad
+#define KINECT_PID_K4W_AUDIO      0x02be
+#define KINECT_PID_NUI_MOTOR      0x02b0 // 1414 only, the later models moved it into the audio device
+#define KINECT_PID_CAMERA         0x02ae
+#define KINECT_PID_K4W_CAMERA     0x02bf
+
+#define KINECT_EP_OUT             0x01
+#define KINECT_EP_IN              0x81
+
+#define KINECT_CMD_MAGIC          0x06022009
+#define KINECT_REPLY_MAGIC        0x0a6fe000
+
+// bootloader commands
+#define KINECT_BL_CMD_INFO        0x00
+#define KINECT_BL_CMD_WRITE       0x03
+#define KINECT_BL_CMD_EXECUTE     0x04
+
+#define KINECT_FW_LOAD_ADDR       0x00080000
+#define KINECT_FW_ENTRY_ADDR      0x00080030
+#define KINECT_FW_PAGE_SIZE       0x4000
+#define KINECT_FW_INFO_REPLY_SIZE 0x60
+
+// motor commands
+#define KINECT_MOTOR_CMD_LED      0x10
+#define KINECT_MOTOR_CMD_STATUS   0x8032
+#define KINECT_MOTOR_CMD_TILT     0x803b
+#define KINECT_STATUS_REPLY_SIZE  0x68
+
+// in the status reply, after the three accelerometer words at 16
+#define KINECT_STATUS_TILT_ANGLE  28 // int32, degrees
+#define KINECT_STATUS_TILT_STATE  32 // uint32, one of these
+#define KINECT_TILT_STOPPED       0x00
+#define KINECT_TILT_LIMIT         0x01
+#define KINECT_TILT_MOVING        0x04
+
+// arg2 of KINECT_MOTOR_CMD_LED, the same values as led_state in k4w_tilt_led.h
+#define KINECT_LED_OFF            1
+#define KINECT_LED_BLINK_GREEN    2
+#define KINECT_LED_SOLID_GREEN    3
+#define KINECT_LED_SOLID_RED      4
+
+// 1414 motor device: vendor requests on the control endpoint instead of bulk
+// commands. The state reply is 10 bytes, accel big endian int16 at 2, 4 and
+// 6, tilt in half degrees (int8) at 8 and one of KINECT_TILT_* at 9.
+#define KINECT_NUI_SET_LED        0x06 // wValue: KINECT_NUI_LED_*
+#define KINECT_NUI_SET_TILT       0x31 // wValue: int16, half degrees
+#define KINECT_NUI_GET_STATE      0x32
+#define KINECT_NUI_STATE_SIZE     10
+#define KINECT_NUI_LED_OFF        0
+#define KINECT_NUI_LED_GREEN      1
+#define KINECT_NUI_LED_RED        2
+#define KINECT_NUI_LED_YELLOW     3
+#define KINECT_NUI_LED_BLINK_GREEN 4
+
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t bytes;
+	uint32_t cmd;
+	uint32_t write_addr;
+	uint32_t unk;
+} bootloader_command;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t status;
+} status_code;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t tag;
+	uint32_t arg1;
+	uint32_t cmd;
+	uint32_t arg2;
+} motor_command;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t tag;
+	uint32_t status;
+} motor_reply;
+
+#endif /* defined(__kinectExample__kinect_protocol__) */
@@ -0,0 +1,696 @@
+//
+//  kinect_reactor.cpp
+//  kinectExample
+//
+
+#include "kinect_reactor.h"
+#include "kinect_motor_pipe.h"
+#include "kinect_usb_runtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <vector>
+
+#ifdef __linux__
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+
+#define QUEUE_MASK (KINECT_REACTOR_QUEUE_SIZE - 1)
+
+// how often a pipe with commands outstanding on a libusb io is looked at for
+// replies that are overdue; its completions themselves wake the loop
+#define EXPIRE_CHECK_US 100000
+
+#define MAX_EVENTS 32
+
+typedef struct {
+	kinect_reactor_device* device;
+	uint32_t cmd;
+	int32_t arg;
+} reactor_command;
+
+struct kinect_reactor_device {
+	kinect_reactor* reactor;
+	int id;
+	kusb_io* io;
+	kinect_reactor_device_params params;
+	kinect_accel_ring samples;
+
+	// reactor thread only
+	int opened;                // taken on, by its add or its first command
+	kinect_motor_pipe* pipe;   // NULL if it couldn't be opened
+	uint64_t next_sample_us;
+	uint64_t next_keepalive_us;
+	uint64_t last_traffic_us;  // last reply other than to a keep alive
+	int status_busy;
+	int tilt_busy;
+	int tilt_waiting;
+	int32_t tilt;
+	int led;
+
+	int released;              // under the reactor's lock
+};
+
+struct kinect_reactor {
+	libusb_context* ctx;
+	pthread_t thread;
+	pthread_t loop_thread;     // as the reactor thread sees itself
+	volatile int stopping;
+	int wake[2];
+	volatile int wake_pending;
+#ifdef USE_EPOLL
+	int epfd;
+#else
+	// libusb's fds as its notifiers last left them
+	pthread_mutex_t fds_lock;
+	std::vector<struct pollfd> fds;
+	volatile int fds_changed;
+	std::vector<struct pollfd> polled; // reactor thread only
+#endif
+
+	// posting thread -> reactor thread
+	reactor_command commands[KINECT_REACTOR_QUEUE_SIZE];
+	volatile uint32_t command_head;
+	volatile uint32_t command_tail;
+	// reactor thread -> reading thread
+	kinect_reactor_result results[KINECT_REACTOR_QUEUE_SIZE];
+	volatile uint32_t result_head;
+	volatile uint32_t result_tail;
+
+	pthread_mutex_t lock;      // adding, removing, released
+	pthread_cond_t released;
+	std::vector<kinect_reactor_device*> adding;
+	std::vector<kinect_reactor_device*> removing;
+	int next_id;
+
+	std::vector<kinect_reactor_device*> devices; // reactor thread only
+	kinect_reactor_stats stats;
+};
+
+void kinect_reactor_default_params(kinect_reactor_device_params* params) {
+	memset(params, 0, sizeof(*params));
+	params->in_flight = 4;
+	params->timeout_ms = 1000;
+}
+
+static void wake(kinect_reactor* r) {
+	// one byte in the pipe until the reactor has drained it is enough
+	if (__sync_bool_compare_and_swap(&r->wake_pending, 0, 1)) {
+		char c = 0;
+		if (write(r->wake[1], &c, 1) < 0 && errno != EAGAIN) {
+			LOG("kinect_reactor: can't wake the reactor thread: %d\n", errno);
+		}
+	}
+}
+
+static void drain_wake(kinect_reactor* r) {
+	char buf[64];
+	while (read(r->wake[0], buf, sizeof(buf)) > 0) {
+	}
+	// reset before the queues are looked at again, so a post from now on
+	// writes a new byte
+	r->wake_pending = 0;
+	__sync_synchronize();
+}
+
+// --- the queues, single producer / single consumer like kinect_accel_ring ---
+
+static int post(kinect_reactor* r, kinect_reactor_device* device, uint32_t cmd, int32_t arg) {
+	uint32_t head = r->command_head;
+	if (head - r->command_tail >= KINECT_REACTOR_QUEUE_SIZE) {
+		__sync_fetch_and_add(&r->stats.commands_refused, 1);
+		return LIBUSB_ERROR_BUSY;
+	}
+	__sync_synchronize();
+	reactor_command* c = &r->commands[head & QUEUE_MASK];
+	c->device = device;
+	c->cmd = cmd;
+	c->arg = arg;
+	__sync_synchronize();
+	r->command_head = head + 1;
+	wake(r);
+	return 0;
+}
+
+static void push_result(kinect_reactor* r, kinect_reactor_device* d, const kinect_motor_result* result) {
+	uint32_t head = r->result_head;
+	if (head - r->result_tail >= KINECT_REACTOR_QUEUE_SIZE) {
+		r->stats.results_dropped++;
+		return;
+	}
+	__sync_synchronize();
+	kinect_reactor_result* out = &r->results[head & QUEUE_MASK];
+	out->device = d->id;
+	out->cmd = result->cmd;
+	out->status = result->status;
+	out->latency_us = result->latency_us;
+	__sync_synchronize();
+	r->result_head = head + 1;
+}
+
+int kinect_reactor_read_results(kinect_reactor* r, kinect_reactor_result* out, int max) {
+	uint32_t tail = r->result_tail;
+	uint32_t head = r->result_head;
+	__sync_synchronize();
+	int n = (int)(head - tail);
+	if (n > max) {
+		n = max > 0 ? max : 0;
+	}
+	for (int i = 0; i < n; i++) {
+		out[i] = r->results[(tail + i) & QUEUE_MASK];
+	}
+	__sync_synchronize();
+	r->result_tail = tail + n;
+	return n;
+}
+
+int kinect_reactor_read_samples(kinect_reactor_device* device, kinect_accel_sample* out, int max) {
+	return kinect_accel_ring_pop(&device->samples, out, max);
+}
+
+// Called by kusb_io when another thread reaped one of a device's transfers.
+static void io_reaped(void* user_data) {
+	kinect_reactor* r = (kinect_reactor*)user_data;
+	if (!pthread_equal(pthread_self(), r->loop_thread)) {
+		wake(r);
+	}
+}
+
+// --- completions, from kusb_handle_events() on the reactor thread ---
+
+static void led_done(const kinect_motor_result* result, void* user_data) {
+	kinect_reactor_device* d = (kinect_reactor_device*)user_data;
+	if (result->status == 0) {
+		d->last_traffic_us = kusb_now_us();
+	}
+	push_result(d->reactor, d, result);
+}
+
+static void send_tilt(kinect_reactor_device* d);
+
+static void tilt_done(const kinect_motor_result* result, void* user_data) {
+	kinect_reactor_device* d = (kinect_reactor_device*)user_data;
+	d->tilt_busy = 0;
+	if (result->status == 0) {
+		d->last_traffic_us = kusb_now_us();
+	}
+	push_result(d->reactor, d, result);
+	if (d->tilt_waiting && result->status != LIBUSB_ERROR_INTERRUPTED) {
+		send_tilt(d);
+	}
+}
+
+static void status_done(const kinect_motor_result* result, void* user_data) {
+	kinect_reactor_device* d = (kinect_reactor_device*)user_data;
+	d->status_busy = 0;
+	if (result->status != 0) {
+		return;
+	}
+	kinect_accel_sample sample;
+	sample.time_us = kusb_now_us();
+	sample.latency_us = (uint32_t)result->latency_us;
+	memcpy(sample.accel, result->accel, sizeof(sample.accel));
+	kinect_accel_ring_push(&d->samples, &sample);
+	d->last_traffic_us = sample.time_us;
+	d->reactor->stats.samples++;
+}
+
+static void keepalive_done(const kinect_motor_result* result, void* user_data) {
+	(void)result;
+	(void)user_data;
+}
+
+// --- the reactor thread ---
+
+static void submit(kinect_reactor_device* d, uint32_t cmd, int32_t arg, kinect_motor_cb callback) {
+	int res = d->pipe != NULL ? kinect_motor_pipe_submit(d->pipe, cmd, arg, callback, d)
+		: LIBUSB_ERROR_NO_DEVICE;
+	if (res != 0) {
+		kinect_motor_result result;
+		memset(&result, 0, sizeof(result));
+		result.cmd = cmd;
+		result.status = res;
+		callback(&result, d);
+	}
+}
+
+static void send_tilt(kinect_reactor_device* d) {
+	d->tilt_waiting = 0;
+	d->tilt_busy = 1;
+	submit(d, KINECT_MOTOR_CMD_TILT, d->tilt, tilt_done);
+}
+
+static void open_device(kinect_reactor* r, kinect_reactor_device* d);
+
+static void take_commands(kinect_reactor* r) {
+	uint32_t tail = r->command_tail;
+	uint32_t head = r->command_head;
+	__sync_synchronize();
+	for (; tail != head; tail++) {
+		reactor_command c = r->commands[tail & QUEUE_MASK];
+		kinect_reactor_device* d = c.device;
+		r->stats.commands++;
+		// posted right after kinect_reactor_add(), before the reactor had
+		// seen the add
+		open_device(r, d);
+		if (c.cmd == KINECT_MOTOR_CMD_TILT) {
+			d->tilt = c.arg;
+			d->tilt_waiting = 1;
+			if (!d->tilt_busy) {
+				send_tilt(d);
+			}
+		} else {
+			d->led = c.arg;
+			submit(d, c.cmd, c.arg, led_done);
+		}
+	}
+	__sync_synchronize();
+	r->command_tail = tail;
+}
+
+static void open_device(kinect_reactor* r, kinect_reactor_device* d) {
+	if (d->opened) {
+		return;
+	}
+	d->opened = 1;
+	d->pipe = kinect_motor_pipe_open(d->io, d->params.in_flight, d->params.timeout_ms);
+	if (d->pipe == NULL) {
+		LOG("kinect_reactor: can't open device %d\n", d->id);
+	} else if (r->ctx != NULL && d->params.poll_us == 0) {
+		kusb_libusb_set_notify(d->io, io_reaped, r);
+	}
+	uint64_t now = kusb_now_us();
+	d->next_sample_us = now;
+	d->next_keepalive_us = now + (uint64_t)d->params.keepalive_ms * 1000;
+	d->last_traffic_us = 0;
+	r->devices.push_back(d);
+	r->stats.devices++;
+}
+
+static void close_device(kinect_reactor* r, kinect_reactor_device* d) {
+	for (size_t i = 0; i < r->devices.size(); i++) {
+		if (r->devices[i] == d) {
+			r->devices.erase(r->devices.begin() + i);
+			r->stats.devices--;
+			break;
+		}
+	}
+	if (d->pipe != NULL) {
+		d->tilt_waiting = 0;
+		kinect_motor_pipe_close(d->pipe);
+		if (r->ctx != NULL && d->params.poll_us == 0) {
+			kusb_libusb_set_notify(d->io, NULL, NULL);
+		}
+		d->pipe = NULL;
+	}
+	pthread_mutex_lock(&r->lock);
+	d->released = 1;
+	pthread_cond_broadcast(&r->released);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void take_changes(kinect_reactor* r) {
+	pthread_mutex_lock(&r->lock);
+	std::vector<kinect_reactor_device*> adding;
+	std::vector<kinect_reactor_device*> removing;
+	adding.swap(r->adding);
+	removing.swap(r->removing);
+	pthread_mutex_unlock(&r->lock);
+
+	for (size_t i = 0; i < adding.size(); i++) {
+		open_device(r, adding[i]);
+	}
+	// anything posted for them before they were removed has to be taken
+	// first, it still points at them
+	take_commands(r);
+	for (size_t i = 0; i < removing.size(); i++) {
+		close_device(r, removing[i]);
+	}
+}
+
+static uint64_t earlier(uint64_t a, uint64_t b) {
+	if (a == KUSB_NO_DEADLINE) {
+		return b;
+	}
+	return b != KUSB_NO_DEADLINE && b < a ? b : a;
+}
+
+// Runs what the devices have due and returns when the next thing is,
+// KUSB_NO_DEADLINE if nothing is.
+static uint64_t run_devices(kinect_reactor* r) {
+	uint64_t next = KUSB_NO_DEADLINE;
+	for (size_t i = 0; i < r->devices.size(); i++) {
+		kinect_reactor_device* d = r->devices[i];
+		if (d->pipe == NULL) {
+			continue;
+		}
+		// runs what has been reaped, here or by another thread
+		kusb_handle_events(d->io, 0);
+		kinect_motor_pipe_poll(d->pipe);
+
+		uint64_t now = kusb_now_us();
+		if (d->params.sample_hz > 0 && !d->status_busy && now >= d->next_sample_us) {
+			uint64_t period = 1000000 / d->params.sample_hz;
+			d->next_sample_us += period;
+			if (d->next_sample_us <= now) {
+				d->next_sample_us = now + period;
+			}
+			d->status_busy = 1;
+			submit(d, KINECT_MOTOR_CMD_STATUS, 0, status_done);
+		}
+		if (d->params.keepalive_ms > 0 && now >= d->next_keepalive_us) {
+			uint64_t interval = (uint64_t)d->params.keepalive_ms * 1000;
+			if (d->last_traffic_us + interval > now) {
+				r->stats.keepalives_skipped++;
+				d->next_keepalive_us = d->last_traffic_us + interval;
+			} else {
+				r->stats.keepalives++;
+				d->next_keepalive_us = now + interval;
+				submit(d, KINECT_MOTOR_CMD_LED, d->led, keepalive_done);
+			}
+		}
+
+		if (d->params.sample_hz > 0 && !d->status_busy) {
+			next = earlier(next, d->next_sample_us);
+		}
+		if (d->params.keepalive_ms > 0) {
+			next = earlier(next, d->next_keepalive_us);
+		}
+		if (kinect_motor_pipe_pending(d->pipe) > 0) {
+			next = earlier(next, now + (d->params.poll_us > 0 ? d->params.poll_us : EXPIRE_CHECK_US));
+		}
+	}
+	return next;
+}
+
+// ms to wait for next, and for libusb's own next timeout; -1 for ever.
+// *usb_due is set when libusb's timeout is what bounds the wait.
+static int wait_ms(kinect_reactor* r, uint64_t next, int* usb_due) {
+	int ms = -1;
+	if (next != KUSB_NO_DEADLINE) {
+		uint64_t now = kusb_now_us();
+		ms = next <= now ? 0 : (int)((next - now + 999) / 1000);
+	}
+	*usb_due = 0;
+	struct timeval tv;
+	if (r->ctx != NULL && libusb_get_next_timeout(r->ctx, &tv) == 1) {
+		int usb_ms = (int)(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+		if (ms < 0 || usb_ms <= ms) {
+			ms = usb_ms;
+			*usb_due = 1;
+		}
+	}
+	return ms;
+}
+
+// --- libusb's file descriptors ---
+
+#ifdef USE_EPOLL
+
+static void watch(kinect_reactor* r, int fd, short events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (events & POLLIN ? (uint32_t)EPOLLIN : 0) | (events & POLLOUT ? (uint32_t)EPOLLOUT : 0);
+	ev.data.fd = fd;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) != 0 && errno != EEXIST) {
+		LOG("kinect_reactor: can't watch fd %d: %d\n", fd, errno);
+	}
+}
+
+static void unwatch(kinect_reactor* r, int fd) {
+	epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int open_fds(kinect_reactor* r) {
+	r->epfd = epoll_create(MAX_EVENTS);
+	if (r->epfd < 0) {
+		LOG("kinect_reactor: epoll_create failed: %d\n", errno);
+		return -1;
+	}
+	fcntl(r->epfd, F_SETFD, FD_CLOEXEC);
+	watch(r, r->wake[0], POLLIN);
+	return 0;
+}
+
+static void close_fds(kinect_reactor* r) {
+	close(r->epfd);
+}
+
+// Returns how many of libusb's fds are ready, *woken if the wake pipe is.
+static int wait_fds(kinect_reactor* r, int timeout_ms, int* woken) {
+	struct epoll_event events[MAX_EVENTS];
+	int n = epoll_wait(r->epfd, events, MAX_EVENTS, timeout_ms);
+	int ready = 0;
+	*woken = 0;
+	for (int i = 0; i < n; i++) {
+		if (events[i].data.fd == r->wake[0]) {
+			*woken = 1;
+		} else {
+			ready++;
+		}
+	}
+	return ready;
+}
+
+#else
+
+static void watch(kinect_reactor* r, int fd, short events) {
+	pthread_mutex_lock(&r->fds_lock);
+	struct pollfd p;
+	p.fd = fd;
+	p.events = events;
+	p.revents = 0;
+	r->fds.push_back(p);
+	r->fds_changed = 1;
+	pthread_mutex_unlock(&r->fds_lock);
+}
+
+static void unwatch(kinect_reactor* r, int fd) {
+	pthread_mutex_lock(&r->fds_lock);
+	for (size_t i = 0; i < r->fds.size(); i++) {
+		if (r->fds[i].fd == fd) {
+			r->fds.erase(r->fds.begin() + i);
+			break;
+		}
+	}
+	r->fds_changed = 1;
+	pthread_mutex_unlock(&r->fds_lock);
+}
+
+static int open_fds(kinect_reactor* r) {
+	pthread_mutex_init(&r->fds_lock, NULL);
+	r->fds_changed = 1;
+	return 0;
+}
+
+static void close_fds(kinect_reactor* r) {
+	pthread_mutex_destroy(&r->fds_lock);
+}
+
+static int wait_fds(kinect_reactor* r, int timeout_ms, int* woken) {
+	// the wake pipe first, then a copy of libusb's, taken again only when a
+	// notifier changed them
+	std::vector<struct pollfd>& polled = r->polled;
+	if (r->fds_changed) {
+		pthread_mutex_lock(&r->fds_lock);
+		r->fds_changed = 0;
+		polled.resize(1);
+		polled.insert(polled.end(), r->fds.begin(), r->fds.end());
+		pthread_mutex_unlock(&r->fds_lock);
+	}
+	polled[0].fd = r->wake[0];
+	polled[0].events = POLLIN;
+	int n = poll(&polled[0], polled.size(), timeout_ms);
+	*woken = n > 0 && polled[0].revents != 0;
+	return n > 0 ? n - *woken : 0;
+}
+
+#endif
+
+static void LIBUSB_CALL fd_added(int fd, short events, void* user_data) {
+	watch((kinect_reactor*)user_data, fd, events);
+}
+
+static void LIBUSB_CALL fd_removed(int fd, void* user_data) {
+	unwatch((kinect_reactor*)user_data, fd);
+}
+
+static void* reactor_loop(void* arg) {
+	kinect_reactor* r = (kinect_reactor*)arg;
+	r->loop_thread = pthread_self();
+	while (!r->stopping) {
+		take_changes(r);
+		take_commands(r);
+		uint64_t next = run_devices(r);
+
+		int usb_due;
+		int timeout_ms = wait_ms(r, next, &usb_due);
+		int woken;
+		int ready = wait_fds(r, timeout_ms, &woken);
+		r->stats.wakeups++;
+		if (woken) {
+			drain_wake(r);
+		}
+		int timed_out = ready == 0 && !woken;
+		if (r->ctx != NULL && (ready > 0 || (timed_out && usb_due))) {
+			// takes the event lock only for this; when another thread has it,
+			// that one reaps and the reactor is notified
+			struct timeval zero = { 0, 0 };
+			libusb_handle_events_timeout_completed(r->ctx, &zero, NULL);
+			r->stats.usb_events++;
+		}
+		if (timed_out && !usb_due && (next == KUSB_NO_DEADLINE || kusb_now_us() < next)) {
+			r->stats.idle_wakeups++;
+		}
+	}
+
+	take_changes(r);
+	while (!r->devices.empty()) {
+		kinect_reactor_device* d = r->devices.back();
+		close_device(r, d);
+		delete d;
+	}
+	return NULL;
+}
+
+kinect_reactor* kinect_reactor_start(libusb_context* ctx) {
+	kinect_reactor* r = new kinect_reactor();
+	r->ctx = ctx;
+	r->stopping = 0;
+	r->wake_pending = 0;
+	r->command_head = r->command_tail = 0;
+	r->result_head = r->result_tail = 0;
+	r->next_id = 0;
+	memset(&r->stats, 0, sizeof(r->stats));
+	if (pipe(r->wake) != 0) {
+		LOG("kinect_reactor: can't make the wake pipe: %d\n", errno);
+		delete r;
+		return NULL;
+	}
+	for (int i = 0; i < 2; i++) {
+		fcntl(r->wake[i], F_SETFL, fcntl(r->wake[i], F_GETFL) | O_NONBLOCK);
+		fcntl(r->wake[i], F_SETFD, FD_CLOEXEC);
+	}
+	if (open_fds(r) != 0) {
+		close(r->wake[0]);
+		close(r->wake[1]);
+		delete r;
+		return NULL;
+	}
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->released, NULL);
+
+	if (ctx != NULL) {
+		// from here on the reactor is the context's event handler
+		kinect_usb_pause_events();
+		libusb_set_pollfd_notifiers(ctx, fd_added, fd_removed, r);
+		const struct libusb_pollfd** fds = libusb_get_pollfds(ctx);
+		for (int i = 0; fds != NULL && fds[i] != NULL; i++) {
+			watch(r, fds[i]->fd, fds[i]->events);
+		}
+		// libusb_free_pollfds() is newer than the libusbx we ship
+		free(fds);
+	}
+	if (pthread_create(&r->thread, NULL, reactor_loop, r) != 0) {
+		LOG("kinect_reactor: can't start the reactor thread\n");
+		if (ctx != NULL) {
+			libusb_set_pollfd_notifiers(ctx, NULL, NULL, NULL);
+			kinect_usb_resume_events();
+		}
+		close_fds(r);
+		close(r->wake[0]);
+		close(r->wake[1]);
+		pthread_cond_destroy(&r->released);
+		pthread_mutex_destroy(&r->lock);
+		delete r;
+		return NULL;
+	}
+	return r;
+}
+
+void kinect_reactor_stop(kinect_reactor* r) {
+	if (r == NULL) {
+		return;
+	}
+	r->stopping = 1;
+	wake(r);
+	pthread_join(r->thread, NULL);
+	if (r->ctx != NULL) {
+		libusb_set_pollfd_notifiers(r->ctx, NULL, NULL, NULL);
+		kinect_usb_resume_events();
+	}
+	close_fds(r);
+	close(r->wake[0]);
+	close(r->wake[1]);
+	pthread_cond_destroy(&r->released);
+	pthread_mutex_destroy(&r->lock);
+	delete r;
+}
+
+kinect_reactor_device* kinect_reactor_add(kinect_reactor* r, kusb_io* io,
+	const kinect_reactor_device_params* params) {
+	kinect_reactor_device* d = new kinect_reactor_device();
+	memset(d, 0, sizeof(*d));
+	d->reactor = r;
+	d->io = io;
+	kinect_reactor_default_params(&d->params);
+	if (params != NULL) {
+		d->params = *params;
+		if (d->params.in_flight <= 0) {
+			d->params.in_flight = 4;
+		}
+		if (d->params.timeout_ms == 0) {
+			d->params.timeout_ms = 1000;
+		}
+	}
+	d->led = KINECT_LED_SOLID_RED;
+	kinect_accel_ring_init(&d->samples);
+
+	pthread_mutex_lock(&r->lock);
+	d->id = r->next_id++;
+	r->adding.push_back(d);
+	pthread_mutex_unlock(&r->lock);
+	wake(r);
+	return d;
+}
+
+void kinect_reactor_remove(kinect_reactor* r, kinect_reactor_device* d) {
+	if (d == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&r->lock);
+	r->removing.push_back(d);
+	pthread_mutex_unlock(&r->lock);
+	wake(r);
+	pthread_mutex_lock(&r->lock);
+	while (!d->released) {
+		pthread_cond_wait(&r->released, &r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	delete d;
+}
+
+int kinect_reactor_device_id(const kinect_reactor_device* device) {
+	return device->id;
+}
+
+int kinect_reactor_set_led(kinect_reactor* r, kinect_reactor_device* device, int state) {
+	return post(r, device, KINECT_MOTOR_CMD_LED, state);
+}
+
+int kinect_reactor_set_tilt(kinect_reactor* r, kinect_reactor_device* device, int degrees) {
+	return post(r, device, KINECT_MOTOR_CMD_TILT, degrees);
+}
+
+void kinect_reactor_get_stats(kinect_reactor* r, kinect_reactor_stats* stats) {
+	*stats = r->stats;
+}
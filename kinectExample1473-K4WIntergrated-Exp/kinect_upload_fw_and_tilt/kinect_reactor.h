@@ -0,0 +1,109 @@
+//
+//  kinect_reactor.h
+//  kinectExample
+//
+//  One thread that drives any number of audio/motor devices without
+//  blocking on any of them. libusb's file descriptors and its next timeout
+//  are exported into an epoll set (poll() where there is no epoll, e.g. OS
+//  X) next to a wake pipe, and each device's accel sampling and keep alive
+//  are timers on the same loop, so the thread sleeps until a transfer
+//  completes, a timer is due or the caller posts something. Every command
+//  goes through a kinect_motor_pipe, several in flight per device.
+//
+//  The caller, e.g. the OF main thread, never blocks either: LED and tilt
+//  requests go in through a lock-free queue, command results come back
+//  through another and accel samples through a kinect_accel_ring per device.
+//  All of those are single producer: post from one thread only.
+//
+//  While a reactor runs on the kinect_usb_runtime context it is the event
+//  handler, the runtime's event thread is paused. It waits with libusb's
+//  event lock let go and takes it only to handle what is ready, so blocking
+//  transfers from other threads still complete. A transfer of the reactor's
+//  that one of those threads reaps is only queued on its kusb_io and wakes
+//  the reactor; every device callback runs on the reactor thread.
+//
+
+#ifndef __kinectExample__kinect_reactor__
+#define __kinectExample__kinect_reactor__
+
+#include "kinect_usb_io.h"
+#include "kinect_accel_ring.h"
+
+#include <libusb.h>
+
+#define KINECT_REACTOR_QUEUE_SIZE 256 // commands and results, power of two
+
+typedef struct kinect_reactor kinect_reactor;
+typedef struct kinect_reactor_device kinect_reactor_device;
+
+typedef struct {
+	unsigned int sample_hz;     // status polls a second, 0 doesn't sample
+	unsigned int keepalive_ms;  // LED repeated after this long without traffic, 0 never
+	int in_flight;              // commands on the wire at once, 0 for 4
+	unsigned int timeout_ms;    // for each reply, 0 for a second
+	// For ios whose completions don't come through the reactor's libusb
+	// context, e.g. the simulator: how often to run their events while
+	// something is outstanding. 0 for libusb ios on the reactor's context.
+	unsigned int poll_us;
+} kinect_reactor_device_params;
+
+void kinect_reactor_default_params(kinect_reactor_device_params* params);
+
+typedef struct {
+	int device;           // as returned by kinect_reactor_device_id()
+	uint32_t cmd;         // KINECT_MOTOR_CMD_LED or KINECT_MOTOR_CMD_TILT
+	int status;           // 0 or a libusb_error code
+	uint64_t latency_us;  // from sending the command to the reply
+} kinect_reactor_result;
+
+typedef struct {
+	int devices;
+	int wakeups;          // returns from epoll_wait() / poll()
+	int idle_wakeups;     // of those, with nothing ready and no timer due
+	int usb_events;       // times libusb's events were handled
+	int commands;         // posted requests taken off the queue
+	int samples;          // status replies pushed to the rings
+	int keepalives;
+	int keepalives_skipped; // came due but the device had seen traffic anyway
+	int results_dropped;  // the caller fell KINECT_REACTOR_QUEUE_SIZE behind
+	int commands_refused; // the command queue was full
+} kinect_reactor_stats;
+
+// Starts the thread. ctx is kinect_usb_context(), which libusb ios added
+// later have to be opened on, or NULL for a reactor that only drives polled
+// ios. NULL if the thread or the wake pipe can't be had.
+kinect_reactor* kinect_reactor_start(libusb_context* ctx);
+
+// Closes and frees the devices still added, then stops the thread and gives
+// the context's events back to the runtime.
+void kinect_reactor_stop(kinect_reactor* reactor);
+
+// io stays owned by the caller and must not be used by anything else until
+// kinect_reactor_remove() has returned. The device is taken on by the
+// reactor thread, before anything posted for it; NULL if it can't be queued.
+kinect_reactor_device* kinect_reactor_add(kinect_reactor* reactor, kusb_io* io,
+	const kinect_reactor_device_params* params);
+
+// Cancels what is outstanding and waits for the reactor thread to let go
+// of the device; its results may still be in the queue.
+void kinect_reactor_remove(kinect_reactor* reactor, kinect_reactor_device* device);
+
+int kinect_reactor_device_id(const kinect_reactor_device* device);
+
+// These post the request and return 0 right away, or LIBUSB_ERROR_BUSY when
+// the queue is full. state is one of KINECT_LED_*. Tilts are coalesced: only
+// the latest angle waiting when the previous one is acknowledged is sent.
+int kinect_reactor_set_led(kinect_reactor* reactor, kinect_reactor_device* device, int state);
+int kinect_reactor_set_tilt(kinect_reactor* reactor, kinect_reactor_device* device, int degrees);
+
+// Moves up to max results not read yet, oldest first, into out and returns
+// how many. Never blocks.
+int kinect_reactor_read_results(kinect_reactor* reactor, kinect_reactor_result* out, int max);
+
+// The same for the device's accel samples.
+int kinect_reactor_read_samples(kinect_reactor_device* device, kinect_accel_sample* out, int max);
+
+// Read from any thread; the counters are updated without a lock.
+void kinect_reactor_get_stats(kinect_reactor* reactor, kinect_reactor_stats* stats);
+
+#endif /* defined(__kinectExample__kinect_reactor__) */
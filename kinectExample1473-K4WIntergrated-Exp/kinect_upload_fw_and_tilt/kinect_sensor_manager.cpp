@@ -0,0 +1,451 @@
+//
+//  kinect_sensor_manager.cpp
+//  kinectExample
+//
+
+#include "kinect_sensor_manager.h"
+#include "kinect_protocol.h"
+#include "kinect_usb_io.h"
+#include "kinect_usb_runtime.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <vector>
+
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+
+#define MAX_PORTS 8
+
+typedef struct {
+	libusb_device* device;    // referenced
+	int arrived;
+	int attached;             // in the sensor table already, only the callback is left
+	uint64_t event_us;        // when the hotplug event came in
+	uint64_t due_us;          // retries only
+} sensor_event;
+
+struct kinect_sensor_manager {
+	kinect_sensor_cb cb;
+	void* user_data;
+	libusb_context* ctx;
+	libusb_hotplug_callback_handle handle;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;      // an event was queued, or stop
+	int stop;
+	std::vector<sensor_event> queue;
+	std::vector<sensor_event> retries;
+	std::vector<kinect_sensor> sensors;
+	kinect_sensor_manager_stats stats;
+};
+
+static int LIBUSB_CALL hotplug_cb(libusb_context* ctx, libusb_device* device,
+	libusb_hotplug_event event, void* user_data) {
+	(void)ctx;
+	kinect_sensor_manager* m = (kinect_sensor_manager*)user_data;
+	sensor_event e;
+	e.device = libusb_ref_device(device);
+	e.arrived = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+	e.attached = 0;
+	e.event_us = kusb_now_us();
+	e.due_us = 0;
+	pthread_mutex_lock(&m->lock);
+	m->queue.push_back(e);
+	pthread_cond_signal(&m->wake);
+	pthread_mutex_unlock(&m->lock);
+	return 0;
+}
+
+// -1 for the other Microsoft devices.
+static int classify(uint16_t pid, kinect_sensor_interface* which) {
+	switch (pid) {
+		case KINECT_PID_CAMERA:
+		case KINECT_PID_K4W_CAMERA:
+			*which = KINECT_SENSOR_CAMERA;
+			return 0;
+		case KINECT_PID_NUI_MOTOR:
+			*which = KINECT_SENSOR_MOTOR;
+			return 0;
+		case KINECT_PID_AUDIO:
+		case KINECT_PID_K4W_AUDIO:
+			*which = KINECT_SENSOR_AUDIO;
+			return 0;
+	}
+	return -1;
+}
+
+// Port path of the hub the device hangs off, "" when the platform doesn't
+// report one.
+static void hub_path(libusb_device* device, char* path, size_t size) {
+	uint8_t ports[MAX_PORTS];
+	int n = libusb_get_port_numbers(device, ports, MAX_PORTS);
+	path[0] = '\0';
+	if (n < 2) {
+		return;
+	}
+	int used = snprintf(path, size, "%d-", libusb_get_bus_number(device));
+	for (int i = 0; i < n - 1 && used > 0 && (size_t)used < size; i++) {
+		used += snprintf(path + used, size - used, i > 0 ? ".%d" : "%d", ports[i]);
+	}
+}
+
+static int read_serial(libusb_device* device, uint8_t index, char* serial, size_t size) {
+	serial[0] = '\0';
+	if (index == 0) {
+		return 0;
+	}
+	libusb_device_handle* dev = NULL;
+	if (libusb_open(device, &dev) != 0) {
+		return LIBUSB_ERROR_BUSY;
+	}
+	int res = libusb_get_string_descriptor_ascii(dev, index, (unsigned char*)serial, (int)size);
+	libusb_close(dev);
+	if (res < 0) {
+		serial[0] = '\0';
+		return LIBUSB_ERROR_BUSY;
+	}
+	return 0;
+}
+
+// With the lock held: the sensor device is attached to, -1 if none.
+static int find_device(kinect_sensor_manager* m, libusb_device* device, kinect_sensor_interface* which) {
+	for (size_t i = 0; i < m->sensors.size(); i++) {
+		for (int w = 0; w < KINECT_SENSOR_INTERFACES; w++) {
+			if ((m->sensors[i].present & (1 << w)) && m->sensors[i].devices[w] == device) {
+				*which = (kinect_sensor_interface)w;
+				return (int)i;
+			}
+		}
+	}
+	return -1;
+}
+
+// With the lock held: the sensor for path or serial, added if it's new.
+static int find_sensor(kinect_sensor_manager* m, const char* path, const char* serial) {
+	for (size_t i = 0; i < m->sensors.size(); i++) {
+		const kinect_sensor* s = &m->sensors[i];
+		if (path[0] != '\0' ? strcmp(s->path, path) == 0
+			: serial[0] != '\0' && strcmp(s->serial, serial) == 0) {
+			return (int)i;
+		}
+	}
+	kinect_sensor s;
+	memset(&s, 0, sizeof(s));
+	s.id = (int)m->sensors.size();
+	s.model = KINECT_MODEL_1473;
+	snprintf(s.path, sizeof(s.path), "%s", path);
+	snprintf(s.serial, sizeof(s.serial), "%s", serial);
+	m->sensors.push_back(s);
+	m->stats.sensors = (int)m->sensors.size();
+	return s.id;
+}
+
+static void update_model(kinect_sensor* s, uint16_t pid) {
+	if (pid == KINECT_PID_K4W_CAMERA || pid == KINECT_PID_K4W_AUDIO) {
+		s->model = KINECT_MODEL_K4W;
+	} else if (pid == KINECT_PID_NUI_MOTOR) {
+		s->model = KINECT_MODEL_1414;
+	}
+}
+
+// 1 if the audio device has the firmware's interfaces, 0 for the
+// bootloader, LIBUSB_ERROR_BUSY if it can't be told yet.
+static int running_firmware(libusb_device* device) {
+	struct libusb_config_descriptor* config = NULL;
+	if (libusb_get_active_config_descriptor(device, &config) != 0) {
+		return LIBUSB_ERROR_BUSY;
+	}
+	int interfaces = config->bNumInterfaces;
+	libusb_free_config_descriptor(config);
+	return interfaces >= 2;
+}
+
+static void retry_later(kinect_sensor_manager* m, const sensor_event* e, int attached) {
+	sensor_event r = *e;
+	r.device = libusb_ref_device(e->device);
+	r.attached = attached;
+	r.due_us = kusb_now_us() + (uint64_t)KINECT_SENSOR_RETRY_MS * 1000;
+	pthread_mutex_lock(&m->lock);
+	m->retries.push_back(r);
+	m->stats.retries++;
+	pthread_mutex_unlock(&m->lock);
+}
+
+static int expired(const sensor_event* e) {
+	return kusb_now_us() - e->event_us >= (uint64_t)KINECT_SENSOR_RETRY_FOR * 1000;
+}
+
+// Without the lock: brings the sensor table up to date with e and tells the
+// callback.
+static void handle_event(kinect_sensor_manager* m, const sensor_event* e) {
+	kinect_sensor_interface which;
+	kinect_sensor sensor;
+	int index;
+
+	if (!e->arrived) {
+		pthread_mutex_lock(&m->lock);
+		// gone before it could be looked at
+		for (size_t i = 0; i < m->retries.size();) {
+			if (m->retries[i].device == e->device) {
+				libusb_unref_device(m->retries[i].device);
+				m->retries.erase(m->retries.begin() + i);
+			} else {
+				i++;
+			}
+		}
+		index = find_device(m, e->device, &which);
+		if (index >= 0) {
+			kinect_sensor* s = &m->sensors[index];
+			s->present &= ~(1 << which);
+			s->devices[which] = NULL;
+			if (which == KINECT_SENSOR_AUDIO) {
+				s->firmware = 0;
+			}
+			m->stats.removals++;
+			sensor = *s;
+		}
+		pthread_mutex_unlock(&m->lock);
+		if (index >= 0) {
+			m->cb(&sensor, which, 0, m->user_data);
+			// the reference the sensor table held
+			libusb_unref_device(e->device);
+		}
+		return;
+	}
+
+	struct libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(e->device, &desc) != 0
+		|| desc.idVendor != KINECT_VID || classify(desc.idProduct, &which) != 0) {
+		return;
+	}
+
+	if (!e->attached) {
+		char path[32];
+		char serial[64] = "";
+		hub_path(e->device, path, sizeof(path));
+		if (path[0] == '\0' && read_serial(e->device, desc.iSerialNumber, serial, sizeof(serial)) != 0) {
+			if (!expired(e)) {
+				retry_later(m, e, 0);
+				return;
+			}
+		}
+		int firmware = which == KINECT_SENSOR_AUDIO ? running_firmware(e->device) : 0;
+		if (firmware == LIBUSB_ERROR_BUSY) {
+			if (!expired(e)) {
+				retry_later(m, e, 0);
+				return;
+			}
+			firmware = 0;
+		}
+
+		pthread_mutex_lock(&m->lock);
+		kinect_sensor_interface seen;
+		if (find_device(m, e->device, &seen) >= 0) {
+			// LIBUSB_HOTPLUG_ENUMERATE may report a device twice
+			pthread_mutex_unlock(&m->lock);
+			return;
+		}
+		index = find_sensor(m, path, serial);
+		kinect_sensor* s = &m->sensors[index];
+		if (s->present & (1 << which)) {
+			// its removal was missed
+			libusb_unref_device(s->devices[which]);
+		}
+		s->present |= 1 << which;
+		s->devices[which] = libusb_ref_device(e->device);
+		if (which == KINECT_SENSOR_AUDIO) {
+			s->firmware = firmware;
+		}
+		if (s->serial[0] == '\0') {
+			snprintf(s->serial, sizeof(s->serial), "%s", serial);
+		}
+		update_model(s, desc.idProduct);
+		m->stats.arrivals++;
+		sensor = *s;
+		pthread_mutex_unlock(&m->lock);
+	} else {
+		pthread_mutex_lock(&m->lock);
+		index = find_device(m, e->device, &which);
+		if (index >= 0) {
+			sensor = m->sensors[index];
+		}
+		pthread_mutex_unlock(&m->lock);
+		if (index < 0) {
+			return; // gone again meanwhile
+		}
+	}
+
+	int res = m->cb(&sensor, which, 1, m->user_data);
+	if (res == LIBUSB_ERROR_BUSY) {
+		if (!expired(e)) {
+			retry_later(m, e, 1);
+			return;
+		}
+		LOG("kinect_sensor_manager: gave up attaching interface %d of sensor %d\n", which, sensor.id);
+	}
+
+	uint64_t latency = kusb_now_us() - e->event_us;
+	pthread_mutex_lock(&m->lock);
+	m->stats.last_latency_us = latency;
+	if (latency > m->stats.max_latency_us) {
+		m->stats.max_latency_us = latency;
+	}
+	pthread_mutex_unlock(&m->lock);
+}
+
+static void deadline_at(struct timespec* ts, uint64_t at_us) {
+	uint64_t now = kusb_now_us();
+	uint64_t delay = at_us > now ? at_us - now : 0;
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	uint64_t until = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec + delay;
+	ts->tv_sec = (time_t)(until / 1000000);
+	ts->tv_nsec = (long)(until % 1000000) * 1000;
+}
+
+static void* manager_thread(void* arg) {
+	kinect_sensor_manager* m = (kinect_sensor_manager*)arg;
+	std::vector<sensor_event> work;
+
+	pthread_mutex_lock(&m->lock);
+	while (!m->stop) {
+		if (m->queue.empty()) {
+			if (m->retries.empty()) {
+				pthread_cond_wait(&m->wake, &m->lock);
+			} else {
+				uint64_t due = m->retries[0].due_us;
+				for (size_t i = 1; i < m->retries.size(); i++) {
+					if (m->retries[i].due_us < due) {
+						due = m->retries[i].due_us;
+					}
+				}
+				if (due > kusb_now_us()) {
+					struct timespec ts;
+					deadline_at(&ts, due);
+					pthread_cond_timedwait(&m->wake, &m->lock, &ts);
+				}
+			}
+			if (m->stop) {
+				break;
+			}
+		}
+
+		work.swap(m->queue);
+		uint64_t now = kusb_now_us();
+		for (size_t i = 0; i < m->retries.size();) {
+			if (m->retries[i].due_us <= now) {
+				work.push_back(m->retries[i]);
+				m->retries.erase(m->retries.begin() + i);
+			} else {
+				i++;
+			}
+		}
+		pthread_mutex_unlock(&m->lock);
+
+		for (size_t i = 0; i < work.size(); i++) {
+			handle_event(m, &work[i]);
+			libusb_unref_device(work[i].device);
+		}
+		work.clear();
+
+		pthread_mutex_lock(&m->lock);
+	}
+	pthread_mutex_unlock(&m->lock);
+	return NULL;
+}
+
+kinect_sensor_manager* kinect_sensor_manager_start(kinect_sensor_cb cb, void* user_data) {
+	libusb_context* ctx = kinect_usb_context();
+	if (ctx == NULL || cb == NULL) {
+		return NULL;
+	}
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		LOG("kinect_sensor_manager: no hotplug support in this libusb\n");
+		return NULL;
+	}
+
+	kinect_sensor_manager* m = new kinect_sensor_manager();
+	m->cb = cb;
+	m->user_data = user_data;
+	m->ctx = ctx;
+	m->stop = 0;
+	memset(&m->stats, 0, sizeof(m->stats));
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->wake, NULL);
+
+	if (pthread_create(&m->thread, NULL, manager_thread, m) != 0) {
+		LOG("kinect_sensor_manager: can't start the thread\n");
+		pthread_cond_destroy(&m->wake);
+		pthread_mutex_destroy(&m->lock);
+		delete m;
+		return NULL;
+	}
+
+	// the attached devices are reported from in here, before it returns
+	int res = libusb_hotplug_register_callback(ctx,
+		(libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+		LIBUSB_HOTPLUG_ENUMERATE, KINECT_VID, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		hotplug_cb, m, &m->handle);
+	if (res != LIBUSB_SUCCESS) {
+		LOG("kinect_sensor_manager: can't register the hotplug callback: %d\n", res);
+		pthread_mutex_lock(&m->lock);
+		m->stop = 1;
+		pthread_cond_signal(&m->wake);
+		pthread_mutex_unlock(&m->lock);
+		pthread_join(m->thread, NULL);
+		pthread_cond_destroy(&m->wake);
+		pthread_mutex_destroy(&m->lock);
+		delete m;
+		return NULL;
+	}
+	return m;
+}
+
+void kinect_sensor_manager_stop(kinect_sensor_manager* m) {
+	if (m == NULL) {
+		return;
+	}
+	libusb_hotplug_deregister_callback(m->ctx, m->handle);
+
+	pthread_mutex_lock(&m->lock);
+	m->stop = 1;
+	pthread_cond_signal(&m->wake);
+	pthread_mutex_unlock(&m->lock);
+	pthread_join(m->thread, NULL);
+
+	for (size_t i = 0; i < m->queue.size(); i++) {
+		libusb_unref_device(m->queue[i].device);
+	}
+	for (size_t i = 0; i < m->retries.size(); i++) {
+		libusb_unref_device(m->retries[i].device);
+	}
+	for (size_t i = 0; i < m->sensors.size(); i++) {
+		for (int w = 0; w < KINECT_SENSOR_INTERFACES; w++) {
+			if (m->sensors[i].present & (1 << w)) {
+				libusb_unref_device(m->sensors[i].devices[w]);
+			}
+		}
+	}
+	pthread_cond_destroy(&m->wake);
+	pthread_mutex_destroy(&m->lock);
+	delete m;
+}
+
+int kinect_sensor_manager_get_sensors(kinect_sensor_manager* m, kinect_sensor* sensors, int max) {
+	pthread_mutex_lock(&m->lock);
+	int count = (int)m->sensors.size();
+	for (int i = 0; i < count && i < max; i++) {
+		sensors[i] = m->sensors[i];
+	}
+	pthread_mutex_unlock(&m->lock);
+	return count;
+}
+
+void kinect_sensor_manager_get_stats(kinect_sensor_manager* m, kinect_sensor_manager_stats* stats) {
+	pthread_mutex_lock(&m->lock);
+	*stats = m->stats;
+	pthread_mutex_unlock(&m->lock);
+}
@@ -0,0 +1,74 @@
+//
+//  kinect_sensor_manager.h
+//  kinectExample
+//
+//  Follows Kinects coming and going through libusb hotplug events on the
+//  kinect_usb_runtime context. The camera, motor (1414) and audio devices
+//  of one Kinect hang off its internal hub, so they are put together into
+//  one kinect_sensor by the port path of that hub, or by serial number where
+//  the platform can't report port paths. A sensor keeps its id across
+//  unplugging and plugging back in on the same port.
+//
+//  The hotplug callback only queues the event; a thread of the manager's
+//  own waits for the queue and hands each change to the callback, which may
+//  open and close devices. Nothing polls: the thread sleeps until an event
+//  arrives, or until a busy device is due to be tried again.
+//
+
+#ifndef __kinectExample__kinect_sensor_manager__
+#define __kinectExample__kinect_sensor_manager__
+
+#include "kinect_device.h"
+
+#include <libusb.h>
+
+typedef enum {
+	KINECT_SENSOR_CAMERA,
+	KINECT_SENSOR_MOTOR,   // 1414 only
+	KINECT_SENSOR_AUDIO,   // motor, LED and accel on the 1473 and K4W
+	KINECT_SENSOR_INTERFACES
+} kinect_sensor_interface;
+
+typedef struct {
+	int id;                // stable while the manager runs
+	kinect_model model;
+	char path[32];         // bus-port.port of the internal hub, "" if unknown
+	char serial[64];       // of the camera or audio device, "" if not read
+	int present;           // 1 << kinect_sensor_interface for each attached
+	int firmware;          // the audio device runs firmware, not the bootloader
+	libusb_device* devices[KINECT_SENSOR_INTERFACES]; // valid while present
+} kinect_sensor;
+
+// Called on the manager thread for every arrival and removal. Returning
+// LIBUSB_ERROR_BUSY for an arrival has it called again
+// KINECT_SENSOR_RETRY_MS later, for devices that don't open right away.
+typedef int (*kinect_sensor_cb)(const kinect_sensor* sensor, kinect_sensor_interface which,
+	int arrived, void* user_data);
+
+#define KINECT_SENSOR_RETRY_MS   20
+#define KINECT_SENSOR_RETRY_FOR  3000 // ms before a busy arrival is given up on
+
+typedef struct kinect_sensor_manager kinect_sensor_manager;
+
+typedef struct {
+	int sensors;
+	int arrivals;
+	int removals;
+	int retries;
+	uint64_t last_latency_us; // hotplug event to the callback returning
+	uint64_t max_latency_us;
+} kinect_sensor_manager_stats;
+
+// Devices already attached are reported as arrivals right away. NULL when
+// libusb has no hotplug support on this platform.
+kinect_sensor_manager* kinect_sensor_manager_start(kinect_sensor_cb cb, void* user_data);
+
+// No callbacks are running or will run once this returns.
+void kinect_sensor_manager_stop(kinect_sensor_manager* manager);
+
+// Copies up to max sensors seen so far, returns how many there are.
+int kinect_sensor_manager_get_sensors(kinect_sensor_manager* manager, kinect_sensor* sensors, int max);
+
+void kinect_sensor_manager_get_stats(kinect_sensor_manager* manager, kinect_sensor_manager_stats* stats);
+
+#endif /* defined(__kinectExample__kinect_sensor_manager__) */
@@ -0,0 +1,30 @@
+//
+//  kinect_sha256.h
+//  kinectExample
+//
+//  SHA-256 (FIPS 180-4), fed in pieces so an image can be hashed page by
+//  page while it is being uploaded.
+//
+
+#ifndef __kinectExample__kinect_sha256__
+#define __kinectExample__kinect_sha256__
+
+#include <stdint.h>
+
+#define KINECT_SHA256_SIZE 32
+
+typedef struct {
+	uint32_t state[8];
+	uint64_t length;         // bytes hashed so far
+	unsigned char block[64];
+	int used;                // bytes waiting in block
+} kinect_sha256;
+
+void kinect_sha256_init(kinect_sha256* h);
+void kinect_sha256_update(kinect_sha256* h, const unsigned char* data, int size);
+void kinect_sha256_final(kinect_sha256* h, unsigned char digest[KINECT_SHA256_SIZE]);
+
+// Lowercase hex into out, which needs 2 * KINECT_SHA256_SIZE + 1 bytes.
+void kinect_sha256_hex(const unsigned char digest[KINECT_SHA256_SIZE], char* out);
+
+#endif /* defined(__kinectExample__kinect_sha256__) */
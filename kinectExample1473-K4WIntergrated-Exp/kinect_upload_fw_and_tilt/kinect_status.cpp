@@ -0,0 +1,52 @@
+//
+//  kinect_status.cpp
+//  kinectExample
+//
+
+#include "kinect_status.h"
+
+#include <libusb.h>
+#include <string.h>
+
+#define fn_le32(x) (x)
+
+int kinect_status_decode(const unsigned char* data, int length, kinect_status* status) {
+	uint32_t words[KINECT_STATUS_WORDS];
+	memset(words, 0, sizeof(words));
+	if (length > (int)sizeof(words)) {
+		length = sizeof(words);
+	}
+	if (length > 0) {
+		memcpy(words, data, length);
+	}
+
+	memset(status, 0, sizeof(*status));
+	status->length = length;
+	for (int i = 0; i < 4; i++) {
+		status->header[i] = fn_le32(words[i]);
+	}
+	for (int i = 0; i < 3; i++) {
+		status->accel[i] = (int32_t)fn_le32(words[4 + i]);
+	}
+	status->tilt_angle = (int32_t)fn_le32(words[KINECT_STATUS_TILT_ANGLE / 4]);
+	status->tilt_state = fn_le32(words[KINECT_STATUS_TILT_STATE / 4]);
+	for (int i = 9; i < KINECT_STATUS_WORDS; i++) {
+		status->unknown[i - 9] = fn_le32(words[i]);
+	}
+	return length >= 28 ? 0 : LIBUSB_ERROR_IO;
+}
+
+static const char* tilt_state_name(uint32_t state) {
+	switch (state) {
+		case KINECT_TILT_STOPPED: return "stopped";
+		case KINECT_TILT_LIMIT: return "at limit";
+		case KINECT_TILT_MOVING: return "moving";
+		default: return "unknown";
+	}
+}
+
+void kinect_status_print(FILE* out, const kinect_status* status) {
+	fprintf(out, "status: accel X %d Y %d Z %d, tilt %d degrees, %s (%u)\n",
+		status->accel[0], status->accel[1], status->accel[2],
+		status->tilt_angle, tilt_state_name(status->tilt_state), status->tilt_state);
+}
@@ -0,0 +1,40 @@
+//
+//  kinect_status.h
+//  kinectExample
+//
+//  The 104 byte block the audio/motor firmware sends back for
+//  KINECT_MOTOR_CMD_STATUS, decoded into named fields. Words we don't
+//  understand yet are kept as they came so they can be logged and compared.
+//
+
+#ifndef __kinectExample__kinect_status__
+#define __kinectExample__kinect_status__
+
+#include "kinect_protocol.h"
+
+#include <stdio.h>
+
+#define KINECT_STATUS_WORDS (KINECT_STATUS_REPLY_SIZE / 4)
+
+// what the accelerometer reads for 1 g, the 1414's scale until the 1473's has
+// been measured
+#define KINECT_COUNTS_PER_G 819
+#define KINECT_GRAVITY      9.80665f // m/s^2
+
+typedef struct {
+	uint32_t header[4];     // words 0-3
+	int32_t accel[3];       // words 4-6, raw, KINECT_COUNTS_PER_G for 1 g
+	int32_t tilt_angle;     // word 7, degrees
+	uint32_t tilt_state;    // word 8, KINECT_TILT_*
+	uint32_t unknown[KINECT_STATUS_WORDS - 9]; // words 9-25
+	int length;             // bytes the device sent, fields past it are 0
+} kinect_status;
+
+// Decodes length bytes of a status reply. Returns 0, or LIBUSB_ERROR_IO when
+// it is too short to hold the accelerometer words.
+int kinect_status_decode(const unsigned char* data, int length, kinect_status* status);
+
+// One line: accel, tilt and the state by name.
+void kinect_status_print(FILE* out, const kinect_status* status);
+
+#endif /* defined(__kinectExample__kinect_status__) */
@@ -0,0 +1,177 @@
+//
+//  kinect_trace.cpp
+//  kinectExample
+//
+
+#include "kinect_trace.h"
+#include "kinect_protocol.h"
+#include "kinect_usb_io.h"
+
+#include <string.h>
+
+#define RECORD_MASK (KINECT_TRACE_RECORDS - 1)
+
+int kinect_trace_level = KINECT_TRACE_COMMANDS;
+
+static kinect_trace_record ring[KINECT_TRACE_RECORDS];
+static volatile uint32_t head;
+
+void kinect_trace_transfer(int level, unsigned char endpoint, const unsigned char* data,
+	int length, int actual, int status) {
+	uint32_t index = __sync_fetch_and_add(&head, 1);
+	kinect_trace_record* r = &ring[index & RECORD_MASK];
+
+	r->seq = 0;
+	__sync_synchronize();
+	r->endpoint = endpoint;
+	r->level = (uint8_t)level;
+	r->length = length;
+	r->actual = actual;
+	r->status = status;
+	r->time_us = kusb_now_us();
+	// what was sent, or what came back
+	int bytes = (endpoint & 0x80) ? actual : length;
+	if (bytes > KINECT_TRACE_CAPTURE) bytes = KINECT_TRACE_CAPTURE;
+	if (bytes < 0 || data == NULL) bytes = 0;
+	memcpy(r->data, data, bytes);
+	r->captured = (uint16_t)bytes;
+	__sync_synchronize();
+	r->seq = index + 1;
+}
+
+void kinect_trace_clear() {
+	uint32_t end = head;
+	for (uint32_t i = 0; i < KINECT_TRACE_RECORDS; i++) {
+		ring[i].seq = 0;
+	}
+	// anything recorded since still counts
+	__sync_bool_compare_and_swap(&head, end, 0);
+}
+
+// Copies out the records still in the ring, oldest first.
+static int snapshot(kinect_trace_record* out) {
+	uint32_t end = head;
+	uint32_t begin = end > KINECT_TRACE_RECORDS ? end - KINECT_TRACE_RECORDS : 0;
+	int count = 0;
+	for (uint32_t i = begin; i != end; i++) {
+		const kinect_trace_record* r = &ring[i & RECORD_MASK];
+		uint32_t before = r->seq;
+		__sync_synchronize();
+		out[count] = *r;
+		__sync_synchronize();
+		if (before == i + 1 && r->seq == before) {
+			count++;
+		}
+	}
+	return count;
+}
+
+//------------------------------------------------------------------------------
+// decoder
+
+static uint32_t word(const kinect_trace_record* r, int offset) {
+	uint32_t v = 0;
+	if (offset + 4 <= r->captured) {
+		memcpy(&v, r->data + offset, 4);
+	}
+	return v;
+}
+
+static void hex(FILE* out, const kinect_trace_record* r, const char* format, int limit) {
+	int n = r->captured < limit ? r->captured : limit;
+	for (int i = 0; i < n; i++) {
+		fprintf(out, format, r->data[i]);
+	}
+}
+
+static void dump_records(const kinect_trace_record* records, int count, FILE* out) {
+	// 12 byte replies look the same to both protocols, so go by the command
+	// that preceded them
+	int bootloader = 0;
+	uint64_t start = count > 0 ? records[0].time_us : 0;
+
+	for (int i = 0; i < count; i++) {
+		const kinect_trace_record* r = &records[i];
+		fprintf(out, "%10.3f ", (r->time_us - start) / 1000.0);
+
+		if (!(r->endpoint & 0x80)) {
+			if (r->status != 0) {
+				fprintf(out, "Error: res: %d\ttransferred: %d (expected %d)\n", r->status, r->actual, r->length);
+			} else if (r->length == 24 && word(r, 0) == KINECT_CMD_MAGIC) {
+				bootloader = 1;
+				fprintf(out, "About to send: ");
+				hex(out, r, "%02X ", 24);
+				fprintf(out, "\n");
+			} else if ((r->length == 16 || r->length == 20) && word(r, 0) == KINECT_CMD_MAGIC) {
+				bootloader = 0;
+				fprintf(out, "About to send bulk transfer:");
+				hex(out, r, " %02X", r->length);
+				fprintf(out, "\n");
+			} else {
+				fprintf(out, "Sent %d bytes:", r->length);
+				hex(out, r, " %02X", 16);
+				fprintf(out, r->length > 16 ? " ...\n" : "\n");
+			}
+			continue;
+		}
+
+		if (r->status != 0) {
+			fprintf(out, "Error reading reply: %d\ttransferred: %d\n", r->status, r->actual);
+		} else if (r->actual == KINECT_FW_INFO_REPLY_SIZE) {
+			fprintf(out, "Reading first reply: ");
+			hex(out, r, "%02X ", r->actual);
+			fprintf(out, "\n");
+		} else if (r->actual == 12 && word(r, 0) == KINECT_REPLY_MAGIC) {
+			if (bootloader) {
+				fprintf(out, "Reading reply: ");
+				hex(out, r, "%02X ", 12);
+			} else {
+				fprintf(out, "get_reply(): got %d bytes:", r->actual);
+				hex(out, r, " %02X", 12);
+			}
+			fprintf(out, "\n");
+		} else if (r->actual == KINECT_STATUS_REPLY_SIZE) {
+			fprintf(out, "poll_status():");
+			for (int j = 0; j + 4 <= r->captured; j += 4) {
+				fprintf(out, "\t%d", (int32_t)word(r, j));
+			}
+			fprintf(out, "\n%10s X: %d\tY: %d\tZ:%d\n", "",
+				(int32_t)word(r, 16), (int32_t)word(r, 20), (int32_t)word(r, 24));
+		} else {
+			fprintf(out, "Read %d bytes:", r->actual);
+			hex(out, r, " %02X", 16);
+			fprintf(out, r->actual > 16 ? " ...\n" : "\n");
+		}
+	}
+}
+
+void kinect_trace_dump(FILE* out) {
+	static kinect_trace_record copy[KINECT_TRACE_RECORDS];
+	dump_records(copy, snapshot(copy), out);
+}
+
+int kinect_trace_save(const char* path) {
+	static kinect_trace_record copy[KINECT_TRACE_RECORDS];
+	int count = snapshot(copy);
+	FILE* f = fopen(path, "wb");
+	if (f == NULL) {
+		return -1;
+	}
+	int written = (int)fwrite(copy, sizeof(kinect_trace_record), count, f);
+	if (fclose(f) != 0 || written != count) {
+		return -1;
+	}
+	return count;
+}
+
+int kinect_trace_dump_file(const char* path, FILE* out) {
+	static kinect_trace_record records[KINECT_TRACE_RECORDS];
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) {
+		return -1;
+	}
+	int count = (int)fread(records, sizeof(kinect_trace_record), KINECT_TRACE_RECORDS, f);
+	fclose(f);
+	dump_records(records, count, out);
+	return count;
+}
@@ -0,0 +1,75 @@
+//
+//  kinect_trace.h
+//  kinectExample
+//
+//  Binary trace of the bulk transfers to and from the audio/motor device.
+//  Recording a transfer is an atomic increment and a copy of up to 104 bytes
+//  into a fixed ring, so it can stay on in the upload and polling loops where
+//  printing every byte used to slow things down. kinect_trace_dump() renders
+//  the ring afterwards in the format the old hex dumps used.
+//
+//  KINECT_TRACE_MAX_LEVEL compiles levels above it out; kinect_trace_level
+//  gates the rest at runtime.
+//
+
+#ifndef __kinectExample__kinect_trace__
+#define __kinectExample__kinect_trace__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define KINECT_TRACE_OFF      0
+#define KINECT_TRACE_ERRORS   1 // failed transfers only
+#define KINECT_TRACE_COMMANDS 2 // commands and replies, not firmware payload
+#define KINECT_TRACE_ALL      3 // payload chunks too (first bytes of each)
+
+#ifndef KINECT_TRACE_MAX_LEVEL
+#define KINECT_TRACE_MAX_LEVEL KINECT_TRACE_ALL
+#endif
+
+#define KINECT_TRACE_RECORDS  1024 // power of two
+#define KINECT_TRACE_CAPTURE  104  // bytes kept per transfer, a whole status block
+
+typedef struct {
+	uint32_t seq;      // index + 1 once written, 0 while being written
+	uint8_t endpoint;
+	uint8_t level;
+	uint16_t captured; // bytes in data
+	int32_t length;    // bytes asked for
+	int32_t actual;    // bytes transferred
+	int32_t status;    // libusb_error, 0 on success
+	uint64_t time_us;
+	unsigned char data[KINECT_TRACE_CAPTURE];
+} kinect_trace_record;
+
+extern int kinect_trace_level;
+
+// Transfers moving this many bytes or fewer count as commands/replies, longer
+// ones as payload.
+#define KINECT_TRACE_COMMAND_BYTES 128
+
+// Call once a transfer has completed. data is the transfer buffer.
+#define KINECT_TRACE_TRANSFER(endpoint, data, length, actual, status) \
+	do { \
+		int _trace_level = (status) != 0 ? KINECT_TRACE_ERRORS \
+			: (((endpoint) & 0x80) ? (actual) : (length)) <= KINECT_TRACE_COMMAND_BYTES \
+			? KINECT_TRACE_COMMANDS : KINECT_TRACE_ALL; \
+		if (_trace_level <= KINECT_TRACE_MAX_LEVEL && _trace_level <= kinect_trace_level) { \
+			kinect_trace_transfer(_trace_level, (endpoint), (data), (length), (actual), (status)); \
+		} \
+	} while (0)
+
+void kinect_trace_transfer(int level, unsigned char endpoint, const unsigned char* data,
+	int length, int actual, int status);
+
+void kinect_trace_clear();
+
+// Renders what is in the ring, oldest first. Safe while transfers are being
+// recorded; records overwritten during the dump are skipped.
+void kinect_trace_dump(FILE* out);
+
+// Raw records, for kinect_trace_dump_file() later or on another machine.
+int kinect_trace_save(const char* path);
+int kinect_trace_dump_file(const char* path, FILE* out);
+
+#endif /* defined(__kinectExample__kinect_trace__) */
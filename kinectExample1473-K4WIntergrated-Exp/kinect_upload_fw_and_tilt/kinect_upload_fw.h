@@ -0,0 +1,46 @@
+//
+//  kinect_upload_fw.h
+//  kinectExample
+//
+//  Entry points for flashing the audio/motor bootloader.
+//
+
+#ifndef __kinectExample__kinect_upload_fw__
+#define __kinectExample__kinect_upload_fw__
+
+#include "kinect_usb_io.h"
+
+// kinect_upload_fw_from_code.cpp - uploads the compiled in fw1473Bin image
+int upload_firmware(bool b1473);
+
+// Same, but only when the device is still in its bootloader, and after an
+// upload it waits for the device to re-enumerate (kinect_fw_wait). Returns 1
+// once the freshly uploaded firmware is up, 0 if it was already running, or a
+// negative error.
+int upload_firmware_if_needed(bool b1473);
+
+// upload_firmware_if_needed() on a background thread, so the app can go on
+// initialising the camera meanwhile. callback (may be NULL) runs on that
+// thread with the result.
+typedef struct kinect_fw_task kinect_fw_task;
+typedef void (*kinect_fw_ready_cb)(int result, void* user_data);
+
+kinect_fw_task* upload_firmware_async(bool b1473, kinect_fw_ready_cb callback, void* user_data);
+
+// The task's result, or LIBUSB_ERROR_TIMEOUT if it is still running after
+// timeout_ms (0 waits forever).
+int kinect_fw_task_wait(kinect_fw_task* task, unsigned int timeout_ms);
+
+// Waits for the task and frees it, returning its result.
+int kinect_fw_task_free(kinect_fw_task* task);
+
+// kinect_upload_fw_multi.cpp - same image to every device found, in parallel.
+// Devices already running the image are left alone. Returns 0 or the first
+// failing device's libusb_error; failed, if set, gets how many failed.
+int upload_firmware_all(bool b1473, int* failed);
+
+// kinect_upload_fw-theo.cpp - uploads ../../../data/firmware.bin
+int upload_main();
+int upload_main_io(kusb_io* io, const char* filename);
+
+#endif /* defined(__kinectExample__kinect_upload_fw__) */
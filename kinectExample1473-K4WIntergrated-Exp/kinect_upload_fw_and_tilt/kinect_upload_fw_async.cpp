@@ -0,0 +1,497 @@
+//
+//  kinect_upload_fw_async.cpp
+//  kinectExample
+//
+//  The bootloader takes a 24 byte write command followed by the page payload
+//  and answers every page with a 12 byte status. Instead of waiting for each
+//  of those transfers in turn we keep a window of OUT transfers queued on
+//  endpoint 0x01 and a reply transfer posted on 0x81, so header, payload and
+//  the previous page's status all overlap. By default each page goes out as
+//  one transfer and the host controller splits it into wMaxPacketSize packets,
+//  which is the same traffic on the wire for a fraction of the submissions.
+//  Each page is hashed right after it was queued, while the bus is busy with
+//  it, so checking the image against kinect_fw_images costs no extra time.
+//
+
+#include "kinect_upload_fw_async.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG(...) printf(__VA_ARGS__)
+#define fn_le32(x) (x)
+
+#define KFW_MAX_CHUNKS 64
+#define KFW_REPLY_BUF 512
+
+struct upload_state;
+
+typedef struct {
+	kusb_xfer xfer;
+	upload_state* st;
+	int page;
+	int offset; // -1 for the page header
+	int busy;
+} out_slot;
+
+struct upload_state {
+	kusb_io* io;
+	kinect_fw_upload_params params;
+	kinect_fw_upload_stats* stats;
+
+	kinect_fw_source* src;
+	int num_pages;
+	uint32_t first_seq;
+	bootloader_command* headers;
+
+	// next chunk to put on the wire
+	int next_page;
+	int next_offset;
+
+	out_slot slots[KFW_MAX_CHUNKS];
+	int out_busy;
+
+	union {
+		status_code code;
+		unsigned char dump[KFW_REPLY_BUF];
+	} reply;
+	kusb_xfer reply_xfer;
+	int reply_busy;
+	int pages_acked;
+
+	kinect_sha256 sha;
+	int pages_hashed;
+
+	// after a stall we let the queue drain, clear the halt, then resend from
+	// the earliest chunk the device refused. A fallback to packet sized
+	// writes does the same without the clear.
+	int stalled;
+	int halted;
+	int fallback;
+	// nothing is queued behind the first large payload transfer until it went
+	// through, so a device that refuses it hasn't taken a later header as
+	// payload by the time we fall back
+	int probing;
+	int stall_retries;
+	int rewind_page;
+	int rewind_offset;
+
+	int error;
+};
+
+void kinect_fw_upload_default_params(kinect_fw_upload_params* params) {
+	params->pages_in_flight = 2;
+	params->chunks_in_flight = 8;
+	params->chunk_size = KINECT_FW_CHUNK_PAGE;
+	params->packet_fallback = 1;
+	params->max_stall_retries = 3;
+	params->verify = 1;
+	params->timeout = 10000;
+}
+
+static bool chunk_before(int page_a, int offset_a, int page_b, int offset_b) {
+	return page_a < page_b || (page_a == page_b && offset_a < offset_b);
+}
+
+static void out_cb(kusb_xfer* xfer);
+static void reply_cb(kusb_xfer* xfer);
+
+// Pages are hashed in order once all of their chunks have been queued. A
+// resend after a stall doesn't hash anything twice, and the page is still
+// within the source's window since it was queued just now.
+static void hash_queued(upload_state* st) {
+	if (st->pages_hashed >= st->next_page) {
+		return;
+	}
+	uint64_t start = kusb_now_us();
+	while (st->pages_hashed < st->next_page) {
+		const unsigned char* page = kinect_fw_source_page(st->src, st->pages_hashed);
+		if (page == NULL) {
+			st->error = LIBUSB_ERROR_IO;
+			break;
+		}
+		kinect_sha256_update(&st->sha, page, kinect_fw_source_page_length(st->src, st->pages_hashed));
+		st->pages_hashed++;
+	}
+	st->stats->hash_us += kusb_now_us() - start;
+}
+
+static void pump(upload_state* st) {
+	while (!st->error && !st->stalled
+		&& st->out_busy < (st->probing ? 1 : st->params.chunks_in_flight)
+		&& st->next_page < st->num_pages
+		&& st->next_page < st->pages_acked + st->params.pages_in_flight) {
+
+		out_slot* slot = NULL;
+		for (int i = 0; i < st->params.chunks_in_flight; i++) {
+			if (!st->slots[i].busy) {
+				slot = &st->slots[i];
+				break;
+			}
+		}
+		if (slot == NULL) {
+			break;
+		}
+
+		int len;
+		unsigned char* buf;
+		if (st->next_offset < 0) {
+			buf = (unsigned char*)&st->headers[st->next_page];
+			len = sizeof(bootloader_command);
+		} else {
+			// straight out of the source, no copy
+			const unsigned char* page = kinect_fw_source_page(st->src, st->next_page);
+			if (page == NULL) {
+				st->error = LIBUSB_ERROR_IO;
+				break;
+			}
+			int left = kinect_fw_source_page_length(st->src, st->next_page) - st->next_offset;
+			len = left < st->params.chunk_size ? left : st->params.chunk_size;
+			buf = (unsigned char*)page + st->next_offset;
+		}
+
+		slot->st = st;
+		slot->page = st->next_page;
+		slot->offset = st->next_offset;
+		kusb_fill_bulk(&slot->xfer, KINECT_EP_OUT, buf, len, out_cb, slot, st->params.timeout);
+		int res = kusb_submit(st->io, &slot->xfer);
+		if (res != 0) {
+			LOG("kinect_fw_upload(): submit failed: %d\n", res);
+			st->error = res;
+			break;
+		}
+		slot->busy = 1;
+		st->out_busy++;
+		st->stats->out_transfers++;
+
+		if (st->next_offset < 0) {
+			st->next_offset = 0;
+		} else {
+			st->next_offset += len;
+			if (st->next_offset >= kinect_fw_source_page_length(st->src, st->next_page)) {
+				st->next_page++;
+				st->next_offset = -1;
+			}
+		}
+	}
+
+	if (!st->error && !st->reply_busy && st->pages_acked < st->num_pages) {
+		kusb_fill_bulk(&st->reply_xfer, KINECT_EP_IN, st->reply.dump, KFW_REPLY_BUF, reply_cb, st, st->params.timeout);
+		int res = kusb_submit(st->io, &st->reply_xfer);
+		if (res != 0) {
+			LOG("kinect_fw_upload(): reply submit failed: %d\n", res);
+			st->error = res;
+			return;
+		}
+		st->reply_busy = 1;
+	}
+	hash_queued(st);
+}
+
+static void out_cb(kusb_xfer* xfer) {
+	out_slot* slot = (out_slot*)xfer->user_data;
+	upload_state* st = slot->st;
+	slot->busy = 0;
+	st->out_busy--;
+
+	if (xfer->status == 0) {
+		// got through since the last resend, so the stalls aren't in a row
+		st->stall_retries = 0;
+		if (slot->offset >= 0) {
+			st->probing = 0;
+		}
+	}
+
+	if (xfer->status == LIBUSB_ERROR_PIPE) {
+		st->stats->stalls++;
+		if (!st->stalled || chunk_before(slot->page, slot->offset, st->rewind_page, st->rewind_offset)) {
+			st->rewind_page = slot->page;
+			st->rewind_offset = slot->offset;
+		}
+		st->stalled = 1;
+		st->halted = 1;
+	} else if (xfer->status != 0 && xfer->status != LIBUSB_ERROR_INTERRUPTED && !st->error
+		&& st->params.packet_fallback && xfer->length > st->stats->packet_size) {
+		// resend from the first packet the device didn't take
+		int offset = slot->offset;
+		if (offset >= 0) {
+			offset += xfer->actual_length - xfer->actual_length % st->stats->packet_size;
+		}
+		if (!st->stalled || chunk_before(slot->page, offset, st->rewind_page, st->rewind_offset)) {
+			st->rewind_page = slot->page;
+			st->rewind_offset = offset;
+		}
+		if (!st->fallback) {
+			LOG("kinect_fw_upload(): %d byte write failed (%d), falling back to %d byte writes\n",
+				xfer->length, xfer->status, st->stats->packet_size);
+			st->stats->fallbacks++;
+		}
+		st->fallback = 1;
+		st->stalled = 1;
+		st->params.chunk_size = st->stats->packet_size;
+	} else if (xfer->status != 0 || xfer->actual_length != xfer->length) {
+		LOG("kinect_fw_upload(): page %d offset %d: res: %d\ttransferred: %d (expected %d)\n",
+			slot->page, slot->offset, xfer->status, xfer->actual_length, xfer->length);
+		if (!st->error) {
+			st->error = xfer->status != 0 ? xfer->status : LIBUSB_ERROR_IO;
+		}
+	}
+
+	if (st->stalled && st->out_busy == 0) {
+		if (st->halted && !st->error) {
+			// nothing is on the endpoint any more
+			int res = kusb_clear_halt(st->io, KINECT_EP_OUT);
+			if (res != 0) {
+				LOG("kinect_fw_upload(): clearing the halt failed: %d\n", res);
+				st->error = res;
+			}
+		}
+		if (st->error) {
+			// nothing to resend
+		} else if (st->stall_retries >= st->params.max_stall_retries) {
+			LOG("kinect_fw_upload(): giving up after %d stalls in a row\n", st->stall_retries);
+			st->error = LIBUSB_ERROR_PIPE;
+		} else {
+			st->stall_retries++;
+			st->next_page = st->rewind_page;
+			st->next_offset = st->rewind_offset;
+		}
+		st->stalled = 0;
+		st->halted = 0;
+	}
+	pump(st);
+}
+
+static void reply_cb(kusb_xfer* xfer) {
+	upload_state* st = (upload_state*)xfer->user_data;
+	st->reply_busy = 0;
+	st->stats->in_transfers++;
+
+	if (xfer->status != 0 || xfer->actual_length != sizeof(status_code)) {
+		LOG("Error reading reply: %d\ttransferred: %d (expected %zu)\n", xfer->status, xfer->actual_length, sizeof(status_code));
+		if (!st->error) {
+			st->error = xfer->status != 0 ? xfer->status : LIBUSB_ERROR_IO;
+		}
+		return;
+	}
+	uint32_t expected = st->first_seq + st->pages_acked;
+	if (fn_le32(st->reply.code.magic) != KINECT_REPLY_MAGIC) {
+		LOG("Error reading reply: invalid magic %08X\n", st->reply.code.magic);
+		st->error = LIBUSB_ERROR_IO;
+		return;
+	}
+	if (fn_le32(st->reply.code.seq) != expected) {
+		LOG("Error reading reply: non-matching sequence number %08X (expected %08X)\n", st->reply.code.seq, expected);
+		st->error = LIBUSB_ERROR_IO;
+		return;
+	}
+	if (fn_le32(st->reply.code.status) != 0) {
+		LOG("Notice reading reply: last uint32_t was nonzero: %d\n", st->reply.code.status);
+	}
+	st->pages_acked++;
+	pump(st);
+}
+
+static void fill_command(bootloader_command* cmd, uint32_t seq, uint32_t bytes, uint32_t op, uint32_t addr) {
+	cmd->magic = fn_le32(KINECT_CMD_MAGIC);
+	cmd->seq = fn_le32(seq);
+	cmd->bytes = fn_le32(bytes);
+	cmd->cmd = fn_le32(op);
+	cmd->write_addr = fn_le32(addr);
+	cmd->unk = fn_le32(0);
+}
+
+static int send_command(kusb_io* io, bootloader_command* cmd, unsigned int timeout) {
+	int transferred = 0;
+	int res = kusb_bulk(io, KINECT_EP_OUT, (unsigned char*)cmd, sizeof(*cmd), &transferred, timeout);
+	if (res != 0 || transferred != sizeof(*cmd)) {
+		LOG("Error: res: %d\ttransferred: %d (expected %zu)\n", res, transferred, sizeof(*cmd));
+		return res != 0 ? res : LIBUSB_ERROR_IO;
+	}
+	return 0;
+}
+
+static int read_status(kusb_io* io, uint32_t seq, unsigned int timeout) {
+	union {
+		status_code buffer;
+		unsigned char dump[KFW_REPLY_BUF];
+	} reply;
+	int transferred = 0;
+	int res = kusb_bulk(io, KINECT_EP_IN, reply.dump, KFW_REPLY_BUF, &transferred, timeout);
+	if (res != 0 || transferred != sizeof(status_code)) {
+		LOG("Error reading reply: %d\ttransferred: %d (expected %zu)\n", res, transferred, sizeof(status_code));
+		return res != 0 ? res : LIBUSB_ERROR_IO;
+	}
+	if (fn_le32(reply.buffer.magic) != KINECT_REPLY_MAGIC) {
+		LOG("Error reading reply: invalid magic %08X\n", reply.buffer.magic);
+		return LIBUSB_ERROR_IO;
+	}
+	if (fn_le32(reply.buffer.seq) != seq) {
+		LOG("Error reading reply: non-matching sequence number %08X (expected %08X)\n", reply.buffer.seq, seq);
+		return LIBUSB_ERROR_IO;
+	}
+	if (fn_le32(reply.buffer.status) != 0) {
+		LOG("Notice reading reply: last uint32_t was nonzero: %d\n", reply.buffer.status);
+	}
+	return 0;
+}
+
+static int upload_pages(upload_state* st) {
+	pump(st);
+	while (!st->error && st->pages_acked < st->num_pages) {
+		int res = kusb_handle_events(st->io, 1000);
+		if (res != 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+			st->error = res;
+		}
+	}
+
+	if (st->error) {
+		for (int i = 0; i < st->params.chunks_in_flight; i++) {
+			if (st->slots[i].busy) {
+				kusb_cancel(st->io, &st->slots[i].xfer);
+			}
+		}
+		if (st->reply_busy) {
+			kusb_cancel(st->io, &st->reply_xfer);
+		}
+		for (int tries = 0; (st->out_busy > 0 || st->reply_busy) && tries < 50; tries++) {
+			kusb_handle_events(st->io, 100);
+		}
+	}
+	return st->error;
+}
+
+int kinect_fw_upload_source(kusb_io* io, kinect_fw_source* src,
+	const kinect_fw_upload_params* params, kinect_fw_upload_stats* stats) {
+	kinect_fw_upload_stats local_stats;
+	if (stats == NULL) {
+		stats = &local_stats;
+	}
+	memset(stats, 0, sizeof(*stats));
+
+	upload_state* st = (upload_state*)calloc(1, sizeof(upload_state));
+	if (st == NULL) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	if (params != NULL) {
+		st->params = *params;
+	} else {
+		kinect_fw_upload_default_params(&st->params);
+	}
+	if (st->params.chunks_in_flight < 1) st->params.chunks_in_flight = 1;
+	if (st->params.chunks_in_flight > KFW_MAX_CHUNKS) st->params.chunks_in_flight = KFW_MAX_CHUNKS;
+	if (st->params.pages_in_flight < 1) st->params.pages_in_flight = 1;
+	stats->packet_size = kusb_max_packet_size(io, KINECT_EP_OUT);
+	if (stats->packet_size <= 0) {
+		stats->packet_size = 512;
+	}
+	if (st->params.chunk_size == KINECT_FW_CHUNK_PAGE || st->params.chunk_size > KINECT_FW_PAGE_SIZE) {
+		st->params.chunk_size = KINECT_FW_PAGE_SIZE;
+	} else if (st->params.chunk_size < 1) {
+		st->params.chunk_size = stats->packet_size;
+	}
+	st->probing = st->params.packet_fallback && st->params.chunk_size > stats->packet_size;
+	// a streamed source only keeps window_pages pages around
+	if (src->window_pages > 0 && st->params.pages_in_flight > src->window_pages - 1) {
+		st->params.pages_in_flight = src->window_pages > 1 ? src->window_pages - 1 : 1;
+	}
+
+	uint64_t start = kusb_now_us();
+	unsigned int timeout = st->params.timeout;
+	int res = 0;
+	uint32_t seq = 1;
+	bootloader_command cmd;
+
+	// The reply to the info request doesn't have the usual magic bytes at the
+	// beginning and is 96 bytes long, followed by a regular status.
+	fill_command(&cmd, seq, KINECT_FW_INFO_REPLY_SIZE, KINECT_BL_CMD_INFO, 0x15);
+	res = send_command(io, &cmd, timeout);
+	if (res == 0) {
+		unsigned char info[KFW_REPLY_BUF];
+		int transferred = 0;
+		res = kusb_bulk(io, KINECT_EP_IN, info, KFW_REPLY_BUF, &transferred, timeout);
+		if (res != 0) {
+			LOG("Error reading first reply: %d\ttransferred: %d (expected %d)\n", res, transferred, KINECT_FW_INFO_REPLY_SIZE);
+		}
+	}
+	if (res == 0) {
+		res = read_status(io, seq, timeout);
+	}
+	seq++;
+
+	if (res == 0) {
+		st->io = io;
+		st->stats = stats;
+		st->src = src;
+		st->num_pages = kinect_fw_source_pages(src);
+		st->first_seq = seq;
+		st->next_offset = -1;
+		kinect_sha256_init(&st->sha);
+		st->headers = (bootloader_command*)calloc(st->num_pages + 1, sizeof(bootloader_command));
+		if (st->headers == NULL) {
+			res = LIBUSB_ERROR_NO_MEM;
+		} else {
+			for (int i = 0; i < st->num_pages; i++) {
+				fill_command(&st->headers[i], seq + i, kinect_fw_source_page_length(st->src, i), KINECT_BL_CMD_WRITE,
+					KINECT_FW_LOAD_ADDR + i * KINECT_FW_PAGE_SIZE);
+			}
+			res = upload_pages(st);
+			seq += st->num_pages;
+		}
+	}
+
+	if (res == 0) {
+		kinect_sha256_final(&st->sha, stats->sha256);
+		stats->image = kinect_fw_find_image(stats->sha256, src->size);
+		if (stats->image == NULL && st->params.verify) {
+			LOG("kinect_fw_upload(): not a known firmware image, not executing it\n");
+			res = KINECT_FW_ERROR_UNKNOWN_IMAGE;
+		}
+	}
+
+	if (res == 0) {
+		fill_command(&cmd, seq, 0, KINECT_BL_CMD_EXECUTE, KINECT_FW_ENTRY_ADDR);
+		res = send_command(io, &cmd, timeout);
+		if (res == 0) {
+			res = read_status(io, seq, timeout);
+		}
+		seq++;
+	}
+	// Now the device reenumerates.
+
+	stats->pages = st->pages_acked;
+	stats->chunk_size = st->params.chunk_size;
+	stats->bytes = src->size;
+	stats->duration_us = kusb_now_us() - start;
+
+	free(st->headers);
+	free(st);
+	return res;
+}
+
+void kinect_fw_print_upload_stats(const char* who, const kinect_fw_upload_stats* stats, int res) {
+	double seconds = stats->duration_us / 1000000.0;
+	LOG("%s: %d bytes in %d pages, %.1f ms, %.2f MB/s, %d transfers (%d byte writes, %d byte packets%s), %d stalls, res %d\n",
+		who, stats->bytes, stats->pages, stats->duration_us / 1000.0,
+		seconds > 0 ? stats->bytes / seconds / (1024.0 * 1024.0) : 0.0,
+		stats->out_transfers + stats->in_transfers, stats->chunk_size, stats->packet_size,
+		stats->fallbacks ? ", fell back" : "", stats->stalls, res);
+	if (stats->pages > 0 && stats->pages == (stats->bytes + KINECT_FW_PAGE_SIZE - 1) / KINECT_FW_PAGE_SIZE) {
+		char hex[2 * KINECT_SHA256_SIZE + 1];
+		kinect_sha256_hex(stats->sha256, hex);
+		LOG("%s: sha256 %s, %s, hashed in %.2f ms\n", who, hex,
+			stats->image != NULL ? stats->image->description : "unknown image", stats->hash_us / 1000.0);
+	}
+}
+
+int kinect_fw_upload(kusb_io* io, const unsigned char* data, int size,
+	const kinect_fw_upload_params* params, kinect_fw_upload_stats* stats) {
+	kinect_fw_source* src = kinect_fw_source_open_memory(data, size);
+	if (src == NULL) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	int res = kinect_fw_upload_source(io, src, params, stats);
+	kinect_fw_source_close(src);
+	return res;
+}
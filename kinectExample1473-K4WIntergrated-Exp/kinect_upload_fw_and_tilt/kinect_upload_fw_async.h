@@ -0,0 +1,71 @@
+//
+//  kinect_upload_fw_async.h
+//  kinectExample
+//
+//  Pipelined firmware upload for the audio/motor bootloader. Page headers and
+//  payload chunks are queued as asynchronous transfers so the next page is
+//  already on the wire while the device acknowledges the current one.
+//
+
+#ifndef __kinectExample__kinect_upload_fw_async__
+#define __kinectExample__kinect_upload_fw_async__
+
+#include "kinect_usb_io.h"
+#include "kinect_protocol.h"
+#include "kinect_fw_source.h"
+#include "kinect_fw_images.h"
+
+// returned when verify is on and the image isn't in kinect_fw_images
+#define KINECT_FW_ERROR_UNKNOWN_IMAGE LIBUSB_ERROR_NOT_SUPPORTED
+
+// chunk_size values besides a byte count
+#define KINECT_FW_CHUNK_PAGE    0  // the whole page in one transfer, the host splits it into packets
+#define KINECT_FW_CHUNK_PACKET  -1 // wMaxPacketSize of the OUT endpoint
+
+typedef struct {
+	int pages_in_flight;    // pages sent ahead of their status reply, 1 = lock-step
+	int chunks_in_flight;   // OUT transfers queued on the endpoint at once
+	int chunk_size;         // payload bytes per OUT transfer, or one of the above
+	// drop to packet sized writes when a larger one fails with anything but a
+	// stall, for devices that can't take a page at once
+	int packet_fallback;
+	int max_stall_retries;  // resends after LIBUSB_ERROR_PIPE in a row before giving up
+	// don't send the execute command for an image missing from kinect_fw_images
+	int verify;
+	unsigned int timeout;   // per transfer, ms (0 waits forever)
+} kinect_fw_upload_params;
+
+typedef struct {
+	int pages;
+	int bytes;
+	int out_transfers;
+	int in_transfers;
+	int stalls;
+	int packet_size;        // wMaxPacketSize of the OUT endpoint
+	int chunk_size;         // payload bytes per OUT transfer at the end
+	int fallbacks;          // switched to packet sized writes
+	uint64_t duration_us;
+	// of the pages sent, hashed while they were on the wire
+	unsigned char sha256[KINECT_SHA256_SIZE];
+	const kinect_fw_image* image; // NULL if not a known image
+	uint64_t hash_us;       // CPU time that took
+} kinect_fw_upload_stats;
+
+void kinect_fw_upload_default_params(kinect_fw_upload_params* params);
+
+// Runs the whole bootloader exchange on io: info request, page writes and the
+// final execute command. params and stats may be NULL. Returns 0 or a
+// libusb_error code. The device re-enumerates after a successful upload.
+int kinect_fw_upload_source(kusb_io* io, kinect_fw_source* src,
+	const kinect_fw_upload_params* params, kinect_fw_upload_stats* stats);
+
+// Upload report, prefixed with who: throughput, transfers submitted (a
+// syscall each) and how the pages were split, then the image hash and
+// whether it is a known one.
+void kinect_fw_print_upload_stats(const char* who, const kinect_fw_upload_stats* stats, int res);
+
+// Same for an image in memory.
+int kinect_fw_upload(kusb_io* io, const unsigned char* data, int size,
+	const kinect_fw_upload_params* params, kinect_fw_upload_stats* stats);
+
+#endif /* defined(__kinectExample__kinect_upload_fw_async__) */
@@ -34,245 +34,192 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <libusb.h>
 
 #include "fwbin.h"
-
-static libusb_device_handle *dev;
-static unsigned int seq;
-FILE* fw;
-
-typedef struct {
-	uint32_t magic;
-	uint32_t seq;
-	uint32_t bytes;
-	uint32_t cmd;
-	uint32_t write_addr;
-	uint32_t unk;
-} bootloader_command;
-
-typedef struct {
-	uint32_t magic;
-	uint32_t seq;
-	uint32_t status;
-} status_code;
+#include "kinect_upload_fw.h"
+#include "kinect_upload_fw_async.h"
+#include "kinect_fw_probe.h"
+#include "kinect_fw_wait.h"
+#include "kinect_usb_runtime.h"
 
 #define LOG(...) printf(__VA_ARGS__)
-#define fn_le32(x) (x)
 
+#define KINECT_FW_READY_TIMEOUT 10000 // ms for the device to come back after execute
 
-static void dump_bl_cmd(bootloader_command cmd) {
-	int i;
-	for (i = 0; i < 24; i++)
-		LOG("%02X ", ((unsigned char*)(&cmd))[i]);
-	LOG("\n");
-}
+static int upload(bool b1473, bool if_needed, bool wait_ready) {
+	int res = 0;
+	kinect_fw_wait* wait = NULL;
 
-static int get_first_reply(void) {
-	unsigned char buffer[512];
-	int res;
-	int transferred = 0;
-	res = libusb_bulk_transfer(dev, 0x81, buffer, 512, &transferred, 0);
-	if (res != 0 ) {
-		LOG("Error reading first reply: %d\ttransferred: %d (expected %d)\n", res, transferred, 0x60);
-		return res;
+	// the packed image is decoded a page ahead of the upload rather than
+	// unpacked whole first
+	kinect_fw_source* src = b1473 ? getFWSource1473() : kinect_fw_source_open_memory(NULL, 0);
+	if (src == NULL) {
+		return -ENOMEM;
 	}
-	LOG("Reading first reply: ");
-	int i;
-	for (i = 0; i < transferred; ++i) {
-		LOG("%02X ", buffer[i]);
+	unsigned char digest[KINECT_SHA256_SIZE];
+	if (b1473) {
+		memcpy(digest, getFWDigest1473(), KINECT_SHA256_SIZE);
+	} else if (kinect_fw_digest(src, digest) != 0) {
+		kinect_fw_source_close(src);
+		return LIBUSB_ERROR_IO;
 	}
-	LOG("\n");
-	return res;
-}
-
-static int get_reply(void) {
-	union {
-		status_code buffer;
-		/* The following is needed because libusb_bulk_transfer might
-		 * fail when working on a buffer smaller than 512 bytes.
-		 */
-		unsigned char dump[512];
-	} reply;
-	int res;
-	int transferred = 0;
 
-	res = libusb_bulk_transfer(dev, 0x81, reply.dump, 512, &transferred, 0);
-	if (res != 0 || transferred != sizeof(status_code)) {
-		LOG("Error reading reply: %d\ttransferred: %d (expected %zu)\n", res, transferred, sizeof(status_code));
-		return res;
-	}
-	if (fn_le32(reply.buffer.magic) != 0x0a6fe000) {
-		LOG("Error reading reply: invalid magic %08X\n", reply.buffer.magic);
-		return -1;
-	}
-	if (fn_le32(reply.buffer.seq) != seq) {
-		LOG("Error reading reply: non-matching sequence number %08X (expected %08X)\n", reply.buffer.seq, seq);
-		return -1;
-	}
-	if (fn_le32(reply.buffer.status) != 0) {
-		LOG("Notice reading reply: last uint32_t was nonzero: %d\n", reply.buffer.status);
+	// comes with configuration 1 selected and interface 0 claimed
+	libusb_device_handle* dev = kinect_usb_open(KINECT_VID, KINECT_PID_AUDIO);
+	if (dev == NULL) {
+		fprintf(stderr, "Couldn't open device.\n");
+		res = -ENODEV;
+		goto fail_libusb_open;
 	}
 
-	LOG("Reading reply: ");
-	int i;
-	for (i = 0; i < transferred; ++i) {
-		LOG("%02X ", reply.dump[i]);
+	{
+		kinect_fw_probe_result probe;
+		if (kinect_fw_probe_device(dev, &probe) != 0) {
+			probe.state = KINECT_FW_STATE_UNKNOWN;
+		}
+		if (if_needed && !kinect_fw_needs_upload(&probe, digest, "upload_firmware()")) {
+			goto cleanup;
+		}
+
+		if (wait_ready) {
+			// armed before the execute command so the re-enumeration can't be missed
+			wait = kinect_fw_wait_open(probe.serial);
+		}
+
+		int current_configuration = 0;
+		libusb_get_configuration(dev, &current_configuration);
+		if (current_configuration != 1) {
+			res = -ENODEV;
+			goto cleanup;
+		}
+
+		kusb_io* io = kusb_io_open_libusb(kinect_usb_context(), dev);
+		if (io == NULL) {
+			res = -ENOMEM;
+			goto cleanup;
+		}
+
+		kinect_fw_upload_stats stats;
+		res = kinect_fw_upload_source(io, src, NULL, &stats);
+		kusb_io_close(io);
+
+		kinect_fw_print_upload_stats("upload_firmware()", &stats, res);
+		if (res == 0) {
+			if (probe.serial[0] != '\0') {
+				// what actually went out, hashed on the way
+				kinect_fw_cache_store(probe.serial, stats.sha256);
+			}
+			res = 1;
+		}
+		// Now the device reenumerates.
 	}
-	LOG("\n");
 
+cleanup:
+	kinect_usb_close(dev);
+fail_libusb_open:
+	kinect_fw_source_close(src);
+
+	if (wait != NULL) {
+		if (res == 1) {
+			int ready = kinect_fw_wait_ready(wait, KINECT_FW_READY_TIMEOUT);
+			if (ready != 0) {
+				res = ready;
+			}
+		}
+		kinect_fw_wait_close(wait);
+	}
 	return res;
 }
 
 int upload_firmware(bool b1473) {
-    int res = 0;
-    
-    unsigned int numBytesToRead = 0;
-    unsigned int bytesLeft = 0;
-    unsigned char * readPtr = NULL;
-    unsigned int readIndex = 0;
-    {
-    
-            if( b1473 ){
-                readPtr = getFWData1473();
-                numBytesToRead = getFWSize1473();
-                bytesLeft = numBytesToRead;
-            }
-        
-//            char default_filename[] = "../../../data/audiosAlt.bin";
-//            char* filename = default_filename;
-//
-//            fw = fopen(filename, "rb");
-//            if (fw == NULL) {
-//                fprintf(stderr, "Failed to open %s: %s\n", filename, strerror(errno));
-//                return errno;
-//            }
-
-            libusb_init(NULL);
-            libusb_set_debug(NULL, 3);
-
-            dev = libusb_open_device_with_vid_pid(NULL, 0x045e, 0x02ad);
-            if (dev == NULL) {
-                fprintf(stderr, "Couldn't open device.\n");
-                res = -ENODEV;
-                goto fail_libusb_open;
-            }
-
-            int current_configuration = 0;
-            libusb_get_configuration(dev, &current_configuration);
-            if (current_configuration != 1)
-                libusb_set_configuration(dev, 1);
-
-            libusb_claim_interface(dev, 0);
-
-            libusb_get_configuration(dev, &current_configuration);
-            if (current_configuration != 1) {
-                res = -ENODEV;
-                goto cleanup;
-            }
-
-            seq = 1;
-
-            bootloader_command cmd;
-            cmd.magic = fn_le32(0x06022009);
-            cmd.seq = fn_le32(seq);
-            cmd.bytes = fn_le32(0x60);
-            cmd.cmd = fn_le32(0);
-            cmd.write_addr = fn_le32(0x15);
-            cmd.unk = fn_le32(0);
-
-            LOG("About to send: ");
-            dump_bl_cmd(cmd);
-
-            int transferred = 0;
-
-            res = libusb_bulk_transfer(dev, 1, (unsigned char*)&cmd, sizeof(cmd), &transferred, 0);
-            if (res != 0 || transferred != sizeof(cmd)) {
-                LOG("Error: res: %d\ttransferred: %d (expected %zu)\n", res, transferred, sizeof(cmd));
-                goto cleanup;
-            }
-            res = get_first_reply(); // This first one doesn't have the usual magic bytes at the beginning, and is 96 bytes long - much longer than the usual 12-byte replies.
-            res = get_reply(); // I'm not sure why we do this twice here, but maybe it'll make sense later.
-            seq++;
-
-            // Split addr declaration and assignment in order to compile as C++,
-            // otherwise this would give "jump to label '...' crosses initialization"
-            // errors.
-        
-            uint32_t addr;
-            addr = 0x00080000;
-            unsigned char page[0x4000];
+	int res = upload(b1473, false, false);
+	return res > 0 ? 0 : res;
+}
 
-        
-            int read = 0;
-            do {
-            
-                //read = fread(page, 1, 0x4000, fw);
-                
-                read = bytesLeft < 0x4000 ? bytesLeft : 0x4000;                
-                if (read <= 0) {
-                    break;
-                }
-                
-                bytesLeft -= read;
+int upload_firmware_if_needed(bool b1473) {
+	return upload(b1473, true, true);
+}
 
-                printf("index is %i, read is %i, bytes left is %i - numBytes is %i\n", readIndex, read, bytesLeft, numBytesToRead );
+//------------------------------------------------------------------------------
+// the same on a thread of its own
+
+struct kinect_fw_task {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool b1473;
+	kinect_fw_ready_cb callback;
+	void* user_data;
+	int done;
+	int result;
+};
+
+static void* task_thread(void* arg) {
+	kinect_fw_task* task = (kinect_fw_task*)arg;
+	int res = upload(task->b1473, true, true);
+	if (task->callback != NULL) {
+		task->callback(res, task->user_data);
+	}
+	pthread_mutex_lock(&task->lock);
+	task->result = res;
+	task->done = 1;
+	pthread_cond_broadcast(&task->cond);
+	pthread_mutex_unlock(&task->lock);
+	return NULL;
+}
 
-                memcpy(page, &readPtr[readIndex], read);
-                readIndex += read;
-                
-                //LOG("");
-                cmd.seq = fn_le32(seq);
-                cmd.bytes = fn_le32(read);
-                cmd.cmd = fn_le32(0x03);
-                cmd.write_addr = fn_le32(addr);
-                LOG("About to send: ");
-                dump_bl_cmd(cmd);
-                // Send it off!
-                transferred = 0;
-                res = libusb_bulk_transfer(dev, 1, (unsigned char*)&cmd, sizeof(cmd), &transferred, 0);
-                if (res != 0 || transferred != sizeof(cmd)) {
-                    LOG("Error: res: %d\ttransferred: %d (expected %zu)\n", res, transferred, sizeof(cmd));
-                    goto cleanup;
-                }
-                int bytes_sent = 0;
-                while (bytes_sent < read) {
-                    int to_send = (read - bytes_sent > 512 ? 512 : read - bytes_sent);
-                    transferred = 0;
-                    res = libusb_bulk_transfer(dev, 1, &page[bytes_sent], to_send, &transferred, 0);
-                    if (res != 0 || transferred != to_send) {
-                        LOG("Error: res: %d\ttransferred: %d (expected %d)\n", res, transferred, to_send);
-                        goto cleanup;
-                    }
-                    bytes_sent += to_send;
-                }
-                res = get_reply();
+kinect_fw_task* upload_firmware_async(bool b1473, kinect_fw_ready_cb callback, void* user_data) {
+	kinect_fw_task* task = (kinect_fw_task*)calloc(1, sizeof(kinect_fw_task));
+	if (task == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&task->lock, NULL);
+	pthread_cond_init(&task->cond, NULL);
+	task->b1473 = b1473;
+	task->callback = callback;
+	task->user_data = user_data;
+	if (pthread_create(&task->thread, NULL, task_thread, task) != 0) {
+		pthread_cond_destroy(&task->cond);
+		pthread_mutex_destroy(&task->lock);
+		free(task);
+		return NULL;
+	}
+	return task;
+}
 
-                addr += (uint32_t)read;
-                seq++;
-            } while (read > 0);
+int kinect_fw_task_wait(kinect_fw_task* task, unsigned int timeout_ms) {
+	// pthread_cond_timedwait wants wall clock time
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	uint64_t until_us = (uint64_t)now.tv_sec * 1000000 + now.tv_usec + (uint64_t)timeout_ms * 1000;
+	struct timespec until;
+	until.tv_sec = (time_t)(until_us / 1000000);
+	until.tv_nsec = (long)(until_us % 1000000) * 1000;
+
+	pthread_mutex_lock(&task->lock);
+	while (!task->done) {
+		if (timeout_ms == 0) {
+			pthread_cond_wait(&task->cond, &task->lock);
+		} else if (pthread_cond_timedwait(&task->cond, &task->lock, &until) == ETIMEDOUT) {
+			break;
+		}
+	}
+	int res = task->done ? task->result : LIBUSB_ERROR_TIMEOUT;
+	pthread_mutex_unlock(&task->lock);
+	return res;
+}
 
-            cmd.seq = fn_le32(seq);
-            cmd.bytes = fn_le32(0);
-            cmd.cmd = fn_le32(0x04);
-            cmd.write_addr = fn_le32(0x00080030);
-            dump_bl_cmd(cmd);
-            transferred = 0;
-            res = libusb_bulk_transfer(dev, 1, (unsigned char*)&cmd, sizeof(cmd), &transferred, 0);
-            if (res != 0 || transferred != sizeof(cmd)) {
-                LOG("Error: res: %d\ttransferred: %d (expected %zu)\n", res, transferred, sizeof(cmd));
-                goto cleanup;
-            }
-            res = get_reply();
-            seq++;
-            // Now the device reenumerates.
-    
-    }
-    
-cleanup:
-	libusb_close(dev);
-fail_libusb_open:
-	libusb_exit(NULL);
-//	fclose(fw);
+int kinect_fw_task_free(kinect_fw_task* task) {
+	if (task == NULL) {
+		return 0;
+	}
+	pthread_join(task->thread, NULL);
+	int res = task->result;
+	pthread_cond_destroy(&task->cond);
+	pthread_mutex_destroy(&task->lock);
+	free(task);
 	return res;
 }
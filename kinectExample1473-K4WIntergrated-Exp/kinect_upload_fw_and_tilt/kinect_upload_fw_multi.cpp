@@ -0,0 +1,234 @@
+//
+//  kinect_upload_fw_multi.cpp
+//  kinectExample
+//
+
+#include "kinect_upload_fw_multi.h"
+#include "kinect_upload_fw.h"
+#include "fwbin.h"
+#include "kinect_usb_runtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define LOG(...) printf(__VA_ARGS__)
+
+typedef struct {
+	kinect_fw_job* job;
+	const unsigned char* data;
+	int size;
+	const unsigned char* digest;
+	const kinect_fw_upload_params* params;
+} worker_args;
+
+static void* upload_worker(void* arg) {
+	worker_args* w = (worker_args*)arg;
+	kinect_fw_job* job = w->job;
+
+	uint64_t start = kusb_now_us();
+	kusb_io* io = job->open(job);
+	if (io == NULL) {
+		job->result = LIBUSB_ERROR_NO_DEVICE;
+		job->duration_us = kusb_now_us() - start;
+		return NULL;
+	}
+
+	if (w->digest != NULL && job->probe != NULL) {
+		kinect_fw_probe_result probe;
+		if (job->probe(job, &probe) != 0) {
+			probe.state = KINECT_FW_STATE_UNKNOWN;
+			probe.serial[0] = '\0';
+		}
+		strncpy(job->serial, probe.serial, sizeof(job->serial) - 1);
+		job->serial[sizeof(job->serial) - 1] = '\0';
+		if (!kinect_fw_needs_upload(&probe, w->digest, "kinect_fw_upload_jobs()")) {
+			job->skipped = 1;
+		}
+	}
+
+	if (!job->skipped) {
+		job->result = kinect_fw_upload(io, w->data, w->size, w->params, &job->stats);
+		if (job->result == 0 && w->digest != NULL && job->serial[0] != '\0') {
+			// what actually went out, hashed on the way
+			kinect_fw_cache_store(job->serial, job->stats.sha256);
+		}
+	}
+	job->close(job, io);
+	job->duration_us = kusb_now_us() - start;
+	return NULL;
+}
+
+int kinect_fw_upload_jobs(kinect_fw_job* jobs, int count, const unsigned char* data, int size,
+	const unsigned char* digest, const kinect_fw_upload_params* params) {
+	if (count > KINECT_FW_MAX_DEVICES) {
+		count = KINECT_FW_MAX_DEVICES;
+	}
+
+	pthread_t threads[KINECT_FW_MAX_DEVICES];
+	worker_args args[KINECT_FW_MAX_DEVICES];
+	int started[KINECT_FW_MAX_DEVICES];
+
+	for (int i = 0; i < count; i++) {
+		memset(&jobs[i].stats, 0, sizeof(jobs[i].stats));
+		jobs[i].result = 0;
+		jobs[i].skipped = 0;
+		jobs[i].serial[0] = '\0';
+		jobs[i].duration_us = 0;
+		args[i].job = &jobs[i];
+		args[i].data = data;
+		args[i].size = size;
+		args[i].digest = digest;
+		args[i].params = params;
+		started[i] = pthread_create(&threads[i], NULL, upload_worker, &args[i]) == 0;
+		if (!started[i]) {
+			LOG("kinect_fw_upload_jobs(): can't start worker for %03d:%03d, flashing inline\n", jobs[i].bus, jobs[i].address);
+			upload_worker(&args[i]);
+		}
+	}
+
+	int failed = 0;
+	for (int i = 0; i < count; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+		if (jobs[i].result != 0) {
+			failed++;
+		}
+	}
+	return failed;
+}
+
+//------------------------------------------------------------------------------
+// real devices, found by bus and address
+
+static kusb_io* usb_job_open(kinect_fw_job* job) {
+	libusb_context* ctx = kinect_usb_context();
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	libusb_device_handle* dev = NULL;
+	libusb_device** list = NULL;
+	ssize_t n = libusb_get_device_list(ctx, &list);
+	for (ssize_t i = 0; i < n; i++) {
+		if (libusb_get_bus_number(list[i]) == job->bus && libusb_get_device_address(list[i]) == job->address) {
+			dev = kinect_usb_open_device(list[i]);
+			break;
+		}
+	}
+	if (list != NULL) {
+		libusb_free_device_list(list, 1);
+	}
+
+	if (dev == NULL) {
+		LOG("Couldn't open device %03d:%03d.\n", job->bus, job->address);
+		return NULL;
+	}
+
+	kusb_io* io = kusb_io_open_libusb(ctx, dev);
+	if (io == NULL) {
+		kinect_usb_close(dev);
+		return NULL;
+	}
+	job->user_data = dev;
+	return io;
+}
+
+static int usb_job_probe(kinect_fw_job* job, kinect_fw_probe_result* result) {
+	return kinect_fw_probe_device((libusb_device_handle*)job->user_data, result);
+}
+
+static void usb_job_close(kinect_fw_job* job, kusb_io* io) {
+	kusb_io_close(io);
+	kinect_usb_close((libusb_device_handle*)job->user_data);
+	job->user_data = NULL;
+}
+
+int kinect_fw_find_devices(kinect_fw_job* jobs, int max_jobs) {
+	libusb_context* ctx = kinect_usb_context();
+	if (ctx == NULL) {
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	libusb_device** list = NULL;
+	ssize_t n = libusb_get_device_list(ctx, &list);
+	int found = 0;
+	for (ssize_t i = 0; i < n && found < max_jobs; i++) {
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(list[i], &desc) != 0) {
+			continue;
+		}
+		if (desc.idVendor != KINECT_VID || desc.idProduct != KINECT_PID_AUDIO) {
+			continue;
+		}
+		kinect_fw_job* job = &jobs[found++];
+		memset(job, 0, sizeof(*job));
+		job->open = usb_job_open;
+		job->close = usb_job_close;
+		job->probe = usb_job_probe;
+		job->bus = libusb_get_bus_number(list[i]);
+		job->address = libusb_get_device_address(list[i]);
+	}
+	if (list != NULL) {
+		libusb_free_device_list(list, 1);
+	}
+	return n < 0 ? (int)n : found;
+}
+
+void kinect_fw_print_jobs(const kinect_fw_job* jobs, int count, uint64_t wall_us) {
+	uint64_t sum = 0;
+	int flashed = 0;
+	for (int i = 0; i < count; i++) {
+		const kinect_fw_job* job = &jobs[i];
+		if (job->skipped) {
+			LOG("device %03d:%03d: already running the image, total %.1f ms\n",
+				job->bus, job->address, job->duration_us / 1000.0);
+			sum += job->duration_us;
+			continue;
+		}
+		flashed++;
+		LOG("device %03d:%03d: %s, %d bytes, upload %.1f ms, total %.1f ms\n",
+			job->bus, job->address, job->result == 0 ? "ok" : "FAILED",
+			job->stats.bytes, job->stats.duration_us / 1000.0, job->duration_us / 1000.0);
+		sum += job->duration_us;
+	}
+	LOG("%d device(s) flashed in %.1f ms (%.1f ms one after the other)\n", flashed, wall_us / 1000.0, sum / 1000.0);
+}
+
+int upload_firmware_all(bool b1473, int* failed) {
+	if (failed != NULL) {
+		*failed = 0;
+	}
+
+	kinect_fw_job jobs[KINECT_FW_MAX_DEVICES];
+	int count = kinect_fw_find_devices(jobs, KINECT_FW_MAX_DEVICES);
+	if (count <= 0) {
+		fprintf(stderr, "Couldn't find any device.\n");
+		return count < 0 ? count : LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	const unsigned char* data = b1473 ? getFWData1473() : NULL;
+	int size = b1473 ? getFWSize1473() : 0;
+	if (data == NULL) {
+		fprintf(stderr, "upload_firmware_all(): no firmware image to upload\n");
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	uint64_t start = kusb_now_us();
+	int n_failed = kinect_fw_upload_jobs(jobs, count, data, size, getFWDigest1473(), NULL);
+	kinect_fw_print_jobs(jobs, count, kusb_now_us() - start);
+	// Now the flashed devices reenumerate.
+
+	if (failed != NULL) {
+		*failed = n_failed;
+	}
+	for (int i = 0; i < count; i++) {
+		if (jobs[i].result != 0) {
+			return jobs[i].result;
+		}
+	}
+	return 0;
+}
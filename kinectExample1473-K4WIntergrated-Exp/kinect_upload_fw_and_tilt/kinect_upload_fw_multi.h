@@ -0,0 +1,53 @@
+//
+//  kinect_upload_fw_multi.h
+//  kinectExample
+//
+//  Flashes several audio/motor devices at once, one worker thread per device.
+//  The workers share the kinect_usb_runtime context; its event thread reaps
+//  every device's transfers, but each upload's callbacks run on its own
+//  worker, from kusb_handle_events().
+//
+
+#ifndef __kinectExample__kinect_upload_fw_multi__
+#define __kinectExample__kinect_upload_fw_multi__
+
+#include "kinect_upload_fw_async.h"
+#include "kinect_fw_probe.h"
+
+#define KINECT_FW_MAX_DEVICES 16
+
+typedef struct kinect_fw_job kinect_fw_job;
+
+struct kinect_fw_job {
+	// how the worker gets at its device
+	kusb_io* (*open)(kinect_fw_job* job);
+	void (*close)(kinect_fw_job* job, kusb_io* io);
+	// asks an opened device what it runs, NULL if it can't be asked
+	int (*probe)(kinect_fw_job* job, kinect_fw_probe_result* result);
+	void* user_data;
+
+	uint8_t bus;
+	uint8_t address;
+
+	// filled in by the worker
+	int result;
+	int skipped;          // already running the image, left alone
+	char serial[64];      // from the probe, empty if there was none
+	uint64_t duration_us; // open to close, including libusb setup
+	kinect_fw_upload_stats stats;
+};
+
+// Runs every job on its own thread and waits for all of them. With digest
+// set (the SHA-256 of data), jobs that can be probed are skipped when
+// kinect_fw_needs_upload() says so, and successful uploads to devices with
+// a serial go into the firmware cache. Returns the number of jobs that failed.
+int kinect_fw_upload_jobs(kinect_fw_job* jobs, int count, const unsigned char* data, int size,
+	const unsigned char* digest, const kinect_fw_upload_params* params);
+
+// Fills jobs with every 045e:02ad device on the bus. Returns how many were
+// found or a libusb_error code.
+int kinect_fw_find_devices(kinect_fw_job* jobs, int max_jobs);
+
+void kinect_fw_print_jobs(const kinect_fw_job* jobs, int count, uint64_t wall_us);
+
+#endif /* defined(__kinectExample__kinect_upload_fw_multi__) */
@@ -0,0 +1,1587 @@
+//
+//  kinect_usb_bench.cpp
+//  kinectExample
+//
+
+#include "kinect_usb_bench.h"
+
+#ifdef RUN_USB_BENCHMARKS
+
+#include "kinect_usb_sim.h"
+#include "kinect_upload_fw.h"
+#include "kinect_upload_fw_async.h"
+#include "kinect_upload_fw_multi.h"
+#include "k4w_tilt_led.h"
+#include "Simple1473KeepAlive.h"
+#include "kinect_fw_probe.h"
+#include "kinect_trace.h"
+#include "kinect_capture.h"
+#include "kinect_usb_replay.h"
+#include "kinect_motor.h"
+#include "kinect_motor_pipe.h"
+#include "kinect_keepalive.h"
+#include "kinect_orientation.h"
+#include "kinect_device.h"
+#include "kinect_fw_wait.h"
+#include "kinect_usb_runtime.h"
+#include "kinect_usb_usbfs.h"
+#include "kinect_reactor.h"
+#include "fwbin.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#define LOG(...) printf(__VA_ARGS__)
+
+// The fixture of every benchmark that doesn't upload: the simulator's
+// defaults with the application firmware running. Tweak before
+// kinect_sim_open().
+static void app_sim_params(kinect_sim_params* params) {
+	kinect_sim_default_params(params);
+	params->mode = KINECT_SIM_APPLICATION;
+}
+
+static double to_mb_per_sec(int bytes, uint64_t us) {
+	if (us == 0) {
+		return 0.0;
+	}
+	return bytes / (us / 1000000.0) / (1024.0 * 1024.0);
+}
+
+static int bench_upload(const char* label, const kinect_fw_upload_params* params,
+	const kinect_sim_params* sim_params, int iterations) {
+	uint64_t best = 0;
+	uint64_t total = 0;
+	int transfers = 0;
+	int stalls = 0;
+	int fallbacks = 0;
+	int bytes = getFWSize1473();
+
+	for (int i = 0; i < iterations; i++) {
+		kusb_io* io = kinect_sim_open(sim_params);
+		kinect_fw_upload_stats stats;
+		int res = kinect_fw_upload(io, getFWData1473(), bytes, params, &stats);
+
+		kinect_sim_stats sim;
+		kinect_sim_get_stats(io, &sim);
+		kusb_io_close(io);
+
+		if (res != 0 || !sim.executed || sim.bytes_written != bytes) {
+			LOG("bench %s: upload failed: %d (wrote %d of %d bytes)\n", label, res, sim.bytes_written, bytes);
+			return -1;
+		}
+		if (sim.halts_cleared != sim.halts) {
+			LOG("bench %s: endpoint halted %d times, cleared %d\n", label, sim.halts, sim.halts_cleared);
+			return -1;
+		}
+		if (best == 0 || stats.duration_us < best) {
+			best = stats.duration_us;
+		}
+		total += stats.duration_us;
+		transfers = stats.out_transfers + stats.in_transfers;
+		stalls = sim.stalls;
+		fallbacks = stats.fallbacks;
+	}
+
+	LOG("bench upload %-12s %8.2f ms avg %8.2f ms best %7.2f MB/s %5d transfers %3d stalls%s\n",
+		label, total / 1000.0 / iterations, best / 1000.0, to_mb_per_sec(bytes, best), transfers, stalls,
+		fallbacks ? " (fell back to packets)" : "");
+	return 0;
+}
+
+// upload_main_io() maps the file, "streamed" goes through a 4 page window
+static int bench_upload_file(const char* path, bool streamed) {
+	kusb_io* io = kinect_sim_open(NULL);
+	uint64_t start = kusb_now_us();
+	int res;
+	if (streamed) {
+		kinect_fw_source* src = kinect_fw_source_open_stream(path, 4);
+		res = src != NULL ? kinect_fw_upload_source(io, src, NULL, NULL) : -1;
+		kinect_fw_source_close(src);
+	} else {
+		res = upload_main_io(io, path);
+	}
+	uint64_t took = kusb_now_us() - start;
+
+	kinect_sim_stats sim;
+	kinect_sim_get_stats(io, &sim);
+	kusb_io_close(io);
+
+	const char* label = streamed ? "streamed" : "upload_main";
+	if (res != 0 || !sim.executed || sim.bytes_written != getFWSize1473()) {
+		LOG("bench upload %s: upload failed: %d\n", label, res);
+		return -1;
+	}
+	LOG("bench upload %-12s %8.2f ms best %7.2f MB/s\n", label, took / 1000.0,
+		to_mb_per_sec(getFWSize1473(), took));
+	return 0;
+}
+
+// upload_firmware(true): fwbin_packed.cpp decoded a page ahead of the upload
+static int bench_upload_packed(int iterations) {
+	uint64_t best = 0;
+	for (int i = 0; i < iterations; i++) {
+		kusb_io* io = kinect_sim_open(NULL);
+		kinect_fw_source* src = getFWSource1473();
+		kinect_fw_upload_stats stats;
+		int res = src != NULL ? kinect_fw_upload_source(io, src, NULL, &stats) : -1;
+		kinect_fw_source_close(src);
+
+		kinect_sim_stats sim;
+		kinect_sim_get_stats(io, &sim);
+		kusb_io_close(io);
+
+		if (res != 0 || !sim.executed || sim.bytes_written != getFWSize1473()) {
+			LOG("bench upload packed: upload failed: %d\n", res);
+			return -1;
+		}
+		if (best == 0 || stats.duration_us < best) {
+			best = stats.duration_us;
+		}
+	}
+	LOG("bench upload %-12s %8.2f ms best %7.2f MB/s\n", "packed", best / 1000.0,
+		to_mb_per_sec(getFWSize1473(), best));
+	return 0;
+}
+
+// Hash time next to the upload it overlapped, and an image with one byte
+// changed, which has to be written but never executed.
+static int bench_upload_verify() {
+	int size = getFWSize1473();
+	kusb_io* io = kinect_sim_open(NULL);
+	kinect_fw_upload_stats stats;
+	int res = kinect_fw_upload(io, getFWData1473(), size, NULL, &stats);
+	kusb_io_close(io);
+	if (res != 0 || stats.image == NULL) {
+		LOG("bench upload verify: embedded image not recognised: %d\n", res);
+		return -1;
+	}
+
+	unsigned char* modified = (unsigned char*)malloc(size);
+	if (modified == NULL) {
+		return -1;
+	}
+	memcpy(modified, getFWData1473(), size);
+	modified[size / 2] ^= 0x01;
+	io = kinect_sim_open(NULL);
+	kinect_fw_upload_stats rejected;
+	res = kinect_fw_upload(io, modified, size, NULL, &rejected);
+	kinect_sim_stats sim;
+	kinect_sim_get_stats(io, &sim);
+	kusb_io_close(io);
+	free(modified);
+	if (res != KINECT_FW_ERROR_UNKNOWN_IMAGE || sim.executed) {
+		LOG("bench upload verify: modified image wasn't refused: %d (executed %d)\n", res, sim.executed);
+		return -1;
+	}
+
+	LOG("bench upload %-12s %8.2f ms %8.2f ms hashing, modified image refused\n", "verify",
+		stats.duration_us / 1000.0, stats.hash_us / 1000.0);
+	return 0;
+}
+
+static int bench_upload_files() {
+	char path[] = "/tmp/kinect_bench_fw.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		LOG("bench upload file: can't create temp file\n");
+		return -1;
+	}
+	FILE* f = fdopen(fd, "wb");
+	fwrite(getFWData1473(), 1, getFWSize1473(), f);
+	fclose(f);
+
+	int res = bench_upload_file(path, false);
+	if (res == 0) {
+		res = bench_upload_file(path, true);
+	}
+	unlink(path);
+	return res;
+}
+
+int run_upload_benchmark(int iterations) {
+	if (iterations < 1) {
+		iterations = 1;
+	}
+	LOG("bench: uploading %d bytes to the simulated bootloader, %d iterations\n", getFWSize1473(), iterations);
+
+	kinect_sim_params sim;
+	kinect_sim_default_params(&sim);
+
+	kinect_fw_upload_params lockstep;
+	kinect_fw_upload_default_params(&lockstep);
+	lockstep.pages_in_flight = 1;
+	lockstep.chunks_in_flight = 1;
+	lockstep.chunk_size = 512;
+
+	kinect_fw_upload_params pipelined;
+	kinect_fw_upload_default_params(&pipelined);
+
+	kinect_sim_params stalling = sim;
+	stalling.stall_every = 13;
+
+	if (bench_upload("lockstep", &lockstep, &sim, iterations) != 0
+		|| bench_upload("pipelined", &pipelined, &sim, iterations) != 0
+		|| bench_upload("stalls", &pipelined, &stalling, iterations) != 0
+		|| bench_upload_packed(iterations) != 0
+		|| bench_upload_verify() != 0) {
+		return -1;
+	}
+	return bench_upload_files();
+}
+
+int run_transfer_size_benchmark(int iterations) {
+	if (iterations < 1) {
+		iterations = 1;
+	}
+	kinect_sim_params sim;
+	kinect_sim_default_params(&sim);
+
+	// every transfer is a submission (an ioctl on Linux, an IOKit call on OS X)
+	kinect_fw_upload_params bytes512;
+	kinect_fw_upload_default_params(&bytes512);
+	bytes512.chunk_size = 512;
+
+	kinect_fw_upload_params packet;
+	kinect_fw_upload_default_params(&packet);
+	packet.chunk_size = KINECT_FW_CHUNK_PACKET;
+
+	kinect_fw_upload_params page;
+	kinect_fw_upload_default_params(&page);
+
+	kinect_sim_params small_only = sim;
+	small_only.max_transfer_size = sim.max_packet_size;
+
+	if (bench_upload("512 bytes", &bytes512, &sim, iterations) != 0
+		|| bench_upload("packet", &packet, &sim, iterations) != 0
+		|| bench_upload("page", &page, &sim, iterations) != 0
+		|| bench_upload("page, small", &page, &small_only, iterations) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static kusb_io* sim_job_open(kinect_fw_job* job) {
+	(void)job;
+	return kinect_sim_open(NULL);
+}
+
+static void sim_job_close(kinect_fw_job* job, kusb_io* io) {
+	(void)job;
+	kusb_io_close(io);
+}
+
+int run_fleet_benchmark(int devices) {
+	if (devices < 1) devices = 1;
+	if (devices > KINECT_FW_MAX_DEVICES) devices = KINECT_FW_MAX_DEVICES;
+
+	kinect_fw_job jobs[KINECT_FW_MAX_DEVICES];
+	memset(jobs, 0, sizeof(jobs));
+	for (int i = 0; i < devices; i++) {
+		jobs[i].open = sim_job_open;
+		jobs[i].close = sim_job_close;
+		jobs[i].bus = 1;
+		jobs[i].address = i + 2;
+	}
+
+	uint64_t start = kusb_now_us();
+	int failed = kinect_fw_upload_jobs(jobs, devices, getFWData1473(), getFWSize1473(), NULL, NULL);
+	uint64_t wall = kusb_now_us() - start;
+
+	uint64_t slowest = 0;
+	uint64_t sum = 0;
+	for (int i = 0; i < devices; i++) {
+		sum += jobs[i].duration_us;
+		if (jobs[i].duration_us > slowest) slowest = jobs[i].duration_us;
+	}
+	if (failed) {
+		LOG("bench fleet: %d of %d uploads failed\n", failed, devices);
+		return -1;
+	}
+	LOG("bench fleet %-13d %8.2f ms wall %8.2f ms slowest %8.2f ms summed\n",
+		devices, wall / 1000.0, slowest / 1000.0, sum / 1000.0);
+	return 0;
+}
+
+static void report_latency(const char* label, uint64_t total, uint64_t best, uint64_t worst, int count) {
+	LOG("bench command %-11s %8.1f us avg %8.1f us min %8.1f us max %6d calls\n",
+		label, (double)total / count, (double)best, (double)worst, count);
+}
+
+int run_command_latency_benchmark(int commands) {
+	if (commands < 1) {
+		commands = 1;
+	}
+	kinect_sim_params params;
+	app_sim_params(&params);
+
+	kusb_io* io = kinect_sim_open(&params);
+	int res = 0;
+
+	uint64_t total = 0, best = 0, worst = 0;
+	for (int i = 0; i < commands && res == 0; i++) {
+		uint64_t start = kusb_now_us();
+		res = set_led(io, (i & 1) ? LED_SOLID_GREEN : LED_SOLID_RED);
+		uint64_t took = kusb_now_us() - start;
+		total += took;
+		if (best == 0 || took < best) best = took;
+		if (took > worst) worst = took;
+	}
+	if (res == 0) {
+		report_latency("set_led", total, best, worst, commands);
+	}
+
+	total = best = worst = 0;
+	for (int i = 0; i < commands && res == 0; i++) {
+		uint64_t start = kusb_now_us();
+		res = keepAlive1473(io);
+		uint64_t took = kusb_now_us() - start;
+		total += took;
+		if (best == 0 || took < best) best = took;
+		if (took > worst) worst = took;
+	}
+	if (res == 0) {
+		report_latency("keepalive", total, best, worst, commands);
+	}
+
+	// through the motor session: what the caller waits for to queue a
+	// command, and the round trip until the worker has sent it
+	kinect_motor* motor = res == 0 ? kinect_motor_open_io(io) : NULL;
+	if (motor != NULL) {
+		uint64_t queued = 0, queued_best = 0, queued_worst = 0;
+		total = best = worst = 0;
+		for (int i = 0; i < commands && res == 0; i++) {
+			uint64_t start = kusb_now_us();
+			kinect_motor_set_led(motor, (i & 1) ? KINECT_LED_SOLID_GREEN : KINECT_LED_SOLID_RED);
+			uint64_t took = kusb_now_us() - start;
+			queued += took;
+			if (queued_best == 0 || took < queued_best) queued_best = took;
+			if (took > queued_worst) queued_worst = took;
+			res = kinect_motor_sync(motor, 1000);
+			took = kusb_now_us() - start;
+			total += took;
+			if (best == 0 || took < best) best = took;
+			if (took > worst) worst = took;
+		}
+		kinect_motor_close(motor);
+		if (res == 0) {
+			report_latency("queue", queued, queued_best, queued_worst, commands);
+			report_latency("motor", total, best, worst, commands);
+		}
+	}
+
+	kusb_io_close(io);
+	if (res != 0) {
+		LOG("bench command: failed: %d\n", res);
+	}
+	return res;
+}
+
+static void count_done(const kinect_motor_result* result, void* user_data) {
+	int* failed = (int*)user_data;
+	if (result->status != 0) {
+		(*failed)++;
+	}
+}
+
+// Status polls with an LED change after every fourth, through a
+// kinect_motor_pipe with in_flight commands on the wire at once.
+static int bench_motor_pipe(int in_flight, int polls) {
+	kinect_sim_params params;
+	app_sim_params(&params);
+
+	kusb_io* io = kinect_sim_open(&params);
+	kinect_motor_pipe* pipe = kinect_motor_pipe_open(io, in_flight, 1000);
+	int failed = 0;
+	int commands = 0;
+	uint64_t start = kusb_now_us();
+	for (int i = 0; i < polls; i++) {
+		kinect_motor_pipe_submit(pipe, KINECT_MOTOR_CMD_STATUS, 0, count_done, &failed);
+		commands++;
+		if (i % 4 == 3) {
+			kinect_motor_pipe_submit(pipe, KINECT_MOTOR_CMD_LED, (i & 4) ? KINECT_LED_SOLID_GREEN : KINECT_LED_SOLID_RED,
+				count_done, &failed);
+			commands++;
+		}
+	}
+	while (kinect_motor_pipe_pending(pipe) > 0) {
+		kinect_motor_pipe_handle_events(pipe, 1000);
+	}
+	uint64_t took = kusb_now_us() - start;
+	kinect_motor_pipe_close(pipe);
+	kusb_io_close(io);
+
+	if (failed != 0) {
+		LOG("bench accel: %d of %d pipelined commands failed\n", failed, commands);
+		return -1;
+	}
+	char label[32];
+	snprintf(label, sizeof(label), "pipe x%d", in_flight);
+	LOG("bench accel %-13s %8.1f Hz %8.1f us per poll %6d polls + %d LED\n",
+		label, polls / (took / 1000000.0), (double)took / polls, polls, commands - polls);
+	return 0;
+}
+
+// kinect_motor_start_sampling() at hz (0 flat out) for duration_ms, drained
+// every 16 ms like a render thread would, with an LED change each frame.
+// Reports the rate, the longest gap between samples and what was dropped.
+static int bench_motor_sampling(unsigned int hz, int duration_ms) {
+	kinect_sim_params params;
+	app_sim_params(&params);
+
+	kusb_io* io = kinect_sim_open(&params);
+	kinect_motor* motor = kinect_motor_open_io(io);
+	if (motor == NULL) {
+		kusb_io_close(io);
+		return -1;
+	}
+	kinect_accel_sample samples[256];
+	int count = 0;
+	uint64_t first = 0, last = 0, worst_gap = 0;
+	kinect_motor_start_sampling(motor, hz);
+	uint64_t start = kusb_now_us();
+	for (int frame = 0; kusb_now_us() - start < (uint64_t)duration_ms * 1000; frame++) {
+		usleep(16000);
+		kinect_motor_set_led(motor, (frame & 1) ? KINECT_LED_SOLID_GREEN : KINECT_LED_SOLID_RED);
+		int n;
+		while ((n = kinect_motor_read_samples(motor, samples, 256)) > 0) {
+			for (int i = 0; i < n; i++) {
+				if (count++ == 0) {
+					first = samples[i].time_us;
+				} else if (samples[i].time_us - last > worst_gap) {
+					worst_gap = samples[i].time_us - last;
+				}
+				last = samples[i].time_us;
+			}
+		}
+	}
+	kinect_motor_stop_sampling(motor);
+	int res = kinect_motor_sync(motor, 1000);
+	uint32_t dropped = kinect_motor_samples_dropped(motor);
+	kinect_motor_close(motor);
+	kusb_io_close(io);
+
+	if (res != 0 || count < 2) {
+		LOG("bench accel: sampling failed: %d (%d samples)\n", res, count);
+		return res != 0 ? res : -1;
+	}
+	char label[32] = "sample max";
+	if (hz > 0) {
+		snprintf(label, sizeof(label), "sample %uHz", hz);
+	}
+	LOG("bench accel %-13s %8.1f Hz %8.1f us max gap %6d samples %u dropped\n",
+		label, (count - 1) / ((last - first) / 1000000.0), (double)worst_gap, count, dropped);
+	return 0;
+}
+
+// Cost of one kinect_orientation_update(), then the filter fed from a session
+// sampling a sensor pitched 45 degrees forward.
+static int bench_orientation(int updates) {
+	kinect_orientation o;
+	kinect_orientation_init(&o, 100);
+	kinect_accel_sample sample;
+	memset(&sample, 0, sizeof(sample));
+	uint64_t start = kusb_now_us();
+	for (int i = 0; i < updates; i++) {
+		sample.time_us = 1000 + (uint64_t)i * 5000;
+		sample.accel[0] = (i & 7) - 4;
+		sample.accel[1] = 819 + (i & 3);
+		sample.accel[2] = (i & 15) - 8;
+		kinect_orientation_update(&o, &sample);
+	}
+	uint64_t took = kusb_now_us() - start;
+	LOG("bench accel %-13s %8.3f us per sample %6d samples\n", "orientation", (double)took / updates, updates);
+
+	kinect_sim_params params;
+	app_sim_params(&params);
+	params.accel[0] = 0;
+	params.accel[1] = 579; // 819 * cos(45)
+	params.accel[2] = 579;
+	kusb_io* io = kinect_sim_open(&params);
+	kinect_motor* motor = kinect_motor_open_io(io);
+	if (motor == NULL) {
+		kusb_io_close(io);
+		return -1;
+	}
+	kinect_orientation_init(&o, 100);
+	kinect_motor_start_sampling(motor, 200);
+	kinect_accel_sample samples[64];
+	for (int frame = 0; frame < 30; frame++) {
+		usleep(16000);
+		int n;
+		while ((n = kinect_motor_read_samples(motor, samples, 64)) > 0) {
+			for (int i = 0; i < n; i++) {
+				kinect_orientation_update(&o, &samples[i]);
+			}
+		}
+	}
+	kinect_motor_close(motor);
+	kusb_io_close(io);
+
+	float mks[3];
+	kinect_orientation_get_mks_accel(&o, mks);
+	float pitch = kinect_orientation_get_pitch(&o);
+	LOG("bench accel %-13s %8.1f pitch %6.1f roll %6.2f / %.2f / %.2f m/s^2 %d samples\n", "orientation",
+		pitch, kinect_orientation_get_roll(&o), mks[0], mks[1], mks[2], o.samples);
+	if (o.samples == 0 || pitch < 44.0f || pitch > 46.0f) {
+		LOG("bench accel: orientation off\n");
+		return -1;
+	}
+	return 0;
+}
+
+int run_accel_poll_benchmark(int polls) {
+	if (polls < 1) {
+		polls = 1;
+	}
+	kinect_sim_params params;
+	app_sim_params(&params);
+
+	kusb_io* io = kinect_sim_open(&params);
+	int res = 0;
+	uint64_t start = kusb_now_us();
+	int i;
+	for (i = 0; i < polls && res == 0; i++) {
+		res = poll_status(io);
+	}
+	uint64_t took = kusb_now_us() - start;
+	kusb_io_close(io);
+
+	if (res != 0) {
+		LOG("bench accel: poll_status failed: %d\n", res);
+		return res;
+	}
+	LOG("bench accel %-13s %8.1f Hz %8.1f us per poll %6d polls\n",
+		"poll_status", i / (took / 1000000.0), (double)took / i, i);
+	if (bench_motor_pipe(1, polls) != 0 || bench_motor_pipe(4, polls) != 0) {
+		return -1;
+	}
+	if (bench_motor_sampling(200, 500) != 0 || bench_motor_sampling(0, 500) != 0) {
+		return -1;
+	}
+	if (bench_orientation(1000000) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// The per frame "set LED + read accel" pair, and LED + tilt + poll, as
+// blocking calls one after the other and as one kinect_motor_batch.
+int run_batch_benchmark(int frames) {
+	if (frames < 1) {
+		frames = 1;
+	}
+	kinect_sim_params params;
+	app_sim_params(&params);
+	params.tilt_deg_per_s = 0;
+
+	kusb_io* io = kinect_sim_open(&params);
+	int res = 0;
+	int32_t accel[3];
+	uint64_t start = kusb_now_us();
+	for (int i = 0; i < frames && res == 0; i++) {
+		res = set_led(io, (i & 1) ? LED_SOLID_GREEN : LED_SOLID_RED);
+		if (res == 0) {
+			res = get_accel(io, accel);
+		}
+	}
+	uint64_t sequential = kusb_now_us() - start;
+
+	start = kusb_now_us();
+	for (int i = 0; i < frames && res == 0; i++) {
+		res = set_led_and_get_accel(io, (i & 1) ? LED_SOLID_GREEN : LED_SOLID_RED, accel);
+	}
+	uint64_t batched = kusb_now_us() - start;
+	if (res != 0 || accel[1] != params.accel[1]) {
+		LOG("bench batch: led + accel failed: %d\n", res);
+		kusb_io_close(io);
+		return res != 0 ? res : -1;
+	}
+	LOG("bench batch %-13s %8.1f us per frame %8.1f us batched %6d frames\n",
+		"led + accel", (double)sequential / frames, (double)batched / frames, frames);
+
+	start = kusb_now_us();
+	for (int i = 0; i < frames && res == 0; i++) {
+		res = set_led(io, LED_SOLID_GREEN);
+		if (res == 0) res = set_tilt(io, i % 31);
+		if (res == 0) res = poll_status(io);
+	}
+	sequential = kusb_now_us() - start;
+
+	kinect_motor_batch batch;
+	start = kusb_now_us();
+	for (int i = 0; i < frames && res == 0; i++) {
+		kinect_motor_batch_init(&batch);
+		kinect_motor_batch_add(&batch, KINECT_MOTOR_CMD_LED, KINECT_LED_SOLID_GREEN);
+		kinect_motor_batch_add(&batch, KINECT_MOTOR_CMD_TILT, i % 31);
+		kinect_motor_batch_add(&batch, KINECT_MOTOR_CMD_STATUS, 0);
+		res = kinect_motor_batch_run(io, &batch);
+	}
+	batched = kusb_now_us() - start;
+	kinect_sim_stats stats;
+	kinect_sim_get_stats(io, &stats);
+	kusb_io_close(io);
+	if (res != 0 || stats.tilt != (frames - 1) % 31 || batch.result[2].tilt_angle != stats.tilt) {
+		LOG("bench batch: led + tilt + poll failed: %d\n", res);
+		return res != 0 ? res : -1;
+	}
+	LOG("bench batch %-13s %8.1f us per frame %8.1f us batched %6d frames\n",
+		"led+tilt+poll", (double)sequential / frames, (double)batched / frames, frames);
+	return 0;
+}
+
+// Holding OF_KEY_UP: one degree more every frame_us. Directly, every set_tilt()
+// blocks the caller for a round trip and reaches the motor while it is still
+// moving; through the motor session the call returns at once and only the
+// latest angle goes out when the motor is free.
+int run_tilt_benchmark(int requests) {
+	if (requests < 1) {
+		requests = 1;
+	}
+	const unsigned int frame_us = 16000;
+	kinect_sim_params params;
+	app_sim_params(&params);
+
+	kusb_io* io = kinect_sim_open(&params);
+	int res = 0;
+	uint64_t worst = 0;
+	for (int i = 0; i < requests && res == 0; i++) {
+		uint64_t start = kusb_now_us();
+		res = set_tilt(io, i % 31);
+		uint64_t took = kusb_now_us() - start;
+		if (took > worst) worst = took;
+		if (took < frame_us) {
+			usleep(frame_us - took);
+		}
+	}
+	kinect_sim_stats stats;
+	kinect_sim_get_stats(io, &stats);
+	kusb_io_close(io);
+	if (res != 0) {
+		LOG("bench tilt: set_tilt failed: %d\n", res);
+		return res;
+	}
+	LOG("bench tilt %-14s %8.1f us max call %6d requests %4d sent %4d while moving\n",
+		"set_tilt", (double)worst, requests, stats.tilts, stats.tilts_while_moving);
+
+	io = kinect_sim_open(&params);
+	kinect_motor* motor = kinect_motor_open_io(io);
+	if (motor == NULL) {
+		kusb_io_close(io);
+		return -1;
+	}
+	worst = 0;
+	for (int i = 0; i < requests; i++) {
+		uint64_t start = kusb_now_us();
+		kinect_motor_set_tilt(motor, i % 31);
+		uint64_t took = kusb_now_us() - start;
+		if (took > worst) worst = took;
+		usleep(frame_us);
+	}
+	res = kinect_motor_sync(motor, 5000);
+	int requested = 0, sent = 0;
+	kinect_motor_get_tilt_stats(motor, &requested, &sent);
+	kinect_motor_close(motor);
+	kinect_sim_get_stats(io, &stats);
+	kusb_io_close(io);
+	if (res != 0 || stats.tilt != (requests - 1) % 31) {
+		LOG("bench tilt: coalesced tilt failed: %d (motor at %d)\n", res, stats.tilt);
+		return res != 0 ? res : -1;
+	}
+	LOG("bench tilt %-14s %8.1f us max call %6d requests %4d sent %4d while moving\n",
+		"coalesced", (double)worst, requested, stats.tilts, stats.tilts_while_moving);
+	return 0;
+}
+
+// devices sessions on one keepalive service for duration_ms, every one of
+// them sampling at sample_hz (0 for idle ones). Idle devices should get one
+// keep alive per interval, sampled ones none at all.
+static int bench_keepalive(const char* label, int devices, unsigned int sample_hz,
+	unsigned int interval_ms, unsigned int duration_ms) {
+	kinect_sim_params params;
+	app_sim_params(&params);
+
+	kusb_io* io[8];
+	kinect_motor* motor[8];
+	if (devices > 8) {
+		devices = 8;
+	}
+	kinect_keepalive* keepalive = kinect_keepalive_start(10);
+	if (keepalive == NULL) {
+		return -1;
+	}
+	int opened = 0;
+	for (; opened < devices; opened++) {
+		io[opened] = kinect_sim_open(&params);
+		motor[opened] = kinect_motor_open_io(io[opened]);
+		if (motor[opened] == NULL) {
+			kusb_io_close(io[opened]);
+			break;
+		}
+		if (sample_hz > 0) {
+			kinect_motor_start_sampling(motor[opened], sample_hz);
+		}
+		kinect_keepalive_add(keepalive, motor[opened], interval_ms);
+	}
+	usleep(duration_ms * 1000);
+
+	kinect_keepalive_stats stats;
+	kinect_keepalive_get_stats(keepalive, &stats);
+	for (int i = 0; i < opened; i++) {
+		kinect_keepalive_remove(keepalive, motor[i]);
+		kinect_motor_close(motor[i]);
+		kusb_io_close(io[i]);
+	}
+	kinect_keepalive_stop(keepalive);
+	if (opened < devices) {
+		LOG("bench keepalive: opening device %d failed\n", opened);
+		return -1;
+	}
+
+	int expected = sample_hz > 0 ? 0 : devices * (int)(duration_ms / interval_ms);
+	LOG("bench keepalive %-9s %4d devices %6d sent %6d skipped (expected ~%d sent)\n",
+		label, stats.devices, stats.sent, stats.skipped, expected);
+	// idle ones may be a tick short of the last interval
+	if (sample_hz > 0 ? stats.sent != 0 : stats.sent < expected - devices) {
+		return -1;
+	}
+	return 0;
+}
+
+// A few sessions idle and a few sampling the accelerometer, each kept alive
+// every 100 ms from a 10 ms timer wheel for a second.
+int run_keepalive_benchmark(int devices) {
+	if (devices < 1) {
+		devices = 1;
+	}
+	if (bench_keepalive("idle", devices, 0, 100, 1000) != 0) {
+		return -1;
+	}
+	if (bench_keepalive("sampling", devices, 50, 100, 1000) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// Every model through the same kinect_controller calls: the LED and tilt
+// have to arrive in the model's encoding and the status polls have to read
+// back what the simulator reports.
+template <kinect_model M>
+static int bench_controller(kinect_sim_mode mode, int polls) {
+	typedef kinect_device_traits<M> traits;
+	kinect_sim_params params;
+	kinect_sim_default_params(&params);
+	params.mode = mode;
+	params.tilt_deg_per_s = 0;
+
+	kusb_io* io = kinect_sim_open(&params);
+	int res;
+	int i = 0;
+	uint64_t took = 0;
+	kinect_status status;
+	memset(&status, 0, sizeof(status));
+	{
+		kinect_controller<M> controller(io);
+		res = controller.set_led(KINECT_LED_SOLID_GREEN);
+		if (res == 0) {
+			res = controller.set_tilt(90); // clamped
+		}
+		uint64_t start = kusb_now_us();
+		for (; i < polls && res == 0; i++) {
+			res = controller.get_status(&status);
+		}
+		took = kusb_now_us() - start;
+	}
+	kinect_sim_stats stats;
+	kinect_sim_get_stats(io, &stats);
+	kusb_io_close(io);
+
+	if (res != 0 || stats.led != traits::protocol::led_value(KINECT_LED_SOLID_GREEN)
+		|| stats.tilt != traits::tilt_max || status.tilt_angle != traits::tilt_max
+		|| status.accel[1] != params.accel[1]) {
+		LOG("bench device %s: failed: %d (led %d, tilt %d, read back %d, accel y %d)\n", traits::name(),
+			res, stats.led, stats.tilt, status.tilt_angle, status.accel[1]);
+		return res != 0 ? res : -1;
+	}
+	LOG("bench device %-12s %8.1f us per poll %6d polls   tilt %d led %d\n",
+		traits::name(), (double)took / i, i, stats.tilt, stats.led);
+	return 0;
+}
+
+int run_device_benchmark(int polls) {
+	if (polls < 1) {
+		polls = 1;
+	}
+	if (bench_controller<KINECT_MODEL_1414>(KINECT_SIM_NUI_MOTOR, polls) != 0) {
+		return -1;
+	}
+	if (bench_controller<KINECT_MODEL_1473>(KINECT_SIM_APPLICATION, polls) != 0) {
+		return -1;
+	}
+	if (bench_controller<KINECT_MODEL_K4W>(KINECT_SIM_APPLICATION, polls) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static void report_hung(const char* label, uint64_t start, int res) {
+	LOG("bench hung %-14s %8.1f ms   res %d\n", label, (kusb_now_us() - start) / 1000.0, res);
+}
+
+typedef struct {
+	volatile int cancel;
+	unsigned int after_us;
+} cancel_later;
+
+static void* cancel_thread(void* arg) {
+	cancel_later* c = (cancel_later*)arg;
+	usleep(c->after_us);
+	c->cancel = 1;
+	return NULL;
+}
+
+int run_hung_device_benchmark() {
+	kinect_sim_params params;
+	app_sim_params(&params);
+
+	kusb_io* io = kinect_sim_open(&params);
+	kinect_sim_set_hung(io, 1);
+	int failed = 0;
+
+	// blocking, bounded by KINECT_COMMAND_TIMEOUT
+	uint64_t start = kusb_now_us();
+	int res = set_led(io, LED_SOLID_RED);
+	report_hung("set_led", start, res);
+	failed |= res != LIBUSB_ERROR_TIMEOUT;
+
+	// a batch shares the same deadline
+	int32_t accel[3];
+	start = kusb_now_us();
+	res = set_led_and_get_accel(io, LED_SOLID_RED, accel);
+	report_hung("batch", start, res);
+	failed |= res != LIBUSB_ERROR_TIMEOUT;
+
+	// a read with no deadline, cancelled from another thread
+	cancel_later c;
+	c.cancel = 0;
+	c.after_us = 20000;
+	pthread_t thread;
+	pthread_create(&thread, NULL, cancel_thread, &c);
+	unsigned char buffer[512];
+	int transferred;
+	start = kusb_now_us();
+	res = kusb_bulk_until(io, KINECT_EP_IN, buffer, sizeof(buffer), &transferred, KUSB_NO_DEADLINE, &c.cancel);
+	report_hung("cancel 20 ms", start, res);
+	pthread_join(thread, NULL);
+	failed |= res != LIBUSB_ERROR_INTERRUPTED;
+
+	// through the session the caller never waits; the command fails on the
+	// worker and the next one goes through once the device is back
+	kinect_motor* motor = kinect_motor_open_io(io);
+	if (motor == NULL) {
+		kusb_io_close(io);
+		return -1;
+	}
+	start = kusb_now_us();
+	kinect_motor_set_led(motor, KINECT_LED_SOLID_GREEN);
+	LOG("bench hung %-14s %8.1f us\n", "motor call", (double)(kusb_now_us() - start));
+	res = kinect_motor_sync(motor, 5000);
+	report_hung("motor sync", start, res);
+	failed |= res != LIBUSB_ERROR_TIMEOUT;
+
+	kinect_sim_set_hung(io, 0);
+	start = kusb_now_us();
+	kinect_motor_set_led(motor, KINECT_LED_SOLID_RED);
+	res = kinect_motor_sync(motor, 5000);
+	report_hung("recovered", start, res);
+	failed |= res != 0;
+
+	kinect_sim_set_hung(io, 1);
+	for (int i = 0; i < 8; i++) {
+		kinect_motor_set_led(motor, (i & 1) ? KINECT_LED_SOLID_GREEN : KINECT_LED_SOLID_RED);
+	}
+	usleep(10000);
+	start = kusb_now_us();
+	kinect_motor_cancel(motor);
+	res = kinect_motor_sync(motor, 5000);
+	report_hung("cancel", start, res);
+	failed |= res != LIBUSB_ERROR_INTERRUPTED;
+
+	for (int i = 0; i < 8; i++) {
+		kinect_motor_set_led(motor, (i & 1) ? KINECT_LED_SOLID_GREEN : KINECT_LED_SOLID_RED);
+	}
+	start = kusb_now_us();
+	kinect_motor_close(motor);
+	report_hung("close", start, 0);
+	kusb_io_close(io);
+
+	if (failed) {
+		LOG("bench hung: unexpected result\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int bench_probe_state(kinect_sim_mode mode, kinect_fw_state expected, int probes) {
+	kinect_sim_params params;
+	kinect_sim_default_params(&params);
+	params.mode = mode;
+
+	kusb_io* io = kinect_sim_open(&params);
+	uint64_t start = kusb_now_us();
+	int i;
+	for (i = 0; i < probes; i++) {
+		kinect_fw_state state = kinect_fw_probe_io(io, 1000);
+		if (state != expected) {
+			LOG("bench probe: got %s from the %s\n", kinect_fw_state_name(state), kinect_fw_state_name(expected));
+			kusb_io_close(io);
+			return -1;
+		}
+	}
+	uint64_t took = kusb_now_us() - start;
+	kusb_io_close(io);
+	LOG("bench probe %-13s %8.1f us per probe %6d probes\n", kinect_fw_state_name(expected), (double)took / i, i);
+	return 0;
+}
+
+int run_probe_benchmark(int probes) {
+	if (probes < 1) {
+		probes = 1;
+	}
+	if (bench_probe_state(KINECT_SIM_BOOTLOADER, KINECT_FW_STATE_BOOTLOADER, probes) != 0
+		|| bench_probe_state(KINECT_SIM_APPLICATION, KINECT_FW_STATE_APPLICATION, probes) != 0) {
+		return -1;
+	}
+
+	// what a restart costs when the firmware is already up: a cache lookup,
+	// the image digest comes precomputed
+	uint64_t start = kusb_now_us();
+	unsigned char digest[KINECT_SHA256_SIZE];
+	for (int i = 0; i < probes; i++) {
+		kinect_fw_cache_lookup("kinect-bench-no-such-serial", digest);
+	}
+	uint64_t took = kusb_now_us() - start;
+	LOG("bench probe %-13s %8.1f us per lookup\n", "cache", (double)took / probes);
+
+	// and what hashing the image would cost if it didn't
+	kinect_fw_source* src = getFWSource1473();
+	start = kusb_now_us();
+	int res = kinect_fw_digest(src, digest);
+	took = kusb_now_us() - start;
+	kinect_fw_source_close(src);
+	if (res != 0 || memcmp(digest, getFWDigest1473(), KINECT_SHA256_SIZE) != 0) {
+		char hex[2 * KINECT_SHA256_SIZE + 1];
+		kinect_sha256_hex(digest, hex);
+		LOG("bench probe: image sha256 %s (%d) doesn't match the packed one\n", hex, res);
+		return -1;
+	}
+	LOG("bench probe %-13s %8.2f ms\n", "hash image", took / 1000.0);
+	return 0;
+}
+
+static int bench_trace_polls(int level, int polls) {
+	kinect_sim_params params;
+	app_sim_params(&params);
+	// no bus time, so what is left is the host side
+	params.transfer_latency_us = 0;
+	params.command_us = 0;
+	params.transfer_overhead_us = 0;
+
+	int saved = kinect_trace_level;
+	kinect_trace_level = level;
+	kusb_io* io = kinect_sim_open(&params);
+	int res = 0;
+	uint64_t start = kusb_now_us();
+	int i;
+	for (i = 0; i < polls && res == 0; i++) {
+		res = poll_status(io);
+	}
+	uint64_t took = kusb_now_us() - start;
+	kusb_io_close(io);
+	kinect_trace_level = saved;
+
+	if (res != 0) {
+		LOG("bench trace: poll_status failed: %d\n", res);
+		return res;
+	}
+	LOG("bench trace poll level %d   %8.2f us per poll %6d polls\n", level, (double)took / i, i);
+	return 0;
+}
+
+int run_trace_benchmark(int records) {
+	if (records < 1) {
+		records = 1;
+	}
+	unsigned char status[KINECT_STATUS_REPLY_SIZE];
+	memset(status, 0, sizeof(status));
+
+	uint64_t start = kusb_now_us();
+	for (int i = 0; i < records; i++) {
+		kinect_trace_transfer(KINECT_TRACE_COMMANDS, KINECT_EP_IN, status, 512, sizeof(status), 0);
+	}
+	uint64_t took = kusb_now_us() - start;
+	LOG("bench trace %-13s %8.3f us per record %5d records\n", "record", (double)took / records, records);
+
+	FILE* null = fopen("/dev/null", "w");
+	if (null != NULL) {
+		start = kusb_now_us();
+		kinect_trace_dump(null);
+		took = kusb_now_us() - start;
+		fclose(null);
+		LOG("bench trace %-13s %8.2f ms\n", "dump ring", took / 1000.0);
+	}
+	kinect_trace_clear();
+
+	int res = 0;
+	for (int level = KINECT_TRACE_OFF; level <= KINECT_TRACE_ALL && res == 0; level++) {
+		res = bench_trace_polls(level, 1000);
+	}
+	kinect_trace_clear();
+	return res;
+}
+
+// What a session with a freshly powered 1473 does: upload, then the calls
+// testApp makes. The device switches to the motor firmware in between.
+static int replay_session(kusb_io* io, int polls) {
+	int res = kinect_fw_upload(io, getFWData1473(), getFWSize1473(), NULL, NULL);
+	if (res == 0) res = set_led(io, LED_SOLID_GREEN);
+	if (res == 0) res = set_tilt(io, 10);
+	for (int i = 0; i < polls && res == 0; i++) {
+		res = poll_status(io);
+	}
+	if (res == 0) res = keepAlive1473(io);
+	return res;
+}
+
+static int bench_replay(const kinect_capture* capture, kinect_replay_mode mode, const char* label,
+	int polls, uint64_t recorded_us) {
+	kusb_io* io = kinect_replay_open(capture, mode);
+	uint64_t start = kusb_now_us();
+	int res = replay_session(io, polls);
+	uint64_t took = kusb_now_us() - start;
+	kinect_replay_stats stats;
+	kinect_replay_get_stats(io, &stats);
+	kusb_io_close(io);
+	if (res != 0 || stats.diverged != 0 || stats.timeouts != 0 || stats.left != 0) {
+		LOG("bench replay %s: failed: %d (%d diverged, %d timed out, %d left)\n",
+			label, res, stats.diverged, stats.timeouts, stats.left);
+		return res != 0 ? res : -1;
+	}
+	LOG("bench replay %-12s %8.2f ms %8.2f us per transfer %5d transfers (recorded %.2f ms)\n",
+		label, took / 1000.0, (double)took / stats.transfers, stats.transfers, recorded_us / 1000.0);
+	return 0;
+}
+
+int run_replay_benchmark(int polls) {
+	kinect_sim_params params;
+	kinect_sim_default_params(&params);
+	kusb_io* io = kinect_sim_open(&params);
+
+	kinect_capture* capture = kinect_capture_start();
+	if (capture == NULL) {
+		kusb_io_close(io);
+		return -1;
+	}
+	uint64_t start = kusb_now_us();
+	int res = replay_session(io, polls);
+	uint64_t recorded = kusb_now_us() - start;
+	kinect_capture_stop(capture);
+	kusb_io_close(io);
+	if (res != 0) {
+		LOG("bench replay: recording failed: %d\n", res);
+		kinect_capture_free(capture);
+		return res;
+	}
+
+	// through a file, the way a capture from a real device would arrive
+	char path[] = "/tmp/kinect_bench_capture.XXXXXX";
+	int fd = mkstemp(path);
+	kinect_capture* loaded = NULL;
+	if (fd >= 0) {
+		close(fd);
+		if (kinect_capture_save(capture, path) == 0) {
+			loaded = kinect_capture_load(path);
+		}
+		unlink(path);
+	}
+	kinect_capture_free(capture);
+	if (loaded == NULL) {
+		LOG("bench replay: saving and loading the capture failed\n");
+		return -1;
+	}
+
+	res = bench_replay(loaded, KINECT_REPLAY_REALTIME, "realtime", polls, recorded);
+	if (res == 0) {
+		res = bench_replay(loaded, KINECT_REPLAY_FAST, "fast", polls, recorded);
+	}
+	kinect_capture_free(loaded);
+	return res;
+}
+
+//------------------------------------------------------------------------------
+// usbfs against libusb, on a real device
+
+// Bus and address of the first 1473 or K4W audio device, and whether it runs
+// the firmware. 0 if there is none.
+static int find_audio_device(int* bus, int* address, int* firmware) {
+	libusb_context* ctx = kinect_usb_context();
+	if (ctx == NULL) {
+		return 0;
+	}
+	libusb_device** list = NULL;
+	ssize_t n = libusb_get_device_list(ctx, &list);
+	int found = 0;
+	for (ssize_t i = 0; i < n && !found; i++) {
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(list[i], &desc) != 0 || desc.idVendor != KINECT_VID
+			|| (desc.idProduct != KINECT_PID_AUDIO && desc.idProduct != KINECT_PID_K4W_AUDIO)) {
+			continue;
+		}
+		struct libusb_config_descriptor* config = NULL;
+		*firmware = 0;
+		if (libusb_get_active_config_descriptor(list[i], &config) == 0) {
+			*firmware = config->bNumInterfaces >= 2;
+			libusb_free_config_descriptor(config);
+		}
+		*bus = libusb_get_bus_number(list[i]);
+		*address = libusb_get_device_address(list[i]);
+		found = 1;
+	}
+	if (list != NULL) {
+		libusb_free_device_list(list, 1);
+	}
+	return found;
+}
+
+// libusb goes through the shared runtime, so it has to let go of the
+// device before usbfs can claim it.
+static kusb_io* open_backend(int usbfs, int bus, int address, libusb_device_handle** dev) {
+	*dev = NULL;
+	if (usbfs) {
+		return kusb_io_open_usbfs(bus, address);
+	}
+	*dev = kinect_usb_open(KINECT_VID, KINECT_PID_AUDIO);
+	if (*dev == NULL) {
+		*dev = kinect_usb_open(KINECT_VID, KINECT_PID_K4W_AUDIO);
+	}
+	kusb_io* io = *dev != NULL ? kusb_io_open_libusb(kinect_usb_context(), *dev) : NULL;
+	if (io == NULL) {
+		kinect_usb_close(*dev);
+	}
+	return io;
+}
+
+static int usbfs_syscalls(const kusb_usbfs_stats* stats) {
+	return stats->submits + stats->reaps + stats->polls + stats->discards + stats->controls;
+}
+
+// Syscalls since *before was taken, and the zero copy submits among them.
+static void report_usbfs_syscalls(const char* label, kusb_io* io, const kusb_usbfs_stats* before,
+	int count, const char* unit) {
+	kusb_usbfs_stats stats;
+	kusb_usbfs_get_stats(io, &stats);
+	int syscalls = usbfs_syscalls(&stats) - usbfs_syscalls(before);
+	stats.zero_copy -= before->zero_copy;
+	LOG("bench usbfs %-14s %6d syscalls %6.2f per %s %4d largest batch %5d zero copy\n",
+		label, syscalls, count > 0 ? (double)syscalls / count : 0.0, unit, stats.max_batch, stats.zero_copy);
+}
+
+static int bench_usbfs_upload(int usbfs, int bus, int address) {
+	kinect_fw_wait* wait = kinect_fw_wait_open(NULL);
+	libusb_device_handle* dev = NULL;
+	kusb_io* io = open_backend(usbfs, bus, address, &dev);
+	if (io == NULL) {
+		LOG("bench usbfs: can't open %03d:%03d\n", bus, address);
+		kinect_fw_wait_close(wait);
+		return -1;
+	}
+	kinect_fw_source* src = getFWSource1473();
+	kinect_fw_upload_stats stats;
+	kusb_usbfs_stats before;
+	memset(&before, 0, sizeof(before));
+	int res = kinect_fw_upload_source(io, src, NULL, &stats);
+	kinect_fw_source_close(src);
+
+	char label[32];
+	snprintf(label, sizeof(label), "bench upload %s", io->ops->name);
+	kinect_fw_print_upload_stats(label, &stats, res);
+	if (usbfs) {
+		report_usbfs_syscalls("upload", io, &before, stats.pages, "page");
+	}
+	kusb_io_close(io);
+	kinect_usb_close(dev);
+
+	if (res == 0 && wait != NULL) {
+		res = kinect_fw_wait_ready(wait, 10000);
+	}
+	kinect_fw_wait_close(wait);
+	return res;
+}
+
+// poll_status() back to back, then the same through a kinect_motor_pipe,
+// whose command and reply buffers come from kusb_alloc().
+static int bench_usbfs_polls(int usbfs, int bus, int address, int polls) {
+	libusb_device_handle* dev = NULL;
+	kusb_io* io = open_backend(usbfs, bus, address, &dev);
+	if (io == NULL) {
+		LOG("bench usbfs: can't open %03d:%03d\n", bus, address);
+		return -1;
+	}
+
+	kusb_usbfs_stats before;
+	memset(&before, 0, sizeof(before));
+	int res = 0;
+	uint64_t start = kusb_now_us();
+	for (int i = 0; i < polls && res == 0; i++) {
+		res = poll_status(io);
+	}
+	uint64_t took = kusb_now_us() - start;
+	if (res == 0) {
+		LOG("bench usbfs polls %-8s %8.1f us per poll %8.1f Hz\n",
+			io->ops->name, (double)took / polls, polls / (took / 1000000.0));
+		if (usbfs) {
+			report_usbfs_syscalls("polls", io, &before, polls, "poll");
+		}
+	}
+
+	kinect_motor_pipe* pipe = res == 0 ? kinect_motor_pipe_open(io, 1, 1000) : NULL;
+	if (pipe != NULL) {
+		if (usbfs) {
+			kusb_usbfs_get_stats(io, &before);
+		}
+		int failed = 0;
+		start = kusb_now_us();
+		for (int i = 0; i < polls; i++) {
+			kinect_motor_pipe_submit(pipe, KINECT_MOTOR_CMD_STATUS, 0, count_done, &failed);
+		}
+		while (kinect_motor_pipe_pending(pipe) > 0) {
+			kinect_motor_pipe_handle_events(pipe, 1000);
+		}
+		took = kusb_now_us() - start;
+		kinect_motor_pipe_close(pipe);
+		if (failed != 0) {
+			LOG("bench usbfs: %d of %d pipe polls failed\n", failed, polls);
+			res = -1;
+		} else {
+			LOG("bench usbfs pipe  %-8s %8.1f us per poll %8.1f Hz\n",
+				io->ops->name, (double)took / polls, polls / (took / 1000000.0));
+			if (usbfs) {
+				report_usbfs_syscalls("pipe polls", io, &before, polls, "poll");
+			}
+		}
+	}
+	if (res != 0) {
+		LOG("bench usbfs: polls through %s failed: %d\n", io->ops->name, res);
+	}
+	kusb_io_close(io);
+	kinect_usb_close(dev);
+	return res;
+}
+
+int run_usbfs_benchmark(int polls, int upload_through_usbfs) {
+	int bus;
+	int address;
+	int firmware;
+	if (!find_audio_device(&bus, &address, &firmware)) {
+		LOG("bench usbfs: no 1473 or K4W attached, skipped\n");
+		return 0;
+	}
+	int res = 0;
+	if (!firmware) {
+		res = bench_usbfs_upload(upload_through_usbfs, bus, address);
+		if (res == 0 && !find_audio_device(&bus, &address, &firmware)) {
+			res = -1;
+		}
+	}
+	if (res == 0) {
+		res = bench_usbfs_polls(0, bus, address, polls);
+	}
+	if (res == 0) {
+		res = bench_usbfs_polls(1, bus, address, polls);
+	}
+	return res;
+}
+
+// user + system CPU time of the whole process so far
+static uint64_t cpu_us() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+		+ usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// devices sampled at hz behind a keep alive for duration_ms, LEDs changed
+// every 16 ms frame: one kinect_motor session (and thread) per device plus
+// a kinect_keepalive thread, against everything on one kinect_reactor.
+static int bench_reactor_sessions(int devices, unsigned int hz, int duration_ms) {
+	kinect_sim_params params;
+	app_sim_params(&params);
+	kusb_io* io[16];
+	kinect_motor* motor[16];
+	kinect_accel_sample samples[256];
+	if (devices > 16) {
+		devices = 16;
+	}
+
+	kinect_keepalive* keepalive = kinect_keepalive_start(10);
+	int opened = 0;
+	for (; opened < devices; opened++) {
+		io[opened] = kinect_sim_open(&params);
+		motor[opened] = kinect_motor_open_io(io[opened]);
+		if (motor[opened] == NULL) {
+			kusb_io_close(io[opened]);
+			break;
+		}
+		kinect_motor_start_sampling(motor[opened], hz);
+		kinect_keepalive_add(keepalive, motor[opened], 100);
+	}
+	int count = 0;
+	uint64_t cpu = cpu_us();
+	uint64_t start = kusb_now_us();
+	for (int frame = 0; kusb_now_us() - start < (uint64_t)duration_ms * 1000; frame++) {
+		usleep(16000);
+		for (int i = 0; i < opened; i++) {
+			kinect_motor_set_led(motor[i], (frame & 1) ? KINECT_LED_SOLID_GREEN : KINECT_LED_SOLID_RED);
+			count += kinect_motor_read_samples(motor[i], samples, 256);
+		}
+	}
+	uint64_t elapsed = kusb_now_us() - start;
+	cpu = cpu_us() - cpu;
+	for (int i = 0; i < opened; i++) {
+		kinect_keepalive_remove(keepalive, motor[i]);
+		kinect_motor_close(motor[i]);
+		kusb_io_close(io[i]);
+	}
+	kinect_keepalive_stop(keepalive);
+	if (opened < devices) {
+		LOG("bench reactor: opening session %d failed\n", opened);
+		return -1;
+	}
+	LOG("bench reactor %-9s %3d devices %3d threads %8.1f Hz/device %8.1f ms cpu/s\n",
+		"sessions", devices, devices + 1, count / (double)devices / (elapsed / 1000000.0),
+		cpu / (elapsed / 1000.0));
+
+	kinect_reactor* reactor = kinect_reactor_start(NULL);
+	if (reactor == NULL) {
+		return -1;
+	}
+	kinect_reactor_device* device[16];
+	kinect_reactor_device_params dp;
+	kinect_reactor_default_params(&dp);
+	dp.sample_hz = hz;
+	dp.keepalive_ms = 100;
+	dp.poll_us = 200;
+	for (int i = 0; i < devices; i++) {
+		io[i] = kinect_sim_open(&params);
+		device[i] = kinect_reactor_add(reactor, io[i], &dp);
+	}
+	kinect_reactor_result results[KINECT_REACTOR_QUEUE_SIZE];
+	int posted = 0, answered = 0, failed = 0;
+	uint64_t post_us = 0;
+	count = 0;
+	cpu = cpu_us();
+	start = kusb_now_us();
+	for (int frame = 0; kusb_now_us() - start < (uint64_t)duration_ms * 1000; frame++) {
+		usleep(16000);
+		uint64_t t = kusb_now_us();
+		for (int i = 0; i < devices; i++) {
+			posted += kinect_reactor_set_led(reactor, device[i],
+				(frame & 1) ? KINECT_LED_SOLID_GREEN : KINECT_LED_SOLID_RED) == 0;
+		}
+		post_us += kusb_now_us() - t;
+		for (int i = 0; i < devices; i++) {
+			count += kinect_reactor_read_samples(device[i], samples, 256);
+		}
+		int n = kinect_reactor_read_results(reactor, results, KINECT_REACTOR_QUEUE_SIZE);
+		for (int i = 0; i < n; i++) {
+			answered++;
+			failed += results[i].status != 0;
+		}
+	}
+	elapsed = kusb_now_us() - start;
+	cpu = cpu_us() - cpu;
+	kinect_reactor_stats stats;
+	kinect_reactor_get_stats(reactor, &stats);
+	for (int i = 0; i < devices; i++) {
+		kinect_reactor_remove(reactor, device[i]);
+		kusb_io_close(io[i]);
+	}
+	kinect_reactor_stop(reactor);
+
+	LOG("bench reactor %-9s %3d devices %3d threads %8.1f Hz/device %8.1f ms cpu/s\n",
+		"reactor", devices, 1, count / (double)devices / (elapsed / 1000000.0),
+		cpu / (elapsed / 1000.0));
+	LOG("bench reactor %-9s %8.2f us/post %6d wakeups %6d usb %6d keep alives %6d skipped\n",
+		"loop", posted > 0 ? post_us / (double)posted : 0.0, stats.wakeups, stats.usb_events,
+		stats.keepalives, stats.keepalives_skipped);
+	// the last frame's LEDs may still be on the wire
+	if (failed > 0 || answered < posted - devices || count == 0 || stats.keepalives > 0) {
+		LOG("bench reactor: %d of %d LEDs answered, %d failed, %d samples, %d keep alives\n",
+			answered, posted, failed, count, stats.keepalives);
+		return -1;
+	}
+	return 0;
+}
+
+// A reactor with a device that neither samples nor needs keeping alive has
+// nothing to wake up for; one that does only for its keep alives.
+static int bench_reactor_idle(int duration_ms) {
+	kinect_sim_params params;
+	app_sim_params(&params);
+	kinect_reactor* reactor = kinect_reactor_start(NULL);
+	if (reactor == NULL) {
+		return -1;
+	}
+	kinect_reactor_device_params dp;
+	kinect_reactor_default_params(&dp);
+	dp.poll_us = 200;
+	kusb_io* quiet = kinect_sim_open(&params);
+	kinect_reactor_device* device = kinect_reactor_add(reactor, quiet, &dp);
+	usleep(duration_ms * 1000);
+	kinect_reactor_stats idle;
+	kinect_reactor_get_stats(reactor, &idle);
+
+	dp.keepalive_ms = 100;
+	kusb_io* kept = kinect_sim_open(&params);
+	kinect_reactor_device* kept_alive = kinect_reactor_add(reactor, kept, &dp);
+	usleep(duration_ms * 1000);
+	kinect_reactor_stats stats;
+	kinect_reactor_get_stats(reactor, &stats);
+	kinect_reactor_remove(reactor, device);
+	kinect_reactor_remove(reactor, kept_alive);
+	kusb_io_close(quiet);
+	kusb_io_close(kept);
+	kinect_reactor_stop(reactor);
+
+	int wakeups = stats.wakeups - idle.wakeups;
+	LOG("bench reactor %-9s %6d wakeups idle, %d with a keep alive every 100 ms for %d ms (%d sent)\n",
+		"idle", idle.wakeups, wakeups, duration_ms, stats.keepalives);
+	// the add wakes it once; a keep alive takes a wakeup for the timer and
+	// a few polls for the reply
+	if (idle.wakeups > 2 || stats.keepalives < duration_ms / 100 - 1
+		|| wakeups > 2 + stats.keepalives * 20) {
+		return -1;
+	}
+	return 0;
+}
+
+int run_reactor_benchmark(int devices) {
+	if (bench_reactor_idle(500) != 0) {
+		return -1;
+	}
+	if (bench_reactor_sessions(1, 200, 1000) != 0) {
+		return -1;
+	}
+	if (devices > 1 && bench_reactor_sessions(devices, 200, 1000) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static void count_answered(const kinect_motor_result* result, void* user_data) {
+	if (result->status == 0) {
+		(*(int*)user_data)++;
+	}
+}
+
+// kusb_pool_get/put against malloc/free for a reply buffer, then blocking
+// status polls and a motor pipe session on a simulated device: once the
+// io's pool is warm neither may reach the allocator.
+int run_pool_benchmark(int polls) {
+	const int rounds = 100000;
+	kusb_pool* pool = kusb_pool_create(NULL, NULL, NULL);
+	kusb_pool_reserve(pool, 512, 1);
+	uint64_t start = kusb_now_us();
+	for (int i = 0; i < rounds; i++) {
+		unsigned char* buffer = kusb_pool_get(pool, 512);
+		buffer[0] = (unsigned char)i;
+		kusb_pool_put(pool, buffer, 512);
+	}
+	uint64_t pooled = kusb_now_us() - start;
+	kusb_pool_stats stats;
+	kusb_pool_get_stats(pool, &stats);
+	kusb_pool_destroy(pool);
+	start = kusb_now_us();
+	for (int i = 0; i < rounds; i++) {
+		unsigned char* volatile buffer = (unsigned char*)malloc(512);
+		buffer[0] = (unsigned char)i;
+		free(buffer);
+	}
+	uint64_t heap = kusb_now_us() - start;
+	LOG("bench pool get/put        %8.1f ns   malloc/free %8.1f ns   %d of %d from the free list\n",
+		pooled * 1000.0 / rounds, heap * 1000.0 / rounds, stats.hits, stats.gets);
+	if (stats.hits != rounds) {
+		return -1;
+	}
+
+	kinect_sim_params params;
+	app_sim_params(&params);
+	kusb_io* io = kinect_sim_open(&params);
+	kinect_sim_stats before, after;
+	kinect_sim_get_stats(io, &before);
+	int res = 0;
+	for (int i = 0; i < polls && res == 0; i++) {
+		kinect_status status;
+		res = get_status(io, &status);
+	}
+	kinect_sim_get_stats(io, &after);
+	int allocated = after.buffers.backing + after.buffers.heap - before.buffers.backing - before.buffers.heap;
+	LOG("bench pool poll_status    %6d buffers %6d allocated %6d reserved up front   %d polls\n",
+		after.buffers.gets - before.buffers.gets, allocated, before.buffers.heap, polls);
+	if (res != 0 || allocated != 0) {
+		kusb_io_close(io);
+		return -1;
+	}
+
+	// a pipe's buffers are taken once when it opens and given back when it
+	// closes, the reserve covers those too
+	int done = 0;
+	kinect_sim_get_stats(io, &before);
+	for (int round = 0; round < 4 && res == 0; round++) {
+		kinect_motor_pipe* pipe = kinect_motor_pipe_open(io, 4, 1000);
+		if (pipe == NULL) {
+			res = -1;
+			break;
+		}
+		for (int i = 0; i < polls / 4; i++) {
+			kinect_motor_pipe_submit(pipe, KINECT_MOTOR_CMD_STATUS, 0, count_answered, &done);
+		}
+		while (kinect_motor_pipe_pending(pipe) > 0) {
+			kinect_motor_pipe_handle_events(pipe, 100);
+		}
+		kinect_motor_pipe_close(pipe);
+	}
+	kinect_sim_get_stats(io, &after);
+	kusb_io_close(io);
+	allocated = after.buffers.backing + after.buffers.heap - before.buffers.backing - before.buffers.heap;
+	LOG("bench pool motor pipe     %6d buffers %6d allocated %6d polls in 4 sessions\n",
+		after.buffers.gets - before.buffers.gets, allocated, done);
+	return res != 0 || allocated != 0 || done != polls / 4 * 4 ? -1 : 0;
+}
+
+int run_usb_benchmarks() {
+	int failed = 0;
+	failed |= run_upload_benchmark(5) != 0;
+	failed |= run_transfer_size_benchmark(5) != 0;
+	failed |= run_fleet_benchmark(8) != 0;
+	failed |= run_command_latency_benchmark(200) != 0;
+	failed |= run_accel_poll_benchmark(200) != 0;
+	failed |= run_tilt_benchmark(60) != 0;
+	failed |= run_batch_benchmark(200) != 0;
+	failed |= run_device_benchmark(200) != 0;
+	failed |= run_hung_device_benchmark() != 0;
+	failed |= run_keepalive_benchmark(4) != 0;
+	failed |= run_probe_benchmark(200) != 0;
+	failed |= run_trace_benchmark(100000) != 0;
+	failed |= run_replay_benchmark(100) != 0;
+	failed |= run_reactor_benchmark(8) != 0;
+	failed |= run_pool_benchmark(200) != 0;
+	LOG("bench: %s\n", failed ? "FAILED" : "done");
+	return failed;
+}
+
+#endif /* RUN_USB_BENCHMARKS */
@@ -0,0 +1,106 @@
+//
+//  kinect_usb_bench.h
+//  kinectExample
+//
+//  Benchmarks for the audio/motor device code, run against the simulated
+//  device in kinect_usb_sim so they need no hardware. Results are printed one
+//  line each, prefixed with "bench", so build machines can grep and compare
+//  them between runs.
+//
+//  None of it is built into the app unless RUN_USB_BENCHMARKS is defined,
+//  below or with -DRUN_USB_BENCHMARKS in the target's build settings; then
+//  testApp::setup() runs them on startup.
+//
+
+#ifndef __kinectExample__kinect_usb_bench__
+#define __kinectExample__kinect_usb_bench__
+
+// uncomment this to build the simulated usb benchmarks and run them on startup (no kinect needed)
+//#define RUN_USB_BENCHMARKS
+
+// Uploads the embedded 1473 image lock-step (one transfer at a time, the way
+// upload_firmware() used to), pipelined, pipelined with stalls, and from a
+// file, both mapped through upload_main_io() and streamed. Also checks that a
+// modified image is written but not executed.
+int run_upload_benchmark(int iterations);
+
+// Upload transfers (= submissions) and throughput with 512 byte writes,
+// wMaxPacketSize writes and one transfer per page, plus a device that only
+// takes packet sized writes so the page upload has to fall back.
+int run_transfer_size_benchmark(int iterations);
+
+// Flashes that many simulated devices in parallel through kinect_fw_upload_jobs().
+int run_fleet_benchmark(int devices);
+
+// set_led() / keepAlive1473() round trips against the application firmware,
+// then set_led through a kinect_motor session: the queueing call alone and
+// the round trip until it was sent.
+int run_command_latency_benchmark(int commands);
+
+// poll_status() back to back, reported as samples per second, then polls
+// mixed with LED changes through a kinect_motor_pipe, one and four commands
+// in flight, the background sampler of a kinect_motor session at 200 Hz and
+// flat out, and the kinect_orientation filter: per sample cost and the pitch
+// it settles on.
+int run_accel_poll_benchmark(int polls);
+
+// LED + accel and LED + tilt + poll per frame, one blocking call after the
+// other and as a single kinect_motor_batch round trip.
+int run_batch_benchmark(int frames);
+
+// A second of key repeat asking for a new tilt every frame, sent directly with
+// set_tilt() and through a kinect_motor session that coalesces them. Reports
+// how long the caller was held up and how many tilts reached the motor.
+int run_tilt_benchmark(int requests);
+
+// kinect_controller for the 1414, 1473 and K4W against the simulator: LED
+// and clamped tilt in each model's encoding, and status polls per second.
+int run_device_benchmark(int polls);
+
+// A device that stops answering: how long a blocking set_led(), a batch and
+// a kinect_motor session take to give up, a kusb_bulk_until() cancelled from
+// another thread, recovery once it answers again, kinect_motor_cancel() and
+// kinect_motor_close() with commands still queued.
+int run_hung_device_benchmark();
+
+// Devices idle and sampling the accelerometer behind one kinect_keepalive:
+// keep alives sent and skipped because there had been traffic anyway.
+int run_keepalive_benchmark(int devices);
+
+// kinect_fw_probe_io() against a bootloader and a running device, plus the
+// cache lookup and image hash upload_firmware_if_needed() relies on.
+int run_probe_benchmark(int probes);
+
+// Cost of recording one transfer in kinect_trace, and poll_status() with the
+// trace off and at each level.
+int run_trace_benchmark(int records);
+
+// A simulated session (upload, LED, tilt, polls, keep alive) captured, saved
+// and loaded again, then replayed in real time and as fast as possible: the
+// latter is the host side cost of the protocol code alone.
+int run_replay_benchmark(int polls);
+
+// The kusb_usbfs backend against libusb on an attached 1473 or K4W, so
+// Linux only, and skipped when there is none. A device still in its
+// bootloader first gets the embedded image, through usbfs or libusb as
+// asked; power cycle it and run again with the other to compare the two.
+// Then status polls through both, blocking and through a kinect_motor_pipe,
+// with the syscalls usbfs made for them.
+int run_usbfs_benchmark(int polls, int upload_through_usbfs);
+
+// Devices sampled at 200 Hz, kept alive and sent an LED change every frame:
+// one kinect_motor session thread per device plus a kinect_keepalive,
+// against all of them on one kinect_reactor thread, with the CPU time each
+// takes. Before that, how often an idle reactor wakes up.
+int run_reactor_benchmark(int devices);
+
+// kusb_pool against malloc/free, then blocking status polls and motor pipe
+// sessions on a simulated device, which must not allocate a buffer once the
+// io's pool is warm.
+int run_pool_benchmark(int polls);
+
+// All of the above with default sizes, except run_usbfs_benchmark(), which
+// needs hardware. Returns non zero if any of them failed.
+int run_usb_benchmarks();
+
+#endif /* defined(__kinectExample__kinect_usb_bench__) */
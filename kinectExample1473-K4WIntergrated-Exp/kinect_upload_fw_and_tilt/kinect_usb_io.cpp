@@ -0,0 +1,496 @@
+//
+//  kinect_usb_io.cpp
+//  kinectExample
+//
+
+#include "kinect_usb_io.h"
+#include "kinect_protocol.h"
+#include "kinect_trace.h"
+#include "kinect_capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <vector>
+
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+
+uint64_t kusb_now_us() {
+#ifdef __APPLE__
+	static mach_timebase_info_data_t timebase;
+	if (timebase.denom == 0) {
+		mach_timebase_info(&timebase);
+	}
+	return (mach_absolute_time() * timebase.numer / timebase.denom) / 1000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void kusb_fill_bulk(kusb_xfer* xfer, unsigned char endpoint, unsigned char* buffer, int length,
+	kusb_xfer_cb callback, void* user_data, unsigned int timeout) {
+	xfer->endpoint = endpoint;
+	xfer->buffer = buffer;
+	xfer->length = length;
+	xfer->actual_length = 0;
+	xfer->status = 0;
+	xfer->timeout = timeout;
+	xfer->submit_us = 0;
+	xfer->callback = callback;
+	xfer->user_data = user_data;
+	xfer->backend = NULL;
+}
+
+void kusb_complete(kusb_xfer* xfer) {
+	KINECT_TRACE_TRANSFER(xfer->endpoint, xfer->buffer, xfer->length, xfer->actual_length, xfer->status);
+	kinect_capture_transfer(xfer);
+	if (xfer->callback) {
+		xfer->callback(xfer);
+	}
+}
+
+int kusb_submit(kusb_io* io, kusb_xfer* xfer) {
+	xfer->actual_length = 0;
+	xfer->status = 0;
+	xfer->submit_us = kusb_now_us();
+	return io->ops->submit(io, xfer);
+}
+
+int kusb_cancel(kusb_io* io, kusb_xfer* xfer) {
+	return io->ops->cancel(io, xfer);
+}
+
+int kusb_handle_events(kusb_io* io, int timeout_ms) {
+	return io->ops->handle_events(io, timeout_ms);
+}
+
+int kusb_max_packet_size(kusb_io* io, unsigned char endpoint) {
+	return io->ops->max_packet_size(io, endpoint);
+}
+
+int kusb_control(kusb_io* io, uint8_t request_type, uint8_t request, uint16_t value,
+	uint16_t index, unsigned char* data, uint16_t length, unsigned int timeout) {
+	return io->ops->control(io, request_type, request, value, index, data, length, timeout);
+}
+
+int kusb_clear_halt(kusb_io* io, unsigned char endpoint) {
+	return io->ops->clear_halt(io, endpoint);
+}
+
+void kusb_reserve_buffers(kusb_pool* pool) {
+	// blocking commands, then replies and a motor pipe's command block
+	kusb_pool_reserve(pool, (int)sizeof(motor_command), 4);
+	kusb_pool_reserve(pool, 512, 4);
+}
+
+unsigned char* kusb_alloc(kusb_io* io, int size) {
+	if (io->ops->alloc != NULL) {
+		return io->ops->alloc(io, size);
+	}
+	return (unsigned char*)malloc(size);
+}
+
+void kusb_free(kusb_io* io, unsigned char* buffer, int size) {
+	if (buffer == NULL) {
+		return;
+	}
+	if (io->ops->free != NULL) {
+		io->ops->free(io, buffer, size);
+	} else {
+		free(buffer);
+	}
+}
+
+void kusb_io_close(kusb_io* io) {
+	if (io != NULL) {
+		io->ops->destroy(io);
+	}
+}
+
+// The flag may be set on another thread than the one waiting, depending on
+// the backend.
+static void sync_cb(kusb_xfer* xfer) {
+	__sync_lock_test_and_set((volatile int*)xfer->user_data, 1);
+}
+
+static int sync_done(volatile int* completed) {
+	return __sync_fetch_and_add(completed, 0);
+}
+
+uint64_t kusb_deadline_after(unsigned int timeout_ms) {
+	return timeout_ms == 0 ? KUSB_NO_DEADLINE : kusb_now_us() + (uint64_t)timeout_ms * 1000;
+}
+
+int kusb_bulk(kusb_io* io, unsigned char endpoint, unsigned char* data, int length,
+	int* transferred, unsigned int timeout) {
+	return kusb_bulk_until(io, endpoint, data, length, transferred, kusb_deadline_after(timeout), NULL);
+}
+
+int kusb_bulk_until(kusb_io* io, unsigned char endpoint, unsigned char* data, int length,
+	int* transferred, uint64_t deadline_us, volatile int* cancel) {
+	if (transferred != NULL) {
+		*transferred = 0;
+	}
+	// the transfer times out by itself, rounded up so it isn't early
+	unsigned int timeout = 0;
+	if (deadline_us != KUSB_NO_DEADLINE) {
+		uint64_t now = kusb_now_us();
+		if (now >= deadline_us) {
+			return LIBUSB_ERROR_TIMEOUT;
+		}
+		timeout = (unsigned int)((deadline_us - now + 999) / 1000);
+	}
+
+	volatile int completed = 0;
+	kusb_xfer xfer;
+	kusb_fill_bulk(&xfer, endpoint, data, length, sync_cb, (void*)&completed, timeout);
+
+	int res = kusb_submit(io, &xfer);
+	if (res != 0) {
+		return res;
+	}
+	int wait_ms = cancel != NULL ? KUSB_CANCEL_POLL_MS : 1000;
+	while (!sync_done(&completed) && res == 0) {
+		if (cancel != NULL && *cancel) {
+			res = LIBUSB_ERROR_INTERRUPTED;
+			break;
+		}
+		res = kusb_handle_events(io, wait_ms);
+		if (res == LIBUSB_ERROR_INTERRUPTED) {
+			res = 0; // a signal, keep waiting
+		}
+	}
+	if (!sync_done(&completed)) {
+		kusb_cancel(io, &xfer);
+		// xfer lives in this frame, so don't leave before the backend has let
+		// go of it; only an io that fails to handle events, e.g. for a device
+		// that is gone, won't give it back
+		while (!sync_done(&completed)) {
+			int drained = kusb_handle_events(io, 1000);
+			if (drained < 0 && drained != LIBUSB_ERROR_INTERRUPTED && drained != LIBUSB_ERROR_TIMEOUT) {
+				break;
+			}
+		}
+		return res;
+	}
+	if (transferred != NULL) {
+		*transferred = xfer.actual_length;
+	}
+	return xfer.status;
+}
+
+//------------------------------------------------------------------------------
+// libusb backend
+
+// libusb_transfers made up front for each io; more are made when that many
+// are in flight at once, and kept too
+#define POOL_TRANSFERS 8
+
+// libusb_dev_mem_alloc() came with libusb 1.0.21, after the libusbx we ship
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+#define HAVE_DEV_MEM
+#endif
+
+struct libusb_io_priv;
+
+// A libusb_transfer kept for reuse, with what its callback needs to find.
+typedef struct {
+	struct libusb_transfer* transfer;
+	struct libusb_io_priv* io;
+	kusb_xfer* xfer;
+} pooled_transfer;
+
+typedef struct libusb_io_priv {
+	libusb_context* ctx;
+	libusb_device_handle* dev;
+	// free and completed transfers; completions are reaped by whichever
+	// thread handles the context's events
+	pthread_mutex_t lock;
+	std::vector<pooled_transfer*> transfers;
+	// reaped, waiting for libusb_io_handle_events() to run their callbacks
+	std::vector<pooled_transfer*> done;
+	size_t next_done;
+	int completed;   // done isn't empty, for libusb_handle_events_timeout_completed()
+	void (*notify)(void* user_data);
+	void* notify_data;
+	int transfers_made;
+	int submits;
+	kusb_pool* buffers;
+} libusb_io_priv;
+
+// With the lock held.
+static pooled_transfer* make_transfer(libusb_io_priv* p) {
+	pooled_transfer* t = (pooled_transfer*)malloc(sizeof(pooled_transfer));
+	if (t == NULL) {
+		return NULL;
+	}
+	t->transfer = libusb_alloc_transfer(0);
+	if (t->transfer == NULL) {
+		free(t);
+		return NULL;
+	}
+	t->io = p;
+	t->xfer = NULL;
+	p->transfers_made++;
+	// room for all of them on the free and done lists, so putting one back
+	// or reaping one never allocates
+	p->transfers.reserve(p->transfers_made);
+	p->done.reserve(p->transfers_made);
+	return t;
+}
+
+static pooled_transfer* get_transfer(libusb_io_priv* p) {
+	pthread_mutex_lock(&p->lock);
+	p->submits++;
+	pooled_transfer* t;
+	if (!p->transfers.empty()) {
+		t = p->transfers.back();
+		p->transfers.pop_back();
+	} else {
+		t = make_transfer(p);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return t;
+}
+
+static void put_transfer(libusb_io_priv* p, pooled_transfer* t) {
+	t->xfer = NULL;
+	pthread_mutex_lock(&p->lock);
+	p->transfers.push_back(t);
+	pthread_mutex_unlock(&p->lock);
+}
+
+#ifdef HAVE_DEV_MEM
+// Memory the kernel can DMA to and from directly (usbfs mappings on Linux);
+// NULL where it can't, and the pool falls back to the heap.
+static unsigned char* dev_mem_alloc(void* user_data, int size) {
+	return libusb_dev_mem_alloc((libusb_device_handle*)user_data, (size_t)size);
+}
+
+static void dev_mem_free(void* user_data, unsigned char* buffer, int size) {
+	libusb_dev_mem_free((libusb_device_handle*)user_data, buffer, (size_t)size);
+}
+#endif
+
+static int status_to_error(enum libusb_transfer_status status) {
+	switch (status) {
+		case LIBUSB_TRANSFER_COMPLETED: return LIBUSB_SUCCESS;
+		case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+		case LIBUSB_TRANSFER_STALL: return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_OVERFLOW: return LIBUSB_ERROR_OVERFLOW;
+		default: return LIBUSB_ERROR_IO;
+	}
+}
+
+// Runs on whichever thread reaped the transfer: the runtime's event thread,
+// a kinect_reactor or one waiting in libusb_io_handle_events(). Only queues
+// it, the kusb_xfer belongs to the thread driving the io.
+static void LIBUSB_CALL libusb_io_cb(struct libusb_transfer* transfer) {
+	pooled_transfer* t = (pooled_transfer*)transfer->user_data;
+	libusb_io_priv* p = t->io;
+	pthread_mutex_lock(&p->lock);
+	p->done.push_back(t);
+	p->completed = 1;
+	void (*notify)(void*) = p->notify;
+	void* notify_data = p->notify_data;
+	pthread_mutex_unlock(&p->lock);
+	if (notify != NULL) {
+		notify(notify_data);
+	}
+}
+
+// Runs the callbacks of what has been reaped, oldest first; returns how many.
+static int deliver(libusb_io_priv* p) {
+	int n = 0;
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		if (p->next_done == p->done.size()) {
+			p->done.clear();
+			p->next_done = 0;
+			p->completed = 0;
+			pthread_mutex_unlock(&p->lock);
+			return n;
+		}
+		pooled_transfer* t = p->done[p->next_done++];
+		pthread_mutex_unlock(&p->lock);
+
+		kusb_xfer* xfer = t->xfer;
+		xfer->actual_length = t->transfer->actual_length;
+		xfer->status = status_to_error(t->transfer->status);
+		xfer->backend = NULL;
+		put_transfer(p, t);
+		kusb_complete(xfer);
+		n++;
+	}
+}
+
+static int libusb_io_submit(kusb_io* io, kusb_xfer* xfer) {
+	libusb_io_priv* p = (libusb_io_priv*)io->priv;
+	pooled_transfer* t = get_transfer(p);
+	if (t == NULL) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	t->xfer = xfer;
+	libusb_fill_bulk_transfer(t->transfer, p->dev, xfer->endpoint, xfer->buffer, xfer->length,
+		libusb_io_cb, t, xfer->timeout);
+	xfer->backend = t;
+	int res = libusb_submit_transfer(t->transfer);
+	if (res != 0) {
+		xfer->backend = NULL;
+		put_transfer(p, t);
+	}
+	return res;
+}
+
+static int libusb_io_cancel(kusb_io* io, kusb_xfer* xfer) {
+	(void)io;
+	if (xfer->backend == NULL) {
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	return libusb_cancel_transfer(((pooled_transfer*)xfer->backend)->transfer);
+}
+
+// With nothing reaped yet it handles the context's events itself, or sleeps
+// until the thread that is handling them has been through one round.
+static int libusb_io_handle_events(kusb_io* io, int timeout_ms) {
+	libusb_io_priv* p = (libusb_io_priv*)io->priv;
+	uint64_t deadline = kusb_now_us() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0) * 1000;
+	for (;;) {
+		if (deliver(p) > 0) {
+			return 0;
+		}
+		uint64_t now = kusb_now_us();
+		if (now >= deadline) {
+			return 0;
+		}
+		struct timeval tv;
+		tv.tv_sec = (long)((deadline - now) / 1000000);
+		tv.tv_usec = (long)((deadline - now) % 1000000);
+		int res = libusb_handle_events_timeout_completed(p->ctx, &tv, &p->completed);
+		if (res != 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+			deliver(p);
+			return res;
+		}
+	}
+}
+
+static int libusb_io_max_packet_size(kusb_io* io, unsigned char endpoint) {
+	libusb_io_priv* p = (libusb_io_priv*)io->priv;
+	return libusb_get_max_packet_size(libusb_get_device(p->dev), endpoint);
+}
+
+static int libusb_io_control(kusb_io* io, uint8_t request_type, uint8_t request, uint16_t value,
+	uint16_t index, unsigned char* data, uint16_t length, unsigned int timeout) {
+	libusb_io_priv* p = (libusb_io_priv*)io->priv;
+	return libusb_control_transfer(p->dev, request_type, request, value, index, data, length, timeout);
+}
+
+static int libusb_io_clear_halt(kusb_io* io, unsigned char endpoint) {
+	libusb_io_priv* p = (libusb_io_priv*)io->priv;
+	return libusb_clear_halt(p->dev, endpoint);
+}
+
+static unsigned char* libusb_io_alloc(kusb_io* io, int size) {
+	return kusb_pool_get(((libusb_io_priv*)io->priv)->buffers, size);
+}
+
+static void libusb_io_free(kusb_io* io, unsigned char* buffer, int size) {
+	kusb_pool_put(((libusb_io_priv*)io->priv)->buffers, buffer, size);
+}
+
+static void libusb_io_destroy(kusb_io* io) {
+	libusb_io_priv* p = (libusb_io_priv*)io->priv;
+	// reaped but never handled, their callbacks are not run any more
+	for (size_t i = p->next_done; i < p->done.size(); i++) {
+		p->transfers.push_back(p->done[i]);
+	}
+	if ((int)p->transfers.size() < p->transfers_made) {
+		LOG("kusb_io_close(): %d transfers still in flight\n", p->transfers_made - (int)p->transfers.size());
+	}
+	for (size_t i = 0; i < p->transfers.size(); i++) {
+		libusb_free_transfer(p->transfers[i]->transfer);
+		free(p->transfers[i]);
+	}
+	kusb_pool_destroy(p->buffers);
+	pthread_mutex_destroy(&p->lock);
+	delete p;
+	free(io);
+}
+
+static const kusb_io_ops libusb_io_ops = {
+	"libusb",
+	libusb_io_submit,
+	libusb_io_cancel,
+	libusb_io_handle_events,
+	libusb_io_max_packet_size,
+	libusb_io_control,
+	libusb_io_clear_halt,
+	libusb_io_destroy,
+	libusb_io_alloc,
+	libusb_io_free,
+};
+
+kusb_io* kusb_io_open_libusb(libusb_context* ctx, libusb_device_handle* dev) {
+	kusb_io* io = (kusb_io*)calloc(1, sizeof(kusb_io));
+	if (io == NULL) {
+		LOG("kusb_io_open_libusb(): out of memory\n");
+		return NULL;
+	}
+	libusb_io_priv* p = new libusb_io_priv();
+	p->ctx = ctx;
+	p->dev = dev;
+	pthread_mutex_init(&p->lock, NULL);
+	p->next_done = 0;
+	p->completed = 0;
+	p->notify = NULL;
+	p->notify_data = NULL;
+	p->transfers_made = 0;
+	p->submits = 0;
+#ifdef HAVE_DEV_MEM
+	p->buffers = kusb_pool_create(dev_mem_alloc, dev_mem_free, dev);
+#else
+	p->buffers = kusb_pool_create(NULL, NULL, NULL);
+#endif
+	kusb_reserve_buffers(p->buffers);
+	pthread_mutex_lock(&p->lock);
+	for (int i = 0; i < POOL_TRANSFERS; i++) {
+		pooled_transfer* t = make_transfer(p);
+		if (t == NULL) {
+			break;
+		}
+		p->transfers.push_back(t);
+	}
+	pthread_mutex_unlock(&p->lock);
+	io->ops = &libusb_io_ops;
+	io->priv = p;
+	return io;
+}
+
+void kusb_libusb_get_stats(kusb_io* io, kusb_libusb_stats* stats) {
+	libusb_io_priv* p = (libusb_io_priv*)io->priv;
+	pthread_mutex_lock(&p->lock);
+	stats->submits = p->submits;
+	stats->transfers_made = p->transfers_made;
+	pthread_mutex_unlock(&p->lock);
+	kusb_pool_get_stats(p->buffers, &stats->buffers);
+}
+
+void kusb_libusb_set_notify(kusb_io* io, void (*notify)(void* user_data), void* user_data) {
+	libusb_io_priv* p = (libusb_io_priv*)io->priv;
+	pthread_mutex_lock(&p->lock);
+	p->notify = notify;
+	p->notify_data = user_data;
+	pthread_mutex_unlock(&p->lock);
+}
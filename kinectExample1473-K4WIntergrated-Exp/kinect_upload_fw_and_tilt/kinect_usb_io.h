@@ -0,0 +1,139 @@
+//
+//  kinect_usb_io.h
+//  kinectExample
+//
+//  Small asynchronous bulk transfer layer used by the firmware upload and
+//  motor code, plus blocking control transfers for the 1414 motor. A kusb_io
+//  is a table of backend functions plus private state, so the same protocol
+//  code can run against libusb or a simulated device.
+//
+
+#ifndef __kinectExample__kinect_usb_io__
+#define __kinectExample__kinect_usb_io__
+
+#include "kinect_usb_pool.h"
+
+#include <stdint.h>
+#include <libusb.h>
+
+typedef struct kusb_io kusb_io;
+typedef struct kusb_xfer kusb_xfer;
+
+typedef void (*kusb_xfer_cb)(kusb_xfer* xfer);
+
+// One bulk transfer. status uses the libusb_error codes (0 on success,
+// LIBUSB_ERROR_PIPE for a stall, LIBUSB_ERROR_TIMEOUT, ...).
+struct kusb_xfer {
+	unsigned char endpoint;
+	unsigned char* buffer;
+	int length;
+	int actual_length;
+	int status;
+	unsigned int timeout; // ms, 0 waits forever
+	uint64_t submit_us;   // kusb_now_us() at kusb_submit()
+	kusb_xfer_cb callback;
+	void* user_data;
+	void* backend; // owned by the backend while submitted
+};
+
+typedef struct {
+	const char* name;
+	int (*submit)(kusb_io* io, kusb_xfer* xfer);
+	int (*cancel)(kusb_io* io, kusb_xfer* xfer);
+	// Runs completions, waiting at most timeout_ms for one to arrive.
+	int (*handle_events)(kusb_io* io, int timeout_ms);
+	// wMaxPacketSize of endpoint, or a libusb_error code
+	int (*max_packet_size)(kusb_io* io, unsigned char endpoint);
+	// Blocking control transfer, same contract as libusb_control_transfer().
+	int (*control)(kusb_io* io, uint8_t request_type, uint8_t request, uint16_t value,
+		uint16_t index, unsigned char* data, uint16_t length, unsigned int timeout);
+	// Blocking, same contract as libusb_clear_halt(). A halted endpoint
+	// fails every transfer with LIBUSB_ERROR_PIPE until this is done.
+	int (*clear_halt)(kusb_io* io, unsigned char endpoint);
+	void (*destroy)(kusb_io* io);
+	// Transfer buffers the backend can hand to the device without copying.
+	// NULL for both uses malloc(). The libusb, usbfs and simulator backends
+	// keep them in a kusb_pool per io.
+	unsigned char* (*alloc)(kusb_io* io, int size);
+	void (*free)(kusb_io* io, unsigned char* buffer, int size);
+} kusb_io_ops;
+
+struct kusb_io {
+	const kusb_io_ops* ops;
+	void* priv;
+};
+
+// Wraps an opened, claimed libusb handle. The context and handle stay owned
+// by the caller and the handle has to stay open until kusb_io_close(); ctx
+// may be NULL for the default context. libusb_transfers are made up front
+// and reused, buffers from kusb_alloc() come from libusb_dev_mem_alloc()
+// where libusb and the kernel have it.
+//
+// Whichever thread handles ctx's events reaps the transfers, e.g. the
+// kinect_usb_runtime event thread, but the kusb_xfer callbacks only run
+// from kusb_handle_events(), on the thread driving the io, so protocol code
+// on top needs no locking of its own.
+kusb_io* kusb_io_open_libusb(libusb_context* ctx, libusb_device_handle* dev);
+void kusb_io_close(kusb_io* io);
+
+typedef struct {
+	int submits;
+	int transfers_made;       // libusb_alloc_transfer() calls
+	kusb_pool_stats buffers;
+} kusb_libusb_stats;
+
+// io must come from kusb_io_open_libusb().
+void kusb_libusb_get_stats(kusb_io* io, kusb_libusb_stats* stats);
+
+// notify is called, from the thread that reaped it, each time a transfer
+// on io is waiting for kusb_handle_events(); for an event loop that sleeps
+// on something other than the io. NULL turns it off.
+void kusb_libusb_set_notify(kusb_io* io, void (*notify)(void* user_data), void* user_data);
+
+// For backends: fills a new pool with what a motor session or blocking
+// command takes, so not even the first ones allocate.
+void kusb_reserve_buffers(kusb_pool* pool);
+
+void kusb_fill_bulk(kusb_xfer* xfer, unsigned char endpoint, unsigned char* buffer, int length,
+	kusb_xfer_cb callback, void* user_data, unsigned int timeout);
+int kusb_submit(kusb_io* io, kusb_xfer* xfer);
+int kusb_cancel(kusb_io* io, kusb_xfer* xfer);
+int kusb_handle_events(kusb_io* io, int timeout_ms);
+int kusb_max_packet_size(kusb_io* io, unsigned char endpoint);
+// Buffer for transfers on io, NULL if out of memory. Must go back through
+// kusb_free() with the same size, before io is closed.
+unsigned char* kusb_alloc(kusb_io* io, int size);
+void kusb_free(kusb_io* io, unsigned char* buffer, int size);
+// Bytes transferred, or a libusb_error code.
+int kusb_control(kusb_io* io, uint8_t request_type, uint8_t request, uint16_t value,
+	uint16_t index, unsigned char* data, uint16_t length, unsigned int timeout);
+// Nothing may be in flight on endpoint.
+int kusb_clear_halt(kusb_io* io, unsigned char endpoint);
+
+// Blocking transfer with the same contract as libusb_bulk_transfer().
+int kusb_bulk(kusb_io* io, unsigned char endpoint, unsigned char* data, int length,
+	int* transferred, unsigned int timeout);
+
+// Deadlines are kusb_now_us() times, so one can cover a command and its reply
+// together. KUSB_NO_DEADLINE waits forever.
+#define KUSB_NO_DEADLINE 0
+uint64_t kusb_deadline_after(unsigned int timeout_ms);
+
+// How often a blocked kusb_bulk_until() looks at its cancel flag, ms.
+#define KUSB_CANCEL_POLL_MS 50
+
+// kusb_bulk() that gives up at deadline_us (LIBUSB_ERROR_TIMEOUT, also when
+// it has already passed) or soon after *cancel becomes non zero
+// (LIBUSB_ERROR_INTERRUPTED). cancel may be NULL; it is the only thing
+// another thread may touch while this runs.
+int kusb_bulk_until(kusb_io* io, unsigned char endpoint, unsigned char* data, int length,
+	int* transferred, uint64_t deadline_us, volatile int* cancel);
+
+// For backends: records xfer in the transfer trace (and capture, if one is
+// running) and runs its callback.
+void kusb_complete(kusb_xfer* xfer);
+
+// Monotonic clock in microseconds.
+uint64_t kusb_now_us();
+
+#endif /* defined(__kinectExample__kinect_usb_io__) */
@@ -0,0 +1,192 @@
+//
+//  kinect_usb_pool.cpp
+//  kinectExample
+//
+
+#include "kinect_usb_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <algorithm>
+#include <vector>
+
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+
+#define CACHE_LINE 64
+#define PAGE 4096
+
+static const int class_size[KUSB_POOL_CLASSES] = { 64, 512, 4096, 16384 };
+
+struct kusb_pool {
+	kusb_pool_alloc_fn alloc;
+	kusb_pool_free_fn free;
+	void* user_data;
+	// held only to move a pointer on or off a list, never across a call
+	// into the backing allocator
+	volatile int lock;
+	// reserved up front, so putting a buffer back never allocates
+	std::vector<unsigned char*> free_list[KUSB_POOL_CLASSES];
+	// sorted; only looked at when a buffer is really freed
+	std::vector<unsigned char*> backed;
+	kusb_pool_stats stats;
+};
+
+static void lock(kusb_pool* pool) {
+	while (__sync_lock_test_and_set(&pool->lock, 1)) {
+		sched_yield();
+	}
+}
+
+static void unlock(kusb_pool* pool) {
+	__sync_lock_release(&pool->lock);
+}
+
+static int class_of(int size) {
+	for (int i = 0; i < KUSB_POOL_CLASSES; i++) {
+		if (size <= class_size[i]) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Without the lock.
+static unsigned char* fresh(kusb_pool* pool, int size) {
+	unsigned char* buffer = pool->alloc != NULL ? pool->alloc(pool->user_data, size) : NULL;
+	if (buffer != NULL) {
+		lock(pool);
+		pool->backed.insert(std::upper_bound(pool->backed.begin(), pool->backed.end(), buffer), buffer);
+		pool->stats.backing++;
+		unlock(pool);
+		return buffer;
+	}
+	void* p = NULL;
+	if (posix_memalign(&p, size >= PAGE ? PAGE : CACHE_LINE, size) != 0) {
+		return NULL;
+	}
+	lock(pool);
+	pool->stats.heap++;
+	unlock(pool);
+	return (unsigned char*)p;
+}
+
+// Without the lock.
+static void release(kusb_pool* pool, unsigned char* buffer, int size) {
+	lock(pool);
+	std::vector<unsigned char*>::iterator it =
+		std::lower_bound(pool->backed.begin(), pool->backed.end(), buffer);
+	int backed = it != pool->backed.end() && *it == buffer;
+	if (backed) {
+		pool->backed.erase(it);
+	}
+	unlock(pool);
+	if (backed) {
+		pool->free(pool->user_data, buffer, size);
+	} else {
+		free(buffer);
+	}
+}
+
+kusb_pool* kusb_pool_create(kusb_pool_alloc_fn alloc, kusb_pool_free_fn free, void* user_data) {
+	kusb_pool* pool = new kusb_pool();
+	pool->alloc = alloc;
+	pool->free = free;
+	pool->user_data = user_data;
+	pool->lock = 0;
+	for (int i = 0; i < KUSB_POOL_CLASSES; i++) {
+		pool->free_list[i].reserve(KUSB_POOL_KEEP);
+	}
+	memset(&pool->stats, 0, sizeof(pool->stats));
+	return pool;
+}
+
+void kusb_pool_destroy(kusb_pool* pool) {
+	if (pool == NULL) {
+		return;
+	}
+	if (pool->stats.outstanding > 0) {
+		LOG("kusb_pool: %d buffers still out\n", pool->stats.outstanding);
+	}
+	for (int i = 0; i < KUSB_POOL_CLASSES; i++) {
+		for (size_t j = 0; j < pool->free_list[i].size(); j++) {
+			release(pool, pool->free_list[i][j], class_size[i]);
+		}
+	}
+	delete pool;
+}
+
+int kusb_pool_reserve(kusb_pool* pool, int size, int count) {
+	int c = class_of(size);
+	if (c < 0) {
+		return 0;
+	}
+	std::vector<unsigned char*>& list = pool->free_list[c];
+	if (count > KUSB_POOL_KEEP) {
+		count = KUSB_POOL_KEEP;
+	}
+	lock(pool);
+	int held = (int)list.size();
+	unlock(pool);
+	for (; held < count; held++) {
+		unsigned char* buffer = fresh(pool, class_size[c]);
+		if (buffer == NULL) {
+			break;
+		}
+		lock(pool);
+		list.push_back(buffer);
+		unlock(pool);
+	}
+	return held;
+}
+
+unsigned char* kusb_pool_get(kusb_pool* pool, int size) {
+	int c = class_of(size);
+	unsigned char* buffer = NULL;
+	lock(pool);
+	pool->stats.gets++;
+	if (c >= 0 && !pool->free_list[c].empty()) {
+		buffer = pool->free_list[c].back();
+		pool->free_list[c].pop_back();
+		pool->stats.hits++;
+		pool->stats.outstanding++;
+	}
+	unlock(pool);
+	if (buffer == NULL) {
+		buffer = fresh(pool, c >= 0 ? class_size[c] : size);
+		if (buffer != NULL) {
+			lock(pool);
+			pool->stats.outstanding++;
+			unlock(pool);
+		}
+	}
+	return buffer;
+}
+
+void kusb_pool_put(kusb_pool* pool, unsigned char* buffer, int size) {
+	if (buffer == NULL) {
+		return;
+	}
+	int c = class_of(size);
+	lock(pool);
+	pool->stats.outstanding--;
+	int kept = c >= 0 && pool->free_list[c].size() < KUSB_POOL_KEEP;
+	if (kept) {
+		pool->free_list[c].push_back(buffer);
+	}
+	unlock(pool);
+	if (!kept) {
+		release(pool, buffer, c >= 0 ? class_size[c] : size);
+	}
+}
+
+void kusb_pool_get_stats(kusb_pool* pool, kusb_pool_stats* stats) {
+	lock(pool);
+	*stats = pool->stats;
+	stats->cached = 0;
+	for (int i = 0; i < KUSB_POOL_CLASSES; i++) {
+		stats->cached += (int)pool->free_list[i].size();
+	}
+	unlock(pool);
+}
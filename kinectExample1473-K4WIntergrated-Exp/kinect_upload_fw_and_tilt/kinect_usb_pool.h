@@ -0,0 +1,60 @@
+//
+//  kinect_usb_pool.h
+//  kinectExample
+//
+//  Per device cache of transfer buffers for the kusb_io backends. Buffers
+//  come in a few size classes, from a command up to a firmware page; one
+//  that is freed goes on its class's free list and the next kusb_alloc() of
+//  that class takes it back, so once a session has warmed up its commands,
+//  polls and pages never reach the backing allocator. That is
+//  libusb_dev_mem_alloc() or a usbfs mapping where the backend has one, and
+//  aligned heap memory otherwise: cache line aligned, page aligned from a
+//  page up.
+//
+//  Longer buffers than the largest class are passed straight through.
+//  Safe to use from several threads.
+//
+
+#ifndef __kinectExample__kinect_usb_pool__
+#define __kinectExample__kinect_usb_pool__
+
+#include <stdint.h>
+
+#define KUSB_POOL_CLASSES   4   // 64, 512, 4096 and 16384 bytes
+#define KUSB_POOL_KEEP      32  // free buffers kept per class at most
+
+typedef struct kusb_pool kusb_pool;
+
+// Backing allocator; NULL from alloc makes the pool fall back to the heap
+// for that buffer.
+typedef unsigned char* (*kusb_pool_alloc_fn)(void* user_data, int size);
+typedef void (*kusb_pool_free_fn)(void* user_data, unsigned char* buffer, int size);
+
+typedef struct {
+	int gets;
+	int hits;            // served from a free list
+	int backing;         // buffers the backing allocator handed out
+	int heap;            // buffers that came from the heap instead
+	int outstanding;     // given out and not put back yet
+	int cached;          // on the free lists now
+} kusb_pool_stats;
+
+// alloc and free NULL use the heap only.
+kusb_pool* kusb_pool_create(kusb_pool_alloc_fn alloc, kusb_pool_free_fn free, void* user_data);
+
+// Hands everything cached back to the backing allocator. Buffers still out
+// have to be put back first.
+void kusb_pool_destroy(kusb_pool* pool);
+
+// Fills the free list of size's class up to count, so the first uses don't
+// allocate either. Returns how many it holds.
+int kusb_pool_reserve(kusb_pool* pool, int size, int count);
+
+// NULL if out of memory. size is rounded up to its class.
+unsigned char* kusb_pool_get(kusb_pool* pool, int size);
+// size as passed to kusb_pool_get().
+void kusb_pool_put(kusb_pool* pool, unsigned char* buffer, int size);
+
+void kusb_pool_get_stats(kusb_pool* pool, kusb_pool_stats* stats);
+
+#endif /* defined(__kinectExample__kinect_usb_pool__) */
@@ -0,0 +1,324 @@
+//
+//  kinect_usb_replay.cpp
+//  kinectExample
+//
+
+#include "kinect_usb_replay.h"
+#include "kinect_protocol.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <deque>
+#include <map>
+
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+#define fn_le32(x) (x)
+
+// what a replayed device reports for both endpoints
+#define REPLAY_MAX_PACKET_SIZE 512
+
+typedef struct {
+	kusb_xfer* xfer;
+	uint64_t submit_us;
+} replay_pending;
+
+struct replay_device {
+	const kinect_capture* capture;
+	kinect_replay_mode mode;
+	kinect_replay_stats stats;
+	int next;                       // record whose turn it is
+	std::deque<replay_pending> out_queue;
+	std::deque<replay_pending> in_queue;
+	std::deque<kusb_xfer*> cancelled;
+	std::map<uint32_t, uint32_t> tags; // recorded tag / seq -> the one sent now
+	// the last completion, when recorded and now, for pacing real time replay
+	uint64_t last_recorded_us;
+	uint64_t last_live_us;
+};
+
+// Records cancelled while recording say nothing about the device; the
+// replaying code cancels its own transfer again.
+static void skip_cancelled(replay_device* d) {
+	int count = kinect_capture_count(d->capture);
+	while (d->next < count && kinect_capture_get(d->capture, d->next)->status == LIBUSB_ERROR_INTERRUPTED) {
+		d->next++;
+	}
+}
+
+static uint32_t word(const unsigned char* data, int offset) {
+	uint32_t v;
+	memcpy(&v, data + offset, 4);
+	return fn_le32(v);
+}
+
+static void serve_out(replay_device* d, const kinect_capture_record* r, kusb_xfer* xfer) {
+	const unsigned char* recorded = kinect_capture_data(d->capture, r);
+	bool same = xfer->length == r->length;
+	if (same && r->captured >= 8 && word(recorded, 0) == KINECT_CMD_MAGIC) {
+		// a command: same but for its tag, which is remembered for the reply
+		d->tags[word(recorded, 4)] = word(xfer->buffer, 4);
+		same = word(xfer->buffer, 0) == KINECT_CMD_MAGIC
+			&& memcmp(xfer->buffer + 8, recorded + 8, r->captured - 8) == 0;
+	} else if (same && r->captured > 0) {
+		same = memcmp(xfer->buffer, recorded, r->captured) == 0;
+	}
+	if (!same) {
+		d->stats.diverged++;
+	}
+	xfer->actual_length = r->actual < xfer->length ? r->actual : xfer->length;
+	xfer->status = r->status;
+}
+
+static void serve_in(replay_device* d, const kinect_capture_record* r, kusb_xfer* xfer) {
+	int length = (int)r->captured;
+	if (length > xfer->length) {
+		d->stats.diverged++;
+		length = xfer->length;
+		xfer->status = LIBUSB_ERROR_OVERFLOW;
+	} else {
+		xfer->status = r->status;
+	}
+	if (length > 0) {
+		memcpy(xfer->buffer, kinect_capture_data(d->capture, r), length);
+	}
+	if (length >= 8 && word(xfer->buffer, 0) == KINECT_REPLY_MAGIC) {
+		std::map<uint32_t, uint32_t>::const_iterator it = d->tags.find(word(xfer->buffer, 4));
+		if (it != d->tags.end()) {
+			uint32_t tag = fn_le32(it->second);
+			memcpy(xfer->buffer + 4, &tag, 4);
+		}
+	}
+	xfer->actual_length = length;
+}
+
+// The transfer to complete next, and when. NULL if its turn hasn't come.
+static kusb_xfer* next_ready(replay_device* d, uint64_t* when) {
+	skip_cancelled(d);
+	const kinect_capture_record* r = kinect_capture_get(d->capture, d->next);
+	if (r == NULL) {
+		return NULL;
+	}
+	std::deque<replay_pending>& queue = (r->endpoint & 0x80) ? d->in_queue : d->out_queue;
+	if (queue.empty()) {
+		return NULL;
+	}
+	const replay_pending& p = queue.front();
+	*when = p.submit_us;
+	if (d->mode == KINECT_REPLAY_REALTIME) {
+		// as long after the previous completion as when recorded, so
+		// transfers that overlapped still do, and at least as long after
+		// its own submit as was left of its wait then
+		uint64_t since = r->submit_us > d->last_recorded_us ? r->submit_us : d->last_recorded_us;
+		if (d->last_live_us != 0 && r->complete_us > d->last_recorded_us) {
+			uint64_t paced = d->last_live_us + (r->complete_us - d->last_recorded_us);
+			if (paced > *when) *when = paced;
+		}
+		if (r->complete_us > since && p.submit_us + (r->complete_us - since) > *when) {
+			*when = p.submit_us + (r->complete_us - since);
+		}
+	}
+	return p.xfer;
+}
+
+// The soonest pending transfer to give up on, NULL if none will.
+static kusb_xfer* next_timeout(replay_device* d, uint64_t* when) {
+	kusb_xfer* best = NULL;
+	std::deque<replay_pending>* queues[2] = { &d->out_queue, &d->in_queue };
+	for (int q = 0; q < 2; q++) {
+		for (size_t i = 0; i < queues[q]->size(); i++) {
+			const replay_pending& p = (*queues[q])[i];
+			if (p.xfer->timeout == 0) {
+				continue;
+			}
+			uint64_t t = p.submit_us + (uint64_t)p.xfer->timeout * 1000;
+			if (best == NULL || t < *when) {
+				best = p.xfer;
+				*when = t;
+			}
+		}
+	}
+	return best;
+}
+
+static bool remove_pending(std::deque<replay_pending>& queue, kusb_xfer* xfer) {
+	for (std::deque<replay_pending>::iterator it = queue.begin(); it != queue.end(); ++it) {
+		if (it->xfer == xfer) {
+			queue.erase(it);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void complete_next(replay_device* d, kusb_xfer* xfer) {
+	const kinect_capture_record* r = kinect_capture_get(d->capture, d->next++);
+	d->last_recorded_us = r->complete_us;
+	d->last_live_us = kusb_now_us();
+	if (xfer->endpoint & 0x80) {
+		d->in_queue.pop_front();
+		serve_in(d, r, xfer);
+	} else {
+		d->out_queue.pop_front();
+		serve_out(d, r, xfer);
+	}
+	if ((xfer->endpoint & 0x7f) != (r->endpoint & 0x7f)) {
+		d->stats.diverged++;
+	}
+	d->stats.transfers++;
+	xfer->backend = NULL;
+	kusb_complete(xfer);
+}
+
+static void time_out(replay_device* d, kusb_xfer* xfer) {
+	remove_pending((xfer->endpoint & 0x80) ? d->in_queue : d->out_queue, xfer);
+	d->stats.timeouts++;
+	xfer->backend = NULL;
+	xfer->actual_length = 0;
+	xfer->status = LIBUSB_ERROR_TIMEOUT;
+	kusb_complete(xfer);
+}
+
+static void sleep_until(uint64_t when) {
+	uint64_t now = kusb_now_us();
+	if (when > now + 200) {
+		usleep((useconds_t)(when - now - 100));
+	}
+	while (kusb_now_us() < when) {
+		// usleep overshoots by more than most recorded gaps
+	}
+}
+
+static int replay_submit(kusb_io* io, kusb_xfer* xfer) {
+	replay_device* d = (replay_device*)io->priv;
+	replay_pending p;
+	p.xfer = xfer;
+	p.submit_us = kusb_now_us();
+	xfer->backend = d;
+	if (xfer->endpoint & 0x80) {
+		d->in_queue.push_back(p);
+	} else {
+		d->out_queue.push_back(p);
+	}
+	return 0;
+}
+
+static int replay_cancel(kusb_io* io, kusb_xfer* xfer) {
+	replay_device* d = (replay_device*)io->priv;
+	if (!remove_pending(d->out_queue, xfer) && !remove_pending(d->in_queue, xfer)) {
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	d->cancelled.push_back(xfer);
+	return 0;
+}
+
+static int replay_handle_events(kusb_io* io, int timeout_ms) {
+	replay_device* d = (replay_device*)io->priv;
+	uint64_t deadline = kusb_now_us() + (uint64_t)timeout_ms * 1000;
+	int handled = 0;
+
+	while (true) {
+		while (!d->cancelled.empty()) {
+			kusb_xfer* xfer = d->cancelled.front();
+			d->cancelled.pop_front();
+			xfer->backend = NULL;
+			xfer->actual_length = 0;
+			xfer->status = LIBUSB_ERROR_INTERRUPTED;
+			kusb_complete(xfer);
+			handled++;
+		}
+
+		uint64_t now = kusb_now_us();
+		uint64_t ready_at = 0;
+		kusb_xfer* ready = next_ready(d, &ready_at);
+		if (ready != NULL && ready_at <= now) {
+			complete_next(d, ready);
+			handled++;
+			continue;
+		}
+		uint64_t timeout_at = 0;
+		kusb_xfer* expired = next_timeout(d, &timeout_at);
+		if (expired != NULL && timeout_at <= now) {
+			time_out(d, expired);
+			handled++;
+			continue;
+		}
+		if (handled > 0 || now >= deadline) {
+			return 0;
+		}
+		uint64_t wake = deadline;
+		if (ready != NULL && ready_at < wake) wake = ready_at;
+		if (expired != NULL && timeout_at < wake) wake = timeout_at;
+		sleep_until(wake);
+	}
+}
+
+static int replay_max_packet_size(kusb_io* io, unsigned char endpoint) {
+	(void)io;
+	(void)endpoint;
+	return REPLAY_MAX_PACKET_SIZE;
+}
+
+static int replay_control(kusb_io* io, uint8_t request_type, uint8_t request, uint16_t value,
+	uint16_t index, unsigned char* data, uint16_t length, unsigned int timeout) {
+	(void)io;
+	(void)request_type;
+	(void)request;
+	(void)value;
+	(void)index;
+	(void)data;
+	(void)length;
+	(void)timeout;
+	// not in captures
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+static int replay_clear_halt(kusb_io* io, unsigned char endpoint) {
+	(void)io;
+	(void)endpoint;
+	// captures don't record halts, nothing to replay
+	return 0;
+}
+
+static void replay_destroy(kusb_io* io) {
+	delete (replay_device*)io->priv;
+	delete io;
+}
+
+static const kusb_io_ops replay_io_ops = {
+	"replay",
+	replay_submit,
+	replay_cancel,
+	replay_handle_events,
+	replay_max_packet_size,
+	replay_control,
+	replay_clear_halt,
+	replay_destroy,
+	NULL,
+	NULL,
+};
+
+kusb_io* kinect_replay_open(const kinect_capture* capture, kinect_replay_mode mode) {
+	if (capture == NULL) {
+		return NULL;
+	}
+	replay_device* d = new replay_device();
+	d->capture = capture;
+	d->mode = mode;
+	memset(&d->stats, 0, sizeof(d->stats));
+	d->next = 0;
+	d->last_recorded_us = 0;
+	d->last_live_us = 0;
+
+	kusb_io* io = new kusb_io();
+	io->ops = &replay_io_ops;
+	io->priv = d;
+	return io;
+}
+
+void kinect_replay_get_stats(kusb_io* io, kinect_replay_stats* stats) {
+	replay_device* d = (replay_device*)io->priv;
+	skip_cancelled(d);
+	*stats = d->stats;
+	stats->left = kinect_capture_count(d->capture) - d->next;
+}
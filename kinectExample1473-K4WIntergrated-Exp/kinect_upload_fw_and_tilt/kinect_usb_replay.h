@@ -0,0 +1,41 @@
+//
+//  kinect_usb_replay.h
+//  kinectExample
+//
+//  A kusb_io backend that plays a kinect_capture back, so a recorded device
+//  session can be rerun on a machine without a sensor. Transfers complete
+//  strictly in the order they did when recorded, each with the recorded
+//  status, length and, for IN transfers, bytes. Tags and sequence numbers in
+//  replies are rewritten to the ones the replaying code sent.
+//
+//  KINECT_REPLAY_REALTIME holds each transfer for as long as it took when
+//  recorded; KINECT_REPLAY_FAST completes it as soon as it is its turn, which
+//  leaves only the host side of the protocol code to be timed. A transfer
+//  that doesn't fit the recording (other endpoint, other bytes sent) is
+//  counted as diverged but served anyway; one that never gets its turn times
+//  out after its own timeout in both modes, as it would on the device.
+//
+
+#ifndef __kinectExample__kinect_usb_replay__
+#define __kinectExample__kinect_usb_replay__
+
+#include "kinect_usb_io.h"
+#include "kinect_capture.h"
+
+typedef enum {
+	KINECT_REPLAY_REALTIME,
+	KINECT_REPLAY_FAST
+} kinect_replay_mode;
+
+typedef struct {
+	int transfers;    // served from the capture
+	int diverged;     // of those, not what the recording had
+	int timeouts;     // never got their turn
+	int left;         // records not replayed
+} kinect_replay_stats;
+
+// capture has to outlive the io.
+kusb_io* kinect_replay_open(const kinect_capture* capture, kinect_replay_mode mode);
+void kinect_replay_get_stats(kusb_io* io, kinect_replay_stats* stats);
+
+#endif /* defined(__kinectExample__kinect_usb_replay__) */
@@ -0,0 +1,314 @@
+//
+//  kinect_usb_runtime.cpp
+//  kinectExample
+//
+
+#include "kinect_usb_runtime.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <vector>
+
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+
+// how long the event thread blocks in libusb at a time, which bounds how
+// long kinect_usb_shutdown() waits for it
+#define EVENT_SLICE_MS 100
+
+// USB 3 allows 7 tiers of hubs
+#define MAX_PORTS 7
+
+// Where a device is plugged in, which tells two Kinects apart where their
+// vid:pid can't.
+typedef struct {
+	uint8_t bus;
+	uint8_t ports[MAX_PORTS];
+	int port_count;
+} device_path;
+
+typedef struct {
+	libusb_device_handle* dev;
+	libusb_device* device;
+	device_path path;
+	uint16_t vid;
+	uint16_t pid;
+} runtime_handle;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static libusb_context* context;
+static pthread_t event_thread;
+static int event_running;
+static int paused;          // kinect_usb_pause_events() calls not resumed
+static volatile int stopping;
+// a pause or kinect_usb_shutdown() is under way with the lock let go;
+// everything else waits for changed until it is done
+static int changing;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static std::vector<runtime_handle> handles;
+static kinect_usb_stats stats;
+
+static void* event_loop(void* arg) {
+	libusb_context* ctx = (libusb_context*)arg;
+	while (!stopping) {
+		struct timeval tv;
+		tv.tv_sec = EVENT_SLICE_MS / 1000;
+		tv.tv_usec = (EVENT_SLICE_MS % 1000) * 1000;
+		int res = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+		if (res != 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+			LOG("kinect_usb: handling events failed: %d\n", res);
+		}
+	}
+	return NULL;
+}
+
+// With the lock held.
+static int start_events(libusb_context* ctx) {
+	stopping = 0;
+	if (pthread_create(&event_thread, NULL, event_loop, ctx) != 0) {
+		LOG("kinect_usb: can't start the event thread\n");
+		return -1;
+	}
+	event_running = 1;
+	return 0;
+}
+
+// With the lock held and changing set; the lock is let go while the thread
+// finishes.
+static void stop_events() {
+	if (!event_running) {
+		return;
+	}
+	stopping = 1;
+	event_running = 0;
+	pthread_mutex_unlock(&lock);
+	pthread_join(event_thread, NULL);
+	pthread_mutex_lock(&lock);
+}
+
+// With the lock held.
+static void settle() {
+	while (changing) {
+		pthread_cond_wait(&changed, &lock);
+	}
+}
+
+// With the lock held.
+static void done_changing() {
+	changing = 0;
+	pthread_cond_broadcast(&changed);
+}
+
+// With the lock held.
+static libusb_context* context_locked() {
+	settle();
+	if (context != NULL) {
+		return context;
+	}
+	libusb_context* ctx = NULL;
+	int res = libusb_init(&ctx);
+	if (res != 0) {
+		LOG("kinect_usb: libusb_init failed: %d\n", res);
+		return NULL;
+	}
+	stats.inits++;
+	if (paused == 0 && start_events(ctx) != 0) {
+		libusb_exit(ctx);
+		return NULL;
+	}
+	context = ctx;
+	return context;
+}
+
+libusb_context* kinect_usb_context() {
+	pthread_mutex_lock(&lock);
+	libusb_context* ctx = context_locked();
+	pthread_mutex_unlock(&lock);
+	return ctx;
+}
+
+static void path_of(libusb_device* device, device_path* path) {
+	path->bus = libusb_get_bus_number(device);
+	path->port_count = libusb_get_port_numbers(device, path->ports, MAX_PORTS);
+	if (path->port_count < 0) {
+		// a root hub; the address is as good while it stays plugged in
+		path->ports[0] = libusb_get_device_address(device);
+		path->port_count = 1;
+	}
+}
+
+// With the lock held.
+static int is_open(const device_path* path) {
+	for (size_t i = 0; i < handles.size(); i++) {
+		const device_path* p = &handles[i].path;
+		if (p->bus == path->bus && p->port_count == path->port_count
+			&& memcmp(p->ports, path->ports, path->port_count) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// With the lock held: opens device and claims interface 0, unless it is
+// open already.
+static libusb_device_handle* claim(libusb_device* device, uint16_t vid, uint16_t pid) {
+	device_path path;
+	path_of(device, &path);
+	if (is_open(&path)) {
+		LOG("kinect_usb: %04x:%04x on bus %d is in use already\n", vid, pid, path.bus);
+		stats.refused++;
+		return NULL;
+	}
+
+	libusb_device_handle* dev = NULL;
+	int res = libusb_open(device, &dev);
+	if (res != 0) {
+		LOG("kinect_usb: can't open %04x:%04x: %d\n", vid, pid, res);
+		return NULL;
+	}
+	int configuration = 0;
+	libusb_get_configuration(dev, &configuration);
+	if (configuration != 1) {
+		libusb_set_configuration(dev, 1);
+	}
+	res = libusb_claim_interface(dev, 0);
+	if (res != 0) {
+		LOG("kinect_usb: can't claim interface 0 of %04x:%04x: %d\n", vid, pid, res);
+		libusb_close(dev);
+		return NULL;
+	}
+
+	runtime_handle h;
+	h.dev = dev;
+	h.device = libusb_ref_device(device);
+	h.path = path;
+	h.vid = vid;
+	h.pid = pid;
+	handles.push_back(h);
+	stats.opens++;
+	stats.open++;
+	return dev;
+}
+
+libusb_device_handle* kinect_usb_open(uint16_t vid, uint16_t pid) {
+	pthread_mutex_lock(&lock);
+	libusb_context* ctx = context_locked();
+	libusb_device_handle* dev = NULL;
+	if (ctx != NULL) {
+		libusb_device** list = NULL;
+		ssize_t count = libusb_get_device_list(ctx, &list);
+		stats.scans++;
+		int in_use = 0;
+		for (ssize_t i = 0; i < count; i++) {
+			struct libusb_device_descriptor desc;
+			if (libusb_get_device_descriptor(list[i], &desc) != 0
+				|| desc.idVendor != vid || desc.idProduct != pid) {
+				continue;
+			}
+			device_path path;
+			path_of(list[i], &path);
+			if (is_open(&path)) {
+				in_use++;
+				continue;
+			}
+			dev = claim(list[i], vid, pid);
+			break;
+		}
+		if (dev == NULL && in_use > 0) {
+			LOG("kinect_usb: every %04x:%04x is in use already\n", vid, pid);
+			stats.refused++;
+		}
+		if (list != NULL) {
+			libusb_free_device_list(list, 1);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return dev;
+}
+
+libusb_device_handle* kinect_usb_open_device(libusb_device* device) {
+	pthread_mutex_lock(&lock);
+	libusb_device_handle* dev = NULL;
+	struct libusb_device_descriptor desc;
+	if (context_locked() != NULL && libusb_get_device_descriptor(device, &desc) == 0) {
+		dev = claim(device, desc.idVendor, desc.idProduct);
+	}
+	pthread_mutex_unlock(&lock);
+	return dev;
+}
+
+// With the lock held.
+static void close_handle(size_t index) {
+	runtime_handle h = handles[index];
+	handles.erase(handles.begin() + index);
+	libusb_release_interface(h.dev, 0);
+	libusb_close(h.dev);
+	libusb_unref_device(h.device);
+	stats.open--;
+}
+
+void kinect_usb_close(libusb_device_handle* dev) {
+	if (dev == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	settle();
+	for (size_t i = 0; i < handles.size(); i++) {
+		if (handles[i].dev == dev) {
+			close_handle(i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void kinect_usb_pause_events() {
+	pthread_mutex_lock(&lock);
+	settle();
+	if (paused++ == 0 && event_running) {
+		changing = 1;
+		stop_events();
+		done_changing();
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void kinect_usb_resume_events() {
+	pthread_mutex_lock(&lock);
+	settle();
+	if (paused > 0 && --paused == 0 && context != NULL && !event_running) {
+		start_events(context);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void kinect_usb_shutdown() {
+	pthread_mutex_lock(&lock);
+	settle();
+	// until libusb_exit() has returned, so nothing can start a new context
+	// or event thread in between
+	changing = 1;
+	libusb_context* ctx = context;
+	stop_events();
+	if (!handles.empty()) {
+		LOG("kinect_usb: %d handles still open at shutdown\n", (int)handles.size());
+	}
+	while (!handles.empty()) {
+		close_handle(handles.size() - 1);
+	}
+	pthread_mutex_unlock(&lock);
+	if (ctx != NULL) {
+		libusb_exit(ctx);
+	}
+	pthread_mutex_lock(&lock);
+	context = NULL;
+	done_changing();
+	pthread_mutex_unlock(&lock);
+}
+
+void kinect_usb_get_stats(kinect_usb_stats* out) {
+	pthread_mutex_lock(&lock);
+	*out = stats;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,57 @@
+//
+//  kinect_usb_runtime.h
+//  kinectExample
+//
+//  The one libusb context the firmware, motor and keep alive code share, the
+//  thread that handles its events, and the device handles opened on it.
+//  The context is created the first time anything asks for it and lives
+//  until kinect_usb_shutdown(), so later opens skip libusb_init().
+//
+//  The registry knows devices by bus and port path, so two Kinects with the
+//  same vid:pid are two devices. Each is open once at most: a second open of
+//  it is refused until kinect_usb_close(), so two sessions never read the
+//  same endpoint. Handles come with configuration 1 selected and interface
+//  0 claimed. The event thread
+//  reaps transfers on them, but through kusb_io their callbacks run on the
+//  thread driving the io (see kusb_io_open_libusb()), and a blocking one
+//  sleeps until the event thread has reaped it.
+//
+
+#ifndef __kinectExample__kinect_usb_runtime__
+#define __kinectExample__kinect_usb_runtime__
+
+#include <stdint.h>
+#include <libusb.h>
+
+// NULL if libusb can't be initialised.
+libusb_context* kinect_usb_context();
+
+// The first vid:pid device that isn't open yet; NULL if there is none.
+libusb_device_handle* kinect_usb_open(uint16_t vid, uint16_t pid);
+// device as found on kinect_usb_context()'s device list; NULL if it is open
+// already.
+libusb_device_handle* kinect_usb_open_device(libusb_device* device);
+void kinect_usb_close(libusb_device_handle* dev);
+
+// For a caller that handles the context's events itself, e.g. a
+// kinect_reactor: stops the event thread until as many resumes as pauses
+// have been made. The context and handles are left as they are.
+void kinect_usb_pause_events();
+void kinect_usb_resume_events();
+
+// Stops the event thread, closes what is still open and exits the context.
+// Calls made meanwhile from other threads wait for it; the next
+// kinect_usb_context() starts over.
+void kinect_usb_shutdown();
+
+typedef struct {
+	int inits;      // libusb_init() calls so far
+	int scans;      // device list walks to open something
+	int opens;      // handles opened
+	int refused;    // opens turned down, the device was open already
+	int open;       // handles open now
+} kinect_usb_stats;
+
+void kinect_usb_get_stats(kinect_usb_stats* stats);
+
+#endif /* defined(__kinectExample__kinect_usb_runtime__) */
@@ -0,0 +1,599 @@
+//
+//  kinect_usb_sim.cpp
+//  kinectExample
+//
+
+#include "kinect_usb_sim.h"
+#include "kinect_protocol.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <deque>
+#include <vector>
+
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+#define fn_le32(x) (x)
+
+// how long a hung device holds up a control transfer with no timeout, ms
+#define KINECT_SIM_HUNG_WAIT 5000
+
+typedef struct {
+	kusb_xfer* xfer;
+	uint64_t submit_us;
+} sim_pending;
+
+typedef struct {
+	std::vector<unsigned char> data;
+	uint64_t ready_us;
+} sim_reply;
+
+enum {
+	SIM_EVENT_NONE,
+	SIM_EVENT_OUT,
+	SIM_EVENT_IN,
+	SIM_EVENT_IN_TIMEOUT
+};
+
+struct sim_device {
+	kinect_sim_params params;
+	kinect_sim_stats stats;
+
+	std::deque<sim_pending> out_queue;
+	std::deque<sim_pending> in_queue;
+	std::deque<kusb_xfer*> cancelled;
+	std::deque<sim_reply> replies;
+	uint64_t bus_free_us;
+	// the OUT transfer at the head of the queue once it is on the bus, and
+	// the bus time IN replies took in between (packets interleave, so a reply
+	// doesn't wait for a long OUT transfer to finish)
+	uint64_t out_start_us;
+	uint64_t out_extra_us;
+	unsigned int out_count;
+	int out_halted;
+
+	kinect_sim_mode mode;
+	volatile int hung;   // set from any thread
+
+	// motor commands are worked through one at a time
+	uint64_t command_free_us;
+
+	// the motor goes from tilt_from to stats.tilt, starting at tilt_start_us
+	int tilt_from;
+	uint64_t tilt_start_us;
+
+	// bootloader state
+	int payload_left;
+	uint32_t payload_seq;
+
+	// heap backed, like a libusb io without device memory
+	kusb_pool* buffers;
+};
+
+void kinect_sim_default_params(kinect_sim_params* params) {
+	params->mode = KINECT_SIM_BOOTLOADER;
+	// roughly what a high speed bulk endpoint behind a hub gives us
+	params->transfer_latency_us = 125;
+	params->bytes_per_ms = 30000;
+	params->page_write_us = 500;
+	params->command_us = 250;
+	params->transfer_overhead_us = 10;
+	params->stall_every = 0;
+	params->max_packet_size = 512;
+	params->max_transfer_size = 0;
+	params->info_reply_size = KINECT_FW_INFO_REPLY_SIZE;
+	params->status_reply_size = 0;
+	// sensor lying flat, gravity along y
+	params->accel[0] = 0;
+	params->accel[1] = 819;
+	params->accel[2] = 0;
+	params->tilt_deg_per_s = 20;
+}
+
+static uint64_t bus_time_us(const sim_device* d, int length) {
+	if (d->params.bytes_per_ms == 0) {
+		return 0;
+	}
+	return d->params.transfer_overhead_us + (uint64_t)length * 1000 / d->params.bytes_per_ms;
+}
+
+static void queue_reply(sim_device* d, const void* data, int length, uint64_t ready_us) {
+	sim_reply reply;
+	reply.data.assign((const unsigned char*)data, (const unsigned char*)data + length);
+	reply.ready_us = ready_us;
+	d->replies.push_back(reply);
+}
+
+static void queue_status(sim_device* d, uint32_t seq, uint32_t status, uint64_t ready_us) {
+	status_code code;
+	code.magic = fn_le32(KINECT_REPLY_MAGIC);
+	code.seq = fn_le32(seq);
+	code.status = fn_le32(status);
+	queue_reply(d, &code, sizeof(code), ready_us);
+}
+
+static void queue_motor_reply(sim_device* d, uint32_t tag, uint32_t status, uint64_t ready_us) {
+	motor_reply reply;
+	reply.magic = fn_le32(KINECT_REPLY_MAGIC);
+	reply.tag = fn_le32(tag);
+	reply.status = fn_le32(status);
+	queue_reply(d, &reply, sizeof(reply), ready_us);
+}
+
+// Angle of the motor at time us, and whether it is still on its way.
+static int tilt_at(const sim_device* d, uint64_t us, int* moving) {
+	int distance = d->stats.tilt - d->tilt_from;
+	int span = distance < 0 ? -distance : distance;
+	uint64_t done = 0;
+	if (d->params.tilt_deg_per_s == 0) {
+		done = span;
+	} else if (us > d->tilt_start_us) {
+		done = (us - d->tilt_start_us) * d->params.tilt_deg_per_s / 1000000;
+	}
+	*moving = done < (uint64_t)span;
+	if (!*moving) {
+		return d->stats.tilt;
+	}
+	return d->tilt_from + (distance < 0 ? -(int)done : (int)done);
+}
+
+// Motor commands are 20 bytes, the status request only sends the first 16.
+static void motor_receive(sim_device* d, const unsigned char* buf, int length, uint64_t now) {
+	motor_command cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	if (length < 16) {
+		LOG("kinect_sim: short motor command (%d bytes) ignored\n", length);
+		return;
+	}
+	memcpy(&cmd, buf, length < (int)sizeof(cmd) ? length : sizeof(cmd));
+	if (fn_le32(cmd.magic) != KINECT_CMD_MAGIC) {
+		LOG("kinect_sim: bad magic %08X ignored\n", cmd.magic);
+		return;
+	}
+
+	d->stats.commands++;
+	uint64_t ready = (now > d->command_free_us ? now : d->command_free_us) + d->params.command_us;
+	d->command_free_us = ready;
+	switch (fn_le32(cmd.cmd)) {
+		case KINECT_MOTOR_CMD_LED:
+			d->stats.led = (int32_t)fn_le32(cmd.arg2);
+			queue_motor_reply(d, fn_le32(cmd.tag), 0, ready);
+			break;
+		case KINECT_MOTOR_CMD_TILT: {
+			int moving;
+			d->tilt_from = tilt_at(d, ready, &moving);
+			d->tilt_start_us = ready;
+			d->stats.tilt = (int32_t)fn_le32(cmd.arg2);
+			d->stats.tilts++;
+			if (moving) {
+				d->stats.tilts_while_moving++;
+			}
+			queue_motor_reply(d, fn_le32(cmd.tag), 0, ready);
+			break;
+		}
+		case KINECT_MOTOR_CMD_STATUS: {
+			int size = d->params.status_reply_size > 0 ? d->params.status_reply_size : (int)fn_le32(cmd.arg1);
+			std::vector<unsigned char> status(size > 0 ? size : 0, 0);
+			// skip four uint32_t, then x, y, z
+			for (int i = 0; i < 3 && 16 + (i + 1) * 4 <= size; i++) {
+				int32_t v = (int32_t)fn_le32(d->params.accel[i]);
+				memcpy(&status[16 + i * 4], &v, 4);
+			}
+			if (size >= KINECT_STATUS_TILT_STATE + 4) {
+				int moving;
+				int32_t angle = (int32_t)fn_le32(tilt_at(d, ready, &moving));
+				uint32_t state = fn_le32(moving ? KINECT_TILT_MOVING : KINECT_TILT_STOPPED);
+				memcpy(&status[KINECT_STATUS_TILT_ANGLE], &angle, 4);
+				memcpy(&status[KINECT_STATUS_TILT_STATE], &state, 4);
+			}
+			queue_reply(d, status.empty() ? NULL : &status[0], (int)status.size(), ready);
+			queue_motor_reply(d, fn_le32(cmd.tag), 0, ready);
+			break;
+		}
+		default:
+			queue_motor_reply(d, fn_le32(cmd.tag), 1, ready);
+			break;
+	}
+}
+
+// What the device does with bytes arriving on endpoint 0x01.
+static void device_receive(sim_device* d, const unsigned char* buf, int length, uint64_t now) {
+	if (d->hung) {
+		return;
+	}
+	if (d->mode == KINECT_SIM_APPLICATION) {
+		motor_receive(d, buf, length, now);
+		return;
+	}
+	if (d->payload_left > 0) {
+		int used = length < d->payload_left ? length : d->payload_left;
+		d->payload_left -= used;
+		d->stats.bytes_written += used;
+		if (d->payload_left == 0) {
+			d->stats.pages_written++;
+			queue_status(d, d->payload_seq, 0, now + d->params.page_write_us);
+		}
+		return;
+	}
+
+	bootloader_command cmd;
+	if (length < (int)sizeof(cmd)) {
+		LOG("kinect_sim: short command (%d bytes) ignored\n", length);
+		return;
+	}
+	memcpy(&cmd, buf, sizeof(cmd));
+	if (fn_le32(cmd.magic) != KINECT_CMD_MAGIC) {
+		LOG("kinect_sim: bad magic %08X ignored\n", cmd.magic);
+		return;
+	}
+
+	switch (fn_le32(cmd.cmd)) {
+		case KINECT_BL_CMD_INFO: {
+			std::vector<unsigned char> info(d->params.info_reply_size > 0 ? d->params.info_reply_size : 0, 0);
+			queue_reply(d, info.empty() ? NULL : &info[0], (int)info.size(), now);
+			queue_status(d, fn_le32(cmd.seq), 0, now);
+			break;
+		}
+		case KINECT_BL_CMD_WRITE:
+			d->payload_left = fn_le32(cmd.bytes);
+			d->payload_seq = fn_le32(cmd.seq);
+			if (d->payload_left == 0) {
+				queue_status(d, d->payload_seq, 0, now);
+			}
+			break;
+		case KINECT_BL_CMD_EXECUTE:
+			// the real device drops off the bus here and comes back running
+			// the motor firmware
+			d->stats.executed = 1;
+			d->mode = KINECT_SIM_APPLICATION;
+			queue_status(d, fn_le32(cmd.seq), 0, now);
+			break;
+		default:
+			queue_status(d, fn_le32(cmd.seq), 1, now);
+			break;
+	}
+}
+
+static bool out_oversized(const sim_device* d, const kusb_xfer* xfer) {
+	return d->params.max_transfer_size > 0 && xfer->length > d->params.max_transfer_size;
+}
+
+// When the head OUT transfer gets (or got) the bus, 0 if there is none.
+static uint64_t out_start(const sim_device* d) {
+	if (d->out_queue.empty() || d->out_halted) {
+		return 0;
+	}
+	if (d->out_start_us != 0) {
+		return d->out_start_us;
+	}
+	uint64_t start = d->out_queue.front().submit_us + d->params.transfer_latency_us;
+	return start < d->bus_free_us ? d->bus_free_us : start;
+}
+
+// When the front IN transfer could take the front reply, and whether it
+// slots in between the packets of an OUT transfer already on the bus.
+static uint64_t in_time(const sim_device* d, bool* interleaved) {
+	const sim_pending& p = d->in_queue.front();
+	const sim_reply& r = d->replies.front();
+	uint64_t t = p.submit_us + d->params.transfer_latency_us;
+	if (t < r.ready_us) t = r.ready_us;
+	uint64_t out = out_start(d);
+	*interleaved = out != 0 && out <= t;
+	if (!*interleaved && t < d->bus_free_us) t = d->bus_free_us;
+	return t + bus_time_us(d, (int)r.data.size());
+}
+
+static int next_event(const sim_device* d, uint64_t* when) {
+	int event = SIM_EVENT_NONE;
+	uint64_t best = 0;
+
+	if (!d->out_queue.empty()) {
+		const sim_pending& p = d->out_queue.front();
+		if (d->out_halted) {
+			// a halted endpoint refuses everything without touching the bus
+			best = p.submit_us + d->params.transfer_latency_us;
+		} else if (out_oversized(d, p.xfer)) {
+			// refused on the first packet
+			best = out_start(d) + d->params.transfer_overhead_us;
+		} else {
+			best = out_start(d) + bus_time_us(d, p.xfer->length) + d->out_extra_us;
+		}
+		event = SIM_EVENT_OUT;
+	}
+	if (!d->in_queue.empty()) {
+		const sim_pending& p = d->in_queue.front();
+		uint64_t t;
+		int kind;
+		if (!d->replies.empty()) {
+			bool interleaved;
+			t = in_time(d, &interleaved);
+			kind = SIM_EVENT_IN;
+		} else if (p.xfer->timeout != 0) {
+			t = p.submit_us + (uint64_t)p.xfer->timeout * 1000;
+			kind = SIM_EVENT_IN_TIMEOUT;
+		} else {
+			kind = SIM_EVENT_NONE;
+		}
+		if (kind != SIM_EVENT_NONE && (event == SIM_EVENT_NONE || t < best)) {
+			best = t;
+			event = kind;
+		}
+	}
+	*when = best;
+	return event;
+}
+
+static void complete_event(sim_device* d, int event, uint64_t when) {
+	kusb_xfer* xfer;
+	if (event == SIM_EVENT_OUT) {
+		xfer = d->out_queue.front().xfer;
+		d->out_queue.pop_front();
+		d->out_start_us = 0;
+		d->out_extra_us = 0;
+		d->stats.out_transfers++;
+		d->out_count++;
+		if (!d->out_halted && d->params.stall_every != 0 && d->out_count % d->params.stall_every == 0) {
+			d->out_halted = 1;
+			d->stats.halts++;
+		}
+		if (d->out_halted) {
+			// until the host clears it
+			d->stats.stalls++;
+			xfer->actual_length = 0;
+			xfer->status = LIBUSB_ERROR_PIPE;
+		} else if (out_oversized(d, xfer)) {
+			d->bus_free_us = when;
+			d->stats.oversized++;
+			xfer->actual_length = 0;
+			xfer->status = LIBUSB_ERROR_IO;
+		} else {
+			d->bus_free_us = when;
+			xfer->actual_length = xfer->length;
+			xfer->status = 0;
+			device_receive(d, xfer->buffer, xfer->length, when);
+		}
+	} else if (event == SIM_EVENT_IN) {
+		bool interleaved;
+		in_time(d, &interleaved);
+		if (interleaved) {
+			d->out_start_us = out_start(d);
+			d->out_extra_us += bus_time_us(d, (int)d->replies.front().data.size());
+		} else {
+			d->bus_free_us = when;
+		}
+		xfer = d->in_queue.front().xfer;
+		d->in_queue.pop_front();
+		d->stats.in_transfers++;
+		sim_reply& r = d->replies.front();
+		int length = (int)r.data.size();
+		if (length > xfer->length) {
+			xfer->actual_length = xfer->length;
+			xfer->status = LIBUSB_ERROR_OVERFLOW;
+		} else {
+			xfer->actual_length = length;
+			xfer->status = 0;
+		}
+		if (xfer->actual_length > 0) {
+			memcpy(xfer->buffer, &r.data[0], xfer->actual_length);
+		}
+		d->replies.pop_front();
+	} else {
+		xfer = d->in_queue.front().xfer;
+		d->in_queue.pop_front();
+		xfer->actual_length = 0;
+		xfer->status = LIBUSB_ERROR_TIMEOUT;
+	}
+	xfer->backend = NULL;
+	kusb_complete(xfer);
+}
+
+static void sleep_until(uint64_t when) {
+	uint64_t now = kusb_now_us();
+	if (when > now + 200) {
+		usleep((useconds_t)(when - now - 100));
+	}
+	while (kusb_now_us() < when) {
+		// spin out the last few microseconds, usleep is too coarse for a bus model
+	}
+}
+
+static int sim_submit(kusb_io* io, kusb_xfer* xfer) {
+	sim_device* d = (sim_device*)io->priv;
+	sim_pending p;
+	p.xfer = xfer;
+	p.submit_us = kusb_now_us();
+	xfer->backend = d;
+	if (xfer->endpoint & 0x80) {
+		d->in_queue.push_back(p);
+	} else {
+		d->out_queue.push_back(p);
+	}
+	return 0;
+}
+
+static bool remove_pending(std::deque<sim_pending>& queue, kusb_xfer* xfer) {
+	for (std::deque<sim_pending>::iterator it = queue.begin(); it != queue.end(); ++it) {
+		if (it->xfer == xfer) {
+			queue.erase(it);
+			return true;
+		}
+	}
+	return false;
+}
+
+static int sim_cancel(kusb_io* io, kusb_xfer* xfer) {
+	sim_device* d = (sim_device*)io->priv;
+	if (!d->out_queue.empty() && d->out_queue.front().xfer == xfer) {
+		d->out_start_us = 0;
+		d->out_extra_us = 0;
+	}
+	if (!remove_pending(d->out_queue, xfer) && !remove_pending(d->in_queue, xfer)) {
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	d->cancelled.push_back(xfer);
+	return 0;
+}
+
+static int sim_handle_events(kusb_io* io, int timeout_ms) {
+	sim_device* d = (sim_device*)io->priv;
+	uint64_t deadline = kusb_now_us() + (uint64_t)timeout_ms * 1000;
+	int handled = 0;
+
+	while (true) {
+		while (!d->cancelled.empty()) {
+			kusb_xfer* xfer = d->cancelled.front();
+			d->cancelled.pop_front();
+			xfer->backend = NULL;
+			xfer->actual_length = 0;
+			xfer->status = LIBUSB_ERROR_INTERRUPTED;
+			kusb_complete(xfer);
+			handled++;
+		}
+
+		uint64_t when;
+		int event = next_event(d, &when);
+		uint64_t now = kusb_now_us();
+		if (event != SIM_EVENT_NONE && when <= now) {
+			complete_event(d, event, when);
+			handled++;
+			continue;
+		}
+		if (handled > 0 || now >= deadline) {
+			return 0;
+		}
+		sleep_until(event != SIM_EVENT_NONE && when < deadline ? when : deadline);
+	}
+}
+
+static int sim_max_packet_size(kusb_io* io, unsigned char endpoint) {
+	(void)endpoint;
+	return ((sim_device*)io->priv)->params.max_packet_size;
+}
+
+static int sim_control(kusb_io* io, uint8_t request_type, uint8_t request, uint16_t value,
+	uint16_t index, unsigned char* data, uint16_t length, unsigned int timeout) {
+	(void)index;
+	sim_device* d = (sim_device*)io->priv;
+	uint64_t now = kusb_now_us();
+	if (d->hung) {
+		// never answered; a real one blocks until the timeout
+		sleep_until(now + (uint64_t)(timeout > 0 ? timeout : KINECT_SIM_HUNG_WAIT) * 1000);
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+	if (d->mode != KINECT_SIM_NUI_MOTOR) {
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	d->stats.commands++;
+	uint64_t ready = (now > d->command_free_us ? now : d->command_free_us)
+		+ d->params.transfer_latency_us + d->params.command_us;
+	d->command_free_us = ready;
+	int res = 0;
+	if (request_type == (LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT) && request == KINECT_NUI_SET_LED) {
+		d->stats.led = value;
+	} else if (request_type == (LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT) && request == KINECT_NUI_SET_TILT) {
+		int moving;
+		d->tilt_from = tilt_at(d, ready, &moving);
+		d->tilt_start_us = ready;
+		d->stats.tilt = (int16_t)value / 2;
+		d->stats.tilts++;
+		if (moving) {
+			d->stats.tilts_while_moving++;
+		}
+	} else if (request_type == (LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN) && request == KINECT_NUI_GET_STATE) {
+		unsigned char state[KINECT_NUI_STATE_SIZE];
+		memset(state, 0, sizeof(state));
+		for (int i = 0; i < 3; i++) {
+			int16_t v = (int16_t)d->params.accel[i];
+			state[2 + i * 2] = (unsigned char)((uint16_t)v >> 8);
+			state[3 + i * 2] = (unsigned char)(v & 0xff);
+		}
+		int moving;
+		state[8] = (unsigned char)(int8_t)(tilt_at(d, ready, &moving) * 2);
+		state[9] = moving ? KINECT_TILT_MOVING : KINECT_TILT_STOPPED;
+		res = length < KINECT_NUI_STATE_SIZE ? length : KINECT_NUI_STATE_SIZE;
+		memcpy(data, state, res);
+	} else {
+		res = LIBUSB_ERROR_PIPE;
+	}
+	sleep_until(ready);
+	return res;
+}
+
+static int sim_clear_halt(kusb_io* io, unsigned char endpoint) {
+	sim_device* d = (sim_device*)io->priv;
+	if (endpoint == KINECT_EP_OUT && d->out_halted) {
+		d->out_halted = 0;
+		d->stats.halts_cleared++;
+	}
+	// a control transfer's round trip
+	sleep_until(kusb_now_us() + d->params.transfer_latency_us);
+	return 0;
+}
+
+static unsigned char* sim_alloc(kusb_io* io, int size) {
+	return kusb_pool_get(((sim_device*)io->priv)->buffers, size);
+}
+
+static void sim_free(kusb_io* io, unsigned char* buffer, int size) {
+	kusb_pool_put(((sim_device*)io->priv)->buffers, buffer, size);
+}
+
+static void sim_destroy(kusb_io* io) {
+	sim_device* d = (sim_device*)io->priv;
+	kusb_pool_destroy(d->buffers);
+	delete d;
+	delete io;
+}
+
+static const kusb_io_ops sim_io_ops = {
+	"sim",
+	sim_submit,
+	sim_cancel,
+	sim_handle_events,
+	sim_max_packet_size,
+	sim_control,
+	sim_clear_halt,
+	sim_destroy,
+	sim_alloc,
+	sim_free,
+};
+
+kusb_io* kinect_sim_open(const kinect_sim_params* params) {
+	sim_device* d = new sim_device();
+	if (params != NULL) {
+		d->params = *params;
+	} else {
+		kinect_sim_default_params(&d->params);
+	}
+	memset(&d->stats, 0, sizeof(d->stats));
+	d->bus_free_us = 0;
+	d->out_start_us = 0;
+	d->out_extra_us = 0;
+	d->out_count = 0;
+	d->out_halted = 0;
+	d->mode = d->params.mode;
+	d->hung = 0;
+	d->command_free_us = 0;
+	d->tilt_from = 0;
+	d->tilt_start_us = 0;
+	d->payload_left = 0;
+	d->payload_seq = 0;
+	d->buffers = kusb_pool_create(NULL, NULL, NULL);
+	kusb_reserve_buffers(d->buffers);
+
+	kusb_io* io = new kusb_io();
+	io->ops = &sim_io_ops;
+	io->priv = d;
+	return io;
+}
+
+void kinect_sim_get_stats(kusb_io* io, kinect_sim_stats* stats) {
+	sim_device* d = (sim_device*)io->priv;
+	*stats = d->stats;
+	kusb_pool_get_stats(d->buffers, &stats->buffers);
+}
+
+void kinect_sim_set_hung(kusb_io* io, int hung) {
+	((sim_device*)io->priv)->hung = hung;
+}
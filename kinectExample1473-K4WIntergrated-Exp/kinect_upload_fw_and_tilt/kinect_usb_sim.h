@@ -0,0 +1,81 @@
+//
+//  kinect_usb_sim.h
+//  kinectExample
+//
+//  A kusb_io backend that emulates the audio/motor device in userspace so the
+//  upload, motor and keep alive code can be timed on machines without a
+//  Kinect attached. It speaks both the bootloader protocol (info, page write,
+//  execute) and, once executed, the motor protocol (LED, tilt, status).
+//
+//  Timing model: every transfer reaches the device transfer_latency_us after
+//  it was submitted, then occupies the (shared) bus for length / bytes_per_ms.
+//  The status reply for a page becomes available page_write_us after its last
+//  payload byte arrived, motor replies command_us after the command did (or
+//  after the previous command was done, they are worked through in order).
+//  With stall_every set, every Nth OUT transfer halts the endpoint: it and
+//  every OUT transfer after it fail with LIBUSB_ERROR_PIPE until the host
+//  calls kusb_clear_halt(), as on a real device. Every transfer also holds the bus
+//  for transfer_overhead_us, the per transfer cost of scheduling it. With
+//  max_transfer_size set, longer OUT transfers fail with LIBUSB_ERROR_IO, for
+//  devices that only take packet sized writes. A tilt command starts the
+//  motor towards its angle at tilt_deg_per_s, and the status reply says
+//  KINECT_TILT_MOVING until it is there. As a 1414 motor device it answers
+//  the KINECT_NUI_* control requests after transfer_latency_us + command_us
+//  with the same motor model, and stalls them in the other modes.
+//
+
+#ifndef __kinectExample__kinect_usb_sim__
+#define __kinectExample__kinect_usb_sim__
+
+#include "kinect_usb_io.h"
+
+typedef enum {
+	KINECT_SIM_BOOTLOADER,
+	KINECT_SIM_APPLICATION,
+	KINECT_SIM_NUI_MOTOR              // the 1414's motor device, control requests only
+} kinect_sim_mode;
+
+typedef struct {
+	kinect_sim_mode mode;             // what the device is running when opened
+	unsigned int transfer_latency_us;
+	unsigned int bytes_per_ms;
+	unsigned int page_write_us;
+	unsigned int command_us;
+	unsigned int transfer_overhead_us;
+	unsigned int stall_every;         // 0 never stalls
+	int max_packet_size;              // wMaxPacketSize reported for both endpoints
+	int max_transfer_size;            // longest OUT transfer accepted, 0 for any
+	int info_reply_size;              // reply to the bootloader info request
+	int status_reply_size;            // reply to 0x8032, 0 answers with what was asked for
+	int32_t accel[3];                 // raw accelerometer values reported by 0x8032
+	unsigned int tilt_deg_per_s;      // motor speed, 0 gets there at once
+} kinect_sim_params;
+
+typedef struct {
+	int out_transfers;
+	int in_transfers;
+	int stalls;                       // OUT transfers refused while halted
+	int halts;
+	int halts_cleared;                // kusb_clear_halt() on a halted endpoint
+	int oversized;                    // OUT transfers refused for max_transfer_size
+	int bytes_written;
+	int pages_written;
+	int executed;
+	int commands;
+	int led;                          // as sent, KINECT_NUI_LED_* for the 1414
+	int tilt;                         // angle of the last tilt command
+	int tilts;                        // tilt commands received
+	int tilts_while_moving;           // of those, sent before the motor stopped
+	kusb_pool_stats buffers;          // kusb_alloc() on this io
+} kinect_sim_stats;
+
+void kinect_sim_default_params(kinect_sim_params* params);
+
+kusb_io* kinect_sim_open(const kinect_sim_params* params);
+void kinect_sim_get_stats(kusb_io* io, kinect_sim_stats* stats);
+
+// While hung the device takes commands but never answers them, like a wedged
+// 1473. May be called from any thread.
+void kinect_sim_set_hung(kusb_io* io, int hung);
+
+#endif /* defined(__kinectExample__kinect_usb_sim__) */
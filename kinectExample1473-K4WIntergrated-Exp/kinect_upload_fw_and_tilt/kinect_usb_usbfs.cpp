@@ -0,0 +1,467 @@
+//
+//  kinect_usb_usbfs.cpp
+//  kinectExample
+//
+
+#include "kinect_usb_usbfs.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+
+#ifdef __linux__
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/usbdevice_fs.h>
+#include <vector>
+
+#define DESCRIPTOR_BUF 4096
+// reaped before their callbacks run, so a callback that submits again finds
+// the request it came from free already
+#define MAX_BATCH 64
+// requests made when the device is opened; more are made, and kept, when
+// that many are in flight at once
+#define PREALLOC_REQUESTS 16
+
+typedef struct usbfs_request {
+	kusb_xfer* xfer;
+	uint64_t deadline_us;     // KUSB_NO_DEADLINE without a timeout
+	int discarded;
+	int timed_out;
+	struct usbfs_request* next_free;
+	struct usbdevfs_urb urb;  // last, it ends in the (unused) iso descriptors
+} usbfs_request;
+
+typedef struct {
+	unsigned char* base;
+	int size;
+} usbfs_mapping;
+
+typedef struct {
+	int fd;
+	unsigned char descriptors[DESCRIPTOR_BUF];
+	int descriptors_length;
+	std::vector<usbfs_request*> in_flight;
+	usbfs_request* free_list;
+	std::vector<usbfs_mapping> mappings;
+	int can_map;              // the kernel supports mmap() on usbfs
+	kusb_pool* buffers;       // over the mappings, heap where there are none
+	kusb_usbfs_stats stats;
+} usbfs_device;
+
+static int errno_to_error(int err) {
+	switch (err) {
+		case ENODEV:
+		case ESHUTDOWN: return LIBUSB_ERROR_NO_DEVICE;
+		case ENOMEM: return LIBUSB_ERROR_NO_MEM;
+		case EINVAL: return LIBUSB_ERROR_INVALID_PARAM;
+		case EBUSY: return LIBUSB_ERROR_BUSY;
+		case EACCES:
+		case EPERM: return LIBUSB_ERROR_ACCESS;
+		case EPIPE: return LIBUSB_ERROR_PIPE;
+		case ETIMEDOUT: return LIBUSB_ERROR_TIMEOUT;
+		case EOVERFLOW: return LIBUSB_ERROR_OVERFLOW;
+		case EINTR: return LIBUSB_ERROR_INTERRUPTED;
+		default: return LIBUSB_ERROR_IO;
+	}
+}
+
+static int urb_status(const usbfs_request* r) {
+	switch (-r->urb.status) {
+		case 0:
+		case EREMOTEIO: return LIBUSB_SUCCESS; // short packet
+		case ENOENT:
+		case ECONNRESET: return r->timed_out ? LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_INTERRUPTED;
+		case EPIPE: return LIBUSB_ERROR_PIPE;
+		case EOVERFLOW: return LIBUSB_ERROR_OVERFLOW;
+		case ENODEV:
+		case ESHUTDOWN: return LIBUSB_ERROR_NO_DEVICE;
+		default: return LIBUSB_ERROR_IO;
+	}
+}
+
+static int is_mapped(const usbfs_device* d, const unsigned char* buffer, int length) {
+	for (size_t i = 0; i < d->mappings.size(); i++) {
+		const usbfs_mapping* m = &d->mappings[i];
+		if (buffer >= m->base && buffer + length <= m->base + m->size) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int usbfs_submit(kusb_io* io, kusb_xfer* xfer) {
+	usbfs_device* d = (usbfs_device*)io->priv;
+	usbfs_request* r = d->free_list;
+	if (r != NULL) {
+		d->free_list = r->next_free;
+	} else {
+		r = (usbfs_request*)malloc(sizeof(usbfs_request));
+		if (r == NULL) {
+			return LIBUSB_ERROR_NO_MEM;
+		}
+	}
+	memset(r, 0, sizeof(*r));
+	r->urb.type = USBDEVFS_URB_TYPE_BULK;
+	r->urb.endpoint = xfer->endpoint;
+	r->urb.buffer = xfer->buffer;
+	r->urb.buffer_length = xfer->length;
+	r->urb.usercontext = r;
+	r->xfer = xfer;
+	r->deadline_us = kusb_deadline_after(xfer->timeout);
+
+	d->stats.submits++;
+	if (ioctl(d->fd, USBDEVFS_SUBMITURB, &r->urb) != 0) {
+		int res = errno_to_error(errno);
+		r->next_free = d->free_list;
+		d->free_list = r;
+		return res;
+	}
+	if (d->can_map && is_mapped(d, xfer->buffer, xfer->length)) {
+		d->stats.zero_copy++;
+	}
+	xfer->backend = r;
+	d->in_flight.push_back(r);
+	return 0;
+}
+
+static void discard(usbfs_device* d, usbfs_request* r) {
+	if (!r->discarded) {
+		r->discarded = 1;
+		d->stats.discards++;
+		// EINVAL: it completed meanwhile, the reap picks it up either way
+		ioctl(d->fd, USBDEVFS_DISCARDURB, &r->urb);
+	}
+}
+
+static int usbfs_cancel(kusb_io* io, kusb_xfer* xfer) {
+	usbfs_device* d = (usbfs_device*)io->priv;
+	usbfs_request* r = (usbfs_request*)xfer->backend;
+	if (r == NULL) {
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	discard(d, r);
+	return 0;
+}
+
+// Every completion the kernel has, up to max. Returns how many, or a
+// libusb_error code when none could be reaped for another reason than there
+// being none.
+static int reap(usbfs_device* d, usbfs_request** done, int max) {
+	int n = 0;
+	while (n < max) {
+		struct usbdevfs_urb* urb = NULL;
+		d->stats.reaps++;
+		if (ioctl(d->fd, USBDEVFS_REAPURBNDELAY, &urb) != 0) {
+			if (errno == EAGAIN || n > 0) {
+				break;
+			}
+			return errno_to_error(errno);
+		}
+		usbfs_request* r = (usbfs_request*)urb->usercontext;
+		for (size_t i = 0; i < d->in_flight.size(); i++) {
+			if (d->in_flight[i] == r) {
+				d->in_flight.erase(d->in_flight.begin() + i);
+				break;
+			}
+		}
+		done[n++] = r;
+	}
+	return n;
+}
+
+static int usbfs_handle_events(kusb_io* io, int timeout_ms) {
+	usbfs_device* d = (usbfs_device*)io->priv;
+
+	// wake up in time for the first overdue URB
+	uint64_t now = kusb_now_us();
+	int wait_ms = timeout_ms;
+	for (size_t i = 0; i < d->in_flight.size(); i++) {
+		usbfs_request* r = d->in_flight[i];
+		if (r->deadline_us != KUSB_NO_DEADLINE && !r->discarded) {
+			int left = r->deadline_us > now ? (int)((r->deadline_us - now + 999) / 1000) : 0;
+			if (left < wait_ms) {
+				wait_ms = left;
+			}
+		}
+	}
+
+	struct pollfd pfd;
+	pfd.fd = d->fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	d->stats.polls++;
+	int ready = poll(&pfd, 1, wait_ms);
+	if (ready < 0) {
+		return errno == EINTR ? LIBUSB_ERROR_INTERRUPTED : errno_to_error(errno);
+	}
+
+	usbfs_request* done[MAX_BATCH];
+	int n = 0;
+	int res = 0;
+	if (ready > 0) {
+		n = reap(d, done, MAX_BATCH);
+		if (n < 0) {
+			res = n;
+			n = 0;
+		}
+	}
+
+	now = kusb_now_us();
+	int expired = 0;
+	for (size_t i = 0; i < d->in_flight.size(); i++) {
+		usbfs_request* r = d->in_flight[i];
+		if (r->deadline_us != KUSB_NO_DEADLINE && !r->discarded && now >= r->deadline_us) {
+			r->timed_out = 1;
+			discard(d, r);
+			expired++;
+		}
+	}
+	if (expired > 0 && n < MAX_BATCH) {
+		// a discarded URB is given back straight away
+		int more = reap(d, done + n, MAX_BATCH - n);
+		if (more > 0) {
+			n += more;
+		}
+	}
+
+	if (n > d->stats.max_batch) {
+		d->stats.max_batch = n;
+	}
+	d->stats.completions += n;
+	for (int i = 0; i < n; i++) {
+		usbfs_request* r = done[i];
+		kusb_xfer* xfer = r->xfer;
+		xfer->actual_length = r->urb.actual_length;
+		xfer->status = urb_status(r);
+		xfer->backend = NULL;
+		r->next_free = d->free_list;
+		d->free_list = r;
+		kusb_complete(xfer);
+	}
+	return res;
+}
+
+static int usbfs_max_packet_size(kusb_io* io, unsigned char endpoint) {
+	usbfs_device* d = (usbfs_device*)io->priv;
+	// the device descriptor, then the configurations; the first one is the
+	// one the Kinect runs
+	int pos = 0;
+	int end = d->descriptors_length;
+	while (pos + 2 <= end) {
+		int length = d->descriptors[pos];
+		int type = d->descriptors[pos + 1];
+		if (length < 2 || pos + length > end) {
+			break;
+		}
+		if (type == LIBUSB_DT_CONFIG && pos > 0 && length >= 4) {
+			int total = d->descriptors[pos + 2] | (d->descriptors[pos + 3] << 8);
+			if (pos + total < end) {
+				end = pos + total;
+			}
+		}
+		if (type == LIBUSB_DT_ENDPOINT && length >= 6 && d->descriptors[pos + 2] == endpoint) {
+			return (d->descriptors[pos + 4] | (d->descriptors[pos + 5] << 8)) & 0x7ff;
+		}
+		pos += length;
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int usbfs_control(kusb_io* io, uint8_t request_type, uint8_t request, uint16_t value,
+	uint16_t index, unsigned char* data, uint16_t length, unsigned int timeout) {
+	usbfs_device* d = (usbfs_device*)io->priv;
+	struct usbdevfs_ctrltransfer ctrl;
+	ctrl.bRequestType = request_type;
+	ctrl.bRequest = request;
+	ctrl.wValue = value;
+	ctrl.wIndex = index;
+	ctrl.wLength = length;
+	ctrl.timeout = timeout;
+	ctrl.data = data;
+	d->stats.controls++;
+	int res = ioctl(d->fd, USBDEVFS_CONTROL, &ctrl);
+	return res < 0 ? errno_to_error(errno) : res;
+}
+
+static int usbfs_clear_halt(kusb_io* io, unsigned char endpoint) {
+	usbfs_device* d = (usbfs_device*)io->priv;
+	unsigned int ep = endpoint;
+	d->stats.controls++;
+	return ioctl(d->fd, USBDEVFS_CLEAR_HALT, &ep) < 0 ? errno_to_error(errno) : 0;
+}
+
+// Backing for the pool: called only when it has no buffer of the size cached.
+static unsigned char* usbfs_map(void* user_data, int size) {
+	usbfs_device* d = (usbfs_device*)user_data;
+	if (!d->can_map) {
+		return NULL;
+	}
+	void* base = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, d->fd, 0);
+	if (base == MAP_FAILED) {
+		// older kernel, or out of usbfs memory; either way don't keep trying
+		d->can_map = 0;
+		return NULL;
+	}
+	usbfs_mapping m;
+	m.base = (unsigned char*)base;
+	m.size = size;
+	d->mappings.push_back(m);
+	d->stats.mapped++;
+	return m.base;
+}
+
+static void usbfs_unmap(void* user_data, unsigned char* buffer, int size) {
+	(void)size; // the mapping keeps its own
+	usbfs_device* d = (usbfs_device*)user_data;
+	for (size_t i = 0; i < d->mappings.size(); i++) {
+		if (d->mappings[i].base == buffer) {
+			munmap(buffer, (size_t)d->mappings[i].size);
+			d->mappings.erase(d->mappings.begin() + i);
+			return;
+		}
+	}
+}
+
+static unsigned char* usbfs_alloc(kusb_io* io, int size) {
+	return kusb_pool_get(((usbfs_device*)io->priv)->buffers, size);
+}
+
+static void usbfs_free(kusb_io* io, unsigned char* buffer, int size) {
+	kusb_pool_put(((usbfs_device*)io->priv)->buffers, buffer, size);
+}
+
+static void usbfs_destroy(kusb_io* io) {
+	usbfs_device* d = (usbfs_device*)io->priv;
+	// URBs still in flight belong to the kernel until reaped; their
+	// callbacks don't run any more
+	for (size_t i = 0; i < d->in_flight.size(); i++) {
+		discard(d, d->in_flight[i]);
+	}
+	while (!d->in_flight.empty()) {
+		struct usbdevfs_urb* urb = NULL;
+		if (ioctl(d->fd, USBDEVFS_REAPURB, &urb) != 0) {
+			break;
+		}
+		usbfs_request* r = (usbfs_request*)urb->usercontext;
+		for (size_t i = 0; i < d->in_flight.size(); i++) {
+			if (d->in_flight[i] == r) {
+				d->in_flight.erase(d->in_flight.begin() + i);
+				break;
+			}
+		}
+		r->xfer->backend = NULL;
+		free(r);
+	}
+	while (d->free_list != NULL) {
+		usbfs_request* next = d->free_list->next_free;
+		free(d->free_list);
+		d->free_list = next;
+	}
+	kusb_pool_destroy(d->buffers);
+	if (!d->mappings.empty()) {
+		LOG("kusb_usbfs: %d buffers not freed before close\n", (int)d->mappings.size());
+		for (size_t i = 0; i < d->mappings.size(); i++) {
+			munmap(d->mappings[i].base, (size_t)d->mappings[i].size);
+		}
+	}
+	unsigned int interface = 0;
+	ioctl(d->fd, USBDEVFS_RELEASEINTERFACE, &interface);
+	close(d->fd);
+	delete d;
+	delete io;
+}
+
+static const kusb_io_ops usbfs_io_ops = {
+	"usbfs",
+	usbfs_submit,
+	usbfs_cancel,
+	usbfs_handle_events,
+	usbfs_max_packet_size,
+	usbfs_control,
+	usbfs_clear_halt,
+	usbfs_destroy,
+	usbfs_alloc,
+	usbfs_free,
+};
+
+kusb_io* kusb_io_open_usbfs(int bus, int address) {
+	char path[64];
+	snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", bus, address);
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		LOG("kusb_usbfs: can't open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	usbfs_device* d = new usbfs_device();
+	d->fd = fd;
+	d->free_list = NULL;
+	d->can_map = 1;
+	memset(&d->stats, 0, sizeof(d->stats));
+	ssize_t n = pread(fd, d->descriptors, sizeof(d->descriptors), 0);
+	d->descriptors_length = n > 0 ? (int)n : 0;
+
+	// GET_CONFIGURATION, then switch the way libusb_set_configuration() would
+	unsigned char configuration = 0;
+	kusb_io probe;
+	probe.ops = &usbfs_io_ops;
+	probe.priv = d;
+	if (usbfs_control(&probe, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_CONFIGURATION, 0, 0,
+		&configuration, 1, 1000) == 1 && configuration != 1) {
+		unsigned int wanted = 1;
+		if (ioctl(fd, USBDEVFS_SETCONFIGURATION, &wanted) != 0) {
+			LOG("kusb_usbfs: can't select configuration 1 of %s: %s\n", path, strerror(errno));
+		}
+	}
+	unsigned int interface = 0;
+	if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &interface) != 0) {
+		LOG("kusb_usbfs: can't claim interface 0 of %s: %s\n", path, strerror(errno));
+		close(fd);
+		delete d;
+		return NULL;
+	}
+
+	for (int i = 0; i < PREALLOC_REQUESTS; i++) {
+		usbfs_request* r = (usbfs_request*)malloc(sizeof(usbfs_request));
+		if (r == NULL) {
+			break;
+		}
+		r->next_free = d->free_list;
+		d->free_list = r;
+	}
+	d->buffers = kusb_pool_create(usbfs_map, usbfs_unmap, d);
+	kusb_reserve_buffers(d->buffers);
+
+	kusb_io* io = new kusb_io();
+	io->ops = &usbfs_io_ops;
+	io->priv = d;
+	return io;
+}
+
+void kusb_usbfs_get_stats(kusb_io* io, kusb_usbfs_stats* stats) {
+	*stats = ((usbfs_device*)io->priv)->stats;
+}
+
+#else
+
+kusb_io* kusb_io_open_usbfs(int bus, int address) {
+	(void)bus;
+	(void)address;
+	LOG("kusb_usbfs: only available on Linux\n");
+	return NULL;
+}
+
+void kusb_usbfs_get_stats(kusb_io* io, kusb_usbfs_stats* stats) {
+	(void)io;
+	memset(stats, 0, sizeof(*stats));
+}
+
+#endif
@@ -0,0 +1,43 @@
+//
+//  kinect_usb_usbfs.h
+//  kinectExample
+//
+//  A kusb_io backend for Linux that talks to /dev/bus/usb/BBB/DDD directly:
+//  each transfer is one URB submitted with an ioctl, and completions are
+//  reaped in batches, every one the kernel has ready per wakeup, rather than
+//  one per call as libusb's event loop does. Buffers from kusb_alloc() are
+//  mapped from usbfs itself (Linux 4.6 and later), so the kernel hands them
+//  to the controller instead of copying them in and out of its own; they
+//  are kept in a kusb_pool, so each size is mapped once, not per use.
+//
+//  Transfers longer than 16k need a kernel without the old URB size limit;
+//  a firmware page is exactly 16k. Timeouts are kept here, an overdue URB is
+//  discarded and reported as LIBUSB_ERROR_TIMEOUT. On other platforms
+//  kusb_io_open_usbfs() returns NULL.
+//
+
+#ifndef __kinectExample__kinect_usb_usbfs__
+#define __kinectExample__kinect_usb_usbfs__
+
+#include "kinect_usb_io.h"
+
+typedef struct {
+	int submits;            // SUBMITURB ioctls
+	int reaps;              // REAPURBNDELAY ioctls, the ones that found nothing too
+	int polls;              // poll() calls waiting for completions
+	int discards;           // URBs cancelled or timed out
+	int controls;           // CONTROL and CLEAR_HALT ioctls
+	int completions;
+	int max_batch;          // most completions reaped in one handle_events
+	int zero_copy;          // submits whose buffer was mapped from usbfs
+	int mapped;             // usbfs mappings made for the buffer pool
+} kusb_usbfs_stats;
+
+// Opens the device at bus/address, selects configuration 1 and claims
+// interface 0. NULL if it can't, e.g. when another process has it claimed.
+kusb_io* kusb_io_open_usbfs(int bus, int address);
+
+// Syscalls made so far on io, which must come from kusb_io_open_usbfs().
+void kusb_usbfs_get_stats(kusb_io* io, kusb_usbfs_stats* stats);
+
+#endif /* defined(__kinectExample__kinect_usb_usbfs__) */
@@ -1,13 +1,20 @@
 #include "testApp.h"
 #include "Simple1473KeepAlive.h"
+#include "kinect_usb_bench.h"
+#include "kinect_usb_runtime.h"
 
 extern int upload_firmware(bool b1473);
+extern int upload_firmware_if_needed(bool b1473);
 extern int do_motor();
 extern int upload_main();
 
 //--------------------------------------------------------------
 void testApp::setup() {
 	ofSetLogLevel(OF_LOG_VERBOSE);
+
+#ifdef RUN_USB_BENCHMARKS
+	run_usb_benchmarks();
+#endif
 	
 //    ofBuffer buf = ofBufferFromFile("audios.bin",true);
 //    
@@ -37,32 +44,47 @@ void testApp::setup() {
 //    cout << " motor " << endl;
 
 
-//      upload_firmware(true);
-//      ofSleepMillis(3000);
+//      upload_firmware_if_needed(true); // returns once the device is back
 //      do_motor();
 
 
-    keepAlive1473(); 
-    
+    // opened once and kept for tilt / LED changes from keyPressed()
+    motor = kinect_motor_open();
+    kinect_orientation_init(&motorOrientation, 100);
+    motorAccelSamples = 0;
+    // keeps the 1473 on the bus should sampling ever stop
+    keepalive = kinect_keepalive_start(100);
+    if (motor != NULL) {
+        kinect_motor_keep_alive(motor);
+        // gravity vector for the floor plane, sampled on the motor thread
+        kinect_motor_start_sampling(motor, 200);
+        if (keepalive != NULL) {
+            kinect_keepalive_add(keepalive, motor, 2000);
+        }
+    }
     
     
-	// enable depth->video image calibration
-	kinect.setRegistration(true);
     
-	kinect.init();
-	//kinect.init(true); // shows infrared instead of RGB video image
-	//kinect.init(false, false); // disable video image (faster fps)
+	for(int i = 0; i < 2; i++) {
+		// enable depth->video image calibration
+		cameras[i].setRegistration(true);
+		
+		cameras[i].init();
+		//cameras[i].init(true); // shows infrared instead of RGB video image
+		//cameras[i].init(false, false); // disable video image (faster fps)
+	}
+	kinect = &cameras[0];
 	
-	kinect.open();		// opens first available kinect
-	//kinect.open(1);	// open a kinect by id, starting with 0 (sorted by serial # lexicographically))
-	//kinect.open("A00362A08602047A");	// open a kinect using it's unique serial #
+	kinect->open();		// opens first available kinect
+	//kinect->open(1);	// open a kinect by id, starting with 0 (sorted by serial # lexicographically))
+	//kinect->open("A00362A08602047A");	// open a kinect using it's unique serial #
 	
 	// print the intrinsic IR sensor values
-	if(kinect.isConnected()) {
-		ofLogNotice() << "sensor-emitter dist: " << kinect.getSensorEmitterDistance() << "cm";
-		ofLogNotice() << "sensor-camera dist:  " << kinect.getSensorCameraDistance() << "cm";
-		ofLogNotice() << "zero plane pixel size: " << kinect.getZeroPlanePixelSize() << "mm";
-		ofLogNotice() << "zero plane dist: " << kinect.getZeroPlaneDistance() << "mm";
+	if(kinect->isConnected()) {
+		ofLogNotice() << "sensor-emitter dist: " << kinect->getSensorEmitterDistance() << "cm";
+		ofLogNotice() << "sensor-camera dist:  " << kinect->getSensorCameraDistance() << "cm";
+		ofLogNotice() << "zero plane pixel size: " << kinect->getZeroPlanePixelSize() << "mm";
+		ofLogNotice() << "zero plane dist: " << kinect->getZeroPlaneDistance() << "mm";
 	}
 	
 #ifdef USE_TWO_KINECTS
@@ -70,10 +92,15 @@ void testApp::setup() {
 	kinect2.open();
 #endif
 	
-	colorImg.allocate(kinect.width, kinect.height);
-	grayImage.allocate(kinect.width, kinect.height);
-	grayThreshNear.allocate(kinect.width, kinect.height);
-	grayThreshFar.allocate(kinect.width, kinect.height);
+	// reopens the camera and motor when the kinect comes back after dropping
+	// off the bus, from the manager's thread
+	sensorId = -1;
+	sensors = kinect_sensor_manager_start(onSensorChange, this);
+	
+	colorImg.allocate(kinect->width, kinect->height);
+	grayImage.allocate(kinect->width, kinect->height);
+	grayThreshNear.allocate(kinect->width, kinect->height);
+	grayThreshFar.allocate(kinect->width, kinect->height);
 	
 	nearThreshold = 230;
 	farThreshold = 70;
@@ -83,7 +110,7 @@ void testApp::setup() {
 	
 	// zero the tilt on startup
 	angle = 0;
-	kinect.setCameraTiltAngle(angle);
+	setTilt(angle);
 	
 	// start from the front
 	bDrawPointCloud = false;
@@ -91,16 +118,31 @@ void testApp::setup() {
 
 //--------------------------------------------------------------
 void testApp::update() {
+	ofScopedLock lock(deviceLock);
 	
 	ofBackground(100, 100, 100);
 	
-	kinect.update();
+	kinect->update();
+	
+	// everything sampled since the last frame goes through the orientation
+	// filter, so the gravity direction is ready without redoing it here
+	if(motor != NULL) {
+		kinect_accel_sample samples[64];
+		int n;
+		motorAccelSamples = 0;
+		while((n = kinect_motor_read_samples(motor, samples, 64)) > 0) {
+			for(int i = 0; i < n; i++) {
+				kinect_orientation_update(&motorOrientation, &samples[i]);
+			}
+			motorAccelSamples += n;
+		}
+	}
 	
 	// there is a new frame and we are connected
-	if(kinect.isFrameNew()) {
+	if(kinect->isFrameNew()) {
 		
 		// load grayscale depth image from the kinect source
-		grayImage.setFromPixels(kinect.getDepthPixels(), kinect.width, kinect.height);
+		grayImage.setFromPixels(kinect->getDepthPixels(), kinect->width, kinect->height);
 		
 		// we do two thresholds - one for the far plane and one for the near plane
 		// we then do a cvAnd to get the pixels which are a union of the two thresholds
@@ -130,7 +172,7 @@ void testApp::update() {
 		
 		// find contours which are between the size of 20 pixels and 1/3 the w*h pixels.
 		// also, find holes is set to true so we will get interior contours as well....
-		contourFinder.findContours(grayImage, 10, (kinect.width*kinect.height)/2, 20, false);
+		contourFinder.findContours(grayImage, 10, (kinect->width*kinect->height)/2, 20, false);
 	}
 	
 #ifdef USE_TWO_KINECTS
@@ -140,6 +182,7 @@ void testApp::update() {
 
 //--------------------------------------------------------------
 void testApp::draw() {
+	ofScopedLock lock(deviceLock);
 	
 	ofSetColor(255, 255, 255);
 	
@@ -149,8 +192,8 @@ void testApp::draw() {
 		easyCam.end();
 	} else {
 		// draw from the live kinect
-		kinect.drawDepth(10, 10, 400, 300);
-		kinect.draw(420, 10, 400, 300);
+		kinect->drawDepth(10, 10, 400, 300);
+		kinect->draw(420, 10, 400, 300);
 		
 		grayImage.draw(10, 320, 400, 300);
 		contourFinder.draw(10, 320, 400, 300);
@@ -164,10 +207,18 @@ void testApp::draw() {
 	ofSetColor(255, 255, 255);
 	stringstream reportStream;
         
-    if(kinect.hasAccelControl()) {
-        reportStream << "accel is: " << ofToString(kinect.getMksAccel().x, 2) << " / "
-        << ofToString(kinect.getMksAccel().y, 2) << " / "
-        << ofToString(kinect.getMksAccel().z, 2) << endl;
+    if(kinect->hasAccelControl()) {
+        reportStream << "accel is: " << ofToString(kinect->getMksAccel().x, 2) << " / "
+        << ofToString(kinect->getMksAccel().y, 2) << " / "
+        << ofToString(kinect->getMksAccel().z, 2) << endl;
+    } else if(motor != NULL && motorOrientation.samples > 0) {
+        float accel[3];
+        kinect_orientation_get_mks_accel(&motorOrientation, accel);
+        reportStream << "accel is: " << ofToString(accel[0], 2) << " / "
+        << ofToString(accel[1], 2) << " / "
+        << ofToString(accel[2], 2) << " (" << motorAccelSamples << " samples this frame)" << endl
+        << "pitch / roll: " << ofToString(kinect_orientation_get_pitch(&motorOrientation), 1) << " / "
+        << ofToString(kinect_orientation_get_roll(&motorOrientation), 1) << " degrees" << endl;
     } else {
         reportStream << "Note: this is a newer Xbox Kinect or Kinect For Windows device," << endl
 		<< "motor / led / accel controls are not currently supported" << endl << endl;
@@ -178,9 +229,9 @@ void testApp::draw() {
 	<< "set near threshold " << nearThreshold << " (press: + -)" << endl
 	<< "set far threshold " << farThreshold << " (press: < >) num blobs found " << contourFinder.nBlobs
 	<< ", fps: " << ofGetFrameRate() << endl
-	<< "press c to close the connection and o to open it again, connection is: " << kinect.isConnected() << endl;
+	<< "press c to close the connection and o to open it again, connection is: " << kinect->isConnected() << endl;
 
-    if(kinect.hasCamTiltControl()) {
+    if(kinect->hasCamTiltControl() || motor != NULL) {
     	reportStream << "press UP and DOWN to change the tilt angle: " << angle << " degrees" << endl
         << "press 1-5 & 0 to change the led mode" << endl;
     }
@@ -197,9 +248,9 @@ void testApp::drawPointCloud() {
 	int step = 2;
 	for(int y = 0; y < h; y += step) {
 		for(int x = 0; x < w; x += step) {
-			if(kinect.getDistanceAt(x, y) > 0) {
-				mesh.addColor(kinect.getColorAt(x,y));
-				mesh.addVertex(kinect.getWorldCoordinateAt(x, y));
+			if(kinect->getDistanceAt(x, y) > 0) {
+				mesh.addColor(kinect->getColorAt(x,y));
+				mesh.addVertex(kinect->getWorldCoordinateAt(x, y));
 			}
 		}
 	}
@@ -216,16 +267,115 @@ void testApp::drawPointCloud() {
 
 //--------------------------------------------------------------
 void testApp::exit() {
-	kinect.setCameraTiltAngle(0); // zero the tilt on exit
-	kinect.close();
+	kinect_sensor_manager_stop(sensors); // nothing is reattached from here on
+	sensors = NULL;
+	setTilt(0); // zero the tilt on exit
+	kinect->close();
+	if(keepalive != NULL) {
+		kinect_keepalive_remove(keepalive, motor);
+		kinect_keepalive_stop(keepalive);
+		keepalive = NULL;
+	}
+	kinect_motor_close(motor); // sends the tilt first
+	motor = NULL;
+	kinect_usb_shutdown();
 	
 #ifdef USE_TWO_KINECTS
 	kinect2.close();
 #endif
 }
 
+//--------------------------------------------------------------
+static int onSensorChange(const kinect_sensor* sensor, kinect_sensor_interface which, int arrived, void* user_data) {
+	return ((testApp*)user_data)->sensorChanged(sensor, which, arrived);
+}
+
+// On the sensor manager's thread. The devices are opened before the lock is
+// taken, the camera on the spare ofxKinect and the motor by the sensor's own
+// audio device, so a frame only waits for the pointers to be swapped.
+int testApp::sensorChanged(const kinect_sensor* sensor, kinect_sensor_interface which, int arrived) {
+	// only the first kinect is shown
+	if(sensorId < 0 && arrived) {
+		sensorId = sensor->id;
+	}
+	if(sensor->id != sensorId) {
+		return 0;
+	}
+	
+	if(which == KINECT_SENSOR_CAMERA) {
+		// only this thread moves kinect, so it can be read without the lock
+		if(arrived && !kinect->isConnected()) {
+			ofxKinect* next = kinect == &cameras[0] ? &cameras[1] : &cameras[0];
+			if(!next->open()) {
+				return LIBUSB_ERROR_BUSY;
+			}
+			{
+				ofScopedLock lock(deviceLock);
+				kinect = next;
+			}
+			ofLogNotice() << "kinect " << sensor->id << " (" << sensor->path << ") camera back";
+		} else if(!arrived && kinect->isConnected()) {
+			ofScopedLock lock(deviceLock);
+			kinect->close();
+			ofLogNotice() << "kinect " << sensor->id << " camera gone";
+		}
+	} else if(which == KINECT_SENSOR_AUDIO) {
+		if(arrived && motor == NULL) {
+			if(!sensor->firmware) {
+				ofLogWarning() << "kinect " << sensor->id << " is in its bootloader, upload the firmware for tilt and LED";
+				return 0;
+			}
+			kinect_motor* m = kinect_motor_open_device(sensor->devices[KINECT_SENSOR_AUDIO]);
+			if(m == NULL) {
+				return LIBUSB_ERROR_BUSY;
+			}
+			kinect_motor_set_tilt(m, angle);
+			kinect_motor_start_sampling(m, 200);
+			if(keepalive != NULL) {
+				kinect_keepalive_add(keepalive, m, 2000);
+			}
+			ofScopedLock lock(deviceLock);
+			motor = m;
+			kinect_orientation_init(&motorOrientation, 100);
+			ofLogNotice() << "kinect " << sensor->id << " motor back";
+		} else if(!arrived && motor != NULL) {
+			kinect_motor* m;
+			{
+				ofScopedLock lock(deviceLock);
+				m = motor;
+				motor = NULL;
+			}
+			if(keepalive != NULL) {
+				kinect_keepalive_remove(keepalive, m);
+			}
+			kinect_motor_close(m);
+			ofLogNotice() << "kinect " << sensor->id << " motor gone";
+		}
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------
+void testApp::setTilt(int degrees) {
+	if(motor != NULL) {
+		kinect_motor_set_tilt(motor, degrees); // latest wins, sent once the motor is free
+	} else {
+		kinect->setCameraTiltAngle(degrees);
+	}
+}
+
+//--------------------------------------------------------------
+void testApp::setLed(ofxKinect::LedMode mode, int state) {
+	if(motor != NULL) {
+		kinect_motor_set_led(motor, state);
+	} else {
+		kinect->setLed(mode);
+	}
+}
+
 //--------------------------------------------------------------
 void testApp::keyPressed (int key) {
+	ofScopedLock lock(deviceLock);
 	switch (key) {
 		case ' ':
 			bThreshWithOpenCV = !bThreshWithOpenCV;
@@ -259,53 +409,53 @@ void testApp::keyPressed (int key) {
 			break;
 			
 		case 'w':
-			kinect.enableDepthNearValueWhite(!kinect.isDepthNearValueWhite());
+			kinect->enableDepthNearValueWhite(!kinect->isDepthNearValueWhite());
 			break;
 			
 		case 'o':
-			kinect.setCameraTiltAngle(angle); // go back to prev tilt
-			kinect.open();
+			setTilt(angle); // go back to prev tilt
+			kinect->open();
 			break;
 			
 		case 'c':
-			kinect.setCameraTiltAngle(0); // zero the tilt
-			kinect.close();
+			setTilt(0); // zero the tilt
+			kinect->close();
 			break;
 			
 		case '1':
-			kinect.setLed(ofxKinect::LED_GREEN);
+			setLed(ofxKinect::LED_GREEN, KINECT_LED_SOLID_GREEN);
 			break;
 			
 		case '2':
-			kinect.setLed(ofxKinect::LED_YELLOW);
+			kinect->setLed(ofxKinect::LED_YELLOW);
 			break;
 			
 		case '3':
-			kinect.setLed(ofxKinect::LED_RED);
+			setLed(ofxKinect::LED_RED, KINECT_LED_SOLID_RED);
 			break;
 			
 		case '4':
-			kinect.setLed(ofxKinect::LED_BLINK_GREEN);
+			setLed(ofxKinect::LED_BLINK_GREEN, KINECT_LED_BLINK_GREEN);
 			break;
 			
 		case '5':
-			kinect.setLed(ofxKinect::LED_BLINK_YELLOW_RED);
+			kinect->setLed(ofxKinect::LED_BLINK_YELLOW_RED);
 			break;
 			
 		case '0':
-			kinect.setLed(ofxKinect::LED_OFF);
+			setLed(ofxKinect::LED_OFF, KINECT_LED_OFF);
 			break;
 			
 		case OF_KEY_UP:
 			angle++;
 			if(angle>30) angle=30;
-			kinect.setCameraTiltAngle(angle);
+			setTilt(angle);
 			break;
 			
 		case OF_KEY_DOWN:
 			angle--;
 			if(angle<-30) angle=-30;
-			kinect.setCameraTiltAngle(angle);
+			setTilt(angle);
 			break;
 	}
 }
@@ -3,6 +3,10 @@
 #include "ofMain.h"
 #include "ofxOpenCv.h"
 #include "ofxKinect.h"
+#include "kinect_motor.h"
+#include "kinect_keepalive.h"
+#include "kinect_orientation.h"
+#include "kinect_sensor_manager.h"
 
 // uncomment this to read from two kinects simultaneously
 //#define USE_TWO_KINECTS
@@ -16,6 +20,9 @@ public:
 	void exit();
 	
 	void drawPointCloud();
+	void setTilt(int degrees);
+	void setLed(ofxKinect::LedMode mode, int state);
+	int sensorChanged(const kinect_sensor* sensor, kinect_sensor_interface which, int arrived);
 	
 	void keyPressed(int key);
 	void mouseDragged(int x, int y, int button);
@@ -23,7 +30,10 @@ public:
 	void mouseReleased(int x, int y, int button);
 	void windowResized(int w, int h);
 	
-	ofxKinect kinect;
+	// the camera in use, and one to open it on again after it dropped off
+	// the bus while kinect stays where update() and draw() can use it
+	ofxKinect cameras[2];
+	ofxKinect* kinect;
 	
 #ifdef USE_TWO_KINECTS
 	ofxKinect kinect2;
@@ -45,6 +55,18 @@ public:
 	
 	int angle;
 	
+	// tilt, LED and accel of the 1473 / K4W, which ofxKinect can't drive
+	kinect_motor* motor;
+	kinect_orientation motorOrientation; // fed every sample in update()
+	int motorAccelSamples;               // how many arrived last frame
+	kinect_keepalive* keepalive;         // only speaks up while nothing else does
+	
+	// swaps kinect and motor when the sensor drops off the bus and comes back;
+	// held by update(), draw() and keyPressed() while they use them
+	kinect_sensor_manager* sensors;
+	int sensorId;                        // the one being shown, -1 until seen
+	ofMutex deviceLock;
+	
 	// used for viewing the point cloud
 	ofEasyCam easyCam;
 };
@@ -5,8 +5,16 @@
 #include <stdint.h>
 #include <unistd.h> // For usleep()
 
-uint32_t tag_seq = 1;
-uint32_t tag_next_ack = 1;
+#include "kinect_trace.h"
+#include "kinect_usb_runtime.h"
+
+// Shared by every caller, so two threads talking to different devices (or
+// the same one) never reuse a tag. Each call waits for the reply to its own.
+static uint32_t tag_seq = 1;
+
+static uint32_t next_tag() {
+	return __sync_fetch_and_add(&tag_seq, 1);
+}
 
 typedef enum {
 	LED_OFF = 1,
@@ -32,12 +40,22 @@ typedef struct {
 #define le32(X) (X)
 #define LOG(...) fprintf(stderr, __VA_ARGS__)
 
-int get_reply(libusb_device_handle* dev){
+// ms; a wedged device fails the call with LIBUSB_ERROR_TIMEOUT instead of
+// blocking the caller for good
+#define COMMAND_TIMEOUT 1000
+
+static int bulk_transfer(libusb_device_handle* dev, unsigned char endpoint, unsigned char* data, int length, int* transferred) {
+	int res = libusb_bulk_transfer(dev, endpoint, data, length, transferred, COMMAND_TIMEOUT);
+	KINECT_TRACE_TRANSFER(endpoint, data, length, *transferred, res);
+	return res;
+}
+
+static int get_reply(libusb_device_handle* dev, uint32_t tag){
 	unsigned char buffer[512];
 	memset(buffer, 0, 512);
 	int transferred = 0;
 	int res = 0;
-	res = libusb_bulk_transfer(dev, 0x81, buffer, 512, &transferred, 0);
+	res = bulk_transfer(dev, 0x81, buffer, 512, &transferred);
 	if (res != 0) {
 		LOG("get_reply(): libusb_bulk_transfer failed: %d (transferred = %d)\n", res, transferred);
 	} else if (transferred != 12) {
@@ -49,21 +67,14 @@ int get_reply(libusb_device_handle* dev){
 			LOG("Bad magic: %08X (expected 0A6FE000\n", reply.magic);
 			res = -1;
 		}
-		if (reply.tag != tag_next_ack) {
-			LOG("Reply tag out of order: expected %d, got %d\n", tag_next_ack, reply.tag);
+		if (reply.tag != tag) {
+			LOG("Reply for another command: expected tag %d, got %d\n", tag, reply.tag);
 			res = -1;
 		}
 		if (reply.status != 0) {
 			LOG("reply status != 0: failure?\n");
 			res = -1;
 		}
-		tag_next_ack++;
-		LOG("get_reply(): got %d bytes:", transferred);
-		int i;
-		for (i = 0; i < transferred; i++) {
-			LOG(" %02X", buffer[i]);
-		}
-		LOG("\n");
 	}
 	return res;
 }
@@ -73,25 +84,19 @@ int set_led(libusb_device_handle* dev, led_state state) {
 	int res = 0;
 	motor_command cmd;
 	cmd.magic = le32(0x06022009);
-	cmd.tag = le32(tag_seq++);
+	cmd.tag = le32(next_tag());
 	cmd.arg1 = le32(0);
 	cmd.cmd = le32(0x10);
 	cmd.arg2 = (uint32_t)(le32((int32_t)state));
 	unsigned char buffer[20];
 	memcpy(buffer, &cmd, 20);
 	// Send command to set LED to solid green
-	LOG("About to send bulk transfer:");
-	int i;
-	for(i = 0; i < 20 ; i++) {
-		LOG(" %02X", buffer[i]);
-	}
-	LOG("\n");
-	res = libusb_bulk_transfer(dev, 0x01, buffer, 20, &transferred, 0);
+	res = bulk_transfer(dev, 0x01, buffer, 20, &transferred);
 	if (res != 0) {
 		LOG("set_led(): libusb_bulk_transfer failed: %d (transferred = %d)\n", res, transferred);
 		return res;
 	}
-	return get_reply(dev);
+	return get_reply(dev, cmd.tag);
 }
 
 int set_tilt(libusb_device_handle* dev, int tilt_degrees) {
@@ -101,7 +106,7 @@ int set_tilt(libusb_device_handle* dev, int tilt_degrees) {
 	}
 	motor_command cmd;
 	cmd.magic = le32(0x06022009);
-	cmd.tag = le32(tag_seq++);
+	cmd.tag = le32(next_tag());
 	cmd.arg1 = le32(0);
 	cmd.cmd = le32(0x803b);
 	cmd.arg2 = (uint32_t)(le32((int32_t)tilt_degrees));
@@ -110,18 +115,12 @@ int set_tilt(libusb_device_handle* dev, int tilt_degrees) {
 	unsigned char buffer[20];
 	memcpy(buffer, &cmd, 20);
 
-	LOG("About to send bulk transfer:");
-	int i;
-	for(i = 0; i < 20 ; i++) {
-		LOG(" %02X", buffer[i]);
-	}
-	LOG("\n");
-	res = libusb_bulk_transfer(dev, 0x01, buffer, 20, &transferred, 0);
+	res = bulk_transfer(dev, 0x01, buffer, 20, &transferred);
 	if (res != 0) {
 		LOG("set_tilt(): libusb_bulk_transfer failed: %d (transferred = %d)\n", res, transferred);
 		return res;
 	}
-	return get_reply(dev);
+	return get_reply(dev, cmd.tag);
 }
 
 int poll_status(libusb_device_handle* dev) {
@@ -129,48 +128,26 @@ int poll_status(libusb_device_handle* dev) {
 	int res = 0;
 	motor_command cmd;
 	cmd.magic = le32(0x06022009);
-	cmd.tag = le32(tag_seq++);
+	cmd.tag = le32(next_tag());
 	cmd.arg1 = le32(0x68); // 104.  Incidentally, the number of bytes that we expect in the reply.
 	cmd.cmd = le32(0x8032);
 	unsigned char buffer[256];
 	memcpy(buffer, &cmd, 16);
 	// Send command to set LED to solid green
-	LOG("About to send bulk transfer:");
-	int i;
-	for(i = 0; i < 16 ; i++) {
-		LOG(" %02X", buffer[i]);
-	}
-	LOG("\n");
-	res = libusb_bulk_transfer(dev, 0x01, buffer, 16, &transferred, 0);
+	res = bulk_transfer(dev, 0x01, buffer, 16, &transferred);
 	if (res != 0) {
 		LOG("set_led(): libusb_bulk_transfer failed: %d (transferred = %d)\n", res, transferred);
 		return res;
 	}
 
-	res = libusb_bulk_transfer(dev, 0x81, buffer, 256, &transferred, 0); // 104 bytes
+	res = bulk_transfer(dev, 0x81, buffer, 256, &transferred); // 104 bytes
 	if (res != 0) {
 		LOG("set_led(): libusb_bulk_transfer failed: %d (transferred = %d)\n", res, transferred);
 		return res;
-	} else {
-		LOG("poll_status():");
-		int i;
-		for(i = 0 ; i < transferred ; i += 4) {
-			int32_t j;
-			memcpy(&j, buffer + i, 4);
-			LOG("\t%d", j);
-		}
-		LOG("\n");
-		struct {
-			int32_t x;
-			int32_t y;
-			int32_t z;
-		} accel;
-		memcpy(&accel, buffer + 16, sizeof(accel));
-		LOG("X: %d\tY: %d\tZ:%d\n", accel.x, accel.y, accel.z);
 	}
 	// Reply: skip four uint32_t, then you have three int32_t that give you acceleration in that direction, it seems.
 	// Units still to be worked out.
-	return get_reply(dev);
+	return get_reply(dev, cmd.tag);
 }
 
 int do_motor() {
@@ -178,21 +155,11 @@ int do_motor() {
 	led_state state_to_set = LED_SOLID_RED;
 	int tilt = -30;
 
-	libusb_context* ctx = NULL;
-	libusb_init(&ctx);
-
-	libusb_device_handle* dev = NULL;
-	dev = libusb_open_device_with_vid_pid(ctx, 0x045e, 0x02ad);
+	// interface 0 comes claimed
+	libusb_device_handle* dev = kinect_usb_open(0x045e, 0x02ad);
 	if (dev == NULL) {
 		LOG("Failed to open audio device\n");
-		libusb_exit(ctx);
-		exit(1);
-	}
-
-	res = libusb_claim_interface(dev, 0);
-	if (res != 0) {
-		LOG("Failed to claim interface 1: %d\n", res);
-		goto cleanup;
+		return LIBUSB_ERROR_NO_DEVICE;
 	}
 
 	res = set_led(dev, state_to_set);
@@ -224,8 +191,10 @@ int do_motor() {
 	}
     
 cleanup:
-	libusb_close(dev);
-	libusb_exit(ctx);
+	if (res != 0) {
+		kinect_trace_dump(stderr);
+	}
+	kinect_usb_close(dev);
 
-	return 0;
+	return res;
 }
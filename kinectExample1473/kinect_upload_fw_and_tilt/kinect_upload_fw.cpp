@@ -34,53 +34,44 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/time.h>
 #include <libusb.h>
 
+#include "kinect_protocol.h"
+#include "kinect_trace.h"
+#include "kinect_fw_images.h"
+#include "kinect_fw_probe.h"
+#include "kinect_fw_wait.h"
+#include "kinect_usb_runtime.h"
+
+#define FW_FILENAME "../../../data/audios.bin"
+
 static libusb_device_handle *dev;
 static unsigned int seq;
 FILE* fw;
 
-typedef struct {
-	uint32_t magic;
-	uint32_t seq;
-	uint32_t bytes;
-	uint32_t cmd;
-	uint32_t write_addr;
-	uint32_t unk;
-} bootloader_command;
-
-typedef struct {
-	uint32_t magic;
-	uint32_t seq;
-	uint32_t status;
-} status_code;
-
 #define LOG(...) printf(__VA_ARGS__)
 #define fn_le32(x) (x)
 
+// ms, generous for a page write but the upload no longer hangs on a wedged
+// bootloader
+#define TRANSFER_TIMEOUT 10000
 
-static void dump_bl_cmd(bootloader_command cmd) {
-	int i;
-	for (i = 0; i < 24; i++)
-		LOG("%02X ", ((unsigned char*)(&cmd))[i]);
-	LOG("\n");
+static int bulk_transfer(unsigned char endpoint, unsigned char* data, int length, int* transferred) {
+	int res = libusb_bulk_transfer(dev, endpoint, data, length, transferred, TRANSFER_TIMEOUT);
+	KINECT_TRACE_TRANSFER(endpoint, data, length, *transferred, res);
+	return res;
 }
 
 static int get_first_reply(void) {
 	unsigned char buffer[512];
 	int res;
 	int transferred = 0;
-	res = libusb_bulk_transfer(dev, 0x81, buffer, 512, &transferred, 0);
+	res = bulk_transfer(0x81, buffer, 512, &transferred);
 	if (res != 0 ) {
 		LOG("Error reading first reply: %d\ttransferred: %d (expected %d)\n", res, transferred, 0x60);
 		return res;
 	}
-	LOG("Reading first reply: ");
-	int i;
-	for (i = 0; i < transferred; ++i) {
-		LOG("%02X ", buffer[i]);
-	}
-	LOG("\n");
 	return res;
 }
 
@@ -95,7 +86,7 @@ static int get_reply(void) {
 	int res;
 	int transferred = 0;
 
-	res = libusb_bulk_transfer(dev, 0x81, reply.dump, 512, &transferred, 0);
+	res = bulk_transfer(0x81, reply.dump, 512, &transferred);
 	if (res != 0 || transferred != sizeof(status_code)) {
 		LOG("Error reading reply: %d\ttransferred: %d (expected %zu)\n", res, transferred, sizeof(status_code));
 		return res;
@@ -112,20 +103,13 @@ static int get_reply(void) {
 		LOG("Notice reading reply: last uint32_t was nonzero: %d\n", reply.buffer.status);
 	}
 
-	LOG("Reading reply: ");
-	int i;
-	for (i = 0; i < transferred; ++i) {
-		LOG("%02X ", reply.dump[i]);
-	}
-	LOG("\n");
-
 	return res;
 }
 
 int upload_main() {
     int res = 0;
     {
-            char default_filename[] = "../../../data/audios.bin";
+            char default_filename[] = FW_FILENAME;
             char* filename = default_filename;
 
             fw = fopen(filename, "rb");
@@ -134,10 +118,8 @@ int upload_main() {
                 return errno;
             }
 
-            libusb_init(NULL);
-            libusb_set_debug(NULL, 3);
-
-            dev = libusb_open_device_with_vid_pid(NULL, 0x045e, 0x02ad);
+            // comes with configuration 1 selected and interface 0 claimed
+            dev = kinect_usb_open(KINECT_VID, KINECT_PID_AUDIO);
             if (dev == NULL) {
                 fprintf(stderr, "Couldn't open device.\n");
                 res = -ENODEV;
@@ -145,12 +127,6 @@ int upload_main() {
             }
 
             int current_configuration = 0;
-            libusb_get_configuration(dev, &current_configuration);
-            if (current_configuration != 1)
-                libusb_set_configuration(dev, 1);
-
-            libusb_claim_interface(dev, 0);
-
             libusb_get_configuration(dev, &current_configuration);
             if (current_configuration != 1) {
                 res = -ENODEV;
@@ -159,6 +135,21 @@ int upload_main() {
 
             seq = 1;
 
+            // Each page goes out as one transfer and the host splits it into
+            // wMaxPacketSize packets - the same bytes on the wire as 512 byte
+            // writes for 1/32 of the syscalls. Devices that refuse that get
+            // packet sized writes instead.
+            int packet_size;
+            packet_size = libusb_get_max_packet_size(libusb_get_device(dev), 0x01);
+            if (packet_size <= 0)
+                packet_size = 512;
+            int chunk_size;
+            chunk_size = 0x4000;
+            int transfers;
+            transfers = 0;
+            struct timeval started;
+            gettimeofday(&started, NULL);
+
             bootloader_command cmd;
             cmd.magic = fn_le32(0x06022009);
             cmd.seq = fn_le32(seq);
@@ -167,12 +158,9 @@ int upload_main() {
             cmd.write_addr = fn_le32(0x15);
             cmd.unk = fn_le32(0);
 
-            LOG("About to send: ");
-            dump_bl_cmd(cmd);
-
             int transferred = 0;
 
-            res = libusb_bulk_transfer(dev, 1, (unsigned char*)&cmd, sizeof(cmd), &transferred, 0);
+            res = bulk_transfer(1, (unsigned char*)&cmd, sizeof(cmd), &transferred);
             if (res != 0 || transferred != sizeof(cmd)) {
                 LOG("Error: res: %d\ttransferred: %d (expected %zu)\n", res, transferred, sizeof(cmd));
                 goto cleanup;
@@ -186,6 +174,8 @@ int upload_main() {
             // errors.
             uint32_t addr;
             addr = 0x00080000;
+            kinect_sha256 sha;
+            kinect_sha256_init(&sha);
             unsigned char page[0x4000];
             int read;
             do {
@@ -198,53 +188,155 @@ int upload_main() {
                 cmd.bytes = fn_le32(read);
                 cmd.cmd = fn_le32(0x03);
                 cmd.write_addr = fn_le32(addr);
-                LOG("About to send: ");
-                dump_bl_cmd(cmd);
                 // Send it off!
                 transferred = 0;
-                res = libusb_bulk_transfer(dev, 1, (unsigned char*)&cmd, sizeof(cmd), &transferred, 0);
+                res = bulk_transfer(1, (unsigned char*)&cmd, sizeof(cmd), &transferred);
                 if (res != 0 || transferred != sizeof(cmd)) {
                     LOG("Error: res: %d\ttransferred: %d (expected %zu)\n", res, transferred, sizeof(cmd));
                     goto cleanup;
                 }
                 int bytes_sent = 0;
                 while (bytes_sent < read) {
-                    int to_send = (read - bytes_sent > 512 ? 512 : read - bytes_sent);
+                    int to_send = (read - bytes_sent > chunk_size ? chunk_size : read - bytes_sent);
                     transferred = 0;
-                    res = libusb_bulk_transfer(dev, 1, &page[bytes_sent], to_send, &transferred, 0);
+                    res = bulk_transfer(1, &page[bytes_sent], to_send, &transferred);
+                    transfers++;
+                    if (res != 0 && res != LIBUSB_ERROR_PIPE && to_send > packet_size) {
+                        LOG("%d byte write failed (%d), falling back to %d byte writes\n", to_send, res, packet_size);
+                        chunk_size = packet_size;
+                        bytes_sent += transferred - transferred % packet_size;
+                        continue;
+                    }
                     if (res != 0 || transferred != to_send) {
                         LOG("Error: res: %d\ttransferred: %d (expected %d)\n", res, transferred, to_send);
                         goto cleanup;
                     }
                     bytes_sent += to_send;
                 }
+                // hashed while the device writes the page to flash
+                kinect_sha256_update(&sha, page, read);
                 res = get_reply();
 
                 addr += (uint32_t)read;
                 seq++;
             } while (read > 0);
 
+            // Refuse to start anything we don't know, e.g. a truncated or
+            // modified file.
+            unsigned char digest[KINECT_SHA256_SIZE];
+            kinect_sha256_final(&sha, digest);
+            char hex[2 * KINECT_SHA256_SIZE + 1];
+            kinect_sha256_hex(digest, hex);
+            const kinect_fw_image* image;
+            image = kinect_fw_find_image(digest, (int)(addr - 0x00080000));
+            LOG("%s: sha256 %s, %s\n", FW_FILENAME, hex, image != NULL ? image->description : "unknown image");
+            if (image == NULL) {
+                LOG("Not a known firmware image, not executing it\n");
+                res = LIBUSB_ERROR_NOT_SUPPORTED;
+                goto cleanup;
+            }
+
             cmd.seq = fn_le32(seq);
             cmd.bytes = fn_le32(0);
             cmd.cmd = fn_le32(0x04);
             cmd.write_addr = fn_le32(0x00080030);
-            dump_bl_cmd(cmd);
             transferred = 0;
-            res = libusb_bulk_transfer(dev, 1, (unsigned char*)&cmd, sizeof(cmd), &transferred, 0);
+            res = bulk_transfer(1, (unsigned char*)&cmd, sizeof(cmd), &transferred);
             if (res != 0 || transferred != sizeof(cmd)) {
                 LOG("Error: res: %d\ttransferred: %d (expected %zu)\n", res, transferred, sizeof(cmd));
                 goto cleanup;
             }
             res = get_reply();
             seq++;
+
+            struct timeval finished;
+            gettimeofday(&finished, NULL);
+            double seconds;
+            seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_usec - started.tv_usec) / 1000000.0;
+            LOG("Uploaded %u bytes in %.1f ms, %.2f MB/s, %d payload transfers of up to %d bytes\n",
+                addr - 0x00080000, seconds * 1000.0, seconds > 0 ? (addr - 0x00080000) / seconds / (1024.0 * 1024.0) : 0.0,
+                transfers, chunk_size);
             // Now the device reenumerates.
     
     }
     
 cleanup:
-	libusb_close(dev);
+	if (res != 0)
+		kinect_trace_dump(stdout);
+	kinect_usb_close(dev);
+	dev = NULL;
 fail_libusb_open:
-	libusb_exit(NULL);
 	fclose(fw);
 	return res;
 }
+
+
+// Firmware state probe, so restarts don't pay for an upload and the wait for
+// re-enumeration when the firmware is already running. kinect_fw_probe tells
+// the bootloader from the running firmware by its descriptors and remembers
+// the hash of what we upload per serial number.
+
+// -1 if the device can't be opened.
+static int probe_device(kinect_fw_probe_result* result) {
+	memset(result, 0, sizeof(*result));
+	libusb_device_handle* handle = kinect_usb_open(KINECT_VID, KINECT_PID_AUDIO);
+	if (handle == NULL) {
+		return -1;
+	}
+	int res = kinect_fw_probe_device(handle, result);
+	kinect_usb_close(handle);
+	return res;
+}
+
+// 0 or a libusb_error code.
+static int digest_image(const char* filename, unsigned char digest[KINECT_SHA256_SIZE]) {
+	kinect_fw_source* src = kinect_fw_source_open_file(filename);
+	if (src == NULL) {
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	int res = kinect_fw_digest(src, digest);
+	kinect_fw_source_close(src);
+	return res;
+}
+
+// Uploads only when the device is still in its bootloader, then waits for it
+// to re-enumerate. Returns 1 once the uploaded firmware is up, 0 if the
+// firmware was already running, or an error from upload_main() or the wait.
+int upload_main_if_needed() {
+	kinect_fw_probe_result probe;
+	probe_device(&probe);
+	const char* serial = probe.serial;
+	unsigned char digest[KINECT_SHA256_SIZE];
+	int have_digest = digest_image(FW_FILENAME, digest) == 0;
+
+	if (probe.state == KINECT_FW_STATE_APPLICATION) {
+		if (!probe.cached) {
+			LOG("Firmware already running (not uploaded by us), skipping upload\n");
+		} else if (!have_digest || memcmp(probe.loaded_sha256, digest, KINECT_SHA256_SIZE) != 0) {
+			LOG("Device %s is running another image, power cycle it to load %s\n", serial, FW_FILENAME);
+		} else {
+			LOG("Device %s already running %s, skipping upload\n", serial, FW_FILENAME);
+		}
+		return 0;
+	}
+
+	// armed before the upload so the re-enumeration after execute can't be missed
+	kinect_fw_wait* wait = kinect_fw_wait_open(serial);
+
+	int res = upload_main();
+	if (res == 0) {
+		if (serial[0] != '\0' && have_digest) {
+			kinect_fw_cache_store(serial, digest);
+		}
+		res = 1;
+		if (wait != NULL) {
+			int ready = kinect_fw_wait_ready(wait, 10000);
+			if (ready != 0) {
+				res = ready;
+			}
+		}
+	}
+
+	kinect_fw_wait_close(wait);
+	return res;
+}
@@ -1,17 +1,22 @@
 #include "testApp.h"
 
 extern int upload_main();
+extern int upload_main_if_needed();
 extern int do_motor();
+extern void kinect_usb_shutdown();
 
 //--------------------------------------------------------------
 void testApp::setup() {
 	ofSetLogLevel(OF_LOG_VERBOSE);
     
-    //uncomment two lines below to upload firmware - once uploaded comment out until device is power cycled.
-    upload_main();
-    ofSleepMillis(3000);
+    // uploads the firmware only if the device is still in its bootloader, so
+    // restarting the app doesn't pay for the upload again, and returns as soon
+    // as the device has re-enumerated
+    upload_main_if_needed();
 
     do_motor();
+    // both ran on the shared libusb context, nothing else here needs it
+    kinect_usb_shutdown();
 
     
 //upload_main();